@@ -0,0 +1,26 @@
+--------------------------------------------------------------------------------
+--
+-- sql_firewall benchmark: load :nrules filler rules of type :rule_type
+--
+-- The filler rules belong to no user, and their query ids are spread over
+-- the whole 32-bit range, so that they grow the rule table without matching
+-- the benchmarked statements.  They are imported in the exchange format of
+-- sql_firewall.export_rules_binary().
+--
+--------------------------------------------------------------------------------
+SELECT sql_firewall.import_rules(
+  int4send(x'50474652'::int) ||                           -- magic
+  int4send(1) ||                                          -- version
+  int4send(current_setting('server_version_num')::int / 100) ||
+  int4send(:nrules) ||
+  coalesce((SELECT string_agg(
+                     int4send(1) ||                       -- userid
+                     int4send(((i::int8 * 2654435761) % 4294967296
+                               - 2147483648)::int) ||     -- queryid
+                     convert_to(:'rule_type', 'SQL_ASCII') ||
+                     int8send(0) || int8send(0) ||        -- calls, banned
+                     int4send(pg_char_to_encoding(getdatabaseencoding())) ||
+                     int4send(length('filler ' || i)) ||
+                     convert_to('filler ' || i, getdatabaseencoding()),
+                     ''::bytea ORDER BY i)
+            FROM generate_series(1, :nrules) i), ''::bytea));
@@ -0,0 +1,180 @@
+#!/bin/sh
+#
+# sql_firewall benchmark driver
+#
+# Measures the throughput and the latency of pgbench custom scripts with
+# every firewall mode and rule engine, over rule sets of several sizes and
+# several client counts, and writes one JSON object per run to the report.
+#
+# The server must be running with sql_firewall in shared_preload_libraries
+# and sql_firewall.max at least as large as the largest rule set, plus
+# LEARN_ROOM rules for the statements learned on top of it; the larger rule
+# sets are skipped otherwise.  The usual libpq environment variables
+# (PGHOST, PGPORT, PGDATABASE, PGUSER) tell where to connect; the user must
+# be a superuser.
+#
+# Settings, from the environment:
+#
+#   BENCH_SCRIPTS   pgbench scripts to run            (select tpcb)
+#   BENCH_MODES     sql_firewall.firewall values      (disabled learning
+#                                                      permissive enforcing)
+#   BENCH_ENGINES   sql_firewall.engine values        (whitelist blacklist
+#                                                      hybrid)
+#   BENCH_RULES     # of filler rules loaded          (1000 10000 100000
+#                                                      1000000)
+#   BENCH_CLIENTS   pgbench client counts             (1 8 32)
+#   BENCH_DURATION  seconds per run                   (30)
+#   BENCH_SCALE     pgbench scale factor              (10)
+#   BENCH_OUTPUT    report file                       (bench_results/report.json)
+#
+# Usage: bench/run.sh  (or "make bench")
+#
+
+set -e
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+
+BENCH_SCRIPTS=${BENCH_SCRIPTS:-"select tpcb"}
+BENCH_MODES=${BENCH_MODES:-"disabled learning permissive enforcing"}
+BENCH_ENGINES=${BENCH_ENGINES:-"whitelist blacklist hybrid"}
+BENCH_RULES=${BENCH_RULES:-"1000 10000 100000 1000000"}
+BENCH_CLIENTS=${BENCH_CLIENTS:-"1 8 32"}
+BENCH_DURATION=${BENCH_DURATION:-30}
+BENCH_SCALE=${BENCH_SCALE:-10}
+BENCH_OUTPUT=${BENCH_OUTPUT:-bench_results/report.json}
+
+PSQL=${PSQL:-psql}
+PGBENCH=${PGBENCH:-pgbench}
+
+# room left besides the filler rules for what learn_script() learns: the
+# statements of the script, and those of our own sessions meanwhile
+LEARN_ROOM=100
+
+RESULT_DIR=$(dirname "$BENCH_OUTPUT")
+LOG_DIR="$RESULT_DIR/logs"
+
+psql_cmd()
+{
+	"$PSQL" -X -q -t -A -v ON_ERROR_STOP=1 "$@"
+}
+
+# set a sql_firewall parameter, and wait for new sessions to see it
+set_param()
+{
+	psql_cmd -c "ALTER SYSTEM SET sql_firewall.$1 TO '$2'" \
+		-c "SELECT pg_reload_conf()" > /dev/null
+	while [ "$(psql_cmd -c "SHOW sql_firewall.$1")" != "$2" ]
+	do
+		sleep 1
+	done
+}
+
+# the rules are dropped in the disabled mode only
+reset_rules()
+{
+	set_param firewall disabled
+	psql_cmd -c "SELECT sql_firewall_reset()" > /dev/null
+}
+
+# load $1 filler rules of the engine $2
+fill_rules()
+{
+	case "$2" in
+		blacklist)	rule_type=b ;;
+		*)			rule_type=w ;;
+	esac
+	psql_cmd -v nrules="$1" -v rule_type="$rule_type" \
+		-f "$BENCH_DIR/fill_rules.sql" > /dev/null
+}
+
+# have the statements of the script $1 learned as whitelist rules; the
+# blacklist engine lets them run as long as no blacklist rule matches
+learn_script()
+{
+	if [ "$2" != blacklist ]
+	then
+		set_param firewall learning
+		"$PGBENCH" -n -c 1 -t 10 -s "$BENCH_SCALE" \
+			-f "$BENCH_DIR/$1.sql" > /dev/null 2>&1
+	fi
+}
+
+# latency percentile $2 (0-100), in ms, of the pgbench transaction logs $1
+latency_percentile()
+{
+	cat $1 | awk '{ print $3 }' | sort -n | awk -v p="$2" '
+		{ v[NR] = $1 }
+		END {
+			if (NR == 0) { print "null"; exit }
+			i = int(NR * p / 100 + 0.5)
+			if (i < 1) i = 1
+			if (i > NR) i = NR
+			printf "%.3f\n", v[i] / 1000.0
+		}'
+}
+
+mkdir -p "$RESULT_DIR" "$LOG_DIR"
+: > "$BENCH_OUTPUT"
+
+max_rules=$(psql_cmd -c "SHOW sql_firewall.max")
+server_version=$(psql_cmd -c "SHOW server_version_num")
+
+echo "initializing pgbench tables, scale $BENCH_SCALE"
+reset_rules
+"$PGBENCH" -i -q -s "$BENCH_SCALE" > /dev/null 2>&1
+
+for script in $BENCH_SCRIPTS
+do
+	for engine in $BENCH_ENGINES
+	do
+		set_param engine "$engine"
+
+		for nrules in $BENCH_RULES
+		do
+			needed=$nrules
+			[ "$engine" = blacklist ] || needed=$((nrules + LEARN_ROOM))
+			if [ "$needed" -gt "$max_rules" ]
+			then
+				echo "skipping $nrules rules, sql_firewall.max is $max_rules"
+				continue
+			fi
+
+			reset_rules
+			fill_rules "$nrules" "$engine"
+			learn_script "$script" "$engine"
+
+			for mode in $BENCH_MODES
+			do
+				set_param firewall "$mode"
+
+				for clients in $BENCH_CLIENTS
+				do
+					run="$script-$engine-$nrules-$mode-$clients"
+					echo "running $run"
+
+					rm -rf "$LOG_DIR/$run"
+					mkdir "$LOG_DIR/$run"
+					out=$(cd "$LOG_DIR/$run" && \
+						"$PGBENCH" -n -l -c "$clients" -j "$clients" \
+							-T "$BENCH_DURATION" -s "$BENCH_SCALE" \
+							-f "$BENCH_DIR/$script.sql" 2>&1) || true
+
+					tps=$(echo "$out" | \
+						sed -n 's/^tps = \([0-9.]*\) (excluding.*/\1/p')
+					[ -n "$tps" ] || tps=null
+					p50=$(latency_percentile "$LOG_DIR/$run/pgbench_log.*" 50)
+					p99=$(latency_percentile "$LOG_DIR/$run/pgbench_log.*" 99)
+
+					printf '{"server_version": %s, "script": "%s", "engine": "%s", "mode": "%s", "rules": %s, "clients": %s, "duration": %s, "tps": %s, "latency_p50_ms": %s, "latency_p99_ms": %s}\n' \
+						"$server_version" "$script" "$engine" "$mode" \
+						"$nrules" "$clients" "$BENCH_DURATION" \
+						"$tps" "$p50" "$p99" >> "$BENCH_OUTPUT"
+				done
+			done
+		done
+	done
+done
+
+reset_rules
+
+echo "report written to $BENCH_OUTPUT"
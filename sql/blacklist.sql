@@ -114,6 +114,9 @@ SELECT * FROM employee ORDER BY id;
 --
 -- pg_sleep is radomly called so we ignore it here.
 SELECT * FROM sql_firewall.all_rules WHERE query NOT LIKE '%pg_sleep%';
+-- the first page of the rules, and a range of queryids
+SELECT userid, queryid, query, banned FROM sql_firewall_rules('blacklist', row_limit := 1);
+SELECT userid, queryid, query, banned FROM sql_firewall_rules('blacklist', queryid_min := 1000000000);
 
 CREATE USER sqlfirewall_user WITH PASSWORD 'sqlfirewall';
 GRANT ALL ON TABLE employee TO sqlfirewall_user;
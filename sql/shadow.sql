@@ -0,0 +1,70 @@
+--------------------------------------------------------------------------------
+--
+-- shadow rule set tests
+--   * the shadow rules are checked along with the live ones, silently
+--   * the statements they decide otherwise are counted and kept
+--
+--------------------------------------------------------------------------------
+ALTER SYSTEM SET sql_firewall.firewall TO disabled;
+SELECT pg_reload_conf();
+SELECT pg_sleep(0.1);
+SELECT wait_be_set('sql_firewall.firewall', 'disabled');
+SHOW sql_firewall.firewall;
+SELECT sql_firewall_reset();
+
+ALTER SYSTEM SET sql_firewall.engine TO blacklist;
+SELECT pg_reload_conf();
+SELECT pg_sleep(0.1);
+SELECT wait_be_set('sql_firewall.engine', 'blacklist');
+SHOW sql_firewall.engine;
+
+CREATE TABLE fw_shadow(id int);
+INSERT INTO fw_shadow VALUES (1), (2);
+
+--
+-- the candidate rule set bans the deletes, the live one the selects
+--
+SELECT sql_firewall.add_rule('', 'DELETE FROM fw_shadow WHERE id = 1;', 'blacklist');
+CREATE TABLE fw_candidate AS SELECT sql_firewall.export_rules_binary() AS image;
+SELECT sql_firewall_reset();
+SELECT sql_firewall.add_rule('', 'SELECT * FROM fw_shadow WHERE id = 1;', 'blacklist');
+SELECT sql_firewall.shadow_load(image) FROM fw_candidate;
+SELECT side, type FROM sql_firewall.shadow_rule_diff() ORDER BY side;
+
+ALTER SYSTEM SET sql_firewall.firewall TO enforcing;
+SELECT pg_reload_conf();
+SELECT pg_sleep(0.1);
+SELECT wait_be_set('sql_firewall.firewall', 'enforcing');
+SHOW sql_firewall.firewall;
+
+--------------------------------------------------------------------------------
+--
+-- testcase
+--   the live rules alone decide, the divergences of the shadow rules are kept
+--
+--------------------------------------------------------------------------------
+SELECT * FROM fw_shadow WHERE id = 2;
+DELETE FROM fw_shadow WHERE id = 2;
+SELECT id FROM fw_shadow ORDER BY id;
+SELECT live, shadow, calls, query FROM sql_firewall.shadow_divergences ORDER BY query;
+SELECT rules, checks >= 2 AS checked, would_reject, would_allow, divergences, dropped FROM sql_firewall.shadow_stat;
+
+ALTER SYSTEM SET sql_firewall.firewall TO disabled;
+SELECT pg_reload_conf();
+SELECT pg_sleep(0.1);
+SELECT wait_be_set('sql_firewall.firewall', 'disabled');
+SHOW sql_firewall.firewall;
+
+--
+-- the shadow rules go, the live ones stay
+--
+SELECT sql_firewall.shadow_clear();
+SELECT rules, divergences FROM sql_firewall.shadow_stat;
+SELECT count(*) FROM sql_firewall.blacklist;
+
+--
+-- teardown
+--
+SELECT sql_firewall_reset();
+DROP TABLE fw_candidate;
+DROP TABLE fw_shadow;
@@ -0,0 +1,102 @@
+--------------------------------------------------------------------------------
+--
+-- structural rule tests
+--   * a structural rule allows the statements which only access what it covers
+--   * any other statement still needs a whitelist rule
+--
+--------------------------------------------------------------------------------
+ALTER SYSTEM SET sql_firewall.firewall TO disabled;
+SELECT pg_reload_conf();
+SELECT pg_sleep(0.1);
+SELECT wait_be_set('sql_firewall.firewall', 'disabled');
+SHOW sql_firewall.firewall;
+SELECT sql_firewall_reset();
+
+ALTER SYSTEM SET sql_firewall.engine TO whitelist;
+SELECT pg_reload_conf();
+SELECT pg_sleep(0.1);
+SELECT wait_be_set('sql_firewall.engine', 'whitelist');
+SHOW sql_firewall.engine;
+
+CREATE SCHEMA fw_app;
+CREATE TABLE fw_app.orders(id int, amount int);
+CREATE TABLE fw_secret(id int);
+INSERT INTO fw_app.orders VALUES (1, 10), (2, 20);
+INSERT INTO fw_secret VALUES (1);
+
+--
+-- learn the statements which take us back to the disabled mode
+--
+ALTER SYSTEM SET sql_firewall.firewall TO    learning;
+SELECT pg_reload_conf();
+SELECT pg_sleep(0.1);
+SELECT wait_be_set('sql_firewall.firewall', 'learning');
+SELECT pg_reload_conf();
+SELECT pg_sleep(0.1);
+SELECT wait_be_set('sql_firewall.firewall', 'learning');
+SHOW sql_firewall.firewall;
+ALTER SYSTEM SET sql_firewall.firewall TO    disabled;
+SELECT pg_reload_conf();
+SELECT pg_sleep(0.1);
+SELECT wait_be_set('sql_firewall.firewall', 'disabled');
+SHOW sql_firewall.firewall;
+
+--
+-- any user may read the tables of fw_app, and insert into fw_app.orders
+--
+SELECT sql_firewall.add_structural_rule('', 'select', 'fw_app.*');
+SELECT sql_firewall.add_structural_rule('', 'insert', 'fw_app.orders');
+SELECT userid, kind, object, operations FROM sql_firewall.structural_rules ORDER BY kind;
+
+ALTER SYSTEM SET sql_firewall.firewall TO enforcing;
+SELECT pg_reload_conf();
+SELECT pg_sleep(0.1);
+SELECT wait_be_set('sql_firewall.firewall', 'enforcing');
+SHOW sql_firewall.firewall;
+
+--------------------------------------------------------------------------------
+--
+-- testcase
+--   statements covered by the structural rules run without whitelist rules
+--
+--------------------------------------------------------------------------------
+SELECT id, amount FROM fw_app.orders ORDER BY id;
+SELECT amount FROM fw_app.orders WHERE id = 2;
+INSERT INTO fw_app.orders VALUES (3, 30);
+PREPARE fw_orders(int) AS SELECT amount FROM fw_app.orders WHERE id = $1;
+EXECUTE fw_orders(1);
+EXECUTE fw_orders(3);
+
+--------------------------------------------------------------------------------
+--
+-- testcase
+--   statements accessing anything else are prohibited
+--
+--------------------------------------------------------------------------------
+UPDATE fw_app.orders SET amount = 0;
+SELECT * FROM fw_secret;
+SELECT amount FROM fw_app.orders WHERE id IN (SELECT id FROM fw_secret);
+SELECT id, amount FROM fw_app.orders ORDER BY id;
+
+ALTER SYSTEM SET sql_firewall.firewall TO    disabled;
+SELECT pg_reload_conf();
+SELECT pg_sleep(0.1);
+SELECT wait_be_set('sql_firewall.firewall', 'disabled');
+SHOW sql_firewall.firewall;
+
+--
+-- a rule goes away with the last of its operations
+--
+SELECT sql_firewall.del_structural_rule('', 'insert', 'fw_app.orders');
+SELECT sql_firewall.del_structural_rule('', 'insert', 'fw_app.orders');
+SELECT userid, kind, object, operations FROM sql_firewall.structural_rules ORDER BY kind;
+
+--
+-- teardown
+--
+SELECT sql_firewall_reset();
+SELECT count(*) FROM sql_firewall.structural_rules;
+DEALLOCATE fw_orders;
+DROP TABLE fw_secret;
+DROP TABLE fw_app.orders;
+DROP SCHEMA fw_app;
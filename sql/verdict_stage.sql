@@ -0,0 +1,147 @@
+--------------------------------------------------------------------------------
+--
+-- verdict stage tests
+--   * with 'executor_end', a prohibited statement runs before it is rejected
+--   * with 'analyze', a prohibited statement is rejected before it runs
+--   * a prohibited statement run over and over by a function is reported
+--     every time
+--
+--------------------------------------------------------------------------------
+ALTER SYSTEM SET sql_firewall.firewall TO disabled;
+SELECT pg_reload_conf();
+SELECT pg_sleep(0.1);
+SELECT wait_be_set('sql_firewall.firewall', 'disabled');
+SHOW sql_firewall.firewall;
+SELECT sql_firewall_reset();
+SELECT sql_firewall_stat_reset();
+
+--
+-- the side effect of this function survives the rejection of the statement
+--
+CREATE SEQUENCE fw_seq;
+CREATE FUNCTION fw_bump() RETURNS bigint AS 'SELECT nextval(''fw_seq'')' LANGUAGE sql;
+PREPARE fw_stmt AS SELECT fw_bump();
+
+--
+-- verify the default verdict stage
+--
+SHOW sql_firewall.verdict_stage;
+
+ALTER SYSTEM SET sql_firewall.engine TO blacklist;
+SELECT pg_reload_conf();
+SELECT pg_sleep(0.1);
+SELECT wait_be_set('sql_firewall.engine', 'blacklist');
+SHOW sql_firewall.engine;
+
+SELECT sql_firewall.add_rule('', 'SELECT fw_bump();', 'blacklist');
+
+ALTER SYSTEM SET sql_firewall.firewall TO enforcing;
+SELECT pg_reload_conf();
+SELECT pg_sleep(0.1);
+SELECT wait_be_set('sql_firewall.firewall', 'enforcing');
+SHOW sql_firewall.firewall;
+
+--------------------------------------------------------------------------------
+--
+-- testcase
+--   executor_end stage: the statement is rejected once it has been executed
+--
+--------------------------------------------------------------------------------
+SELECT fw_bump();
+SELECT last_value, is_called FROM fw_seq;
+
+--------------------------------------------------------------------------------
+--
+-- testcase
+--   analyze stage: the statement is rejected before it gets executed
+--
+--------------------------------------------------------------------------------
+ALTER SYSTEM SET sql_firewall.verdict_stage TO analyze;
+SELECT pg_reload_conf();
+SELECT pg_sleep(0.1);
+SELECT wait_be_set('sql_firewall.verdict_stage', 'analyze');
+SHOW sql_firewall.verdict_stage;
+
+SELECT fw_bump();
+SELECT last_value, is_called FROM fw_seq;
+
+--
+-- a cached plan is checked when the executor starts
+--
+EXECUTE fw_stmt;
+SELECT last_value, is_called FROM fw_seq;
+
+--
+-- each rejection is counted once
+--
+ALTER SYSTEM SET sql_firewall.firewall TO disabled;
+SELECT pg_reload_conf();
+SELECT pg_sleep(0.1);
+SELECT wait_be_set('sql_firewall.firewall', 'disabled');
+SHOW sql_firewall.firewall;
+
+SELECT query, banned FROM sql_firewall.blacklist;
+SELECT * FROM sql_firewall.sql_firewall_stat;
+
+--------------------------------------------------------------------------------
+--
+-- testcase
+--   a prohibited statement run by a function is reported on every iteration
+--
+--------------------------------------------------------------------------------
+ALTER SYSTEM SET sql_firewall.verdict_stage TO executor_end;
+SELECT pg_reload_conf();
+SELECT pg_sleep(0.1);
+SELECT wait_be_set('sql_firewall.verdict_stage', 'executor_end');
+SHOW sql_firewall.verdict_stage;
+
+CREATE TABLE fw_t (i int);
+CREATE FUNCTION fw_loop() RETURNS void AS $$
+BEGIN
+    FOR n IN 1..3 LOOP
+        INSERT INTO fw_t VALUES (1);
+    END LOOP;
+END;
+$$ LANGUAGE plpgsql;
+SELECT sql_firewall_reset();
+SELECT sql_firewall_stat_reset();
+SELECT sql_firewall.add_rule('', 'INSERT INTO fw_t VALUES (1);', 'blacklist');
+
+ALTER SYSTEM SET sql_firewall.track TO all;
+SELECT pg_reload_conf();
+SELECT pg_sleep(0.1);
+SELECT wait_be_set('sql_firewall.track', 'all');
+SHOW sql_firewall.track;
+
+ALTER SYSTEM SET sql_firewall.firewall TO permissive;
+SELECT pg_reload_conf();
+SELECT pg_sleep(0.1);
+SELECT wait_be_set('sql_firewall.firewall', 'permissive');
+SHOW sql_firewall.firewall;
+
+SELECT fw_loop();
+
+ALTER SYSTEM SET sql_firewall.firewall TO disabled;
+SELECT pg_reload_conf();
+SELECT pg_sleep(0.1);
+SELECT wait_be_set('sql_firewall.firewall', 'disabled');
+SHOW sql_firewall.firewall;
+
+ALTER SYSTEM SET sql_firewall.track TO top;
+SELECT pg_reload_conf();
+SELECT pg_sleep(0.1);
+SELECT wait_be_set('sql_firewall.track', 'top');
+SHOW sql_firewall.track;
+
+SELECT count(*) FROM fw_t;
+SELECT query, banned FROM sql_firewall.blacklist;
+SELECT * FROM sql_firewall.sql_firewall_stat;
+
+--
+-- testcase level teardown
+--
+DEALLOCATE fw_stmt;
+DROP FUNCTION fw_bump();
+DROP SEQUENCE fw_seq;
+DROP FUNCTION fw_loop();
+DROP TABLE fw_t;
@@ -0,0 +1,86 @@
+--------------------------------------------------------------------------------
+--
+-- violation tests
+--   * the violations are kept in the sql_firewall.violations view
+--   * sql_firewall.violation_log_interval rate-limits their server log reports
+--   * sql_firewall_stat_reset() clears them
+--
+--------------------------------------------------------------------------------
+ALTER SYSTEM SET sql_firewall.firewall TO disabled;
+SELECT pg_reload_conf();
+SELECT pg_sleep(0.1);
+SELECT wait_be_set('sql_firewall.firewall', 'disabled');
+SHOW sql_firewall.firewall;
+SELECT sql_firewall_reset();
+SELECT sql_firewall_stat_reset();
+
+ALTER SYSTEM SET sql_firewall.engine TO blacklist;
+SELECT pg_reload_conf();
+SELECT pg_sleep(0.1);
+SELECT wait_be_set('sql_firewall.engine', 'blacklist');
+SHOW sql_firewall.engine;
+
+CREATE TABLE fw_v (i int);
+SELECT sql_firewall.add_rule('', 'SELECT i FROM fw_v;', 'blacklist');
+
+ALTER SYSTEM SET sql_firewall.firewall TO permissive;
+SELECT pg_reload_conf();
+SELECT pg_sleep(0.1);
+SELECT wait_be_set('sql_firewall.firewall', 'permissive');
+SHOW sql_firewall.firewall;
+
+--------------------------------------------------------------------------------
+--
+-- testcase
+--   every violation is reported by default
+--
+--------------------------------------------------------------------------------
+SELECT i FROM fw_v;
+SELECT i FROM fw_v;
+
+--------------------------------------------------------------------------------
+--
+-- testcase
+--   the client is warned of every violation, whatever the interval
+--
+--------------------------------------------------------------------------------
+SET sql_firewall.violation_log_interval TO '2s';
+SELECT i FROM fw_v;
+SELECT i FROM fw_v;
+SELECT i FROM fw_v;
+SELECT pg_sleep(2.1);
+SELECT i FROM fw_v;
+RESET sql_firewall.violation_log_interval;
+
+ALTER SYSTEM SET sql_firewall.firewall TO disabled;
+SELECT pg_reload_conf();
+SELECT pg_sleep(0.1);
+SELECT wait_be_set('sql_firewall.firewall', 'disabled');
+SHOW sql_firewall.firewall;
+
+--------------------------------------------------------------------------------
+--
+-- testcase
+--   all of them are in the view, reported or not
+--
+--------------------------------------------------------------------------------
+SELECT userid,
+       dbid = (SELECT oid FROM pg_database WHERE datname = current_database()) AS this_db,
+       queryid = (SELECT queryid FROM sql_firewall.blacklist) AS same_queryid,
+       action, query
+  FROM sql_firewall.violations;
+
+--------------------------------------------------------------------------------
+--
+-- testcase
+--   sql_firewall_stat_reset() clears the violations
+--
+--------------------------------------------------------------------------------
+SELECT sql_firewall_stat_reset();
+SELECT count(*) FROM sql_firewall.violations;
+
+--
+-- testcase level teardown
+--
+SELECT sql_firewall_reset();
+DROP TABLE fw_v;
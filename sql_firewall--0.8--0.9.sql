@@ -0,0 +1,267 @@
+/* contrib/sql_firewall/sql_firewall--0.8--0.9.sql */
+
+-- complain if script is sourced in psql, rather than via ALTER EXTENSION
+\echo Use "ALTER EXTENSION sql_firewall UPDATE TO '0.9'" to load this file. \quit
+
+-- Rule cache statistics of the current backend.
+CREATE FUNCTION sql_firewall_cache_hit_count()
+RETURNS int8
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE FUNCTION sql_firewall_cache_miss_count()
+RETURNS int8
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE VIEW sql_firewall.sql_firewall_cache_stat AS
+  SELECT sql_firewall_cache_hit_count() AS cache_hit,
+         sql_firewall_cache_miss_count() AS cache_miss;
+
+GRANT SELECT ON sql_firewall.sql_firewall_cache_stat TO PUBLIC;
+
+-- Rule table statistics.
+CREATE FUNCTION sql_firewall_eviction_count()
+RETURNS int8
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE FUNCTION sql_firewall_rejected_count()
+RETURNS int8
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE VIEW sql_firewall.sql_firewall_table_stat AS
+  SELECT sql_firewall_eviction_count() AS evicted,
+         sql_firewall_rejected_count() AS rejected;
+
+GRANT SELECT ON sql_firewall.sql_firewall_table_stat TO PUBLIC;
+
+-- Timings of the firewall stages, see sql_firewall.track_timing.
+CREATE FUNCTION sql_firewall_stat_timing(
+    OUT stage text,
+    OUT lower_us int8,
+    OUT upper_us int8,
+    OUT count int8,
+    OUT stage_total_us int8
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE VIEW sql_firewall.stat_timing AS
+  SELECT * FROM sql_firewall_stat_timing();
+
+GRANT SELECT ON sql_firewall.stat_timing TO PUBLIC;
+
+-- Exchange the rules over a connection, without any file on the server.
+CREATE FUNCTION sql_firewall.export_rules(
+    OUT userid oid,
+    OUT queryid bigint,
+    OUT query text,
+    OUT calls int8,
+    OUT banned int8,
+    OUT type "char",
+    OUT dbid oid
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'sql_firewall_export_rules'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION sql_firewall.export_rules_binary()
+RETURNS bytea
+AS 'MODULE_PATHNAME', 'sql_firewall_export_rules_binary'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION sql_firewall.import_rules(bytea)
+RETURNS int8
+AS 'MODULE_PATHNAME', 'sql_firewall_import_rules'
+LANGUAGE C STRICT VOLATILE;
+
+REVOKE ALL ON FUNCTION sql_firewall.export_rules() FROM PUBLIC;
+REVOKE ALL ON FUNCTION sql_firewall.export_rules_binary() FROM PUBLIC;
+REVOKE ALL ON FUNCTION sql_firewall.import_rules(bytea) FROM PUBLIC;
+
+-- Rule changes replicated to the standbys, see sql_firewall.replicate_rules
+CREATE TABLE sql_firewall.rule_changes (
+    seq bigserial PRIMARY KEY,
+    op "char" NOT NULL,
+    userid oid,
+    queryid bigint,
+    type "char",
+    encoding int4 NOT NULL,
+    query text,
+    dbid oid
+);
+
+REVOKE ALL ON sql_firewall.rule_changes FROM PUBLIC;
+
+-- Number of rules of each database, see sql_firewall.rule_scope.
+CREATE FUNCTION sql_firewall_partitions(
+    OUT dbid oid,
+    OUT rules int8
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE VIEW sql_firewall.rule_partitions AS
+  SELECT p.dbid, d.datname, p.rules
+    FROM sql_firewall_partitions() p
+    LEFT JOIN pg_catalog.pg_database d ON d.oid = p.dbid;
+
+GRANT SELECT ON sql_firewall.rule_partitions TO PUBLIC;
+
+-- Structural rules: the operations allowed on relations or schemas.
+CREATE FUNCTION sql_firewall.add_structural_rule(text, text, text)
+RETURNS boolean
+AS 'MODULE_PATHNAME', 'sql_firewall_add_structural_rule'
+LANGUAGE C;
+
+CREATE FUNCTION sql_firewall.del_structural_rule(text, text, text)
+RETURNS boolean
+AS 'MODULE_PATHNAME', 'sql_firewall_del_structural_rule'
+LANGUAGE C;
+
+REVOKE ALL ON FUNCTION sql_firewall.add_structural_rule(text, text, text) FROM PUBLIC;
+REVOKE ALL ON FUNCTION sql_firewall.del_structural_rule(text, text, text) FROM PUBLIC;
+
+CREATE FUNCTION sql_firewall_structural_rules(
+    OUT userid oid,
+    OUT dbid oid,
+    OUT kind "char",
+    OUT objid oid,
+    OUT operations text
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+-- The objects are named in their own database only.
+CREATE VIEW sql_firewall.structural_rules AS
+  SELECT s.userid, s.dbid, s.kind, s.objid,
+         CASE WHEN d.datname IS DISTINCT FROM current_database() THEN NULL
+              WHEN s.kind = 'n' THEN quote_ident(n.nspname) || '.*'
+              ELSE s.objid::regclass::text
+         END AS object,
+         s.operations
+    FROM sql_firewall_structural_rules() s
+    LEFT JOIN pg_catalog.pg_database d ON d.oid = s.dbid
+    LEFT JOIN pg_catalog.pg_namespace n ON s.kind = 'n' AND n.oid = s.objid;
+
+GRANT SELECT ON sql_firewall.structural_rules TO PUBLIC;
+
+-- The latest violations, see sql_firewall.violation_buffer_size.
+CREATE FUNCTION sql_firewall_violations(
+    OUT "time" timestamptz,
+    OUT userid oid,
+    OUT dbid oid,
+    OUT queryid bigint,
+    OUT action text,
+    OUT query text
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE VIEW sql_firewall.violations AS
+  SELECT * FROM sql_firewall_violations();
+
+GRANT SELECT ON sql_firewall.violations TO PUBLIC;
+
+-- The rules filtered by type, user and range of queryids, and optionally a
+-- page of them, ordered by queryid.
+CREATE FUNCTION sql_firewall_rules(
+    IN rule_type text DEFAULT NULL,
+    IN rule_userid oid DEFAULT NULL,
+    IN queryid_min bigint DEFAULT NULL,
+    IN queryid_max bigint DEFAULT NULL,
+    IN row_offset bigint DEFAULT NULL,
+    IN row_limit bigint DEFAULT NULL,
+    OUT userid oid,
+    OUT dbid oid,
+    OUT queryid bigint,
+    OUT query text,
+    OUT calls int8,
+    OUT banned int8,
+    OUT type  text
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE;
+
+-- The views of the rules read the texts of their own rules only.
+CREATE OR REPLACE VIEW sql_firewall.blacklist AS
+  SELECT userid, queryid, query, banned
+    FROM sql_firewall_rules('blacklist');
+
+CREATE OR REPLACE VIEW sql_firewall.whitelist AS
+  SELECT userid, queryid, query, calls
+    FROM sql_firewall_rules('whitelist');
+
+CREATE OR REPLACE VIEW sql_firewall.all_rules AS
+  SELECT userid, queryid, query, calls, banned, type
+    FROM sql_firewall_rules();
+
+-- The shadow rule set, see sql_firewall.shadow_max.
+CREATE FUNCTION sql_firewall.shadow_load(bytea)
+RETURNS int8
+AS 'MODULE_PATHNAME', 'sql_firewall_shadow_load'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION sql_firewall.shadow_clear()
+RETURNS void
+AS 'MODULE_PATHNAME', 'sql_firewall_shadow_clear'
+LANGUAGE C VOLATILE;
+
+CREATE FUNCTION sql_firewall_shadow_stat(
+    OUT rules int8,
+    OUT checks int8,
+    OUT would_reject int8,
+    OUT would_allow int8,
+    OUT divergences int8,
+    OUT dropped int8
+)
+RETURNS record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION sql_firewall_shadow_divergences(
+    OUT userid oid,
+    OUT dbid oid,
+    OUT queryid bigint,
+    OUT live text,
+    OUT shadow text,
+    OUT calls int8,
+    OUT first_seen timestamptz,
+    OUT last_seen timestamptz,
+    OUT query text
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION sql_firewall.shadow_rule_diff(
+    OUT side text,
+    OUT userid oid,
+    OUT dbid oid,
+    OUT queryid bigint,
+    OUT type text
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'sql_firewall_shadow_rule_diff'
+LANGUAGE C STRICT VOLATILE;
+
+REVOKE ALL ON FUNCTION sql_firewall.shadow_load(bytea) FROM PUBLIC;
+REVOKE ALL ON FUNCTION sql_firewall.shadow_clear() FROM PUBLIC;
+REVOKE ALL ON FUNCTION sql_firewall.shadow_rule_diff() FROM PUBLIC;
+
+CREATE VIEW sql_firewall.shadow_stat AS
+  SELECT * FROM sql_firewall_shadow_stat();
+
+GRANT SELECT ON sql_firewall.shadow_stat TO PUBLIC;
+
+CREATE VIEW sql_firewall.shadow_divergences AS
+  SELECT * FROM sql_firewall_shadow_divergences();
+
+GRANT SELECT ON sql_firewall.shadow_divergences TO PUBLIC;
@@ -57,6 +57,19 @@
  * requires holding pgss->lock exclusively; this allows individual entries
  * in the file to be read or written while holding only shared lock.
  *
+ * sql_firewall: with sql_firewall.text_arena_size set, the query texts are
+ * kept in a string arena in shared memory instead of the external file.  The
+ * same rules apply to the arena, pgss->extent being its next free byte.
+ *
+ * sql_firewall: the enforcing and permissive modes don't take pgss->lock at
+ * all in the common case.  They look up the rules in a read-only snapshot of
+ * the hashtable, see publish_rule_snapshot().  Anyone who creates or deletes
+ * an entry must call invalidate_rule_snapshot() while still holding the lock
+ * exclusively; the snapshot is then rebuilt lazily by the next statement that
+ * needs it.  A reader can race with the deletion of a rule, in which case it
+ * may still bump the counters of the entry it found; since hashtable entries
+ * are never returned to the system, that is harmless.
+ *
  *
  * Copyright (c) 2008-2014, PostgreSQL Global Development Group
  *
@@ -67,28 +80,55 @@
  */
 #include "postgres.h"
 
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include "access/hash.h"
+#include "access/xact.h"
+#include "access/xlog.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_type.h"
+#include "commands/dbcommands.h"
+#include "executor/spi.h"
 #include "executor/instrument.h"
 #include "funcapi.h"
+#include "lib/stringinfo.h"
+#include "libpq/pqformat.h"
 #include "mb/pg_wchar.h"
 #include "miscadmin.h"
+#include "nodes/nodeFuncs.h"
 #include "parser/analyze.h"
+#include "parser/parse_expr.h"
+#include "parser/parser.h"
 #include "parser/parsetree.h"
 #include "parser/scanner.h"
+#include "parser/gram.h"
 #include "pgstat.h"
+#include "postmaster/autovacuum.h"
+#include "postmaster/bgworker.h"
+#include "storage/backendid.h"
+#include "storage/barrier.h"
+#include "storage/copydir.h"
 #include "storage/fd.h"
 #include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lock.h"
+#include "storage/proc.h"
 #include "storage/spin.h"
 #include "tcop/utility.h"
 #include "utils/builtins.h"
+#include "utils/inval.h"
 #include "utils/memutils.h"
+#include "utils/pg_crc.h"
+#include "utils/plancache.h"
+#include "utils/snapmgr.h"
+#include "utils/timestamp.h"
 #include "utils/lsyscache.h"
 #include "utils/rel.h"
 #include "utils/relcache.h"
+#include "utils/syscache.h"
 
 #include "utils/acl.h"
 
@@ -98,6 +138,9 @@ PG_MODULE_MAGIC;
 /* Location of permanent stats file (valid when database is shut down) */
 #define PGSS_STATEMENTS_FILE	PGSTAT_STAT_PERMANENT_DIRECTORY "/sql_firewall_statements.stat"
 #define PGSS_COUNTER_FILE	    PGSTAT_STAT_PERMANENT_DIRECTORY "/sql_firewall.stat"
+#define PGFW_RULE_LOG_FILE		PGSTAT_STAT_PERMANENT_DIRECTORY "/sql_firewall_rules.log"
+#define PGFW_REPLICATION_FILE	PGSTAT_STAT_PERMANENT_DIRECTORY "/sql_firewall_replication.stat"
+#define PGFW_STRUCTURAL_FILE	PGSTAT_STAT_PERMANENT_DIRECTORY "/sql_firewall_structural.stat"
 
 /*
  * Location of external query text file.  We don't keep it in the core
@@ -109,9 +152,17 @@ PG_MODULE_MAGIC;
  */
 #define PGSS_STATEMENTS_TEMP_FILE	PG_STAT_TMP_DIR "/sql_firewall_query_texts.stat"
 
-/* Magic number identifying the stats file format */
+/* Magic number identifying the stats file format, read but no more written */
 static const uint32 PGSS_FILE_HEADER = 0x20140125;
 
+/* Magic number and version of the rule image, see rule_image_load() */
+#define PGFW_RULE_IMAGE_MAGIC		0x50474657	/* "PGFW" */
+#define PGFW_RULE_IMAGE_VERSION		4
+
+/* Magic number and version of the structural rule file */
+#define PGFW_STRUCTURAL_MAGIC		0x50474653	/* "PGFS" */
+#define PGFW_STRUCTURAL_VERSION		1
+
 /* PostgreSQL major version number, changes in which invalidate all entries */
 static const uint32 PGSS_PG_MAJOR_VERSION = PG_VERSION_NUM / 100;
 
@@ -133,13 +184,87 @@ static const uint32 PGSS_PG_MAJOR_VERSION = PG_VERSION_NUM / 100;
 typedef struct pgssHashKey
 {
 	Oid			userid;			/* user OID */
-	uint32		queryid;		/* query identifier */
-	char        type;	    	/* rule type:
+	uint32		queryid;		/* query identifier, 32 bits wide like
+								 * Query.queryId, see AppendJumble() */
+	uint32		type;			/* rule type:
 								 *   'w': whitelist
 								 *   'b': blacklist
+								 * a whole word, so that the key has no
+								 * padding bytes
 								 */
+	Oid			dbid;			/* database OID, InvalidOid for the rules
+								 * applied to all databases */
 } pgssHashKey;
 
+/*
+ * pgssHashKey as it is stored in the files, where the database of a rule,
+ * if any, is kept aside.  The database was added to the key later, and
+ * lands on what was padding before.
+ */
+typedef struct pgfwFileKey
+{
+	Oid			userid;			/* user OID */
+	uint32		queryid;		/* query identifier */
+	uint32		type;			/* rule type */
+} pgfwFileKey;
+
+/*
+ * Number of rules of a database, see sql_firewall.max_per_database.  The
+ * rules applied to all databases are only limited by sql_firewall.max.
+ */
+typedef struct pgfwPartition
+{
+	Oid			dbid;			/* database OID - MUST BE FIRST */
+	int64		nrules;			/* # of rules of the database */
+} pgfwPartition;
+
+#define PGFW_MAX_PARTITIONS		256		/* databases which may have rules */
+
+/*
+ * A structural rule lets a user run the given operations on a relation, or
+ * on every relation of a schema, whatever the text of the statement.  The
+ * objects are those of one database, the one the rule was added in.  See
+ * structural_rules_allow().
+ */
+typedef struct pgfwStructuralRule
+{
+	Oid			userid;			/* user OID, InvalidOid for all users */
+	Oid			dbid;			/* database of objid */
+	Oid			objid;			/* relation or schema OID */
+	char		kind;			/* PGFW_STRUCTURAL_RELATION or _SCHEMA */
+	AclMode		operations;		/* ACL_SELECT, ACL_INSERT, ... allowed */
+} pgfwStructuralRule;
+
+#define PGFW_STRUCTURAL_RELATION	'r'
+#define PGFW_STRUCTURAL_SCHEMA		'n'
+
+/* The operations a structural rule may allow */
+#define PGFW_STRUCTURAL_OPERATIONS \
+	(ACL_SELECT | ACL_INSERT | ACL_UPDATE | ACL_DELETE)
+
+#define PGFW_MAX_STRUCTURAL_RULES	1024
+
+/*
+ * The structural rules, in shared memory.  Modified with exclusive
+ * pgss->lock only, and each change bumps rules_generation.
+ */
+typedef struct pgfwStructuralRules
+{
+	int			nrules;			/* # of rules used */
+	pgfwStructuralRule rules[PGFW_MAX_STRUCTURAL_RULES];
+} pgfwStructuralRules;
+
+/*
+ * The structural rules compiled in a backend, for its user and database:
+ * the operations allowed on each relation seen so far, its schema's rules
+ * folded in.
+ */
+typedef struct pgfwStructuralGrant
+{
+	Oid			relid;			/* relation OID - MUST BE FIRST */
+	AclMode		operations;		/* operations allowed on it */
+} pgfwStructuralGrant;
+
 /*
  * The actual stats counters kept within pgssEntry.
  */
@@ -160,6 +285,8 @@ typedef struct pgssEntry
 {
 	pgssHashKey key;			/* hash key of entry - MUST BE FIRST */
 	Counters	counters;		/* the statistics for this query */
+	Counters	logged;			/* counters in the rule log, protected by
+								 * mutex, see rule_log_checkpoint_counters() */
 	Size		query_offset;	/* query text offset in external file */
 	int			query_len;		/* # of valid bytes in query string */
 	int			encoding;		/* query text encoding */
@@ -169,22 +296,529 @@ typedef struct pgssEntry
 								 *   'b'   : blacklist
 								 *   'd'   : dummy entry
 								 */
+	bool		learned;		/* created by the learning mode? */
+	double		usage;			/* usage factor, protected by mutex */
 } pgssEntry;
 
+/*
+ * pgssEntry as written to PGSS_STATEMENTS_FILE by versions older than the
+ * rule image, see pgss_shmem_startup().
+ */
+typedef struct pgfwLegacyEntry
+{
+	pgfwFileKey key;
+	Counters	counters;
+	Size		query_offset;
+	int			query_len;
+	int			encoding;
+	slock_t		mutex;
+	uint32      type;
+} pgfwLegacyEntry;
+
+/*
+ * Read-only image of the hashtable, searched without holding pgss->lock.
+ *
+ * Unlike pgss_hash, the image is keyed on the queryid only: one slot holds
+ * every rule of a query, so that a single probe gives all the entries the
+ * verdict depends on.  The rules applied to all users of all databases are
+ * kept in the slot itself, the rules of specific users or databases in a run
+ * of pgfwUserRules.
+ *
+ * The slots form an open-addressing table, probed linearly from the queryid,
+ * which is a hash value already; an unused slot ends the probe.  changecount
+ * is odd while the snapshot is being rebuilt, readers retry if it changed
+ * under them.
+ */
+typedef struct pgfwUserRule
+{
+	Oid			userid;			/* user OID, InvalidOid for all users */
+	Oid			dbid;			/* database OID, InvalidOid for all databases */
+	pgssEntry  *whitelist_entry;	/* whitelist rule of the user, or NULL */
+	pgssEntry  *blacklist_entry;	/* blacklist rule of the user, or NULL */
+} pgfwUserRule;
+
+typedef struct pgfwRuleSlot
+{
+	uint32		queryid;		/* query identifier */
+	bool		used;			/* is the slot in use? */
+	uint32		first;			/* first user rule of the query in users[] */
+	uint32		nusers;			/* # of user rules of the query */
+	pgssEntry  *whitelist_entry;	/* whitelist rule for all users, or NULL */
+	pgssEntry  *blacklist_entry;	/* blacklist rule for all users, or NULL */
+} pgfwRuleSlot;
+
+typedef struct pgfwRuleSnapshot
+{
+	uint32		changecount;	/* odd while being rebuilt */
+	uint32		nslots;			/* size of slots[], a power of 2 */
+	pgfwUserRule *users;		/* user rules, pgss_max of them */
+	pgfwRuleSlot slots[1];		/* VARIABLE LENGTH ARRAY - MUST BE LAST */
+} pgfwRuleSnapshot;
+
+/* Number of times a reader retries a snapshot before taking the lock */
+#define RULE_SNAPSHOT_RETRIES	4
+
+/*
+ * Backend-local cache of rule lookups, see local_cache_lookup().  Both the
+ * whitelist and the blacklist entry are remembered, NULL when there is no
+ * such rule, so the verdict can be given for whichever engine is in use.
+ */
+typedef struct pgfwCacheKey
+{
+	Oid			userid;			/* user OID */
+	uint32		queryid;		/* query identifier */
+} pgfwCacheKey;
+
+typedef struct pgfwCacheEntry
+{
+	pgfwCacheKey key;			/* hash key of entry - MUST BE FIRST */
+	pgssEntry  *whitelist_entry;	/* matched whitelist rule, or NULL */
+	pgssEntry  *blacklist_entry;	/* matched blacklist rule, or NULL */
+	int64		pending_calls;	/* calls not yet added to whitelist_entry */
+	int64		pending_banned;	/* bans not yet added to blacklist_entry */
+	uint8		shadow;			/* PGFW_SHADOW_* flags */
+} pgfwCacheEntry;
+
+/*
+ * Backend-local cache of the query ids of statement texts, see
+ * fingerprint_lookup().
+ *
+ * The texts are hashed with the settings they are parsed with; the entry
+ * keeps the text itself, which is compared in full, so that two texts of the
+ * same hash never get each other's query id.
+ */
+typedef struct pgfwFingerprintKey
+{
+	uint32		text_hash;		/* hash of the statement text */
+	uint32		env_hash;		/* hash of the parser settings */
+	Oid			userid;			/* user OID */
+	int			text_len;		/* length of the text, -1 if not cacheable */
+} pgfwFingerprintKey;
+
+typedef struct pgfwFingerprint
+{
+	pgfwFingerprintKey key;		/* hash key of entry - MUST BE FIRST */
+	char	   *text;			/* the statement text */
+	uint32		queryid;		/* its query id */
+	bool		has_constants;	/* did the jumble record any constant? */
+} pgfwFingerprint;
+
+/*
+ * Counters kept in the cache are added to the rule entries once a cache
+ * entry has this many of them, or when the backend hasn't done so for
+ * PGFW_COUNTER_FLUSH_MS, see count_cached_rule().
+ */
+#define PGFW_COUNTER_FLUSH_CALLS	64
+#define PGFW_COUNTER_FLUSH_MS		1000
+
+/*
+ * Verdicts memoized per plan, see plan_verdict_lookup().  The memo is a
+ * small direct-mapped table indexed by the address of the PlannedStmt.
+ */
+typedef struct pgfwPlanVerdict
+{
+	const PlannedStmt *plan;	/* plan executed, NULL if the slot is free */
+	Oid			userid;			/* user OID */
+	uint32		queryid;		/* query identifier */
+	uint32		generation;		/* rules_generation of the rules cached */
+	uint64		cache_epoch;	/* local_cache_epoch of centry */
+	pgfwCacheEntry *centry;		/* cache entry holding the rules, or NULL */
+	bool		structural;		/* allowed by the structural rules? */
+} pgfwPlanVerdict;
+
+#define PLAN_VERDICT_SLOTS			64
+
+/*
+ * Nested statements checked during the current top-level statement, see
+ * nested_verdict_known().  A direct-mapped table too, indexed by queryid.
+ */
+typedef struct pgfwNestedVerdict
+{
+	Oid			userid;			/* user OID */
+	uint32		queryid;		/* query identifier */
+	uint32		generation;		/* rules_generation it was checked against */
+	uint64		top_level_epoch;	/* top_level_epoch of the statement */
+} pgfwNestedVerdict;
+
+#define NESTED_VERDICT_SLOTS		64
+
+/*
+ * Warning and error counters of one backend, written by that backend only.
+ * Each one gets its own cache line so that backends don't fight over them.
+ */
+#ifdef PG_CACHE_LINE_SIZE
+#define PGFW_CACHE_LINE_SIZE	PG_CACHE_LINE_SIZE
+#else
+#define PGFW_CACHE_LINE_SIZE	128
+#endif
+
+typedef struct pgfwBackendCounters
+{
+	int64		warning_count;
+	int64		error_count;
+	int64		shadow_checks;	/* statements checked by the shadow rules */
+	int64		shadow_rejects;	/* prohibited by the shadow rules only */
+	int64		shadow_allows;	/* prohibited by the live rules only */
+	char		pad[PGFW_CACHE_LINE_SIZE - 5 * sizeof(int64)];
+} pgfwBackendCounters;
+
+/*
+ * Timings of the stages of the firewall, see sql_firewall.track_timing.
+ *
+ * Bucket 0 counts the durations below 1us, bucket i > 0 those between
+ * 2^(i-1)us and 2^i us, and the last one those longer still.  Each backend
+ * adds to its own histograms without any lock, like it counts its warnings.
+ */
+typedef enum
+{
+	PGFW_TIMING_JUMBLE,			/* jumbling a parsed statement */
+	PGFW_TIMING_LOCK_WAIT,		/* waiting for pgss->lock */
+	PGFW_TIMING_LOOKUP,			/* searching the rules of a statement */
+	PGFW_TIMING_STORE,			/* storing learned or imported rules */
+	PGFW_TIMING_GC,				/* garbage collecting the query texts */
+	PGFW_NUM_TIMINGS
+}	PGFWTimingStage;
+
+static const char *const pgfw_timing_names[PGFW_NUM_TIMINGS] =
+{
+	"jumble",
+	"lock_wait",
+	"lookup",
+	"store",
+	"gc_qtexts"
+};
+
+#define PGFW_TIMING_BUCKETS		24
+
+typedef struct pgfwTimingHistogram
+{
+	int64		counts[PGFW_TIMING_BUCKETS];	/* # of samples per bucket */
+	int64		total_us;		/* sum of the samples */
+} pgfwTimingHistogram;
+
+typedef struct pgfwBackendTimings
+{
+	pgfwTimingHistogram stages[PGFW_NUM_TIMINGS];
+} pgfwBackendTimings;
+
+/*
+ * Queue of the statements to learn, drained by the learner background
+ * worker, see learn_enqueue() and sql_firewall_learner_main().
+ *
+ * Backends reserve a record under the spinlock, fill it without any lock
+ * and then mark it ready; the worker copies out the ready records at the
+ * tail before it releases them.  Only statements whose normalized text fits
+ * in a record are queued, the others are learned by the backend itself.
+ */
+#define LEARN_QUEUE_TEXT_SIZE	2048	/* max text length of a record */
+#define LEARN_QUEUE_BATCH		64		/* records ingested per lock cycle */
+
+typedef struct pgfwLearnRecord
+{
+	bool		ready;			/* filled in, may be ingested */
+	Oid			dbid;			/* database of the rule, see pgssHashKey */
+	Oid			userid;			/* user OID */
+	uint32		queryid;		/* query identifier */
+	int			encoding;		/* query text encoding */
+	int			query_len;		/* # of valid bytes in query */
+	char		query[LEARN_QUEUE_TEXT_SIZE];	/* normalized query text */
+} pgfwLearnRecord;
+
+typedef struct pgfwLearnQueue
+{
+	slock_t		mutex;			/* protects the following fields only: */
+	uint64		head;			/* # of records ever reserved */
+	uint64		tail;			/* # of records ever released */
+	int64		overflows;		/* # of statements not queued, queue full */
+	Latch	   *latch;			/* latch of the learner, or NULL */
+	uint32		nrecords;		/* size of records[] */
+	pgfwLearnRecord records[1];	/* VARIABLE LENGTH ARRAY - MUST BE LAST */
+} pgfwLearnQueue;
+
+/*
+ * Ring buffer of the latest violations, see violation_record().  An event
+ * takes its number under the spinlock of the ring, then is copied in under
+ * that of its slot, overwriting the oldest one when the ring is full.  The
+ * ring also rate-limits the reports of the violations for all sessions.
+ */
+#define VIOLATION_TEXT_SIZE		256		/* max text length of an event */
+
+typedef struct pgfwViolation
+{
+	slock_t		mutex;			/* protects the following fields only: */
+	uint64		seq;			/* 1 + number of the event, 0 if none yet */
+	TimestampTz time;			/* start of the statement */
+	Oid			userid;			/* user OID */
+	Oid			dbid;			/* database OID */
+	uint32		queryid;		/* query identifier */
+	bool		enforced;		/* rejected, or only warned about? */
+	char		query[VIOLATION_TEXT_SIZE];	/* truncated statement text */
+} pgfwViolation;
+
+typedef struct pgfwViolationRing
+{
+	slock_t		mutex;			/* protects the following fields only: */
+	uint64		next;			/* # of events ever recorded */
+	uint64		first;			/* number of the first event still shown */
+	TimestampTz last_report;	/* time of the latest report, or 0 */
+	int64		not_reported;	/* # of violations not reported since */
+	uint32		nevents;		/* size of events[], may be 0 */
+	pgfwViolation events[1];	/* VARIABLE LENGTH ARRAY - MUST BE LAST */
+} pgfwViolationRing;
+
+/*
+ * A rule of the shadow rule set, see sql_firewall.shadow_max.  The shadow
+ * rules are kept by their keys only: they give a verdict, compared with the
+ * verdict of the live rules, but have neither texts nor counters.
+ */
+typedef struct pgfwShadowRule
+{
+	pgssHashKey key;			/* hash key of the rule - MUST BE FIRST */
+} pgfwShadowRule;
+
+/*
+ * A statement the shadow rules decide otherwise than the live rules, see
+ * shadow_divergence_record().  There is one per user, database and query.
+ */
+typedef struct pgfwDivergenceKey
+{
+	Oid			userid;			/* user OID */
+	Oid			dbid;			/* database OID */
+	uint32		queryid;		/* query identifier */
+} pgfwDivergenceKey;
+
+typedef struct pgfwDivergence
+{
+	pgfwDivergenceKey key;		/* hash key of entry - MUST BE FIRST */
+	slock_t		mutex;			/* protects the following fields only: */
+	bool		shadow_prohibited;	/* prohibited by the shadow rules only? */
+	int64		count;			/* # of statements diverging */
+	TimestampTz first_seen;		/* start of the first of them */
+	TimestampTz last_seen;		/* start of the last of them */
+	char		query[VIOLATION_TEXT_SIZE];	/* truncated text of the first */
+} pgfwDivergence;
+
+#define PGFW_MAX_DIVERGENCES	4096	/* statements whose divergence is kept */
+
+/* pgfwCacheEntry.shadow, what the shadow rules say of the statement */
+#define PGFW_SHADOW_SEARCHED	0x01	/* the shadow rules were searched */
+#define PGFW_SHADOW_WHITELIST	0x02	/* a shadow whitelist rule matches */
+#define PGFW_SHADOW_BLACKLIST	0x04	/* a shadow blacklist rule matches */
+#define PGFW_SHADOW_DROPPED		0x08	/* the divergence couldn't be kept */
+
+/*
+ * A rule to create, see store_rules().
+ */
+typedef struct pgfwRuleItem
+{
+	Oid			dbid;			/* database OID, see pgssHashKey */
+	Oid			userid;			/* user OID */
+	uint32		queryid;		/* query identifier */
+	uint32		type;			/* rule type, 'w' or 'b' */
+	const char *query;			/* normalized query text */
+	int			query_len;		/* # of valid bytes in query */
+	int			encoding;		/* query text encoding */
+	bool		sticky;			/* is the entry created at parse time? */
+	bool		learned;		/* whitelist rule, unless one for all users exists */
+	Counters	counters;		/* initial counters of the rule */
+} pgfwRuleItem;
+
+/*
+ * A rule change to replicate, see rule_changes_enqueue().  It is captured
+ * where the rule log records the change, op being a PGFW_RULE_LOG_* code.
+ */
+typedef struct pgfwRuleChange
+{
+	uint32		op;				/* PGFW_RULE_LOG_* */
+	pgssHashKey key;			/* rule, unused by PGFW_RULE_LOG_RESET */
+	int			encoding;		/* PGFW_RULE_LOG_ADD/LEARN only */
+	char	   *query;			/* PGFW_RULE_LOG_ADD/LEARN only, or NULL */
+	int			query_len;		/* # of valid bytes in query */
+	SubTransactionId subid;		/* subtransaction which made the change */
+} pgfwRuleChange;
+
+/*
+ * How to undo a rule change captured for the standbys, if its transaction
+ * or subtransaction aborts, see rule_changes_undo().  A rule created is
+ * removed again, and a rule removed is created again from its copy.
+ */
+typedef struct pgfwRuleUndo
+{
+	bool		recreate;		/* create the rule again, or remove it? */
+	pgssHashKey key;			/* rule to remove */
+	pgfwRuleItem rule;			/* rule to create again */
+	SubTransactionId subid;		/* subtransaction which made the change */
+} pgfwRuleUndo;
+
+/* # of rule changes a standby applies, or the primary records, per transaction */
+#define RULE_CHANGES_BATCH		1000
+
+/*
+ * Queue of the rule changes committed, for the rule publisher background
+ * worker to record in sql_firewall.rule_changes, see rule_changes_enqueue()
+ * and sql_firewall_rule_publisher_main().
+ *
+ * The transactions changing the rules go one after the other, each
+ * queueing its changes as it commits, and the publisher records them in
+ * that order.  A change is a pgfwRuleChangeRecord followed by its text,
+ * either of which may wrap around the end of the ring; head and tail count
+ * the bytes ever queued and recorded.
+ */
+typedef struct pgfwRuleChangeRecord
+{
+	uint32		op;				/* PGFW_RULE_LOG_* */
+	pgssHashKey key;			/* rule, unused by PGFW_RULE_LOG_RESET */
+	int			encoding;		/* PGFW_RULE_LOG_ADD/LEARN only */
+	int			query_len;		/* # of bytes of text following, or -1 */
+} pgfwRuleChangeRecord;
+
+typedef struct pgfwRuleChangeQueue
+{
+	slock_t		mutex;			/* protects the following fields only: */
+	uint64		head;			/* # of bytes ever queued */
+	uint64		tail;			/* # of bytes ever recorded */
+	Latch	   *latch;			/* latch of the publisher, or NULL */
+	Size		size;			/* size of data[] */
+	char		data[1];		/* VARIABLE LENGTH ARRAY - MUST BE LAST */
+} pgfwRuleChangeQueue;
+
+#define RULE_CHANGE_SIZE(query_len) \
+	(sizeof(pgfwRuleChangeRecord) + Max((query_len), 0))
+
+/*
+ * Key of the lock the transactions changing the rules take, see
+ * rule_changes_begin(), in the advisory lock space of no database.
+ */
+#define RULE_CHANGES_LOCK_KEY	0x73716c66	/* "sqlf" */
+
+/*
+ * Record of the rule log.
+ *
+ * With sql_firewall.rule_log on, every rule created or deleted since
+ * PGSS_STATEMENTS_FILE was last written is appended to PGFW_RULE_LOG_FILE,
+ * and pgss_shmem_startup() replays the log on top of that file.  Appending
+ * needs pgss->lock exclusively, or shared by the rule writer alone, which
+ * also fsyncs the log in batches and folds it into PGSS_STATEMENTS_FILE once
+ * it has grown, see sql_firewall_rule_writer_main().
+ */
+#define PGFW_RULE_LOG_ADD		'a'		/* rule created, text follows */
+#define PGFW_RULE_LOG_LEARN		'l'		/* rule learned, text follows */
+#define PGFW_RULE_LOG_DELETE	'd'		/* rule deleted */
+#define PGFW_RULE_LOG_COUNTERS	'c'		/* counters of a rule */
+#define PGFW_RULE_LOG_RESET		'r'		/* every rule deleted */
+
+#define PGFW_RULE_LOG_CHECKPOINT_MS		60000	/* interval of counter records */
+#define PGFW_RULE_LOG_COMPACT_SIZE		(16 * 1024 * 1024)	/* bytes */
+#define PGFW_RULE_LOG_BATCH_SIZE		(64 * 1024)	/* bytes written at once */
+
+typedef struct pgfwRuleLogRecord
+{
+	pg_crc32	crc;			/* CRC of the rest of the record and text */
+	uint32		op;				/* PGFW_RULE_LOG_* */
+	pgfwFileKey key;			/* rule, unused by PGFW_RULE_LOG_RESET */
+	Oid			dbid;			/* database of the rule */
+	Counters	counters;		/* PGFW_RULE_LOG_COUNTERS only */
+	int			encoding;		/* PGFW_RULE_LOG_ADD/LEARN only */
+	int			query_len;		/* # of bytes of text following */
+} pgfwRuleLogRecord;
+
+/*
+ * Rule image, the format of PGSS_STATEMENTS_FILE.
+ *
+ * The header is followed by the rules, in no particular order, then by their
+ * null-terminated query texts; text_offset counts from the first text.  The
+ * CRC covers everything after the header.  Being a single fixed layout, the
+ * file is mapped and loaded as a whole rather than read rule by rule.
+ */
+typedef struct pgfwRuleImageHeader
+{
+	uint32		magic;			/* PGFW_RULE_IMAGE_MAGIC */
+	uint32		version;		/* PGFW_RULE_IMAGE_VERSION */
+	uint32		pgver;			/* PGSS_PG_MAJOR_VERSION */
+	uint32		nrules;			/* # of rules */
+	uint64		text_size;		/* # of bytes of the query texts */
+	pg_crc32	crc;			/* CRC of the rules and the texts */
+	uint32		pad;			/* keeps the rules aligned */
+} pgfwRuleImageHeader;
+
+typedef struct pgfwRuleImageEntry
+{
+	pgfwFileKey key;			/* hash key of the rule */
+	Oid			dbid;			/* database of the rule (version 4) */
+	Counters	counters;		/* counters of the rule */
+	uint64		text_offset;	/* offset of the query text */
+	int32		query_len;		/* # of valid bytes in query string */
+	int32		encoding;		/* query text encoding */
+	uint32		flags;			/* PGFW_RULE_IMAGE_* (version 2) */
+	uint32		pad;			/* keeps the rules aligned */
+} pgfwRuleImageEntry;
+
+/*
+ * Size of pgfwRuleImageEntry in version 1 of the image, before flags.  The
+ * keys of versions 1 and 2 have a char type, see key_from_legacy().
+ */
+#define RULE_IMAGE_ENTRY_SIZE_V1	offsetof(pgfwRuleImageEntry, flags)
+
+#define PGFW_RULE_IMAGE_LEARNED		0x0001	/* rule created by learning */
+
+/*
+ * The rules to write to PGSS_STATEMENTS_FILE, copied by rule_image_copy()
+ * so that the file is written without holding pgss->lock.
+ */
+typedef struct pgfwRuleImageCopy
+{
+	pgfwRuleImageEntry *rules;	/* the rules, text_offset not set yet */
+	Size	   *query_offsets;	/* offsets of their texts */
+	uint32		nrules;			/* # of rules */
+	int			gc_count;		/* pgss->gc_count at the copy */
+	off_t		log_size;		/* size of the rule log at the copy */
+} pgfwRuleImageCopy;
+
 /*
  * Global shared state
  */
 typedef struct pgssSharedState
 {
 	LWLock	   *lock;			/* protects hashtable search/modification */
+	LWLock	   *checkpoint_lock;	/* serializes checkpoint_rule_file() */
 	double		cur_median_usage;		/* current median usage in hashtable */
 	Size		mean_query_len; /* current mean entry text length */
 	slock_t		mutex;			/* protects following fields only: */
 	Size		extent;			/* current extent of query file */
 	int			n_writers;		/* number of active writers to query file */
 	int			gc_count;		/* query file garbage collection cycle count */
-	int64			error_count;
-	int64			warning_count;
+	int64			error_count;	/* errors not counted per backend below */
+	int64			warning_count;	/* warnings not counted per backend */
+	int64		evictions;		/* # of learned rules evicted */
+	int64		rejected;		/* # of rules dropped, the table being full */
+	pgfwBackendCounters *backend_counters;	/* one per backend, lock-free */
+	pgfwBackendTimings *backend_timings;	/* one per backend, lock-free */
+	pgfwBackendTimings timings_reset;	/* sums at the last reset */
+	pgfwLearnQueue *learn_queue;	/* statements to learn, or NULL */
+	pgfwRuleChangeQueue *rule_change_queue;	/* changes to record, or NULL */
+	char	   *qtext_arena;	/* query texts, or NULL to use the file */
+	Size		qtext_arena_size;	/* size of qtext_arena in bytes */
+	bool		rule_log_dirty;	/* rule log written since its last fsync */
+	int64		replicated_seq;	/* last rule change applied by a standby */
+	/* the following fields are modified only with exclusive pgss->lock */
+	int64		database_rules;	/* # of rules of specific databases */
+	/* the following fields are modified only with exclusive pgss->lock */
+	uint32		rules_generation;	/* bumped whenever the rules change */
+	uint32		rule_log_generation;	/* bumped whenever the log is replaced */
+	bool		snapshot_valid;		/* does the current snapshot match? */
+	int			snapshot_current;	/* index of the snapshot to search */
+	pgfwRuleSnapshot *snapshots[2];	/* double-buffered rule snapshots */
+	pgfwStructuralRules *structural;	/* the structural rules */
+	pgfwViolationRing *violations;	/* the latest violations */
+	/* the following fields are modified only with exclusive pgss->lock */
+	bool		shadow_loaded;	/* is a shadow rule set loaded? */
+	int64		shadow_rules;	/* # of shadow rules */
+	int64		shadow_database_rules;	/* # of them of specific databases */
+	/* the following fields are protected by mutex, like warning_count */
+	int64		shadow_checks;	/* shadow counters not counted per backend */
+	int64		shadow_rejects;
+	int64		shadow_allows;
+	int64		shadow_dropped;	/* # of divergences not kept */
 } pgssSharedState;
 
 /*
@@ -220,11 +854,99 @@ typedef struct pgssJumbleState
 
 extern void JumbleQuery(pgssJumbleState *jstate, Query *query);
 
+/*
+ * clocations of the jumble workspace is given back when it has grown past
+ * this many entries, so that one huge statement doesn't pin its memory.
+ */
+#define JUMBLE_MAX_KEPT_CLOCATIONS	4096
+
 /*---- Local variables ----*/
 
 /* Current nesting depth of ExecutorRun+ProcessUtility calls */
 static int	nested_level = 0;
 
+/*
+ * Verdict given by pgss_post_parse_analyze() in the analyze stage.  The
+ * ExecutorStart of the same statement consumes it, so that the statement is
+ * neither checked nor counted twice.  Any later parse analysis forgets it.
+ */
+static bool verdict_valid = false;
+static Oid	verdict_userid = InvalidOid;
+static uint32 verdict_queryid = 0;
+
+/* Jumble workspace, reused by every statement, see jumble_workspace_reset() */
+static pgssJumbleState jumble_workspace = {NULL, 0, NULL, 0, 0};
+
+/* Backend-local rule cache, valid for rules_generation local_cache_generation */
+static HTAB *local_cache = NULL;
+static int	local_cache_capacity = 0;
+static uint32 local_cache_generation = 0;
+static int64 local_cache_hits = 0;
+static int64 local_cache_misses = 0;
+static bool local_cache_pending = false;	/* any counts kept in the cache? */
+static uint64 local_cache_epoch = 0;	/* bumped when the cache is flushed */
+
+/* Nested statements checked meanwhile, see nested_verdict_known() */
+static pgfwNestedVerdict nested_verdicts[NESTED_VERDICT_SLOTS];
+static uint64 top_level_epoch = 1;	/* bumped by each top-level statement */
+
+/* Backend-local query id cache, see fingerprint_lookup() */
+static HTAB *fingerprint_cache = NULL;
+static MemoryContext fingerprint_cxt = NULL;	/* holds the cached texts */
+static Size fingerprint_cache_used = 0;		/* bytes of the entries and texts */
+static int	fingerprint_cache_capacity = 0;	/* kB budget of the cache */
+
+/* Is sql_firewall_queryid() analyzing the text of a rule? */
+static bool rule_text_analyzing = false;
+
+/* Flags set by the signal handlers of the background workers */
+static volatile sig_atomic_t worker_got_sighup = false;
+static volatile sig_atomic_t worker_got_sigterm = false;
+
+/*
+ * Rule changes captured for the standbys, queued as the transaction
+ * commits.  The capture goes on during the transaction rule_changes_lxid
+ * only, see rule_changes_begin().
+ */
+static List *rule_changes = NIL;
+static Size rule_changes_size = 0;	/* bytes they take in the queue */
+static LocalTransactionId rule_changes_lxid = InvalidLocalTransactionId;
+static SubTransactionId rule_changes_subid = InvalidSubTransactionId;
+
+/* Are the statements of this process exempt from the rules? */
+static bool statements_exempt = false;
+
+/*
+ * How to undo the rule changes captured in the current transaction, the
+ * latest first, see rule_changes_undo().
+ */
+static List *rule_undo = NIL;
+
+/*
+ * The rule log as opened by this process, and the records not written to
+ * it yet, see rule_log_append().
+ */
+static int	rule_log_fd = -1;
+static uint32 rule_log_fd_generation = 0;	/* pgss->rule_log_generation */
+static StringInfoData rule_log_buffer = {NULL, 0, 0, 0};
+static bool rule_log_batching = false;	/* hold the records until flushed? */
+
+/* Plan verdict memo, in front of the rule cache */
+static pgfwPlanVerdict plan_verdicts[PLAN_VERDICT_SLOTS];
+static TimestampTz local_cache_flushed = 0;	/* last flush of the counters */
+
+/*
+ * The structural rules compiled by this backend, see structural_compile().
+ * The rules of the user and the database are copied; the grants of the
+ * relations are filled in as the statements come across them.
+ */
+static pgfwStructuralRule *structural_local = NULL;
+static int	structural_nlocal = 0;
+static HTAB *structural_grants = NULL;
+static bool structural_valid = false;
+static Oid	structural_userid = InvalidOid;
+static uint32 structural_generation = 0;
+
 /* Saved hook values in case of unload */
 static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
 static post_parse_analyze_hook_type prev_post_parse_analyze_hook = NULL;
@@ -233,10 +955,17 @@ static ExecutorRun_hook_type prev_ExecutorRun = NULL;
 static ExecutorFinish_hook_type prev_ExecutorFinish = NULL;
 static ExecutorEnd_hook_type prev_ExecutorEnd = NULL;
 static ProcessUtility_hook_type prev_ProcessUtility = NULL;
+static emit_log_hook_type prev_emit_log_hook = NULL;
+
+/* Keep the next WARNING out of the server log?  See pgfw_emit_log(). */
+static bool violation_warning_unlogged = false;
 
 /* Links to shared memory state */
 static pgssSharedState *pgss = NULL;
 static HTAB *pgss_hash = NULL;
+static HTAB *pgfw_partitions = NULL;	/* pgfwPartitions, by database */
+static HTAB *pgfw_shadow_hash = NULL;	/* pgfwShadowRules, or NULL */
+static HTAB *pgfw_divergences = NULL;	/* pgfwDivergences, or NULL */
 
 /*---- GUC variables ----*/
 
@@ -247,15 +976,13 @@ typedef enum
 	PGSS_TRACK_ALL				/* all statements, including nested ones */
 }	PGSSTrackLevel;
 
-#ifdef NOT_USED
+/* "none" would let every statement through, it is not offered */
 static const struct config_enum_entry track_options[] =
 {
-	{"none", PGSS_TRACK_NONE, false},
 	{"top", PGSS_TRACK_TOP, false},
 	{"all", PGSS_TRACK_ALL, false},
 	{NULL, 0, false}
 };
-#endif
 
 typedef enum
 {
@@ -299,6 +1026,90 @@ static const struct config_enum_entry rule_engine_options[] =
 	{NULL,        0,                     false}
 };
 
+/*
+ * Where in the life of a statement the firewall rules are applied.
+ */
+typedef enum
+{
+	PGFW_STAGE_ANALYZE,			/* right after parse analysis */
+	PGFW_STAGE_EXECUTOR_END		/* once the statement has been executed */
+}	PGFWVerdictStage;
+
+static const struct config_enum_entry verdict_stage_options[] =
+{
+	{"analyze",      PGFW_STAGE_ANALYZE,      false},
+	{"executor_end", PGFW_STAGE_EXECUTOR_END, false},
+	{NULL,           0,                       false}
+};
+
+/*
+ * How the utility statements are told apart.
+ */
+typedef enum
+{
+	PGFW_UTILITY_TEXT,			/* by their exact text */
+	PGFW_UTILITY_CONSTANTS,		/* by their tokens, less the constants */
+	PGFW_UTILITY_IDENTIFIERS	/* by their tokens, less the constants and
+								 * identifiers */
+}	PGFWNormalizeUtility;
+
+/*
+ * Which rules the rules created in a database belong to.
+ */
+typedef enum
+{
+	PGFW_SCOPE_CLUSTER,			/* the rules of all databases */
+	PGFW_SCOPE_DATABASE			/* the rules of the database */
+}	PGFWRuleScope;
+
+static const struct config_enum_entry rule_scope_options[] =
+{
+	{"cluster",  PGFW_SCOPE_CLUSTER,  false},
+	{"database", PGFW_SCOPE_DATABASE, false},
+	{NULL,       0,                   false}
+};
+
+static const struct config_enum_entry normalize_utility_options[] =
+{
+	{"text",        PGFW_UTILITY_TEXT,        false},
+	{"constants",   PGFW_UTILITY_CONSTANTS,   false},
+	{"identifiers", PGFW_UTILITY_IDENTIFIERS, false},
+	{NULL,          0,                        false}
+};
+
+/*
+ * Which statements are written to the server log for diagnostics.
+ */
+typedef enum
+{
+	PGFW_LOG_NONE,				/* nothing */
+	PGFW_LOG_VIOLATIONS,		/* prohibited statements only */
+	PGFW_LOG_ALL				/* every statement, with its query id */
+}	PGFWLogStatements;
+
+static const struct config_enum_entry log_statements_options[] =
+{
+	{"none",       PGFW_LOG_NONE,       false},
+	{"violations", PGFW_LOG_VIOLATIONS, false},
+	{"all",        PGFW_LOG_ALL,        false},
+	{NULL,         0,                   false}
+};
+
+static const struct config_enum_entry log_level_options[] =
+{
+	{"debug5",  DEBUG5,  false},
+	{"debug4",  DEBUG4,  false},
+	{"debug3",  DEBUG3,  false},
+	{"debug2",  DEBUG2,  false},
+	{"debug1",  DEBUG1,  false},
+	{"debug",   DEBUG2,  true},
+	{"info",    INFO,    false},
+	{"notice",  NOTICE,  false},
+	{"warning", WARNING, false},
+	{"log",     LOG,     false},
+	{NULL,      0,       false}
+};
+
 static const struct config_enum_entry rule_type_options[] =
 {
 	{"dummy",     PGFW_DUMMY_ENTRY,      false},
@@ -311,6 +1122,29 @@ static const struct config_enum_entry rule_type_options[] =
 static int  pgfw_rule_engine;
 
 static int	pgfw_mode;			/* firewall mode */
+static int	pgfw_verdict_stage;	/* when the rules are applied */
+static int	pgfw_normalize_utility;	/* how utility statements are jumbled */
+static int	pgfw_rule_scope;	/* databases of the rules created */
+static int	pgfw_max_per_database;	/* max # rules of a database, or 0 */
+static int	pgfw_cache_size;	/* max # rule lookups cached per backend */
+static int	pgfw_fingerprint_cache_size;	/* kB of query ids cached per backend */
+static bool pgfw_track_calls;	/* whether to count calls of whitelist rules */
+static bool pgfw_track_timing;	/* whether to time the firewall stages */
+static int	pgfw_log_statements;	/* which statements to log */
+static int	pgfw_log_level;		/* message level of the diagnostics */
+static double pgfw_log_sample_rate;	/* fraction of the statements to log */
+static int	pgfw_learn_queue_size;	/* # of records of the learning queue */
+static int	pgfw_text_arena_size;	/* kB of shared memory for query texts */
+static bool pgfw_rule_log;			/* log the rule changes? */
+static int	pgfw_rule_log_sync_delay;	/* ms between fsyncs of the rule log */
+static bool pgfw_learning_eviction;	/* evict learned rules when full? */
+static bool pgfw_replicate_rules;	/* replicate the rule changes to standbys? */
+static char *pgfw_replication_database;	/* database of the replicated changes */
+static int	pgfw_replication_naptime;	/* ms between polls of the standbys */
+static int	pgfw_replication_queue_size;	/* kB of the rule change queue */
+static int	pgfw_violation_buffer_size;	/* # of violations kept in shmem */
+static int	pgfw_shadow_max;	/* max # of shadow rules, 0 for none */
+static int	pgfw_violation_log_interval;	/* ms between violation reports */
 
 static int	pgss_max;			/* max # statements to track */
 static int	pgss_track;			/* tracking level */
@@ -318,8 +1152,25 @@ static bool pgss_save;			/* whether to save stats across shutdown */
 
 
 #define pgss_enabled() \
+	(pgfw_mode != PGFW_MODE_DISABLED && \
 	(pgss_track == PGSS_TRACK_ALL || \
-	(pgss_track == PGSS_TRACK_TOP && nested_level == 0))
+	(pgss_track == PGSS_TRACK_TOP && nested_level == 0)))
+
+/* Do we need to apply the rules to statements at all? */
+#define pgfw_checking() \
+	(!statements_exempt && \
+	 (pgfw_mode == PGFW_MODE_ENFORCING || pgfw_mode == PGFW_MODE_PERMISSIVE))
+
+/* Are the rules applied before the statement gets executed? */
+#define pgfw_check_early() \
+	(pgfw_checking() && pgfw_verdict_stage == PGFW_STAGE_ANALYZE)
+
+/* Database of the rules created by this session, see pgssHashKey */
+#define pgfw_current_dbid() \
+	(pgfw_rule_scope == PGFW_SCOPE_DATABASE ? MyDatabaseId : InvalidOid)
+
+#define pgfw_log_wanted(what) \
+	(pgfw_log_statements >= (what) && pgfw_log_sampled())
 
 #define record_gc_qtexts() \
 	do { \
@@ -333,19 +1184,48 @@ static bool pgss_save;			/* whether to save stats across shutdown */
 
 void		_PG_init(void);
 void		_PG_fini(void);
+void		sql_firewall_learner_main(Datum main_arg);
+void		sql_firewall_rule_writer_main(Datum main_arg);
+void		sql_firewall_rule_replayer_main(Datum main_arg);
+void		sql_firewall_rule_publisher_main(Datum main_arg);
 
 PG_FUNCTION_INFO_V1(sql_firewall_reset);
 PG_FUNCTION_INFO_V1(sql_firewall_statements);
+PG_FUNCTION_INFO_V1(sql_firewall_rules);
 PG_FUNCTION_INFO_V1(sql_firewall_stat_error_count);
 PG_FUNCTION_INFO_V1(sql_firewall_stat_warning_count);
 PG_FUNCTION_INFO_V1(sql_firewall_stat_reset);
+PG_FUNCTION_INFO_V1(sql_firewall_cache_hit_count);
+PG_FUNCTION_INFO_V1(sql_firewall_cache_miss_count);
+PG_FUNCTION_INFO_V1(sql_firewall_eviction_count);
+PG_FUNCTION_INFO_V1(sql_firewall_rejected_count);
+PG_FUNCTION_INFO_V1(sql_firewall_stat_timing);
+PG_FUNCTION_INFO_V1(sql_firewall_partitions);
 PG_FUNCTION_INFO_V1(sql_firewall_export_rule);
 PG_FUNCTION_INFO_V1(sql_firewall_import_rule);
+PG_FUNCTION_INFO_V1(sql_firewall_export_rules);
+PG_FUNCTION_INFO_V1(sql_firewall_export_rules_binary);
+PG_FUNCTION_INFO_V1(sql_firewall_import_rules);
 PG_FUNCTION_INFO_V1(sql_firewall_add_rule);
 PG_FUNCTION_INFO_V1(sql_firewall_del_rule);
-
+PG_FUNCTION_INFO_V1(sql_firewall_add_structural_rule);
+PG_FUNCTION_INFO_V1(sql_firewall_del_structural_rule);
+PG_FUNCTION_INFO_V1(sql_firewall_structural_rules);
+PG_FUNCTION_INFO_V1(sql_firewall_violations);
+PG_FUNCTION_INFO_V1(sql_firewall_shadow_load);
+PG_FUNCTION_INFO_V1(sql_firewall_shadow_clear);
+PG_FUNCTION_INFO_V1(sql_firewall_shadow_stat);
+PG_FUNCTION_INFO_V1(sql_firewall_shadow_divergences);
+PG_FUNCTION_INFO_V1(sql_firewall_shadow_rule_diff);
+
+static void pgfw_mode_assign(int newval, void *extra);
 static void pgss_shmem_startup(void);
-static void update_firewall_rule_file(void);
+static bool update_firewall_rule_file(void);
+static void rule_image_copy(pgfwRuleImageCopy *copy);
+static bool rule_image_write(pgfwRuleImageCopy *copy, bool check_gc);
+static bool rule_image_load(FILE *qfile);
+static pgfwRuleItem *copy_rules(int *nrules_p);
+static pgfwRuleItem *rule_image_read(bytea *image, int *nitems_p);
 static void update_firewall_counter_file(void);
 static void pgss_shmem_shutdown(int code, Datum arg);
 static void pgss_post_parse_analyze(ParseState *pstate, Query *query);
@@ -358,31 +1238,41 @@ static void pgss_ExecutorEnd(QueryDesc *queryDesc);
 static void pgss_ProcessUtility(Node *parsetree, const char *queryString,
 					ProcessUtilityContext context, ParamListInfo params,
 					DestReceiver *dest, char *completionTag);
+static void pgfw_emit_log(ErrorData *edata);
 static uint32 pgss_hash_fn(const void *key, Size keysize);
+static void key_from_file(pgssHashKey *key, const pgfwFileKey *fkey,
+						  Oid dbid, bool legacy);
+static void key_to_file(pgfwFileKey *fkey, const pgssHashKey *key);
 static int	pgss_match_fn(const void *key1, const void *key2, Size keysize);
 static uint32 pgss_hash_string(const char *str);
+static uint32 utility_queryid(const char *query, pgssJumbleState **jstate_p);
 static void pgss_store(const char *query, uint32 queryId,
-		   double total_time, uint64 rows,
-		   const BufferUsage *bufusage,
-		   pgssJumbleState *jstate);
+		   Query *parse, pgssJumbleState *jstate);
 static void pg_stat_statements_internal(FunctionCallInfo fcinfo,
 							bool showtext);
 static Size pgss_memsize(void);
-static pgssEntry *entry_alloc(pgssHashKey *key, Size query_offset, int query_len,
-			int encoding, bool sticky);
-#ifdef NOT_USED
-static void entry_dealloc(void);
-#endif
+static pgssEntry *entry_alloc(pgssHashKey *key, const char *query,
+			Size query_offset, int query_len,
+			int encoding, bool sticky, bool learned);
+static int	entry_dealloc(void);
+static void entry_touch(pgssEntry *entry);
 static bool qtext_store(const char *query, int query_len,
 			Size *query_offset, int *gc_count);
 static bool pgss_restore(Oid userid, uint32 queryid, const char *query,
 						 int64 calls, int64 banned, uint32 engine);
 static char *qtext_load_file(Size *buffer_size);
+static void qtext_release(char *buffer);
+static bool qtext_arena_store(const char *query, int query_len,
+							  Size *query_offset, int *gc_count);
+static bool gc_qtexts_arena(void);
 static char *qtext_fetch(Size query_offset, int query_len,
 			char *buffer, Size buffer_size);
+static char *qtext_read(Size query_offset, int query_len, int *fd);
+static int	rule_key_cmp(const void *a, const void *b);
 static bool need_gc_qtexts(void);
 static void gc_qtexts(void);
 static void entry_reset(void);
+static pgssJumbleState *jumble_workspace_reset(void);
 static void AppendJumble(pgssJumbleState *jstate,
 			 const unsigned char *item, Size size);
 static void JumbleRangeTable(pgssJumbleState *jstate, List *rtable);
@@ -393,12 +1283,148 @@ static char *generate_normalized_query(pgssJumbleState *jstate, const char *quer
 static void fill_in_constant_lengths(pgssJumbleState *jstate, const char *query);
 static int	comp_location(const void *a, const void *b);
 
-static bool       to_be_prohibited(Oid userid, uint32 queryid);
-static pgssEntry *lookup_whitelist(Oid userid, uint32 queryid);
+static bool       to_be_prohibited(pgssEntry *whitelist_entry,
+								   pgssEntry *blacklist_entry,
+								   pgfwCacheEntry *centry,
+								   bool structural);
+static void       lookup_rules(Oid userid, uint32 queryid,
+							   pgssEntry **whitelist_entry,
+							   pgssEntry **blacklist_entry);
+static void       pgfw_check_statement(const char *query, uint32 queryId,
+									   Query *parse, const PlannedStmt *plan);
+static void       remember_verdict(uint32 queryId);
+static bool       pgfw_log_sampled(void);
+static bool       whitelist_is_known(Oid userid, uint32 queryid);
+static int        store_rules(pgfwRuleItem *items, int nitems,
+								  bool all_or_none);
+static Size       learn_queue_size(void);
+static Size       violation_ring_size(void);
+static bool       violation_record(Oid userid, uint32 queryid,
+								   const char *query, bool enforced,
+								   int64 *suppressed);
+static bool       shadow_lookup_rule(Oid userid, uint32 queryid,
+									 uint32 rule_type);
+static uint8      shadow_lookup_rules(Oid userid, uint32 queryid);
+static bool       shadow_prohibits(uint8 shadow, bool structural);
+static void       shadow_stat_increment(bool diverged, bool shadow_prohibited);
+static void       shadow_divergence_count(volatile pgfwDivergence *d,
+										  bool shadow_prohibited);
+static void       shadow_divergence_record(Oid userid, uint32 queryid,
+										   const char *query,
+										   pgfwCacheEntry *centry,
+										   bool shadow_prohibited);
+static void       shadow_check(Oid userid, uint32 queryid, const char *query,
+							   pgfwCacheEntry *centry, bool search,
+							   bool structural, bool prohibited);
+static void       shadow_clear(void);
+static void       shadow_counter_totals(int64 *checks, int64 *rejects,
+										int64 *allows);
+static void       shadow_counter_reset(void);
+static void       shadow_check_enabled(const char *funcname);
+static bool       learn_enqueue(Oid dbid, Oid userid, uint32 queryid,
+								const char *query, int query_len,
+								int encoding);
+static int        learn_queue_drain(MemoryContext batch_cxt);
+static void       rule_log_append(uint32 op, const pgssHashKey *key,
+								  const Counters *counters, const char *query,
+								  int query_len, int encoding);
+static void       rule_log_flush(void);
+static void       rule_log_replay(void);
+static void       rule_log_sync(void);
+static void       rule_log_checkpoint_counters(void);
+static off_t      rule_log_size(void);
+static void       rule_log_truncate(off_t covered);
+static void       checkpoint_rule_file(void);
+static void       rule_changes_begin(void);
+static void       rule_change_capture(uint32 op, const pgssHashKey *key,
+									  const char *query, int query_len,
+									  int encoding);
+static void       rule_changes_end(void);
+static void       rule_change_save_removed(const pgssEntry *entry);
+static void       rule_changes_undo(SubTransactionId subid);
+static void       rule_changes_forget(SubTransactionId subid);
+static Size       rule_change_queue_size(void);
+static void       rule_change_queue_copy(pgfwRuleChangeQueue *queue,
+										 uint64 pos, char *buffer, Size len,
+										 bool write);
+static void       rule_changes_wait(void);
+static void       rule_changes_enqueue(void);
+static uint64     rule_changes_record(uint64 tail, uint64 head);
+static void       rule_changes_xact_callback(XactEvent event, void *arg);
+static void       rule_changes_subxact_callback(SubXactEvent event,
+												SubTransactionId mySubid,
+												SubTransactionId parentSubid,
+												void *arg);
+static bool       rule_changes_replay(void);
+static void       rule_change_apply(uint32 op, const pgssHashKey *key,
+									const char *query, int encoding);
+static int64      replication_position_load(void);
+static void       replication_position_save(void);
+static pgssEntry *lookup_whitelist(Oid dbid, Oid userid, uint32 queryid);
+static Size       rule_snapshot_users_offset(void);
+static Size       rule_snapshot_size(void);
+static void       invalidate_rule_snapshot(void);
+static void       publish_rule_snapshot(void);
+static bool       snapshot_lookup_rules(Oid userid, uint32 queryid,
+										pgssEntry **whitelist_entry,
+										pgssEntry **blacklist_entry);
+static pgfwCacheEntry *local_cache_lookup(Oid userid, uint32 queryid,
+									 uint32 generation);
+static pgfwCacheEntry *local_cache_insert(Oid userid, uint32 queryid,
+									 uint32 generation,
+									 pgssEntry *whitelist_entry,
+									 pgssEntry *blacklist_entry);
+static void       local_cache_flush(void);
+static pgfwPlanVerdict *plan_verdict_lookup(const PlannedStmt *plan,
+									 Oid userid, uint32 queryid,
+									 uint32 generation);
+static void       plan_verdict_remember(const PlannedStmt *plan,
+									 Oid userid, uint32 queryid,
+									 uint32 generation,
+									 pgfwCacheEntry *centry,
+									 bool structural);
+static void       local_cache_flush_counters(void);
+static pgfwFingerprint *fingerprint_lookup(ParseState *pstate,
+									 pgfwFingerprintKey *key);
+static void       fingerprint_remember(pgfwFingerprintKey *key, const char *text,
+									 uint32 queryid, bool has_constants);
+static void       fingerprint_cache_flush(void);
+static bool       nested_verdict_known(Oid userid, uint32 queryid);
+static void       nested_verdict_remember(Oid userid, uint32 queryid,
+									  uint32 generation);
+static void       fingerprint_syscache_callback(Datum arg, int cacheid,
+									 uint32 hashvalue);
+static void       fingerprint_relcache_callback(Datum arg, Oid relid);
+static void       local_cache_shmem_exit(int code, Datum arg);
+static int        backend_counter_slots(void);
+static void       stat_counter_totals(int64 *warnings, int64 *errors);
+static void       timing_start(instr_time *start);
+static void       timing_record(PGFWTimingStage stage, instr_time *start);
+static void       timing_totals(pgfwBackendTimings *totals);
+static void       pgfw_lock_acquire(LWLockMode mode);
 static uint32     sql_firewall_queryid(const char *query_string, char **normalized_query);
 static int        add_rule(const char* user, const char *query_string, uint32 rule_type);
 static int        del_rule(const char* user, const char *query_string, uint32 rule_type);
+static int        entry_delete(Oid dbid, Oid userid, uint32 queryid,
+							   uint32 rule_type);
+static bool       entry_remove(const pgssHashKey *key);
+static bool       partition_admit(Oid dbid);
+static void       partition_count(Oid dbid, int delta);
 static char      *rule_typename(char rule_type);
+static uint32     rule_typeid(const char *rule_type_name);
+static bool       structural_rules_allow(Query *parse, const PlannedStmt *plan);
+static bool       structural_query_walker(Node *node, bool *covered);
+static bool       structural_check_rtable(List *rtable, bool *covered);
+static void       structural_compile(Oid userid, uint32 generation);
+static AclMode    structural_grant(Oid relid);
+static void       structural_relcache_callback(Datum arg, Oid relid);
+static AclMode    structural_operations(const char *operation);
+static void       structural_object(const char *object, char *kind, Oid *objid);
+static bool       structural_change(Oid userid, char kind, Oid objid,
+									AclMode operations, bool add);
+static void       structural_reset(void);
+static void       structural_rules_load(void);
+static void       structural_rules_save(void);
 
 
 
@@ -436,15 +1462,14 @@ _PG_init(void)
 							NULL,
 							NULL);
 
-	pgss_track = PGSS_TRACK_TOP;
-	pgss_save = true;
-
-	DefineCustomEnumVariable("sql_firewall.firewall",
-			   "Enable SQL Firewall feature.",
+	DefineCustomEnumVariable("sql_firewall.rule_scope",
+			   "Which databases the new rules apply to. cluster | database."
+			   "cluster: all the databases"
+			   "database: the database they are created in",
 							 NULL,
-							 &pgfw_mode,
-							 PGFW_MODE_DISABLED,
-							 mode_options,
+							 &pgfw_rule_scope,
+							 PGFW_SCOPE_CLUSTER,
+							 rule_scope_options,
 							 PGC_SIGHUP,
 							 0,
 							 NULL,
@@ -453,9 +1478,40 @@ _PG_init(void)
 
 	EmitWarningsOnPlaceholders("sql_firewall");
 
-	DefineCustomEnumVariable("sql_firewall.engine",
-			   "SQL Firewall rule search engine. whitelist | backlist | hybrid."
-			   "whitelist: take account of whitelist rules only"
+	DefineCustomIntVariable("sql_firewall.max_per_database",
+	  "Sets the maximum number of rules of each database.",
+							"0 leaves them to the limit of sql_firewall.max.",
+							&pgfw_max_per_database,
+							0,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	EmitWarningsOnPlaceholders("sql_firewall");
+
+	pgss_save = true;
+
+	DefineCustomEnumVariable("sql_firewall.firewall",
+			   "Enable SQL Firewall feature.",
+							 NULL,
+							 &pgfw_mode,
+							 PGFW_MODE_DISABLED,
+							 mode_options,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 pgfw_mode_assign,
+							 NULL);
+
+	EmitWarningsOnPlaceholders("sql_firewall");
+
+	DefineCustomEnumVariable("sql_firewall.engine",
+			   "SQL Firewall rule search engine. whitelist | backlist | hybrid."
+			   "whitelist: take account of whitelist rules only"
 			   "blacklist: take account of blacklist rules only"
 			   "hybrid: take account of both whitelist and blacklist rules",
 							 NULL,
@@ -470,13 +1526,420 @@ _PG_init(void)
 
 	EmitWarningsOnPlaceholders("sql_firewall");
 
+	DefineCustomEnumVariable("sql_firewall.verdict_stage",
+			   "When SQL Firewall applies its rules to a statement. analyze | executor_end."
+			   "analyze: right after parse analysis, before planning and execution"
+			   "executor_end: after the statement has been executed",
+							 NULL,
+							 &pgfw_verdict_stage,
+							 PGFW_STAGE_EXECUTOR_END,
+							 verdict_stage_options,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	EmitWarningsOnPlaceholders("sql_firewall");
+
+	DefineCustomEnumVariable("sql_firewall.normalize_utility",
+			   "How SQL Firewall tells utility statements apart. text | constants | identifiers."
+			   "text: by their exact text"
+			   "constants: by their tokens, the constants being replaced"
+			   "identifiers: by their tokens, the constants and identifiers being replaced",
+							 NULL,
+							 &pgfw_normalize_utility,
+							 PGFW_UTILITY_TEXT,
+							 normalize_utility_options,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	EmitWarningsOnPlaceholders("sql_firewall");
+
+	DefineCustomEnumVariable("sql_firewall.track",
+			   "Selects which statements are checked and learned by SQL Firewall. top | all."
+			   "top: only the statements sent by the clients"
+			   "all: the statements run by functions as well",
+							 NULL,
+							 &pgss_track,
+							 PGSS_TRACK_TOP,
+							 track_options,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	EmitWarningsOnPlaceholders("sql_firewall");
+
+	DefineCustomBoolVariable("sql_firewall.track_calls",
+	  "Selects whether the calls of whitelist rules are counted.",
+							 NULL,
+							 &pgfw_track_calls,
+							 true,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	EmitWarningsOnPlaceholders("sql_firewall");
+
+	DefineCustomEnumVariable("sql_firewall.log_statements",
+			   "Which statements SQL Firewall writes to the server log. none | violations | all."
+			   "none: no diagnostic at all"
+			   "violations: prohibited statements only"
+			   "all: every statement, with its query id",
+							 NULL,
+							 &pgfw_log_statements,
+							 PGFW_LOG_NONE,
+							 log_statements_options,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	EmitWarningsOnPlaceholders("sql_firewall");
+
+	DefineCustomEnumVariable("sql_firewall.log_level",
+	  "Sets the message level of the statements logged by SQL Firewall.",
+							 NULL,
+							 &pgfw_log_level,
+							 LOG,
+							 log_level_options,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	EmitWarningsOnPlaceholders("sql_firewall");
+
+	DefineCustomRealVariable("sql_firewall.log_sample_rate",
+	  "Fraction of the statements logged by SQL Firewall.",
+							 NULL,
+							 &pgfw_log_sample_rate,
+							 1.0,
+							 0.0,
+							 1.0,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	EmitWarningsOnPlaceholders("sql_firewall");
+
+	DefineCustomIntVariable("sql_firewall.violation_buffer_size",
+							"Sets the number of violations kept for the sql_firewall.violations view.",
+							"Zero keeps none.",
+							&pgfw_violation_buffer_size,
+							1024,
+							0,
+							1024 * 1024,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	EmitWarningsOnPlaceholders("sql_firewall");
+
+	DefineCustomIntVariable("sql_firewall.violation_log_interval",
+							"Sets the minimum time between two violation reports in the server log.",
+							"The violations in between are counted in the next report. "
+							"Zero reports every violation.",
+							&pgfw_violation_log_interval,
+							0,
+							0,
+							INT_MAX,
+							PGC_SUSET,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	EmitWarningsOnPlaceholders("sql_firewall");
+
+	DefineCustomIntVariable("sql_firewall.shadow_max",
+							"Sets the maximum number of rules of the shadow rule set.",
+							"Zero disables the shadow rule set.",
+							&pgfw_shadow_max,
+							0,
+							0,
+							INT_MAX,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	EmitWarningsOnPlaceholders("sql_firewall");
+
+	DefineCustomIntVariable("sql_firewall.learning_queue_size",
+	  "Sets the number of statements queued for the learner background worker.",
+							"Zero makes every backend learn its statements itself.",
+							&pgfw_learn_queue_size,
+							0,
+							0,
+							1024 * 1024,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	EmitWarningsOnPlaceholders("sql_firewall");
+
+	DefineCustomIntVariable("sql_firewall.text_arena_size",
+							"Sets the shared memory kept for the query texts of the rules.",
+							"Zero keeps the query texts in a file instead.",
+							&pgfw_text_arena_size,
+							0,
+							0,
+							MAX_KILOBYTES,
+							PGC_POSTMASTER,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
+	EmitWarningsOnPlaceholders("sql_firewall");
+
+	DefineCustomBoolVariable("sql_firewall.rule_log",
+							 "Logs the rule changes to survive crashes.",
+							 NULL,
+							 &pgfw_rule_log,
+							 false,
+							 PGC_POSTMASTER,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	EmitWarningsOnPlaceholders("sql_firewall");
+
+	DefineCustomIntVariable("sql_firewall.rule_log_sync_delay",
+							"Sets the delay between the flushes of the rule log to disk.",
+							NULL,
+							&pgfw_rule_log_sync_delay,
+							200,
+							1,
+							10000,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	EmitWarningsOnPlaceholders("sql_firewall");
+
+	DefineCustomBoolVariable("sql_firewall.replicate_rules",
+							 "Replicates the rule changes to the standbys.",
+							 NULL,
+							 &pgfw_replicate_rules,
+							 false,
+							 PGC_POSTMASTER,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	EmitWarningsOnPlaceholders("sql_firewall");
+
+	DefineCustomStringVariable("sql_firewall.replication_database",
+							   "Sets the database the rule changes are replicated through.",
+							   NULL,
+							   &pgfw_replication_database,
+							   "postgres",
+							   PGC_POSTMASTER,
+							   0,
+							   NULL,
+							   NULL,
+							   NULL);
+
+	EmitWarningsOnPlaceholders("sql_firewall");
+
+	DefineCustomIntVariable("sql_firewall.replication_naptime",
+							"Sets the delay between the polls of the rule changes on standbys.",
+							NULL,
+							&pgfw_replication_naptime,
+							100,
+							1,
+							60000,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	EmitWarningsOnPlaceholders("sql_firewall");
+
+	DefineCustomIntVariable("sql_firewall.replication_queue_size",
+	   "Sets the amount of shared memory queueing the rule changes to replicate.",
+							"The rule changes of a transaction must fit in it.",
+							&pgfw_replication_queue_size,
+							1024,
+							64,
+							MAX_KILOBYTES,
+							PGC_POSTMASTER,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
+	EmitWarningsOnPlaceholders("sql_firewall");
+
+	DefineCustomBoolVariable("sql_firewall.learning_eviction",
+	  "Evicts the least used learned rules when the rule table is full.",
+							"Otherwise the new rules are dropped.",
+							&pgfw_learning_eviction,
+							false,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	EmitWarningsOnPlaceholders("sql_firewall");
+
+	DefineCustomIntVariable("sql_firewall.fingerprint_cache_size",
+	  "Sets the memory each backend uses to cache the query ids of statement texts.",
+							"Zero disables the cache.",
+							&pgfw_fingerprint_cache_size,
+							0,
+							0,
+							MAX_KILOBYTES,
+							PGC_SIGHUP,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
+	EmitWarningsOnPlaceholders("sql_firewall");
+
+	DefineCustomBoolVariable("sql_firewall.track_timing",
+	  "Selects whether the stages of SQL Firewall are timed.",
+							 "The timings are shown by sql_firewall.stat_timing.",
+							 &pgfw_track_timing,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	EmitWarningsOnPlaceholders("sql_firewall");
+
+	DefineCustomIntVariable("sql_firewall.cache_size",
+	  "Sets the maximum number of rule lookups cached by each backend.",
+							"Zero disables the cache.",
+							&pgfw_cache_size,
+							1024,
+							0,
+							INT_MAX / 2,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	EmitWarningsOnPlaceholders("sql_firewall");
+
 	/*
 	 * Request additional shared resources.  (These are no-ops if we're not in
 	 * the postmaster process.)  We'll allocate or attach to the shared
 	 * resources in pgss_shmem_startup().
 	 */
 	RequestAddinShmemSpace(pgss_memsize());
-	RequestAddinLWLocks(1);
+	RequestAddinLWLocks(2);
+
+	/*
+	 * The learning mode hands the new statements over to a background worker
+	 * if there is a queue for them.
+	 */
+	if (pgfw_learn_queue_size > 0)
+	{
+		BackgroundWorker worker;
+
+		memset(&worker, 0, sizeof(worker));
+		snprintf(worker.bgw_name, BGW_MAXLEN, "sql_firewall learner");
+		worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+		worker.bgw_start_time = BgWorkerStart_ConsistentState;
+		worker.bgw_restart_time = 1;
+		worker.bgw_main = NULL;
+		snprintf(worker.bgw_library_name, BGW_MAXLEN, "sql_firewall");
+		snprintf(worker.bgw_function_name, BGW_MAXLEN,
+				 "sql_firewall_learner_main");
+		worker.bgw_main_arg = (Datum) 0;
+		worker.bgw_notify_pid = 0;
+
+		RegisterBackgroundWorker(&worker);
+	}
+
+	/* The rule log is fsynced and compacted by a background worker */
+	if (pgfw_rule_log)
+	{
+		BackgroundWorker worker;
+
+		memset(&worker, 0, sizeof(worker));
+		snprintf(worker.bgw_name, BGW_MAXLEN, "sql_firewall rule writer");
+		worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+		worker.bgw_start_time = BgWorkerStart_ConsistentState;
+		worker.bgw_restart_time = 1;
+		worker.bgw_main = NULL;
+		snprintf(worker.bgw_library_name, BGW_MAXLEN, "sql_firewall");
+		snprintf(worker.bgw_function_name, BGW_MAXLEN,
+				 "sql_firewall_rule_writer_main");
+		worker.bgw_main_arg = (Datum) 0;
+		worker.bgw_notify_pid = 0;
+
+		RegisterBackgroundWorker(&worker);
+	}
+
+	/*
+	 * The rule changes reach the standbys through a table.  A background
+	 * worker of the primary records them in it, and one of each standby
+	 * applies them there; the latter quits at once on a primary.
+	 */
+	if (pgfw_replicate_rules)
+	{
+		BackgroundWorker worker;
+
+		memset(&worker, 0, sizeof(worker));
+		snprintf(worker.bgw_name, BGW_MAXLEN, "sql_firewall rule publisher");
+		worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+			BGWORKER_BACKEND_DATABASE_CONNECTION;
+		worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+		worker.bgw_restart_time = 1;
+		worker.bgw_main = NULL;
+		snprintf(worker.bgw_library_name, BGW_MAXLEN, "sql_firewall");
+		snprintf(worker.bgw_function_name, BGW_MAXLEN,
+				 "sql_firewall_rule_publisher_main");
+		worker.bgw_main_arg = (Datum) 0;
+		worker.bgw_notify_pid = 0;
+
+		RegisterBackgroundWorker(&worker);
+
+		memset(&worker, 0, sizeof(worker));
+		snprintf(worker.bgw_name, BGW_MAXLEN, "sql_firewall rule replayer");
+		worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+			BGWORKER_BACKEND_DATABASE_CONNECTION;
+		worker.bgw_start_time = BgWorkerStart_ConsistentState;
+		worker.bgw_restart_time = 1;
+		worker.bgw_main = NULL;
+		snprintf(worker.bgw_library_name, BGW_MAXLEN, "sql_firewall");
+		snprintf(worker.bgw_function_name, BGW_MAXLEN,
+				 "sql_firewall_rule_replayer_main");
+		worker.bgw_main_arg = (Datum) 0;
+		worker.bgw_notify_pid = 0;
+
+		RegisterBackgroundWorker(&worker);
+	}
 
 	/*
 	 * Install hooks.
@@ -495,6 +1958,8 @@ _PG_init(void)
 	ExecutorEnd_hook = pgss_ExecutorEnd;
 	prev_ProcessUtility = ProcessUtility_hook;
 	ProcessUtility_hook = pgss_ProcessUtility;
+	prev_emit_log_hook = emit_log_hook;
+	emit_log_hook = pgfw_emit_log;
 }
 
 /*
@@ -511,6 +1976,40 @@ _PG_fini(void)
 	ExecutorFinish_hook = prev_ExecutorFinish;
 	ExecutorEnd_hook = prev_ExecutorEnd;
 	ProcessUtility_hook = prev_ProcessUtility;
+	emit_log_hook = prev_emit_log_hook;
+}
+
+/*
+ * Emit log hook: keep the WARNING of a violation out of the server log if
+ * sql_firewall.violation_log_interval held its report back.  The client
+ * gets it all the same.
+ */
+static void
+pgfw_emit_log(ErrorData *edata)
+{
+	if (violation_warning_unlogged && edata->elevel == WARNING)
+	{
+		violation_warning_unlogged = false;
+		edata->output_to_server = false;
+	}
+
+	if (prev_emit_log_hook)
+		prev_emit_log_hook(edata);
+}
+
+/*
+ * Assign hook for sql_firewall.firewall.
+ *
+ * Statements are not jumbled in the disabled mode, so the plans prepared
+ * meanwhile carry no queryId and would escape the rules.  Have the plan
+ * cache analyze them again, which gives them one, when the firewall is
+ * turned on.
+ */
+static void
+pgfw_mode_assign(int newval, void *extra)
+{
+	if (pgfw_mode == PGFW_MODE_DISABLED && newval != PGFW_MODE_DISABLED)
+		ResetPlanCache();
 }
 
 /*
@@ -539,6 +2038,9 @@ pgss_shmem_startup(void)
 	/* reset in case this is a restart within the postmaster */
 	pgss = NULL;
 	pgss_hash = NULL;
+	pgfw_partitions = NULL;
+	pgfw_shadow_hash = NULL;
+	pgfw_divergences = NULL;
 
 	/*
 	 * Create or attach to the shared memory state, including hash table
@@ -553,6 +2055,7 @@ pgss_shmem_startup(void)
 	{
 		/* First time through ... */
 		pgss->lock = LWLockAssign();
+		pgss->checkpoint_lock = LWLockAssign();
 		pgss->cur_median_usage = ASSUMED_MEDIAN_INIT;
 		pgss->mean_query_len = ASSUMED_LENGTH_INIT;
 		SpinLockInit(&pgss->mutex);
@@ -561,26 +2064,221 @@ pgss_shmem_startup(void)
 		pgss->gc_count = 0;
 		pgss->warning_count = 0;
 		pgss->error_count = 0;
+		pgss->evictions = 0;
+		pgss->rejected = 0;
+		pgss->backend_counters = NULL;
+		pgss->backend_timings = NULL;
+		memset(&pgss->timings_reset, 0, sizeof(pgfwBackendTimings));
+		pgss->learn_queue = NULL;
+		pgss->rule_change_queue = NULL;
+		pgss->qtext_arena = NULL;
+		pgss->qtext_arena_size = 0;
+		pgss->rule_log_dirty = false;
+		pgss->replicated_seq = 0;
+		pgss->database_rules = 0;
+		pgss->rules_generation = 0;
+		pgss->rule_log_generation = 0;
+		pgss->snapshot_valid = false;
+		pgss->snapshot_current = 0;
+		pgss->structural = NULL;
+		pgss->violations = NULL;
+		pgss->shadow_loaded = false;
+		pgss->shadow_rules = 0;
+		pgss->shadow_database_rules = 0;
+		pgss->shadow_checks = 0;
+		pgss->shadow_rejects = 0;
+		pgss->shadow_allows = 0;
+		pgss->shadow_dropped = 0;
 	}
 
-	memset(&info, 0, sizeof(info));
-	info.keysize = sizeof(pgssHashKey);
-	info.entrysize = sizeof(pgssEntry);
-	info.hash = pgss_hash_fn;
-	info.match = pgss_match_fn;
-	pgss_hash = ShmemInitHash("sql_firewall hash",
-							  pgss_max, pgss_max,
-							  &info,
-							  HASH_ELEM | HASH_FUNCTION | HASH_COMPARE);
+	/* The backend counters, starting from zero */
+	{
+		Size		size = mul_size(backend_counter_slots(),
+									sizeof(pgfwBackendCounters));
+		bool		counters_found;
+
+		pgss->backend_counters = ShmemInitStruct("sql_firewall backend counters",
+												 size, &counters_found);
+		if (!counters_found)
+			memset(pgss->backend_counters, 0, size);
+
+		size = mul_size(backend_counter_slots(), sizeof(pgfwBackendTimings));
+		pgss->backend_timings = ShmemInitStruct("sql_firewall backend timings",
+												size, &counters_found);
+		if (!counters_found)
+			memset(pgss->backend_timings, 0, size);
+	}
 
-	LWLockRelease(AddinShmemInitLock);
+	/* The query text arena, if any */
+	if (pgfw_text_arena_size > 0)
+	{
+		bool		arena_found;
 
-	/*
-	 * If we're in the postmaster (or a standalone backend...), set up a shmem
-	 * exit hook to dump the statistics to disk.
-	 */
-	if (!IsUnderPostmaster)
-		on_shmem_exit(pgss_shmem_shutdown, (Datum) 0);
+		pgss->qtext_arena_size = (Size) pgfw_text_arena_size * 1024;
+		pgss->qtext_arena = ShmemInitStruct("sql_firewall query texts",
+											pgss->qtext_arena_size,
+											&arena_found);
+	}
+
+	/* The learning queue, if any, starts empty */
+	if (pgfw_learn_queue_size > 0)
+	{
+		bool		queue_found;
+		pgfwLearnQueue *queue;
+
+		queue = ShmemInitStruct("sql_firewall learning queue",
+								learn_queue_size(), &queue_found);
+		if (!queue_found)
+		{
+			uint32		i;
+
+			SpinLockInit(&queue->mutex);
+			queue->head = 0;
+			queue->tail = 0;
+			queue->overflows = 0;
+			queue->latch = NULL;
+			queue->nrecords = pgfw_learn_queue_size;
+			for (i = 0; i < queue->nrecords; i++)
+				queue->records[i].ready = false;
+		}
+		pgss->learn_queue = queue;
+	}
+
+	/* So does the queue of the rule changes to replicate */
+	if (pgfw_replicate_rules)
+	{
+		bool		queue_found;
+		pgfwRuleChangeQueue *queue;
+
+		queue = ShmemInitStruct("sql_firewall rule change queue",
+								rule_change_queue_size(), &queue_found);
+		if (!queue_found)
+		{
+			SpinLockInit(&queue->mutex);
+			queue->head = 0;
+			queue->tail = 0;
+			queue->latch = NULL;
+			queue->size = (Size) pgfw_replication_queue_size * 1024;
+		}
+		pgss->rule_change_queue = queue;
+	}
+
+	/*
+	 * The violation ring starts empty.  It is there even without any room
+	 * for the events, to rate-limit their reports.
+	 */
+	{
+		bool		ring_found;
+		pgfwViolationRing *ring;
+
+		ring = ShmemInitStruct("sql_firewall violations",
+							   violation_ring_size(), &ring_found);
+		if (!ring_found)
+		{
+			int			i;
+
+			SpinLockInit(&ring->mutex);
+			ring->next = 0;
+			ring->first = 0;
+			ring->last_report = 0;
+			ring->not_reported = 0;
+			ring->nevents = pgfw_violation_buffer_size;
+			for (i = 0; i < ring->nevents; i++)
+			{
+				SpinLockInit(&ring->events[i].mutex);
+				ring->events[i].seq = 0;
+			}
+		}
+		pgss->violations = ring;
+	}
+
+	/* Both snapshots live in a single chunk, rebuilt on first use */
+	{
+		char	   *snapshots;
+		bool		snapshots_found;
+		int			snapno;
+
+		snapshots = ShmemInitStruct("sql_firewall rule snapshots",
+									mul_size(rule_snapshot_size(), 2),
+									&snapshots_found);
+		if (!snapshots_found)
+		{
+			for (snapno = 0; snapno < 2; snapno++)
+			{
+				pgfwRuleSnapshot *snap = (pgfwRuleSnapshot *)
+					(snapshots + snapno * rule_snapshot_size());
+
+				snap->changecount = 0;
+				snap->nslots = 0;
+				snap->users = (pgfwUserRule *) ((char *) snap +
+												rule_snapshot_users_offset());
+				pgss->snapshots[snapno] = snap;
+			}
+		}
+	}
+
+	/* The structural rules, loaded below */
+	{
+		bool		structural_found;
+
+		pgss->structural = ShmemInitStruct("sql_firewall structural rules",
+										   sizeof(pgfwStructuralRules),
+										   &structural_found);
+		if (!structural_found)
+			pgss->structural->nrules = 0;
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(pgssHashKey);
+	info.entrysize = sizeof(pgssEntry);
+	info.hash = pgss_hash_fn;
+	info.match = pgss_match_fn;
+	pgss_hash = ShmemInitHash("sql_firewall hash",
+							  pgss_max, pgss_max,
+							  &info,
+							  HASH_ELEM | HASH_FUNCTION | HASH_COMPARE);
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(Oid);
+	info.entrysize = sizeof(pgfwPartition);
+	info.hash = oid_hash;
+	pgfw_partitions = ShmemInitHash("sql_firewall partitions",
+									PGFW_MAX_PARTITIONS, PGFW_MAX_PARTITIONS,
+									&info,
+									HASH_ELEM | HASH_FUNCTION);
+
+	/* The shadow rule set, if any, starts empty: it is never saved */
+	if (pgfw_shadow_max > 0)
+	{
+		memset(&info, 0, sizeof(info));
+		info.keysize = sizeof(pgssHashKey);
+		info.entrysize = sizeof(pgfwShadowRule);
+		info.hash = pgss_hash_fn;
+		info.match = pgss_match_fn;
+		pgfw_shadow_hash = ShmemInitHash("sql_firewall shadow rules",
+										 pgfw_shadow_max, pgfw_shadow_max,
+										 &info,
+										 HASH_ELEM | HASH_FUNCTION | HASH_COMPARE);
+
+		memset(&info, 0, sizeof(info));
+		info.keysize = sizeof(pgfwDivergenceKey);
+		info.entrysize = sizeof(pgfwDivergence);
+		info.hash = tag_hash;
+		pgfw_divergences = ShmemInitHash("sql_firewall shadow divergences",
+										 PGFW_MAX_DIVERGENCES,
+										 PGFW_MAX_DIVERGENCES,
+										 &info,
+										 HASH_ELEM | HASH_FUNCTION);
+	}
+
+	LWLockRelease(AddinShmemInitLock);
+
+	/*
+	 * If we're in the postmaster (or a standalone backend...), set up a shmem
+	 * exit hook to dump the statistics to disk.
+	 */
+	if (!IsUnderPostmaster)
+		on_shmem_exit(pgss_shmem_shutdown, (Datum) 0);
 
 	/*
 	 * Done if some other process already completed our initialization.
@@ -596,10 +2294,17 @@ pgss_shmem_startup(void)
 	/* Unlink query text file possibly left over from crash */
 	unlink(PGSS_STATEMENTS_TEMP_FILE);
 
-	/* Allocate new query text temp file */
-	qfile = AllocateFile(PGSS_STATEMENTS_TEMP_FILE, PG_BINARY_W);
-	if (qfile == NULL)
-		goto write_error;
+	/* Where a standby is in the replicated rule changes */
+	if (pgfw_replicate_rules)
+		pgss->replicated_seq = replication_position_load();
+
+	/* Allocate new query text temp file, unless the texts go to the arena */
+	if (pgss->qtext_arena == NULL)
+	{
+		qfile = AllocateFile(PGSS_STATEMENTS_TEMP_FILE, PG_BINARY_W);
+		if (qfile == NULL)
+			goto write_error;
+	}
 
 	/*
 	 * If we were told not to load old statistics, we're done.  (Note we do
@@ -608,10 +2313,13 @@ pgss_shmem_startup(void)
 	 */
 	if (!pgss_save)
 	{
-		FreeFile(qfile);
+		if (qfile)
+			FreeFile(qfile);
 		return;
 	}
 
+	structural_rules_load();
+
 	/*
 	 * Attempt to load old statistics from the dump file.
 	 */
@@ -620,16 +2328,32 @@ pgss_shmem_startup(void)
 	{
 		if (errno != ENOENT)
 			goto read_error;
-		/* No existing persisted stats file, so we're done */
-		FreeFile(qfile);
+		/* No existing persisted stats file, only the rule log may be left */
+		if (qfile)
+			FreeFile(qfile);
+		rule_log_replay();
 		return;
 	}
 
+	if (fread(&header, sizeof(uint32), 1, file) != 1)
+		goto read_error;
+
+	/* The file is a rule image, unless written by an older sql_firewall */
+	if (header == PGFW_RULE_IMAGE_MAGIC)
+	{
+		FreeFile(file);
+		file = NULL;
+		if (!rule_image_load(qfile))
+			goto fail;
+		if (qfile)
+			FreeFile(qfile);
+		goto loaded;
+	}
+
 	buffer_size = 2048;
 	buffer = (char *) palloc(buffer_size);
 
-	if (fread(&header, sizeof(uint32), 1, file) != 1 ||
-		fread(&pgver, sizeof(uint32), 1, file) != 1 ||
+	if (fread(&pgver, sizeof(uint32), 1, file) != 1 ||
 		fread(&num, sizeof(int32), 1, file) != 1)
 		goto read_error;
 
@@ -639,12 +2363,14 @@ pgss_shmem_startup(void)
 
 	for (i = 0; i < num; i++)
 	{
-		pgssEntry	temp;
+		pgfwLegacyEntry temp;
+		pgssHashKey key;
 		pgssEntry  *entry;
 		Size		query_offset;
 
-		if (fread(&temp, sizeof(pgssEntry), 1, file) != 1)
+		if (fread(&temp, sizeof(pgfwLegacyEntry), 1, file) != 1)
 			goto read_error;
+		key_from_file(&key, &temp.key, InvalidOid, true);
 
 		/* Encoding is the only field we can easily sanity-check */
 		if (!PG_VALID_BE_ENCODING(temp.encoding))
@@ -664,15 +2390,24 @@ pgss_shmem_startup(void)
 		buffer[temp.query_len] = '\0';
 
 		/* Store the query text */
-		query_offset = pgss->extent;
-		if (fwrite(buffer, 1, temp.query_len + 1, qfile) != temp.query_len + 1)
-			goto write_error;
-		pgss->extent += temp.query_len + 1;
+		if (pgss->qtext_arena)
+		{
+			/* keep the rules loaded so far if the arena is too small */
+			if (!qtext_arena_store(buffer, temp.query_len, &query_offset, NULL))
+				break;
+		}
+		else
+		{
+			query_offset = pgss->extent;
+			if (fwrite(buffer, 1, temp.query_len + 1, qfile) != temp.query_len + 1)
+				goto write_error;
+			pgss->extent += temp.query_len + 1;
+		}
 
 		/* make the hashtable entry (discards old entries if too many) */
-		entry = entry_alloc(&temp.key, query_offset, temp.query_len,
+		entry = entry_alloc(&key, NULL, query_offset, temp.query_len,
 							temp.encoding,
-							false);
+							false, false);
 
 		if (entry == NULL)
 			break;
@@ -683,7 +2418,12 @@ pgss_shmem_startup(void)
 
 	pfree(buffer);
 	FreeFile(file);
-	FreeFile(qfile);
+	if (qfile)
+		FreeFile(qfile);
+
+loaded:
+	/* Then redo the rule changes made since the file was written */
+	rule_log_replay();
 
 	/*
 	 * Remove the persisted stats file so it's not included in
@@ -769,60 +2509,168 @@ fail:
  * shmem_shutdown hook: Dump statistics into file.
  *
  * Note: we don't bother with acquiring lock, because there should be no
- * other processes running when this is called.
+ * other processes running when this is called.  The others go through
+ * checkpoint_rule_file().
+ *
+ * return false if the file could not be written
  */
-static void
+static bool
 update_firewall_rule_file(void)
 {
-	FILE	   *file;
-	char	   *qbuffer = NULL;
-	Size		qbuffer_size = 0;
+	pgfwRuleImageCopy copy;
+	bool		written;
+
+	rule_image_copy(&copy);
+	written = rule_image_write(&copy, false);
+
+	pfree(copy.rules);
+	pfree(copy.query_offsets);
+
+	return written;
+}
+
+/*
+ * Copy the rules for rule_image_write().
+ *
+ * The caller must hold pgss->lock exclusively, so that neither the rules
+ * nor the rule log change meanwhile.  Only the entries are copied; their
+ * texts are read by rule_image_write(), without the lock.
+ */
+static void
+rule_image_copy(pgfwRuleImageCopy *copy)
+{
 	HASH_SEQ_STATUS hash_seq;
-	int32		num_entries;
 	pgssEntry  *entry;
+	long		nentries = Max(hash_get_num_entries(pgss_hash), 1);
 
-	file = AllocateFile(PGSS_STATEMENTS_FILE ".tmp", PG_BINARY_W);
-	if (file == NULL)
-		goto error;
+	copy->rules = palloc0(nentries * sizeof(pgfwRuleImageEntry));
+	copy->query_offsets = palloc(nentries * sizeof(Size));
+	copy->nrules = 0;
+	copy->gc_count = pgss->gc_count;
+	copy->log_size = rule_log_size();
 
-	if (fwrite(&PGSS_FILE_HEADER, sizeof(uint32), 1, file) != 1)
-		goto error;
-	if (fwrite(&PGSS_PG_MAJOR_VERSION, sizeof(uint32), 1, file) != 1)
-		goto error;
-	num_entries = hash_get_num_entries(pgss_hash);
-	if (fwrite(&num_entries, sizeof(int32), 1, file) != 1)
-		goto error;
+	hash_seq_init(&hash_seq, pgss_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		volatile pgssEntry *e = (volatile pgssEntry *) entry;
+		pgfwRuleImageEntry *rule = &copy->rules[copy->nrules];
+
+		key_to_file(&rule->key, &entry->key);
+		rule->dbid = entry->key.dbid;
+		SpinLockAcquire(&e->mutex);
+		rule->counters = e->counters;
+		SpinLockRelease(&e->mutex);
+		rule->query_len = entry->query_len;
+		rule->encoding = entry->encoding;
+		if (entry->learned)
+			rule->flags |= PGFW_RULE_IMAGE_LEARNED;
+		copy->query_offsets[copy->nrules++] = entry->query_offset;
+	}
+}
+
+/*
+ * Write the rules copied by rule_image_copy() to PGSS_STATEMENTS_FILE.
+ *
+ * No lock is needed, but the caller must be the only writer of the
+ * temporary file.  If check_gc, the texts read are checked against a
+ * garbage collection since the copy, which would have moved them; the file
+ * is then left as it is.
+ *
+ * return false if the file could not be written
+ */
+static bool
+rule_image_write(pgfwRuleImageCopy *copy, bool check_gc)
+{
+	FILE	   *file = NULL;
+	char	   *qbuffer = NULL;
+	Size		qbuffer_size = 0;
+	pgfwRuleImageHeader header;
+	pgfwRuleImageEntry *rules = copy->rules;
+	uint32		nrules;
+	uint32		i;
 
 	qbuffer = qtext_load_file(&qbuffer_size);
 	if (qbuffer == NULL)
 		goto error;
 
+	/* the arena may be compacted at any time, unlike a copy of it */
+	if (qbuffer == pgss->qtext_arena)
+	{
+		qbuffer = malloc(Max(qbuffer_size, 1));
+		if (qbuffer == NULL)
+			goto error;
+		memcpy(qbuffer, pgss->qtext_arena, qbuffer_size);
+	}
+
+	if (check_gc)
+	{
+		bool		moved;
+
+		pgfw_lock_acquire(LW_SHARED);
+		moved = (pgss->gc_count != copy->gc_count);
+		LWLockRelease(pgss->lock);
+
+		if (moved)
+		{
+			qtext_release(qbuffer);
+			return false;
+		}
+	}
+
 	/*
-	 * When serializing to disk, we store query texts immediately after their
-	 * entry data.  Any orphaned query texts are thereby excluded.
+	 * The rules with a valid text make the image, in hashtable order, as
+	 * loading it makes one entry per rule regardless.  Any orphaned query
+	 * texts are thereby excluded.
 	 */
-	hash_seq_init(&hash_seq, pgss_hash);
-	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	memset(&header, 0, sizeof(header));
+	header.magic = PGFW_RULE_IMAGE_MAGIC;
+	header.version = PGFW_RULE_IMAGE_VERSION;
+	header.pgver = PGSS_PG_MAJOR_VERSION;
+	header.text_size = 0;
+
+	nrules = 0;
+	for (i = 0; i < copy->nrules; i++)
 	{
-		int			len = entry->query_len;
-		char	   *qstr = qtext_fetch(entry->query_offset, len,
-									   qbuffer, qbuffer_size);
-
-		if (qstr == NULL)
+		if (qtext_fetch(copy->query_offsets[i], rules[i].query_len,
+						qbuffer, qbuffer_size) == NULL)
 			continue;			/* Ignore any entries with bogus texts */
+		rules[nrules] = rules[i];
+		rules[nrules].text_offset = header.text_size;
+		copy->query_offsets[nrules] = copy->query_offsets[i];
+		header.text_size += rules[nrules].query_len + 1;
+		nrules++;
+	}
+	header.nrules = nrules;
 
-		if (fwrite(entry, sizeof(pgssEntry), 1, file) != 1 ||
-			fwrite(qstr, 1, len + 1, file) != len + 1)
-		{
-			/* note: we assume hash_seq_term won't change errno */
-			hash_seq_term(&hash_seq);
+	INIT_CRC32(header.crc);
+	COMP_CRC32(header.crc, (char *) rules, nrules * sizeof(pgfwRuleImageEntry));
+	for (i = 0; i < nrules; i++)
+		COMP_CRC32(header.crc, qbuffer + copy->query_offsets[i],
+				   rules[i].query_len + 1);
+	FIN_CRC32(header.crc);
+
+	file = AllocateFile(PGSS_STATEMENTS_FILE ".tmp", PG_BINARY_W);
+	if (file == NULL)
+		goto error;
+
+	if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+		fwrite(rules, sizeof(pgfwRuleImageEntry), nrules, file) != nrules)
+		goto error;
+	for (i = 0; i < nrules; i++)
+	{
+		int			len = rules[i].query_len;
+
+		if (fwrite(qbuffer + copy->query_offsets[i], 1, len + 1, file) != len + 1)
 			goto error;
-		}
 	}
 
-	free(qbuffer);
+	qtext_release(qbuffer);
 	qbuffer = NULL;
 
+	/* the rule log is truncated on the strength of this file */
+	if (fflush(file) != 0 || pg_fsync(fileno(file)) != 0)
+		goto error;
+
 	if (FreeFile(file))
 	{
 		file = NULL;
@@ -833,12 +2681,18 @@ update_firewall_rule_file(void)
 	 * Rename file into place, so we atomically replace any old one.
 	 */
 	if (rename(PGSS_STATEMENTS_FILE ".tmp", PGSS_STATEMENTS_FILE) != 0)
+	{
 		ereport(LOG,
 				(errcode_for_file_access(),
 				 errmsg("could not rename sql_firewall file \"%s\": %m",
 						PGSS_STATEMENTS_FILE ".tmp")));
+		return false;
+	}
 
-	return;
+	/* ... and make the rename itself durable before the log goes */
+	fsync_fname(PGSTAT_STAT_PERMANENT_DIRECTORY, true);
+
+	return true;
 
 error:
 	ereport(LOG,
@@ -846,9 +2700,145 @@ error:
 			 errmsg("could not write sql_firewall file \"%s\": %m",
 					PGSS_STATEMENTS_FILE ".tmp")));
 	if (qbuffer)
-		free(qbuffer);
+		qtext_release(qbuffer);
 	if (file)
 		FreeFile(file);
+	return false;
+}
+
+/*
+ * Load the rule image in PGSS_STATEMENTS_FILE.
+ *
+ * The file is mapped and checked as a whole.  Its texts are then handed over
+ * in one piece, written to "qfile" or copied to the arena, so that loading
+ * the rules costs no I/O beyond that; only the hashtable entries remain to
+ * be made.  If the arena is too small for all the texts, the rules whose
+ * text doesn't fit in it are left out.
+ *
+ * Called by pgss_shmem_startup() only, when no other process is running.
+ *
+ * return false if the image could not be loaded, having logged why
+ */
+static bool
+rule_image_load(FILE *qfile)
+{
+	int			fd;
+	struct stat st;
+	char	   *image = MAP_FAILED;
+	const pgfwRuleImageHeader *header;
+	const char *rules;
+	const char *texts;
+	Size		stride;
+	Size		text_size;
+	pg_crc32	crc;
+	uint32		i;
+
+	fd = OpenTransientFile(PGSS_STATEMENTS_FILE, O_RDONLY | PG_BINARY, 0);
+	if (fd < 0 || fstat(fd, &st) != 0)
+		goto read_error;
+
+	if (st.st_size < sizeof(pgfwRuleImageHeader))
+		goto data_error;
+
+	image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (image == MAP_FAILED)
+		goto read_error;
+
+	header = (const pgfwRuleImageHeader *) image;
+	if (header->magic != PGFW_RULE_IMAGE_MAGIC ||
+		header->pgver != PGSS_PG_MAJOR_VERSION)
+		goto data_error;
+
+	/* version 1 images have no rule flags, every rule is a configured one */
+	if (header->version >= 2 && header->version <= PGFW_RULE_IMAGE_VERSION)
+		stride = sizeof(pgfwRuleImageEntry);
+	else if (header->version == 1)
+		stride = RULE_IMAGE_ENTRY_SIZE_V1;
+	else
+		goto data_error;
+
+	rules = (const char *) (header + 1);
+	if (header->nrules > (st.st_size - sizeof(pgfwRuleImageHeader)) / stride)
+		goto data_error;
+	texts = rules + header->nrules * stride;
+	if (texts + header->text_size != image + st.st_size)
+		goto data_error;
+
+	INIT_CRC32(crc);
+	COMP_CRC32(crc, (char *) rules, st.st_size - sizeof(pgfwRuleImageHeader));
+	FIN_CRC32(crc);
+	if (!EQ_CRC32(crc, header->crc))
+		goto data_error;
+
+	/* all the texts at once */
+	text_size = header->text_size;
+	if (pgss->qtext_arena)
+	{
+		text_size = Min(text_size, pgss->qtext_arena_size);
+		memcpy(pgss->qtext_arena, texts, text_size);
+	}
+	else if (fwrite(texts, 1, text_size, qfile) != text_size)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not write sql_firewall file \"%s\": %m",
+						PGSS_STATEMENTS_TEMP_FILE)));
+		goto fail;
+	}
+	pgss->extent = text_size;
+
+	for (i = 0; i < header->nrules; i++)
+	{
+		pgfwRuleImageEntry rule_data;
+		const pgfwRuleImageEntry *rule = &rule_data;
+		pgssHashKey key;
+		pgssEntry  *entry;
+
+		memset(&rule_data, 0, sizeof(rule_data));
+		memcpy(&rule_data, rules + i * stride, stride);
+		/* the database of older versions is padding, always zeroed */
+		key_from_file(&key, &rule->key, rule->dbid, header->version < 3);
+
+		if (rule->query_len < 0 ||
+			rule->text_offset + rule->query_len >= text_size ||
+			texts[rule->text_offset + rule->query_len] != '\0' ||
+			!PG_VALID_BE_ENCODING(rule->encoding))
+			continue;
+
+		/* make the hashtable entry (discards old entries if too many) */
+		entry = entry_alloc(&key, NULL, rule->text_offset, rule->query_len,
+							rule->encoding, false,
+							(rule->flags & PGFW_RULE_IMAGE_LEARNED) != 0);
+		if (entry == NULL)
+			break;
+
+		entry->type = key.type;
+		entry->counters = rule->counters;
+		entry->logged = rule->counters;
+	}
+
+	munmap(image, st.st_size);
+	CloseTransientFile(fd);
+
+	return true;
+
+read_error:
+	ereport(LOG,
+			(errcode_for_file_access(),
+			 errmsg("could not read sql_firewall file \"%s\": %m",
+					PGSS_STATEMENTS_FILE)));
+	goto fail;
+data_error:
+	ereport(LOG,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("ignoring invalid data in sql_firewall file \"%s\"",
+					PGSS_STATEMENTS_FILE)));
+fail:
+	if (image != MAP_FAILED)
+		munmap(image, st.st_size);
+	if (fd >= 0)
+		CloseTransientFile(fd);
+	return false;
 }
 
 static void
@@ -873,10 +2863,7 @@ update_firewall_counter_file(void)
 		int64 warnings = 0;
 		int64 errors = 0;
 
-		SpinLockAcquire(&pgss->mutex);
-		warnings = pgss->warning_count;
-		errors = pgss->error_count;
-		SpinLockRelease(&pgss->mutex);
+		stat_counter_totals(&warnings, &errors);
 
 		fprintf(file, "%ld %ld", warnings, errors);
 	}
@@ -912,14 +2899,19 @@ pgss_shmem_shutdown(int code, Datum arg)
 	/* rule can be added during learning mode or inserted manually by
 	 * database administrator, or imported from human maintained file.
 	 * */
-	update_firewall_rule_file();
+	if (update_firewall_rule_file())
+		rule_log_truncate(rule_log_size());
 
 	update_firewall_counter_file();
 
+	if (pgfw_replicate_rules)
+		replication_position_save();
+
 	/* Unlink query-texts file; it's not needed while shutdown */
 	unlink(PGSS_STATEMENTS_TEMP_FILE);
 	unlink(PGSS_STATEMENTS_FILE ".tmp");
 	unlink(PGSS_COUNTER_FILE ".tmp");
+	unlink(PGFW_RULE_LOG_FILE ".tmp");
 
 	elog(LOG, "sql_firewall file \"%s\" has been updated.", PGSS_STATEMENTS_FILE);
 
@@ -932,22 +2924,49 @@ pgss_shmem_shutdown(int code, Datum arg)
 static void
 pgss_post_parse_analyze(ParseState *pstate, Query *query)
 {
-	pgssJumbleState jstate;
+	pgssJumbleState *jstate = NULL;
+	instr_time	start;
+	pgfwFingerprintKey fkey;
+	pgfwFingerprint *fingerprint;
+	bool		has_constants = false;
 
 	if (prev_post_parse_analyze_hook)
 		prev_post_parse_analyze_hook(pstate, query);
 
-	/* queryId could be set by other module, like pg_stat_statements */
-	if (query->queryId != 0)
+	/* The text of a rule is no statement to check or to learn */
+	if (rule_text_analyzing)
 		return;
 
-	/* Assert we didn't do this already */
-	Assert(query->queryId == 0);
+	/* A new statement is on its way, forget the verdict on the previous one */
+	verdict_valid = false;
 
 	/* Safety check... */
 	if (!pgss || !pgss_hash)
 		return;
 
+	/*
+	 * Nothing to do at all in the disabled mode, unless query ids are to be
+	 * logged.  See pgfw_mode_assign() for the statements prepared meanwhile.
+	 */
+	if (pgfw_mode == PGFW_MODE_DISABLED &&
+		pgfw_log_statements != PGFW_LOG_ALL)
+		return;
+
+	/*
+	 * queryId could be set by other module, like pg_stat_statements.  There
+	 * is no need to jumble the query again, but the verdict is still ours.
+	 */
+	if (query->queryId != 0)
+	{
+		if (pgfw_check_early() && pgss_enabled() && !query->utilityStmt)
+		{
+			pgfw_check_statement(pstate->p_sourcetext, query->queryId, query,
+								 NULL);
+			remember_verdict(query->queryId);
+		}
+		return;
+	}
+
 	/*
 	 * Utility statements get queryId zero.  We do this even in cases where
 	 * the statement contains an optimizable statement for which a queryId
@@ -962,40 +2981,81 @@ pgss_post_parse_analyze(ParseState *pstate, Query *query)
 		return;
 	}
 
-	/* Set up workspace for query jumbling */
-	jstate.jumble = (unsigned char *) palloc(JUMBLE_SIZE);
-	jstate.jumble_len = 0;
-	jstate.clocations_buf_size = 32;
-	jstate.clocations = (pgssLocationLen *)
-		palloc(jstate.clocations_buf_size * sizeof(pgssLocationLen));
-	jstate.clocations_count = 0;
-
-	/* Compute query ID and mark the Query node with it */
-	JumbleQuery(&jstate, query);
-	query->queryId = hash_any(jstate.jumble, jstate.jumble_len);
-	elog(LOG, "query \'%s\' query id %u", pstate->p_sourcetext, query->queryId);
-
 	/*
-	 * If we are unlucky enough to get a hash of zero, use 1 instead, to
-	 * prevent confusion with the utility-statement case.
+	 * A text analyzed before gets the query id it got then, without walking
+	 * the tree again.  To learn a new statement with constants, its text
+	 * needs normalizing though, which takes the constants of the jumble.
 	 */
-	if (query->queryId == 0)
-		query->queryId = 1;
+	fingerprint = fingerprint_lookup(pstate, &fkey);
+	if (fingerprint != NULL)
+	{
+		query->queryId = fingerprint->queryid;
+		has_constants = fingerprint->has_constants;
 
-	/*
-	 * If we were able to identify any ignorable constants, we immediately
-	 * create a hash table entry for the query, so that we can record the
-	 * normalized form of the query string.  If there were no such constants,
-	 * the normalized string would be the same as the query text anyway, so
-	 * there's no need for an early entry.
-	 */
-	if (jstate.clocations_count > 0)
-		pgss_store(pstate->p_sourcetext,
-				   query->queryId,
-				   0,
-				   0,
-				   NULL,
-				   &jstate);
+		if (has_constants && pgfw_mode == PGFW_MODE_LEARNING &&
+			!pgfw_check_early() &&
+			!whitelist_is_known(GetUserId(), query->queryId))
+			fingerprint = NULL;
+	}
+
+	if (fingerprint == NULL)
+	{
+		/* Set up workspace for query jumbling */
+		jstate = jumble_workspace_reset();
+
+		/* Compute query ID and mark the Query node with it */
+		timing_start(&start);
+		JumbleQuery(jstate, query);
+		query->queryId = hash_any(jstate->jumble, jstate->jumble_len);
+		timing_record(PGFW_TIMING_JUMBLE, &start);
+
+		/*
+		 * If we are unlucky enough to get a hash of zero, use 1 instead, to
+		 * prevent confusion with the utility-statement case.
+		 */
+		if (query->queryId == 0)
+			query->queryId = 1;
+
+		has_constants = (jstate->clocations_count > 0);
+		fingerprint_remember(&fkey, pstate->p_sourcetext, query->queryId,
+							 has_constants);
+	}
+
+	if (pgfw_log_wanted(PGFW_LOG_ALL))
+		ereport(pgfw_log_level,
+				(errmsg("sql_firewall: query id %u", query->queryId),
+				 errhint("SQL statement : %s", pstate->p_sourcetext),
+				 errhidestmt(true)));
+
+	/*
+	 * In the analyze stage, the rules are applied here so that a prohibited
+	 * statement costs us a parse only, not a plan plus a full execution.
+	 */
+	if (pgfw_check_early())
+	{
+		if (pgss_enabled())
+		{
+			pgfw_check_statement(pstate->p_sourcetext, query->queryId, query,
+								 NULL);
+			remember_verdict(query->queryId);
+		}
+		return;
+	}
+
+	/*
+	 * If we were able to identify any ignorable constants, we immediately
+	 * create a hash table entry for the query, so that we can record the
+	 * normalized form of the query string.  If there were no such constants,
+	 * the normalized string would be the same as the query text anyway, so
+	 * there's no need for an early entry.  A statement whose query id was
+	 * cached is known already, if it is learned at all, so it needs no
+	 * jumble state.
+	 */
+	if (has_constants)
+		pgss_store(pstate->p_sourcetext,
+				   query->queryId,
+				   query,
+				   jstate);
 }
 
 /*
@@ -1004,32 +3064,38 @@ pgss_post_parse_analyze(ParseState *pstate, Query *query)
 static void
 pgss_ExecutorStart(QueryDesc *queryDesc, int eflags)
 {
-	if (prev_ExecutorStart)
-		prev_ExecutorStart(queryDesc, eflags);
-	else
-		standard_ExecutorStart(queryDesc, eflags);
+	uint32		queryId = queryDesc->plannedstmt->queryId;
+
+	if (nested_level == 0)
+		top_level_epoch++;
 
 	/*
-	 * If query has queryId zero, don't track it.  This prevents double
-	 * counting of optimizable statements that are directly contained in
-	 * utility statements.
+	 * In the analyze stage, the verdict has normally been given right after
+	 * parse analysis of this very statement.  Plans taken from the plan cache
+	 * (prepared statements, for instance) don't go through parse analysis
+	 * again, so check them here, before the executor does any work.
 	 */
-	if (pgss_enabled() && queryDesc->plannedstmt->queryId != 0)
+	if (pgfw_check_early() && queryId != 0 && pgss_enabled() &&
+		pgss && pgss_hash)
 	{
-		/*
-		 * Set up to track total elapsed time in ExecutorRun.  Make sure the
-		 * space is allocated in the per-query context so it will go away at
-		 * ExecutorEnd.
-		 */
-		if (queryDesc->totaltime == NULL)
-		{
-			MemoryContext oldcxt;
-
-			oldcxt = MemoryContextSwitchTo(queryDesc->estate->es_query_cxt);
-			queryDesc->totaltime = InstrAlloc(1, INSTRUMENT_ALL);
-			MemoryContextSwitchTo(oldcxt);
-		}
+		if (verdict_valid &&
+			verdict_queryid == queryId &&
+			verdict_userid == GetUserId())
+			verdict_valid = false;
+		else
+			pgfw_check_statement(queryDesc->sourceText, queryId, NULL,
+								 queryDesc->plannedstmt);
 	}
+
+	/*
+	 * Unlike pg_stat_statements, we don't set up queryDesc->totaltime: the
+	 * firewall has no use for the elapsed time, and instrumenting every
+	 * statement is not free.
+	 */
+	if (prev_ExecutorStart)
+		prev_ExecutorStart(queryDesc, eflags);
+	else
+		standard_ExecutorStart(queryDesc, eflags);
 }
 
 /*
@@ -1086,20 +3152,23 @@ pgss_ExecutorEnd(QueryDesc *queryDesc)
 {
 	uint32		queryId = queryDesc->plannedstmt->queryId;
 
-	if (queryId != 0 && queryDesc->totaltime && pgss_enabled())
+	/*
+	 * If query has queryId zero, don't track it.  This prevents double
+	 * counting of optimizable statements that are directly contained in
+	 * utility statements.  Nothing left to do either if the rules were
+	 * applied in ExecutorStart.
+	 */
+	if (queryId != 0 && pgss_enabled() && !pgfw_check_early())
 	{
-		/*
-		 * Make sure stats accumulation is done.  (Note: it's okay if several
-		 * levels of hook all do this.)
-		 */
-		InstrEndLoop(queryDesc->totaltime);
-
-		pgss_store(queryDesc->sourceText,
-				   queryId,
-				   queryDesc->totaltime->total * 1000.0,		/* convert to msec */
-				   queryDesc->estate->es_processed,
-				   &queryDesc->totaltime->bufusage,
-				   NULL);
+		/* the plan lets a cached verdict be found without any search */
+		if (pgfw_checking() && pgss && pgss_hash)
+			pgfw_check_statement(queryDesc->sourceText, queryId, NULL,
+								 queryDesc->plannedstmt);
+		else
+			pgss_store(queryDesc->sourceText,
+					   queryId,
+					   NULL,
+					   NULL);
 	}
 
 	if (prev_ExecutorEnd)
@@ -1116,6 +3185,9 @@ pgss_ProcessUtility(Node *parsetree, const char *queryString,
 					ProcessUtilityContext context, ParamListInfo params,
 					DestReceiver *dest, char *completionTag)
 {
+	if (nested_level == 0)
+		top_level_epoch++;
+
 	/*
 	 * If it's an EXECUTE statement, we don't track it and don't increment the
 	 * nesting level.  This allows the cycles to be charged to the underlying
@@ -1135,15 +3207,18 @@ pgss_ProcessUtility(Node *parsetree, const char *queryString,
 		!IsA(parsetree, PrepareStmt) &&
 		!IsA(parsetree, DeallocateStmt))
 	{
-		instr_time	start;
-		instr_time	duration;
-		uint64		rows;
-		BufferUsage bufusage_start,
-					bufusage;
 		uint32		queryId;
+		pgssJumbleState *jstate;
+		bool		checked = false;
+
+		queryId = utility_queryid(queryString, &jstate);
 
-		bufusage_start = pgBufferUsage;
-		INSTR_TIME_SET_CURRENT(start);
+		/* In the analyze stage, don't run a prohibited utility statement */
+		if (pgfw_check_early() && pgss && pgss_hash)
+		{
+			pgfw_check_statement(queryString, queryId, NULL, NULL);
+			checked = true;
+		}
 
 		nested_level++;
 		PG_TRY();
@@ -1165,57 +3240,19 @@ pgss_ProcessUtility(Node *parsetree, const char *queryString,
 		}
 		PG_END_TRY();
 
-		INSTR_TIME_SET_CURRENT(duration);
-		INSTR_TIME_SUBTRACT(duration, start);
-
-		/* parse command tag to retrieve the number of affected rows. */
-		if (completionTag &&
-			strncmp(completionTag, "COPY ", 5) == 0)
+		/*
+		 * The statements run meanwhile may have reused the jumble workspace,
+		 * scan the text again for its constants.
+		 */
+		if (!checked)
 		{
-#ifdef HAVE_STRTOULL
-			rows = strtoull(completionTag + 5, NULL, 10);
-#else
-			rows = strtoul(completionTag + 5, NULL, 10);
-#endif
+			if (jstate)
+				utility_queryid(queryString, &jstate);
+			pgss_store(queryString,
+					   queryId,
+					   NULL,
+					   jstate);
 		}
-		else
-			rows = 0;
-
-		/* calc differences of buffer counters. */
-		bufusage.shared_blks_hit =
-			pgBufferUsage.shared_blks_hit - bufusage_start.shared_blks_hit;
-		bufusage.shared_blks_read =
-			pgBufferUsage.shared_blks_read - bufusage_start.shared_blks_read;
-		bufusage.shared_blks_dirtied =
-			pgBufferUsage.shared_blks_dirtied - bufusage_start.shared_blks_dirtied;
-		bufusage.shared_blks_written =
-			pgBufferUsage.shared_blks_written - bufusage_start.shared_blks_written;
-		bufusage.local_blks_hit =
-			pgBufferUsage.local_blks_hit - bufusage_start.local_blks_hit;
-		bufusage.local_blks_read =
-			pgBufferUsage.local_blks_read - bufusage_start.local_blks_read;
-		bufusage.local_blks_dirtied =
-			pgBufferUsage.local_blks_dirtied - bufusage_start.local_blks_dirtied;
-		bufusage.local_blks_written =
-			pgBufferUsage.local_blks_written - bufusage_start.local_blks_written;
-		bufusage.temp_blks_read =
-			pgBufferUsage.temp_blks_read - bufusage_start.temp_blks_read;
-		bufusage.temp_blks_written =
-			pgBufferUsage.temp_blks_written - bufusage_start.temp_blks_written;
-		bufusage.blk_read_time = pgBufferUsage.blk_read_time;
-		INSTR_TIME_SUBTRACT(bufusage.blk_read_time, bufusage_start.blk_read_time);
-		bufusage.blk_write_time = pgBufferUsage.blk_write_time;
-		INSTR_TIME_SUBTRACT(bufusage.blk_write_time, bufusage_start.blk_write_time);
-
-		/* For utility statements, we just hash the query string directly */
-		queryId = pgss_hash_string(queryString);
-
-		pgss_store(queryString,
-				   queryId,
-				   INSTR_TIME_GET_MILLISEC(duration),
-				   rows,
-				   &bufusage,
-				   NULL);
 	}
 	else
 	{
@@ -1232,15 +3269,47 @@ pgss_ProcessUtility(Node *parsetree, const char *queryString,
 
 /*
  * Calculate hash value for a key
+ *
+ * The query id is a hash already, so a single multiplicative mix of the key
+ * is enough to spread the rules of a query over the buckets; the user and the
+ * type are folded in first so that the whitelist and blacklist rules of a
+ * query, or its rules for different users, don't share a bucket.
  */
 static uint32
 pgss_hash_fn(const void *key, Size keysize)
 {
 	const pgssHashKey *k = (const pgssHashKey *) key;
+	uint64		h;
+
+	h = ((uint64) k->queryid << 32) | ((uint32) k->userid ^ (k->type << 24));
+	h ^= (uint64) k->dbid * UINT64CONST(0xC2B2AE3D27D4EB4F);
+	h *= UINT64CONST(0x9E3779B97F4A7C15);
+	return (uint32) (h >> 32) ^ (uint32) h;
+}
+
+/*
+ * Convert a key read from a file.  A "legacy" key has a char type, followed
+ * by three padding bytes which may hold anything.
+ */
+static void
+key_from_file(pgssHashKey *key, const pgfwFileKey *fkey, Oid dbid,
+			  bool legacy)
+{
+	key->userid = fkey->userid;
+	key->queryid = fkey->queryid;
+	if (legacy)
+		key->type = (uint32) *(const unsigned char *) &fkey->type;
+	else
+		key->type = fkey->type;
+	key->dbid = dbid;
+}
 
-	return hash_uint32((uint32) k->userid) ^
-		hash_uint32((uint32) k->queryid) ^
-		hash_uint32((uint32) k->type);
+static void
+key_to_file(pgfwFileKey *fkey, const pgssHashKey *key)
+{
+	fkey->userid = key->userid;
+	fkey->queryid = key->queryid;
+	fkey->type = key->type;
 }
 
 /*
@@ -1254,7 +3323,8 @@ pgss_match_fn(const void *key1, const void *key2, Size keysize)
 
 	if (k1->userid == k2->userid &&
 		k1->queryid == k2->queryid &&
-		k1->type    == k2->type)
+		k1->type    == k2->type &&
+		k1->dbid    == k2->dbid)
 		return 0;
 	else
 		return 1;
@@ -1271,10 +3341,118 @@ pgss_hash_string(const char *str)
 	return hash_any((const unsigned char *) str, strlen(str));
 }
 
+/*
+ * Compute the query id of a utility statement, per
+ * sql_firewall.normalize_utility.  The utility statements have no Query tree
+ * to jumble, so their tokens are jumbled instead: the whitespace and the
+ * comments make no difference, and the constants, plus the identifiers if so
+ * configured, are recorded in the jumble state in place of their text, to be
+ * replaced with '?' by generate_normalized_query().
+ *
+ * *jstate_p is set to the jumble workspace if anything is to be replaced,
+ * to NULL otherwise.
+ */
+static uint32
+utility_queryid(const char *query, pgssJumbleState **jstate_p)
+{
+	pgssJumbleState *jstate;
+	core_yyscan_t yyscanner;
+	core_yy_extra_type yyextra;
+	core_YYSTYPE yylval;
+	YYLTYPE		yylloc;
+	int			tok;
+	uint32		queryid;
+
+	*jstate_p = NULL;
+
+	/* For utility statements, we just hash the query string directly */
+	if (pgfw_normalize_utility == PGFW_UTILITY_TEXT)
+		return pgss_hash_string(query);
+
+	jstate = jumble_workspace_reset();
+
+	/* initialize the flex scanner --- should match raw_parser() */
+	yyscanner = scanner_init(query,
+							 &yyextra,
+							 ScanKeywords,
+							 NumScanKeywords);
+
+	while ((tok = core_yylex(&yylval, &yylloc, yyscanner)) != 0)
+	{
+		switch (tok)
+		{
+			case ICONST:
+			case FCONST:
+			case SCONST:
+			case BCONST:
+			case XCONST:
+			case PARAM:
+				RecordConstLocation(jstate, yylloc);
+				break;
+			case IDENT:
+				if (pgfw_normalize_utility == PGFW_UTILITY_IDENTIFIERS)
+					RecordConstLocation(jstate, yylloc);
+				else
+					AppendJumble(jstate, (const unsigned char *) yylval.str,
+								 strlen(yylval.str) + 1);
+				break;
+			case Op:
+				AppendJumble(jstate, (const unsigned char *) yylval.str,
+							 strlen(yylval.str) + 1);
+				break;
+			default:
+				/* keywords and punctuation, told apart by the token alone */
+				break;
+		}
+		AppendJumble(jstate, (const unsigned char *) &tok, sizeof(tok));
+	}
+
+	scanner_finish(yyscanner);
+
+	queryid = hash_any(jstate->jumble, jstate->jumble_len);
+
+	if (jstate->clocations_count > 0)
+		*jstate_p = jstate;
+
+	return queryid;
+}
+
+/*
+ * Number of backends having their own warning and error counters, computed
+ * the way the postmaster computes MaxBackends, which isn't set yet when the
+ * shared memory is requested.
+ */
+static int
+backend_counter_slots(void)
+{
+	return MaxConnections + autovacuum_max_workers + 1 + max_worker_processes;
+}
+
+/*
+ * The counters of this backend, or NULL if it hasn't any; the shared ones
+ * protected by pgss->mutex are used then.
+ */
+static volatile pgfwBackendCounters *
+my_backend_counters(void)
+{
+	if (MyBackendId == InvalidBackendId || MyBackendId < 1 ||
+		MyBackendId > backend_counter_slots())
+		return NULL;
+
+	return &pgss->backend_counters[MyBackendId - 1];
+}
+
 static void
 stat_warning_increment(void)
 {
 	volatile pgssSharedState *s = (volatile pgssSharedState *) pgss;
+	volatile pgfwBackendCounters *c = my_backend_counters();
+
+	if (c != NULL)
+	{
+		c->warning_count++;
+		return;
+	}
 
 	SpinLockAcquire(&s->mutex);
 	s->warning_count++;
@@ -1285,6 +3463,13 @@ static void
 stat_error_increment(void)
 {
 	volatile pgssSharedState *s = (volatile pgssSharedState *) pgss;
+	volatile pgfwBackendCounters *c = my_backend_counters();
+
+	if (c != NULL)
+	{
+		c->error_count++;
+		return;
+	}
 
 	SpinLockAcquire(&s->mutex);
 	s->error_count++;
@@ -1292,2787 +3477,8596 @@ stat_error_increment(void)
 }
 
 /*
- * Store some statistics for a statement.
+ * Sum up the warning and error counters of all backends.
  *
- * If jstate is not NULL then we're trying to create an entry for which
- * we have no statistics as yet; we just want to record the normalized
- * query string.  total_time, rows, bufusage are ignored in this case.
+ * The shared counters hold whatever was counted outside of the backend
+ * counters, minus their sum at the last reset, see sql_firewall_stat_reset().
  */
 static void
-pgss_store(const char *query, uint32 queryId,
-		   double total_time, uint64 rows,
-		   const BufferUsage *bufusage,
-		   pgssJumbleState *jstate)
+stat_counter_totals(int64 *warnings, int64 *errors)
 {
-	pgssHashKey key;
-	char	   *norm_query = NULL;
-	int			encoding = GetDatabaseEncoding();
-	int			query_len;
+	volatile pgssSharedState *s = (volatile pgssSharedState *) pgss;
+	int			nslots = backend_counter_slots();
+	int			i;
 
-	Assert(query != NULL);
+	SpinLockAcquire(&s->mutex);
+	*warnings = s->warning_count;
+	*errors = s->error_count;
+	SpinLockRelease(&s->mutex);
 
-	elog(DEBUG1, "pgss_store: query=\"%s\" queryid=%u", query, queryId);
+	for (i = 0; i < nslots; i++)
+	{
+		volatile pgfwBackendCounters *c = &s->backend_counters[i];
 
-	/* Safety check... */
-	if (!pgss || !pgss_hash)
+		*warnings += c->warning_count;
+		*errors += c->error_count;
+	}
+}
+
+/*
+ * Start timing a stage, if sql_firewall.track_timing is on.
+ */
+static void
+timing_start(instr_time *start)
+{
+	if (pgfw_track_timing)
+		INSTR_TIME_SET_CURRENT(*start);
+	else
+		INSTR_TIME_SET_ZERO(*start);
+}
+
+/*
+ * Add the time elapsed since timing_start() to the histogram of the stage,
+ * in the slot of this backend.  The processes without a slot aren't timed.
+ */
+static void
+timing_record(PGFWTimingStage stage, instr_time *start)
+{
+	volatile pgfwTimingHistogram *hist;
+	instr_time	duration;
+	uint64		us;
+	int			bucket = 0;
+
+	if (INSTR_TIME_IS_ZERO(*start) ||
+		MyBackendId == InvalidBackendId || MyBackendId < 1 ||
+		MyBackendId > backend_counter_slots())
 		return;
 
-	query_len = strlen(query);
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, *start);
+	us = INSTR_TIME_GET_MICROSEC(duration);
 
-	/* Set up key for hashtable search */
-	key.userid = GetUserId();
-	key.queryid = queryId;
+	while (us >> bucket && bucket < PGFW_TIMING_BUCKETS - 1)
+		bucket++;
 
-	LWLockAcquire(pgss->lock, LW_SHARED);
-	/*
-	 * for disabled mode, we did not need to search the rule table at all,
-	 * this should be an optimization consideration here.
-	 */
-	if ((pgfw_mode == PGFW_MODE_ENFORCING) && to_be_prohibited(key.userid, key.queryid)) {
-		stat_error_increment();
-		ereport(ERROR,
-				(errcode(ERRCODE_S_R_E_PROHIBITED_SQL_STATEMENT_ATTEMPTED),
-				 errmsg("Prohibited SQL statement - sql firewall violation"),
-				 errhint("SQL statement : %s", query)));
-	} else if ((pgfw_mode == PGFW_MODE_PERMISSIVE) && to_be_prohibited(key.userid, key.queryid)) {
-		ereport(WARNING,
-				(errmsg("Prohibited SQL statement - sql firewall violation"), 
-				 errhint("SQL statement : %s", query)));
-		stat_warning_increment();
-		goto done;
-	} else if ((pgfw_mode == PGFW_MODE_LEARNING) && !lookup_whitelist(key.userid, key.queryid)) {
-		/* Create new entry, if not present */
-		Size		query_offset;
-		int			gc_count;
-		bool		stored;
-		bool		do_gc;
-		pgssEntry  *entry;
+	hist = &pgss->backend_timings[MyBackendId - 1].stages[stage];
+	hist->counts[bucket]++;
+	hist->total_us += us;
+}
 
-		/*
-		 * Create a new, normalized query string if caller asked.  We don't
-		 * need to hold the lock while doing this work.  (Note: in any case,
-		 * it's possible that someone else creates a duplicate hashtable entry
-		 * in the interval where we don't hold the lock below.  That case is
-		 * handled by entry_alloc.)
-		 */
-		if (jstate)
-		{
-			norm_query = generate_normalized_query(jstate, query,
-												   &query_len,
-												   encoding);
-		}
+/*
+ * Sum the timings of all the backends since the last reset.
+ */
+static void
+timing_totals(pgfwBackendTimings *totals)
+{
+	volatile pgssSharedState *s = (volatile pgssSharedState *) pgss;
+	int			nslots = backend_counter_slots();
+	int			i,
+				j,
+				k;
 
-		/* Append new query text to file with only shared lock held */
-		stored = qtext_store(norm_query ? norm_query : query, query_len,
-							 &query_offset, &gc_count);
+	SpinLockAcquire(&s->mutex);
+	memcpy(totals, (const void *) &s->timings_reset, sizeof(pgfwBackendTimings));
+	SpinLockRelease(&s->mutex);
 
-		/*
-		 * Determine whether we need to garbage collect external query texts
-		 * while the shared lock is still held.  This micro-optimization
-		 * avoids taking the time to decide this while holding exclusive lock.
-		 */
-		do_gc = need_gc_qtexts();
+	for (k = 0; k < PGFW_NUM_TIMINGS; k++)
+	{
+		pgfwTimingHistogram *total = &totals->stages[k];
 
-		/* Need exclusive lock to make a new hashtable entry - promote */
-		LWLockRelease(pgss->lock);
-		LWLockAcquire(pgss->lock, LW_EXCLUSIVE);
+		for (j = 0; j < PGFW_TIMING_BUCKETS; j++)
+			total->counts[j] = -total->counts[j];
+		total->total_us = -total->total_us;
 
-		/*
-		 * A garbage collection may have occurred while we weren't holding the
-		 * lock.  In the unlikely event that this happens, the query text we
-		 * stored above will have been garbage collected, so write it again.
-		 * This should be infrequent enough that doing it while holding
-		 * exclusive lock isn't a performance problem.
-		 */
-		if (!stored || pgss->gc_count != gc_count)
-			stored = qtext_store(norm_query ? norm_query : query, query_len,
-								 &query_offset, NULL);
+		for (i = 0; i < nslots; i++)
+		{
+			volatile pgfwTimingHistogram *hist = &s->backend_timings[i].stages[k];
 
-		/* If we failed to write to the text file, give up */
-		if (!stored) {
-			goto done;
+			for (j = 0; j < PGFW_TIMING_BUCKETS; j++)
+				total->counts[j] += hist->counts[j];
+			total->total_us += hist->total_us;
 		}
+	}
+}
 
-		/* OK to create a new hashtable entry */
-		/* learned firewall rule is whitelist one */
-		key.type = (uint32)PGFW_WHITELIST_ENTRY;
-		entry = entry_alloc(&key, query_offset, query_len, encoding,
-							jstate != NULL);
-		entry->type = (uint32)PGFW_WHITELIST_ENTRY;
+/*
+ * Acquire pgss->lock, timing the wait.
+ */
+static void
+pgfw_lock_acquire(LWLockMode mode)
+{
+	instr_time	start;
 
-		/* If needed, perform garbage collection while exclusive lock held */
-		if (do_gc)
-			gc_qtexts();
-	}
+	timing_start(&start);
+	LWLockAcquire(pgss->lock, mode);
+	timing_record(PGFW_TIMING_LOCK_WAIT, &start);
+}
 
-done:
-	LWLockRelease(pgss->lock);
+/*
+ * Should this statement be logged, given sql_firewall.log_sample_rate?
+ */
+static bool
+pgfw_log_sampled(void)
+{
+	if (pgfw_log_sample_rate >= 1.0)
+		return true;
+	if (pgfw_log_sample_rate <= 0.0)
+		return false;
 
-	/* We postpone this clean-up until we're out of the lock */
-	if (norm_query)
-		pfree(norm_query);
+	return random() < pgfw_log_sample_rate * ((double) MAX_RANDOM_VALUE + 1.0);
 }
 
 /*
- * Reset all statement statistics.
+ * Apply the firewall rules to a statement.
  *
- * keep blacklist entries ?
+ * The matching rules are searched in the backend-local cache first, then in
+ * the rule snapshot, and only then in the hashtable.  The structural rules,
+ * if any, are applied before all of them, to the statement parsed or to
+ * the plan.  The plan executed, if any, finds its cache entry and its
+ * structural verdict directly the next time it is executed.  In the enforcing mode
+ * a prohibited statement is rejected with an ERROR, in the permissive mode
+ * it is only reported with a WARNING.  The counters of the matched rule
+ * entry are maintained by to_be_prohibited(), through the cache entry when
+ * there is one.
  */
-Datum
-sql_firewall_reset(PG_FUNCTION_ARGS)
+static void
+pgfw_check_statement(const char *query, uint32 queryId,
+					 Query *parse, const PlannedStmt *plan)
 {
-	if (!superuser())
-		ereport(ERROR,
-				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
-				 (errmsg("must be superuser to use sql_firewall_reset"))));
+	Oid			userid = GetUserId();
+	uint32		generation;
+	pgfwPlanVerdict *memo = NULL;
+	pgfwCacheEntry *centry;
+	pgssEntry  *whitelist_entry = NULL;
+	pgssEntry  *blacklist_entry = NULL;
+	bool		structural = false;
+	bool		search;
+	bool		prohibited;
+	instr_time	start;
+
+	/* A nested statement is checked once per top-level statement */
+	if (nested_level > 0 && nested_verdict_known(userid, queryId))
+		return;
 
-	if (pgfw_mode != PGFW_MODE_DISABLED)
-		ereport(ERROR,
-				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
-				 errmsg("sql_firewall_reset() is available only under the disable mode")));
+	timing_start(&start);
 
-	if (!pgss || !pgss_hash)
-		ereport(ERROR,
-				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
-				 errmsg("sql_firewall must be loaded via shared_preload_libraries")));
-	entry_reset();
+	/*
+	 * Read the generation before searching, so that a change of the rules
+	 * racing with us flushes whatever we cache below.
+	 */
+	generation = ((volatile pgssSharedState *) pgss)->rules_generation;
+	pg_read_barrier();
 
-	update_firewall_rule_file();
+	centry = NULL;
+	if (plan != NULL)
+		memo = plan_verdict_lookup(plan, userid, queryId, generation);
+	if (memo != NULL)
+	{
+		centry = memo->centry;
+		structural = memo->structural;
+	}
+	else if (pgfw_rule_engine != PGFW_ENGINE_BLACKLIST)
+		structural = structural_rules_allow(parse, plan);
 
-	PG_RETURN_VOID();
-}
+	/*
+	 * The structural rules come first: there is nothing else to search for
+	 * the whitelist engine once they allow a statement.  The hybrid engine
+	 * still needs to know whether a blacklist rule bans it.
+	 */
+	search = !(structural && pgfw_rule_engine == PGFW_ENGINE_WHITELIST);
+	if (!search)
+		centry = NULL;
+	else if (centry == NULL)
+		centry = local_cache_lookup(userid, queryId, generation);
 
-/* Number of output arguments (columns) for various API versions */
-#define SQL_FIREWALL_COLS			    6		/* maximum of above */
-#define SQL_FIREWALL_CSV_COLS			6		/* maximum of above */
+	if (centry != NULL)
+	{
+		whitelist_entry = centry->whitelist_entry;
+		blacklist_entry = centry->blacklist_entry;
+	}
+	else if (search)
+	{
+		if (!snapshot_lookup_rules(userid, queryId,
+								   &whitelist_entry, &blacklist_entry))
+		{
+			/*
+			 * The snapshot is out of date.  Rebuild it, unless somebody else
+			 * is busy with the hashtable, and search the hashtable itself
+			 * anyway.
+			 */
+			if (LWLockConditionalAcquire(pgss->lock, LW_EXCLUSIVE))
+			{
+				if (!pgss->snapshot_valid)
+					publish_rule_snapshot();
+			}
+			else
+				pgfw_lock_acquire(LW_SHARED);
+
+			lookup_rules(userid, queryId, &whitelist_entry, &blacklist_entry);
+			LWLockRelease(pgss->lock);
+		}
+
+		centry = local_cache_insert(userid, queryId, generation,
+									whitelist_entry, blacklist_entry);
+	}
+
+	if (plan != NULL && (centry != NULL || structural))
+		plan_verdict_remember(plan, userid, queryId, generation, centry,
+							  structural);
+
+	prohibited = to_be_prohibited(whitelist_entry, blacklist_entry, centry,
+								  structural);
+
+	/* the shadow rules only count what they would have done */
+	if (pgfw_shadow_hash != NULL &&
+		((volatile pgssSharedState *) pgss)->shadow_loaded)
+		shadow_check(userid, queryId, query, centry, search, structural,
+					 prohibited);
+
+	timing_record(PGFW_TIMING_LOOKUP, &start);
+
+	if (prohibited)
+	{
+		bool		enforced = (pgfw_mode == PGFW_MODE_ENFORCING);
+		bool		report;
+		int64		suppressed = 0;
+
+		/* the server log reports of a burst of violations are rate-limited */
+		report = violation_record(userid, queryId, query, enforced,
+								  &suppressed);
+
+		if (report && pgfw_log_wanted(PGFW_LOG_VIOLATIONS))
+			ereport(pgfw_log_level,
+					(errmsg("sql_firewall: query id %u of user %u is prohibited",
+							queryId, userid),
+					 suppressed > 0 ?
+					 errdetail("Also " INT64_FORMAT " violations not reported since the previous one.",
+							   suppressed) : 0,
+					 errhint("SQL statement : %s", query),
+					 errhidestmt(true)));
+
+		/* the client of a rejected statement is always told, though */
+		if (enforced)
+		{
+			stat_error_increment();
+			ereport(ERROR,
+					(errcode(ERRCODE_S_R_E_PROHIBITED_SQL_STATEMENT_ATTEMPTED),
+					 errmsg("Prohibited SQL statement - sql firewall violation"),
+					 errhint("SQL statement : %s", query)));
+		}
+
+		/* ... as is the violating client of the permissive mode */
+		violation_warning_unlogged = !report;
+		ereport(WARNING,
+				(errmsg("Prohibited SQL statement - sql firewall violation"),
+				 errhint("SQL statement : %s", query)));
+		violation_warning_unlogged = false;
+		stat_warning_increment();
+	}
+
+	if (nested_level > 0 && !prohibited)
+		nested_verdict_remember(userid, queryId, generation);
+}
 
 /*
- * Retrieve statement statistics.
+ * Does (userid, queryid) have a whitelist rule?  Used by the learning mode
+ * to skip the statements it knows already without taking pgss->lock.
  *
- * The SQL API of this function has changed multiple times, and will likely
- * do so again in future.  To support the case where a newer version of this
- * loadable module is being used with an old SQL declaration of the function,
- * we continue to support the older API versions.  For 1.2 and later, the
- * expected API version is identified by embedding it in the C name of the
- * function.  Unfortunately we weren't bright enough to do that for 1.1.
+ * return:
+ *   false   :   no such rule, or it can't be told without the lock
+ *   true    :   the rule exists
  */
-Datum
-sql_firewall_statements(PG_FUNCTION_ARGS)
+static bool
+whitelist_is_known(Oid userid, uint32 queryid)
 {
-	bool		showtext = PG_GETARG_BOOL(0);
+	uint32		generation;
+	pgfwCacheEntry *centry;
+	pgssEntry  *whitelist_entry = NULL;
+	pgssEntry  *blacklist_entry = NULL;
 
-	pg_stat_statements_internal(fcinfo, showtext);
+	generation = ((volatile pgssSharedState *) pgss)->rules_generation;
+	pg_read_barrier();
 
-	return (Datum) 0;
+	centry = local_cache_lookup(userid, queryid, generation);
+	if (centry != NULL)
+	{
+		entry_touch(centry->whitelist_entry);
+		return centry->whitelist_entry != NULL;
+	}
+
+	/*
+	 * The snapshot is rarely valid while learning, every new rule makes it
+	 * stale; cache what the hashtable says instead.
+	 */
+	if (!snapshot_lookup_rules(userid, queryid,
+							   &whitelist_entry, &blacklist_entry))
+	{
+		if (pgfw_cache_size <= 0)
+			return false;
+
+		pgfw_lock_acquire(LW_SHARED);
+		lookup_rules(userid, queryid, &whitelist_entry, &blacklist_entry);
+		LWLockRelease(pgss->lock);
+	}
+
+	local_cache_insert(userid, queryid, generation,
+					   whitelist_entry, blacklist_entry);
+
+	entry_touch(whitelist_entry);
+	return whitelist_entry != NULL;
 }
 
-/* Common code for all versions of pg_stat_statements() */
+/*
+ * A learned statement has been seen again, keep its rule from being evicted.
+ */
 static void
-pg_stat_statements_internal(FunctionCallInfo fcinfo,
-							bool showtext)
+entry_touch(pgssEntry *entry)
 {
-	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
-	TupleDesc	tupdesc;
-	Tuplestorestate *tupstore;
-	MemoryContext per_query_ctx;
-	MemoryContext oldcontext;
-	Oid			userid = GetUserId();
-	bool		is_superuser = superuser();
-	char	   *qbuffer = NULL;
-	Size		qbuffer_size = 0;
-	Size		extent = 0;
-	int			gc_count = 0;
-	HASH_SEQ_STATUS hash_seq;
-	pgssEntry  *entry;
+	volatile pgssEntry *e = (volatile pgssEntry *) entry;
 
-	/* hash table must exist already */
+	if (e == NULL || !e->learned || !pgfw_learning_eviction)
+		return;
+
+	SpinLockAcquire(&e->mutex);
+	e->usage += USAGE_EXEC(0);
+	SpinLockRelease(&e->mutex);
+}
+
+/*
+ * Remember that the statement being analyzed has already been checked, see
+ * pgss_ExecutorStart().
+ */
+static void
+remember_verdict(uint32 queryId)
+{
+	verdict_valid = true;
+	verdict_userid = GetUserId();
+	verdict_queryid = queryId;
+}
+
+/*
+ * Apply the rules to a statement, or learn it.
+ *
+ * If jstate is not NULL then we're trying to create an entry for which
+ * we have no statistics as yet; we just want to record the normalized
+ * query string.
+ *
+ * parse is the analyzed statement, if there is one, for the structural
+ * rules.
+ *
+ * The firewall keeps no timing, row or buffer statistics, so none are
+ * collected by the executor and utility hooks for us.
+ */
+static void
+pgss_store(const char *query, uint32 queryId,
+		   Query *parse, pgssJumbleState *jstate)
+{
+	pgssHashKey key;
+	char	   *norm_query = NULL;
+	int			encoding = GetDatabaseEncoding();
+	int			query_len;
+
+	Assert(query != NULL);
+
+	elog(DEBUG1, "pgss_store: query=\"%s\" queryid=%u", query, queryId);
+
+	/* Safety check... */
 	if (!pgss || !pgss_hash)
-		ereport(ERROR,
-				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
-				 errmsg("sql_firewall must be loaded via shared_preload_libraries")));
+		return;
 
-	/* check to see if caller supports us returning a tuplestore */
-	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
-		ereport(ERROR,
-				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-				 errmsg("set-valued function called in context that cannot accept a set")));
-	if (!(rsinfo->allowedModes & SFRM_Materialize))
-		ereport(ERROR,
-				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-				 errmsg("materialize mode required, but it is not " \
-						"allowed in this context")));
+	if (pgfw_checking())
+	{
+		pgfw_check_statement(query, queryId, parse, NULL);
+		return;
+	}
 
-	/* Switch into long-lived context to construct returned data structures */
-	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
-	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+	/* for disabled mode, we did not need to search the rule table at all */
+	if (pgfw_mode != PGFW_MODE_LEARNING)
+		return;
 
-	/* Build a tuple descriptor for our result type */
-	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
-		elog(ERROR, "return type must be a row type");
+	query_len = strlen(query);
 
-	/*
-	 * Check we have the expected number of output arguments.  Aside from
-	 * being a good safety check, we need a kluge here to detect API version
-	 * 1.1, which was wedged into the code in an ill-considered way.
-	 */
-	Assert(tupdesc->natts == SQL_FIREWALL_COLS);
+	/* Set up key for hashtable search */
+	key.userid = GetUserId();
+	key.queryid = queryId;
+	key.dbid = pgfw_current_dbid();
 
-	tupstore = tuplestore_begin_heap(true, false, work_mem);
-	rsinfo->returnMode = SFRM_Materialize;
-	rsinfo->setResult = tupstore;
-	rsinfo->setDesc = tupdesc;
+	/* A query learned already needs neither the lock nor a new entry */
+	if (whitelist_is_known(key.userid, key.queryid))
+		return;
 
-	MemoryContextSwitchTo(oldcontext);
+	/*
+	 * Create a new, normalized query string if caller asked.  We don't
+	 * need to hold the lock while doing this work.  (Note: in any case,
+	 * it's possible that someone else creates a duplicate hashtable entry
+	 * in the interval where we don't hold the lock below.  That case is
+	 * handled by entry_alloc.)
+	 */
+	if (jstate)
+	{
+		norm_query = generate_normalized_query(jstate, query,
+											   &query_len,
+											   encoding);
+	}
 
 	/*
-	 * We'd like to load the query text file (if needed) while not holding any
-	 * lock on pgss->lock.  In the worst case we'll have to do this again
-	 * after we have the lock, but it's unlikely enough to make this a win
-	 * despite occasional duplicated work.  We need to reload if anybody
-	 * writes to the file (either a retail qtext_store(), or a garbage
-	 * collection) between this point and where we've gotten shared lock.  If
-	 * a qtext_store is actually in progress when we look, we might as well
-	 * skip the speculative load entirely.
+	 * Leave the statement to the learner if there is one.  We learn it
+	 * ourselves if the queue is full or the text does not fit in a record.
 	 */
-	if (showtext)
+	if (pgss->learn_queue == NULL ||
+		query_len >= LEARN_QUEUE_TEXT_SIZE ||
+		!learn_enqueue(key.dbid, key.userid, key.queryid,
+					   norm_query ? norm_query : query, query_len, encoding))
 	{
-		int			n_writers;
+		pgfwRuleItem item;
 
-		/* Take the mutex so we can examine variables */
+		/* learned firewall rule is whitelist one */
+		memset(&item, 0, sizeof(item));
+		item.dbid = key.dbid;
+		item.userid = key.userid;
+		item.queryid = key.queryid;
+		item.type = (uint32)PGFW_WHITELIST_ENTRY;
+		item.query = norm_query ? norm_query : query;
+		item.query_len = query_len;
+		item.encoding = encoding;
+		item.sticky = (jstate != NULL);
+		item.learned = true;
+
+		store_rules(&item, 1, false);
+	}
+
+	if (norm_query)
+		pfree(norm_query);
+}
+
+/*
+ * Create the rules not there yet, with the given counters.  The rules there
+ * already are left as they are.
+ *
+ * The query texts are appended to the file with only a shared lock held,
+ * then the entries are created under a single exclusive lock.  With
+ * all_or_none, a rule which can't be created has those created before it
+ * removed again under that lock, so that no other session ever sees part
+ * of the rules.
+ *
+ * return the number of the rules there in the end, created or not
+ */
+static int
+store_rules(pgfwRuleItem *items, int nitems, bool all_or_none)
+{
+	Size	   *query_offsets;
+	bool	   *stored;
+	bool	   *create;
+	int			gc_count = 0;
+	bool		do_gc;
+	bool		failed = false;
+	int			nrules = 0;
+	int			i;
+	instr_time	start;
+
+	timing_start(&start);
+
+	query_offsets = (Size *) palloc(nitems * sizeof(Size));
+	stored = (bool *) palloc(nitems * sizeof(bool));
+	create = (bool *) palloc(nitems * sizeof(bool));
+
+	pgfw_lock_acquire(LW_SHARED);
+
+	for (i = 0; i < nitems; i++)
+	{
+		pgssHashKey key;
+
+		memset(&key, 0, sizeof(pgssHashKey));
+		key.userid = items[i].userid;
+		key.queryid = items[i].queryid;
+		key.type = items[i].type;
+		key.dbid = items[i].dbid;
+
+		if (items[i].learned)
 		{
-			volatile pgssSharedState *s = (volatile pgssSharedState *) pgss;
+			pgssEntry  *entry = lookup_whitelist(items[i].dbid, key.userid,
+												 key.queryid);
 
-			SpinLockAcquire(&s->mutex);
-			extent = s->extent;
-			n_writers = s->n_writers;
-			gc_count = s->gc_count;
-			SpinLockRelease(&s->mutex);
+			create[i] = (entry == NULL);
+			entry_touch(entry);
 		}
+		else
+			create[i] = (hash_search(pgss_hash, &key, HASH_FIND, NULL) == NULL);
+		stored[i] = false;
 
-		/* No point in loading file now if there are active writers */
-		if (n_writers == 0)
-			qbuffer = qtext_load_file(&qbuffer_size);
+		/* Append new query text to file with only shared lock held */
+		if (create[i])
+			stored[i] = qtext_store(items[i].query, items[i].query_len,
+									&query_offsets[i], &gc_count);
+		else
+			nrules++;
 	}
 
 	/*
-	 * Get shared lock, load or reload the query text file if we must, and
-	 * iterate over the hashtable entries.
-	 *
-	 * With a large hash table, we might be holding the lock rather longer
-	 * than one could wish.  However, this only blocks creation of new hash
-	 * table entries, and the larger the hash table the less likely that is to
-	 * be needed.  So we can hope this is okay.  Perhaps someday we'll decide
-	 * we need to partition the hash table to limit the time spent holding any
-	 * one lock.
+	 * Determine whether we need to garbage collect external query texts
+	 * while the shared lock is still held.  This micro-optimization
+	 * avoids taking the time to decide this while holding exclusive lock.
 	 */
-	LWLockAcquire(pgss->lock, LW_SHARED);
+	do_gc = need_gc_qtexts();
 
-	if (showtext)
+	/* Need exclusive lock to make a new hashtable entry - promote */
+	LWLockRelease(pgss->lock);
+	pgfw_lock_acquire(LW_EXCLUSIVE);
+
+	for (i = 0; i < nitems; i++)
 	{
+		pgssHashKey key;
+		pgssEntry  *entry;
+		bool		found;
+
+		if (!create[i])
+			continue;
+
 		/*
-		 * Here it is safe to examine extent and gc_count without taking the
-		 * mutex.  Note that although other processes might change
-		 * pgss->extent just after we look at it, the strings they then write
-		 * into the file cannot yet be referenced in the hashtable, so we
-		 * don't care whether we see them or not.
-		 *
-		 * If qtext_load_file fails, we just press on; we'll return NULL for
-		 * every query text.
+		 * A garbage collection may have occurred while we weren't holding the
+		 * lock.  In the unlikely event that this happens, the query text we
+		 * stored above will have been garbage collected, so write it again.
+		 * This should be infrequent enough that doing it while holding
+		 * exclusive lock isn't a performance problem.
 		 */
-		if (qbuffer == NULL ||
-			pgss->extent != extent ||
-			pgss->gc_count != gc_count)
+		if (!stored[i] || pgss->gc_count != gc_count)
+			stored[i] = qtext_store(items[i].query, items[i].query_len,
+									&query_offsets[i], NULL);
+
+		/* If we failed to write to the text file, give up */
+		if (!stored[i])
 		{
-			if (qbuffer)
-				free(qbuffer);
-			qbuffer = qtext_load_file(&qbuffer_size);
+			create[i] = false;
+			failed = true;
+			if (all_or_none)
+				break;
+			continue;
+		}
+
+		/* OK to create a new hashtable entry */
+		memset(&key, 0, sizeof(pgssHashKey));
+		key.userid = items[i].userid;
+		key.queryid = items[i].queryid;
+		key.type = items[i].type;
+		key.dbid = items[i].dbid;
+
+		/* someone else may have created it in the meantime */
+		found = (hash_search(pgss_hash, &key, HASH_FIND, NULL) != NULL);
+
+		/* make room for the learned rules, if so configured */
+		if (!found && items[i].learned && pgfw_learning_eviction &&
+			hash_get_num_entries(pgss_hash) >= pgss_max)
+			entry_dealloc();
+
+		entry = entry_alloc(&key, items[i].query,
+							query_offsets[i], items[i].query_len,
+							items[i].encoding, items[i].sticky,
+							items[i].learned);
+		if (entry == NULL)
+		{
+			create[i] = false;
+			failed = true;
+			if (all_or_none)
+				break;
+			continue;
+		}
+
+		/* create[] is left set for the rules created here only */
+		if (!found)
+		{
+			entry->type = items[i].type;
+
+			SpinLockAcquire(&entry->mutex);
+			entry->counters = items[i].counters;
+			SpinLockRelease(&entry->mutex);
 		}
+		else
+			create[i] = false;
+		nrules++;
 	}
 
-	hash_seq_init(&hash_seq, pgss_hash);
-	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	/* take back the rules created, if they can't all be */
+	if (failed && all_or_none)
 	{
-		Datum		values[SQL_FIREWALL_COLS];
-		bool		nulls[SQL_FIREWALL_COLS];
-		int			i = 0;
-		Counters	tmp;
-		int64		queryid = entry->key.queryid;
+		int			j;
 
-		memset(values, 0, sizeof(values));
-		memset(nulls, 0, sizeof(nulls));
+		for (j = 0; j < i; j++)
+		{
+			pgssHashKey key;
 
-		values[i++] = ObjectIdGetDatum(entry->key.userid);
+			if (!create[j])
+				continue;
 
-		if (is_superuser || entry->key.userid == userid)
-		{
-			values[i++] = Int64GetDatumFast(queryid);
+			memset(&key, 0, sizeof(pgssHashKey));
+			key.userid = items[j].userid;
+			key.queryid = items[j].queryid;
+			key.type = items[j].type;
+			key.dbid = items[j].dbid;
 
-			if (showtext)
+			if (entry_remove(&key))
 			{
-				char	   *qstr = qtext_fetch(entry->query_offset,
-											   entry->query_len,
-											   qbuffer,
-											   qbuffer_size);
+				rule_log_append(PGFW_RULE_LOG_DELETE, &key, NULL, NULL, 0, 0);
+				nrules--;
+			}
+		}
+		invalidate_rule_snapshot();
+	}
 
-				if (qstr)
-				{
-					char	   *enc;
+	/* If needed, perform garbage collection while exclusive lock held */
+	if (do_gc)
+	{
+		instr_time	gc_start;
 
-					enc = pg_any_to_server(qstr,
-										   entry->query_len,
-										   entry->encoding);
+		timing_start(&gc_start);
+		gc_qtexts();
+		timing_record(PGFW_TIMING_GC, &gc_start);
+	}
 
-					values[i++] = CStringGetTextDatum(enc);
+	LWLockRelease(pgss->lock);
 
-					if (enc != qstr)
-						pfree(enc);
-				}
-				else
-				{
-					/* Just return a null if we fail to find the text */
-					nulls[i++] = true;
-				}
-			}
-			else
-			{
-				/* Query text not requested */
-				nulls[i++] = true;
-			}
-		}
-		else
-		{
-			/* Don't show queryid */
-			nulls[i++] = true;
+	pfree(query_offsets);
+	pfree(stored);
+	pfree(create);
 
-			/*
-			 * Don't show query text, but hint as to the reason for not doing
-			 * so if it was requested
-			 */
-			if (showtext)
-				values[i++] = CStringGetTextDatum("<insufficient privilege>");
-			else
-				nulls[i++] = true;
-		}
+	timing_record(PGFW_TIMING_STORE, &start);
 
-		/* copy counters to a local variable to keep locking time short */
-		{
-			volatile pgssEntry *e = (volatile pgssEntry *) entry;
+	return nrules;
+}
 
-			SpinLockAcquire(&e->mutex);
-			tmp = e->counters;
-			SpinLockRelease(&e->mutex);
-		}
+/*
+ * Estimate shared memory space needed for the learning queue.
+ */
+static Size
+learn_queue_size(void)
+{
+	return add_size(offsetof(pgfwLearnQueue, records),
+					mul_size(pgfw_learn_queue_size, sizeof(pgfwLearnRecord)));
+}
 
-		/* Skip entry if unexecuted (ie, it's a pending "sticky" entry) */
-		/* if (tmp.calls == 0)
-		   continue; */
+/*
+ * Size of the violation ring in shared memory.
+ */
+static Size
+violation_ring_size(void)
+{
+	return add_size(offsetof(pgfwViolationRing, events),
+					mul_size(pgfw_violation_buffer_size,
+							 sizeof(pgfwViolation)));
+}
 
-		values[i++] = Int64GetDatumFast(tmp.calls);
-		values[i++] = Int64GetDatumFast(tmp.banned);
-		/* rule entry type */
-		values[i++] = CStringGetTextDatum(rule_typename(entry->type));
+/*
+ * Record a violation in the ring, its text cut to VIOLATION_TEXT_SIZE, and
+ * tell whether to report it now, given sql_firewall.violation_log_interval.
+ * If so, *suppressed is set to the number of violations of all sessions not
+ * reported since the previous report.
+ *
+ * The time recorded is that of the start of the statement, which costs no
+ * system call.  The reports go by the current time, though, as the
+ * statements of different sessions may start in any order.
+ */
+static bool
+violation_record(Oid userid, uint32 queryid, const char *query, bool enforced,
+				 int64 *suppressed)
+{
+	volatile pgfwViolationRing *ring = pgss->violations;
+	volatile pgfwViolation *event;
+	TimestampTz now = 0;
+	uint64		pos;
+	bool		report = true;
+	int			query_len;
 
-		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	*suppressed = 0;
+
+	if (pgfw_violation_log_interval > 0)
+		now = GetCurrentTimestamp();
+
+	SpinLockAcquire(&ring->mutex);
+	pos = ring->next++;
+	if (pgfw_violation_log_interval > 0)
+	{
+		if (ring->last_report != 0 &&
+			!TimestampDifferenceExceeds(ring->last_report, now,
+										pgfw_violation_log_interval))
+		{
+			ring->not_reported++;
+			report = false;
+		}
+		else
+		{
+			*suppressed = ring->not_reported;
+			ring->not_reported = 0;
+			ring->last_report = now;
+		}
 	}
+	SpinLockRelease(&ring->mutex);
 
-	/* clean up and return the tuplestore */
-	LWLockRelease(pgss->lock);
+	if (ring->nevents == 0)
+		return report;
 
-	if (qbuffer)
-		free(qbuffer);
+	query_len = pg_mbcliplen(query, strlen(query), VIOLATION_TEXT_SIZE - 1);
 
-	tuplestore_donestoring(tupstore);
+	event = &ring->events[pos % ring->nevents];
+
+	SpinLockAcquire(&event->mutex);
+	/* a later event has the slot already if the ring went round meanwhile */
+	if (event->seq < pos + 1)
+	{
+		event->seq = pos + 1;
+		event->time = GetCurrentStatementStartTimestamp();
+		event->userid = userid;
+		event->dbid = MyDatabaseId;
+		event->queryid = queryid;
+		event->enforced = enforced;
+		memcpy((char *) event->query, query, query_len);
+		event->query[query_len] = '\0';
+	}
+	SpinLockRelease(&event->mutex);
+
+	return report;
 }
 
-Datum
-sql_firewall_stat_warning_count(PG_FUNCTION_ARGS)
+/*
+ * Does a shadow rule of the given type match (userid, queryid)?  The shadow
+ * rules only give a verdict, so any match does, whichever is the most
+ * specific one; see lookup_rule().
+ *
+ * caller must hold at least a shared lock on pgss->lock
+ */
+static bool
+shadow_lookup_rule(Oid userid, uint32 queryid, uint32 rule_type)
 {
-	int64 count;
+	pgssHashKey key;
+	Oid			dbids[2];
+	Oid			userids[2];
+	int			ndbids = 0;
+	int			nuserids = 0;
+	int			i;
+	int			j;
 
-	volatile pgssSharedState *s = (volatile pgssSharedState *) pgss;
+	if (pgss->shadow_database_rules > 0 && MyDatabaseId != InvalidOid)
+		dbids[ndbids++] = MyDatabaseId;
+	dbids[ndbids++] = InvalidOid;
+	if (userid != InvalidOid)
+		userids[nuserids++] = userid;
+	userids[nuserids++] = InvalidOid;
 
-	SpinLockAcquire(&s->mutex);
-	count = s->warning_count;
-	SpinLockRelease(&s->mutex);
+	memset(&key, 0, sizeof(key));
+	key.queryid = queryid;
+	key.type = rule_type;
+
+	for (i = 0; i < nuserids; i++)
+	{
+		for (j = 0; j < ndbids; j++)
+		{
+			key.userid = userids[i];
+			key.dbid = dbids[j];
+			if (hash_search(pgfw_shadow_hash, &key, HASH_FIND, NULL) != NULL)
+				return true;
+		}
+	}
 
-	PG_RETURN_INT64(count);
+	return false;
 }
 
-Datum
-sql_firewall_stat_error_count(PG_FUNCTION_ARGS)
+/*
+ * Search the shadow rules of (userid, queryid), for pgfwCacheEntry.shadow.
+ */
+static uint8
+shadow_lookup_rules(Oid userid, uint32 queryid)
 {
-	int64 count;
+	uint8		shadow = PGFW_SHADOW_SEARCHED;
 
-	volatile pgssSharedState *s = (volatile pgssSharedState *) pgss;
+	pgfw_lock_acquire(LW_SHARED);
+	if (shadow_lookup_rule(userid, queryid, (uint32) PGFW_WHITELIST_ENTRY))
+		shadow |= PGFW_SHADOW_WHITELIST;
+	if (shadow_lookup_rule(userid, queryid, (uint32) PGFW_BLACKLIST_ENTRY))
+		shadow |= PGFW_SHADOW_BLACKLIST;
+	LWLockRelease(pgss->lock);
 
-	SpinLockAcquire(&s->mutex);
-	count = s->error_count;
-	SpinLockRelease(&s->mutex);
+	return shadow;
+}
+
+/*
+ * to_be_prohibited() for the shadow rules, which collect no statistics.
+ */
+static bool
+shadow_prohibits(uint8 shadow, bool structural)
+{
+	bool		whitelist_hit = ((shadow & PGFW_SHADOW_WHITELIST) != 0 || structural);
+	bool		blacklist_hit = ((shadow & PGFW_SHADOW_BLACKLIST) != 0);
 
-	PG_RETURN_INT64(count);
+	switch (pgfw_rule_engine)
+	{
+		case PGFW_ENGINE_WHITELIST:
+			return !whitelist_hit;
+		case PGFW_ENGINE_BLACKLIST:
+			return blacklist_hit;
+		default:
+			return (!whitelist_hit || blacklist_hit);
+	}
 }
 
-Datum
-sql_firewall_stat_reset(PG_FUNCTION_ARGS)
+/*
+ * Count a statement checked by the shadow rules, and whether they diverged
+ * from the live rules; see stat_warning_increment().
+ */
+static void
+shadow_stat_increment(bool diverged, bool shadow_prohibited)
 {
 	volatile pgssSharedState *s = (volatile pgssSharedState *) pgss;
+	volatile pgfwBackendCounters *c = my_backend_counters();
+
+	if (c != NULL)
+	{
+		c->shadow_checks++;
+		if (diverged && shadow_prohibited)
+			c->shadow_rejects++;
+		else if (diverged)
+			c->shadow_allows++;
+		return;
+	}
 
 	SpinLockAcquire(&s->mutex);
-	s->warning_count = 0;
-	s->error_count = 0;
+	s->shadow_checks++;
+	if (diverged && shadow_prohibited)
+		s->shadow_rejects++;
+	else if (diverged)
+		s->shadow_allows++;
 	SpinLockRelease(&s->mutex);
-
-	PG_RETURN_VOID();
 }
 
 /*
- * Export firewall rule in the sql_firewall_statements
- *
- * sql_firewall_export_rule() exports only part of pgssEntry members
- * (userid, queryid, query string, and number of calls) in CSV format.
+ * Count a statement in its divergence.
  *
- * To import the rule, query_offset, query_len and encoding need to be
- * re-computed.
+ * caller must hold at least a shared lock on pgss->lock
  */
-Datum
-sql_firewall_export_rule(PG_FUNCTION_ARGS)
+static void
+shadow_divergence_count(volatile pgfwDivergence *d, bool shadow_prohibited)
 {
-	char	   *rule_file = text_to_cstring(PG_GETARG_TEXT_P(0));
-	char	   *qbuffer = NULL;
-	Size		qbuffer_size = 0;
-	HASH_SEQ_STATUS hash_seq;
-	pgssEntry  *entry;
-	FILE *filep;
-
-	/* hash table must exist already */
-	if (!pgss || !pgss_hash)
-		ereport(ERROR,
-				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
-				 errmsg("sql_firewall must be loaded via shared_preload_libraries")));
-
-	if (!superuser())
-		ereport(ERROR,
-				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
-				 (errmsg("must be superuser to use sql_firewall_export_rule"))));
+	SpinLockAcquire(&d->mutex);
+	d->shadow_prohibited = shadow_prohibited;
+	d->count++;
+	d->last_seen = GetCurrentStatementStartTimestamp();
+	SpinLockRelease(&d->mutex);
+}
 
-	if (pgfw_mode != PGFW_MODE_DISABLED)
-		ereport(ERROR,
-				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
-				 errmsg("sql_firewall_export_rule() is available only under the disable mode")));
+/*
+ * Count a divergence of the statement, in that of (userid, queryid) in this
+ * database, which is created on first sight.
+ *
+ * The divergence is searched for every time, and counted before the lock
+ * is released: shadow_clear() may remove it as soon as it is.  Once the
+ * table is found full, the cache entry remembers not to ask again.
+ */
+static void
+shadow_divergence_record(Oid userid, uint32 queryid, const char *query,
+						 pgfwCacheEntry *centry, bool shadow_prohibited)
+{
+	pgfwDivergenceKey key;
+	pgfwDivergence *divergence;
+	bool		found;
 
-	elog(DEBUG1, "rule file=%s", rule_file);
+	/* the table was full, no need to ask again */
+	if (centry != NULL && (centry->shadow & PGFW_SHADOW_DROPPED))
+		return;
 
-	hash_seq_init(&hash_seq, pgss_hash);
+	memset(&key, 0, sizeof(key));
+	key.userid = userid;
+	key.dbid = MyDatabaseId;
+	key.queryid = queryid;
 
-	LWLockAcquire(pgss->lock, LW_SHARED);
+	pgfw_lock_acquire(LW_SHARED);
+	divergence = (pgfwDivergence *) hash_search(pgfw_divergences, &key,
+												HASH_FIND, NULL);
+	if (divergence != NULL)
+		shadow_divergence_count(divergence, shadow_prohibited);
+	LWLockRelease(pgss->lock);
 
-	if (qbuffer)
-		free(qbuffer);
-	qbuffer = qtext_load_file(&qbuffer_size);
+	if (divergence != NULL)
+		return;
 
-	filep = AllocateFile(rule_file, PG_BINARY_W);
-	if (filep == NULL)
-		ereport(ERROR,
-			(errmsg("could not open file \"%s\": %m",
-				rule_file)));
+	pgfw_lock_acquire(LW_EXCLUSIVE);
 
-	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	divergence = (pgfwDivergence *) hash_search(pgfw_divergences, &key,
+												HASH_FIND, NULL);
+	if (divergence == NULL &&
+		hash_get_num_entries(pgfw_divergences) < PGFW_MAX_DIVERGENCES)
 	{
-		Counters	tmp;
-		char	   *qstr;
-		int		need_quote = 0;
-
-		{
-			volatile pgssEntry *e = (volatile pgssEntry *) entry;
-
-			SpinLockAcquire(&e->mutex);
-			tmp = e->counters;
-			SpinLockRelease(&e->mutex);
-		}
-
-		qstr = qtext_fetch(entry->query_offset,
-				   entry->query_len,
-				   qbuffer,
-				   qbuffer_size);
-
-		if (qstr)
+		divergence = (pgfwDivergence *) hash_search(pgfw_divergences, &key,
+													HASH_ENTER_NULL, &found);
+		if (divergence != NULL && !found)
 		{
-			char *enc = pg_any_to_server(qstr,
-					       entry->query_len,
-					       entry->encoding);
-
-			if (enc != qstr)
-				pfree(enc);
+			int			query_len;
+
+			query_len = pg_mbcliplen(query, strlen(query),
+									 VIOLATION_TEXT_SIZE - 1);
+
+			SpinLockInit(&divergence->mutex);
+			divergence->shadow_prohibited = shadow_prohibited;
+			divergence->count = 0;
+			divergence->first_seen = GetCurrentStatementStartTimestamp();
+			divergence->last_seen = divergence->first_seen;
+			memcpy(divergence->query, query, query_len);
+			divergence->query[query_len] = '\0';
 		}
+	}
+	if (divergence != NULL)
+		shadow_divergence_count(divergence, shadow_prohibited);
 
-		if (strchr(qstr, '\n') != NULL || strchr(qstr, '\r') != NULL ||
-		    strchr(qstr, ',') != NULL || strchr(qstr, '"') != NULL)
-			need_quote = 1;
+	LWLockRelease(pgss->lock);
 
-		fprintf(filep, "%d,%u,", entry->key.userid, entry->key.queryid);
-		if (need_quote)
-			fprintf(filep, "\"");
+	if (divergence == NULL)
+	{
+		volatile pgssSharedState *s = (volatile pgssSharedState *) pgss;
 
-		{
-			int i;
-			for (i = 0 ; i < strlen(qstr) ; i++)
-			{
-				if (qstr[i] == '"')
-					fputc('"', filep);
-				fputc(qstr[i], filep);
-			}
-		}
+		SpinLockAcquire(&s->mutex);
+		s->shadow_dropped++;
+		SpinLockRelease(&s->mutex);
 
-		if (need_quote)
-			fprintf(filep, "\"");
+		if (centry != NULL)
+			centry->shadow |= PGFW_SHADOW_DROPPED;
+	}
+}
 
-		fprintf(filep, ",%ld,%ld,%c\n", tmp.calls, tmp.banned, entry->type);
+/*
+ * Apply the shadow rules to a statement the live rules have just decided
+ * on, and count whether they agree.  Nothing is ever reported to the
+ * client, nor are the counters of the live rules touched.
+ *
+ * The shadow verdict is kept in the cache entry of the statement, next to
+ * the live rules found, so that a statement found in the cache costs no
+ * search of the shadow rules either.  When the structural rules have allowed
+ * the statement without any search, they allow it for both rule sets.
+ */
+static void
+shadow_check(Oid userid, uint32 queryid, const char *query,
+			 pgfwCacheEntry *centry, bool search, bool structural,
+			 bool prohibited)
+{
+	uint8		shadow;
+	bool		shadow_prohibited;
 
-		//#ifdef NOT_USED
-		elog(DEBUG1, "user=%d, queryid=%u, query=%s, len=%zd, query_len=%d, calls=%ld, "
-			 "banned=%ld, type=%c",
-			 entry->key.userid,
-		     entry->key.queryid, qstr, strlen(qstr), entry->query_len, tmp.calls,
-			 tmp.banned,
-			 entry->type);
-		//#endif
+	if (!search)
+		shadow = PGFW_SHADOW_SEARCHED;
+	else if (centry != NULL && (centry->shadow & PGFW_SHADOW_SEARCHED))
+		shadow = centry->shadow;
+	else
+	{
+		shadow = shadow_lookup_rules(userid, queryid);
+		if (centry != NULL)
+			centry->shadow = shadow;
 	}
 
-	if (FreeFile(filep))
-		ereport(ERROR,
-			(errcode_for_file_access(),
-			 errmsg("could not close file \"%s\": %m",
-				rule_file)));
+	shadow_prohibited = shadow_prohibits(shadow, structural);
 
-	LWLockRelease(pgss->lock);
+	shadow_stat_increment(shadow_prohibited != prohibited, shadow_prohibited);
 
-	PG_RETURN_BOOL(true);
+	if (shadow_prohibited != prohibited)
+		shadow_divergence_record(userid, queryid, query, centry,
+								 shadow_prohibited);
 }
 
 /*
- * rule type can be whitelist or blacklist
+ * Drop the shadow rules and their divergences.  The backends forget the
+ * shadow verdicts they cache; the rule snapshot stays valid.
  *
+ * caller must hold an exclusive lock on pgss->lock
  */
-static bool
-pgss_restore(Oid userid, uint32 queryid, const char *query, int64 calls,
-			 int64 banned,
-			 uint32 rule_type)
+static void
+shadow_clear(void)
 {
-	pgssHashKey key = {0};
-	pgssEntry  *entry;
-	int			query_len;
-	Size		query_offset;
-	int			gc_count;
-	bool		stored;
-	int			encoding = GetDatabaseEncoding();
-	bool ret = false;
+	HASH_SEQ_STATUS hash_seq;
+	pgfwShadowRule *rule;
+	pgfwDivergence *divergence;
+
+	hash_seq_init(&hash_seq, pgfw_shadow_hash);
+	while ((rule = hash_seq_search(&hash_seq)) != NULL)
+		hash_search(pgfw_shadow_hash, &rule->key, HASH_REMOVE, NULL);
+
+	hash_seq_init(&hash_seq, pgfw_divergences);
+	while ((divergence = hash_seq_search(&hash_seq)) != NULL)
+		hash_search(pgfw_divergences, &divergence->key, HASH_REMOVE, NULL);
+
+	pgss->shadow_loaded = false;
+	pgss->shadow_rules = 0;
+	pgss->shadow_database_rules = 0;
+	pgss->rules_generation++;
+	pg_write_barrier();
+}
 
-	/*
-	 * 10 | 3294787656 | select * from k1 where uid = ?; |     2
-	 */
-	key.userid  = userid;
-	key.queryid = queryid;
-	key.type    = rule_type;
+/*
+ * Sum up the shadow counters of all backends, see stat_counter_totals().
+ */
+static void
+shadow_counter_totals(int64 *checks, int64 *rejects, int64 *allows)
+{
+	volatile pgssSharedState *s = (volatile pgssSharedState *) pgss;
+	int			nslots = backend_counter_slots();
+	int			i;
 
-	/*
-	 * Check the entry in the hash table.
-	 */
-	LWLockAcquire(pgss->lock, LW_SHARED);
+	SpinLockAcquire(&s->mutex);
+	*checks = s->shadow_checks;
+	*rejects = s->shadow_rejects;
+	*allows = s->shadow_allows;
+	SpinLockRelease(&s->mutex);
 
-	entry = (pgssEntry *) hash_search(pgss_hash, &key, HASH_FIND, NULL);
-	if (entry)
+	for (i = 0; i < nslots; i++)
 	{
-		elog(DEBUG1, "userid %d, queryid %u type %u already exists.", key.userid, key.queryid, key.type);
-		ret = true;
-		goto done;
+		volatile pgfwBackendCounters *c = &s->backend_counters[i];
+
+		*checks += c->shadow_checks;
+		*rejects += c->shadow_rejects;
+		*allows += c->shadow_allows;
 	}
+}
 
-	LWLockRelease(pgss->lock);
-	/*
-	 * Restore the entry
-	 */
-	LWLockAcquire(pgss->lock, LW_EXCLUSIVE);
+/*
+ * Start the shadow counters over, see sql_firewall_stat_reset().
+ */
+static void
+shadow_counter_reset(void)
+{
+	volatile pgssSharedState *s = (volatile pgssSharedState *) pgss;
+	int64		checks = 0;
+	int64		rejects = 0;
+	int64		allows = 0;
+	int			nslots = backend_counter_slots();
+	int			i;
 
-	query_len = strlen(query);
-	stored = qtext_store(query, query_len, &query_offset, &gc_count);
-	if (!stored)
+	for (i = 0; i < nslots; i++)
 	{
-		elog(ERROR, "Could not store a query text to the file.");
-		goto done;
+		checks += s->backend_counters[i].shadow_checks;
+		rejects += s->backend_counters[i].shadow_rejects;
+		allows += s->backend_counters[i].shadow_allows;
 	}
 
-	entry = entry_alloc(&key, query_offset, query_len, encoding, false);
-	if (!entry)
+	SpinLockAcquire(&s->mutex);
+	s->shadow_checks = -checks;
+	s->shadow_rejects = -rejects;
+	s->shadow_allows = -allows;
+	s->shadow_dropped = 0;
+	SpinLockRelease(&s->mutex);
+}
+
+/*
+ * Queue a statement for the learner.
+ *
+ * return false if the queue is full, the caller learns the statement then
+ */
+static bool
+learn_enqueue(Oid dbid, Oid userid, uint32 queryid, const char *query,
+			  int query_len, int encoding)
+{
+	volatile pgfwLearnQueue *queue = pgss->learn_queue;
+	volatile pgfwLearnRecord *rec;
+	Latch	   *latch;
+	uint64		pos;
+
+	Assert(query_len < LEARN_QUEUE_TEXT_SIZE);
+
+	SpinLockAcquire(&queue->mutex);
+	if (queue->head - queue->tail >= queue->nrecords)
 	{
-		elog(ERROR, "Could not allocate an entry in the hash table.");
-		goto done;
+		queue->overflows++;
+		SpinLockRelease(&queue->mutex);
+		return false;
 	}
+	pos = queue->head++;
+	latch = queue->latch;
+	SpinLockRelease(&queue->mutex);
 
-	entry->type = rule_type;
-
-	SpinLockAcquire(&entry->mutex);
-	entry->counters.calls  = calls;
-	entry->counters.banned = banned;
-	SpinLockRelease(&entry->mutex);
+	rec = &queue->records[pos % queue->nrecords];
+	rec->dbid = dbid;
+	rec->userid = userid;
+	rec->queryid = queryid;
+	rec->encoding = encoding;
+	rec->query_len = query_len;
+	memcpy((char *) rec->query, query, query_len);
+	rec->query[query_len] = '\0';
 
-	if (need_gc_qtexts())
-		gc_qtexts();
+	pg_write_barrier();
+	rec->ready = true;
 
-	ret = true;
+	if (latch)
+		SetLatch(latch);
 
-done:
-	LWLockRelease(pgss->lock);
-	return ret;
+	return true;
 }
 
-#define CSV_DEFAULT     1
-#define CSV_SEPARATOR   2
-#define CSV_NON_QUOTED  3
-#define CSV_QUOTED      4
-
+/*
+ * Learn the statements queued so far, LEARN_QUEUE_BATCH at a time.
+ *
+ * Only the learner calls this.  It stops at the first record a backend is
+ * still filling in; setting that one ready sets the latch again.
+ *
+ * return the number of statements ingested
+ */
 static int
-parse_csv_values(const char *buf, char **values)
+learn_queue_drain(MemoryContext batch_cxt)
 {
-	int i;
-	int cols = 1;
-	int off = 0;
-	int buflen = strlen(buf);
-	int len = 0;
-	int mode = CSV_DEFAULT;
-
-	int buf2len = 512;
-	char *buf2 = palloc(buf2len);
-	memset(buf2, 0, buf2len);
+	volatile pgfwLearnQueue *queue = pgss->learn_queue;
+	int			total = 0;
 
-	/*
-	 * the last character of the input buf is \n
-	 */
-	for (i = 0 ; i < buflen ; i++)
+	for (;;)
 	{
-		int field_end = false;
-
-		switch (buf[i])
-		{
-			case '"':
-				switch (mode)
-				{
-					case CSV_DEFAULT:
-					case CSV_SEPARATOR:
-						mode = CSV_QUOTED;
-						off++;
-						/* len should still be zero. */
-						break;
-
-					case CSV_NON_QUOTED:
-						/* it's not correct csv format, but ok. */
-						buf2[len++] = buf[i];
-						break;
-
-					case CSV_QUOTED:
-						if (i < buflen - 1 && buf[i+1] == '"')
-						{
-							/* skip next char, and continue reading */
-							i++;
-							buf2[len++] = buf[i];
-						}
-						else
-						{
-							field_end = true;
-						
-							mode = CSV_DEFAULT;
-						}
-						break;
-				}
-				break;
-
-			case '\n':
-			case ',':
-				switch (mode)
-				{
-					case CSV_DEFAULT:
-						break;
+		pgfwRuleItem items[LEARN_QUEUE_BATCH];
+		MemoryContext oldcxt;
+		uint64		tail;
+		uint64		head;
+		int			n = 0;
 
-					case CSV_SEPARATOR:
-					case CSV_NON_QUOTED:
-						/* end of the field */
-						field_end = true;
-						
-						mode = CSV_SEPARATOR;
-						break;
+		SpinLockAcquire(&queue->mutex);
+		tail = queue->tail;
+		head = queue->head;
+		SpinLockRelease(&queue->mutex);
 
-					case CSV_QUOTED:
-						buf2[len++] = buf[i];
-						break;
-				}
-				break;
+		oldcxt = MemoryContextSwitchTo(batch_cxt);
 
-			default:
-				switch (mode)
-				{
-					case CSV_DEFAULT:
-					case CSV_SEPARATOR:
-						off = i;
-						mode = CSV_NON_QUOTED;
-						break;
-				}
-				buf2[len++] = buf[i];
-				break;
-		}
-		if (field_end == true)
+		while (tail + n < head && n < LEARN_QUEUE_BATCH)
 		{
-			/* end of the field */
-			values[cols-1] = palloc(len + 1);
-			memset(values[cols-1], 0, len + 1);
-			strncpy(values[cols-1], buf2, len);
-
-			memset(buf2, 0, buf2len);
-			
-			off = i + 1;
-			len = 0;
-			cols++;
+			volatile pgfwLearnRecord *rec;
+			char	   *query;
 
-			field_end = false;
+			rec = &queue->records[(tail + n) % queue->nrecords];
+			if (!rec->ready)
+				break;
+			pg_read_barrier();
+
+			query = palloc(rec->query_len + 1);
+			memcpy(query, (char *) rec->query, rec->query_len + 1);
+
+			memset(&items[n], 0, sizeof(pgfwRuleItem));
+			items[n].dbid = rec->dbid;
+			items[n].userid = rec->userid;
+			items[n].queryid = rec->queryid;
+			items[n].type = (uint32)PGFW_WHITELIST_ENTRY;
+			items[n].query = query;
+			items[n].query_len = rec->query_len;
+			items[n].encoding = rec->encoding;
+			items[n].sticky = false;
+			items[n].learned = true;
+
+			rec->ready = false;
+			n++;
 		}
 
-		if (strlen(buf2) == buf2len - 1)
+		/* the records are copied, give them back */
+		if (n > 0)
 		{
-			buf2 = repalloc(buf2, buf2len * 2);
-			memset(buf2 + buf2len, 0, buf2len);
-			buf2len = buf2len * 2;
+			pg_memory_barrier();
+			SpinLockAcquire(&queue->mutex);
+			queue->tail += n;
+			SpinLockRelease(&queue->mutex);
+
+			store_rules(items, n, false);
+			total += n;
 		}
-	}
 
-	/*
-	 * we should not take the last two characters " \n\0" as a field
-	 */
-	if ((len > 0) && (off > 0))
-	{
-		/* end of the field */
-		values[cols-1] = palloc(len + 1);
-		memset(values[cols-1], 0, len + 1);
-		strncpy(values[cols-1], buf2, len);
+		MemoryContextSwitchTo(oldcxt);
+		MemoryContextReset(batch_cxt);
 
-		memset(buf2, 0, buf2len);
-						
-		cols++;
+		if (n < LEARN_QUEUE_BATCH)
+			break;
 	}
 
-	pfree(buf2);
-
-	return cols - 1;
+	return total;
 }
 
 /*
- * the rules file may be sourced from a human maintained file,
- * so we re calculate the query id from the query text, and
- * ignore the query id.
+ * Append a record to the rule log, if it is enabled.
  *
- *  */
-Datum
-sql_firewall_import_rule(PG_FUNCTION_ARGS)
+ * The caller must hold pgss->lock exclusively, or shared if it is the rule
+ * writer.  The record is written at once, unless rule_log_batching holds it
+ * back for rule_log_flush().  A failure is only logged: the rule change
+ * stands, though it may not survive a crash.  The change is captured for
+ * the standbys as well if rule_changes_begin() asked for it.
+ */
+static void
+rule_log_append(uint32 op, const pgssHashKey *key, const Counters *counters,
+				const char *query, int query_len, int encoding)
 {
-	char	   *rule_file = text_to_cstring(PG_GETARG_TEXT_P(0));
-	FILE *filep;
-	bool  ret = false;
-	char *buf, *line;
-	size_t buflen;
-
-	/* hash table must exist already */
-	if (!pgss || !pgss_hash)
-		ereport(ERROR,
-				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
-				 errmsg("sql_firewall must be loaded via shared_preload_libraries")));
+	pgfwRuleLogRecord rec;
 
-	if (!superuser())
-		ereport(ERROR,
-				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
-				 (errmsg("must be superuser to use sql_firewall_import_rule"))));
+	/* a change the standbys are to repeat? */
+	if (rule_changes_lxid != InvalidLocalTransactionId &&
+		rule_changes_lxid == MyProc->lxid &&
+		op != PGFW_RULE_LOG_COUNTERS)
+		rule_change_capture(op, key, query, query_len, encoding);
 
-	if (pgfw_mode != PGFW_MODE_DISABLED)
-		ereport(ERROR,
-				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
-				 errmsg("sql_firewall_import_rule() is available only under the disable mode")));
+	if (!pgfw_rule_log)
+		return;
 
+	if (rule_log_buffer.data == NULL)
 	{
-		struct stat st;
+		MemoryContext oldcxt = MemoryContextSwitchTo(TopMemoryContext);
 
-		if (stat(rule_file, &st) != 0)
-		{
-			ereport(ERROR,
-				(errmsg("could not stat file \"%s\": %m",
-					rule_file)));
-		}
-		if (!S_ISREG(st.st_mode))
-		{
-			ereport(ERROR,
-				(errmsg("\"%s\" is not a regular file",
-					rule_file)));
-		}
+		initStringInfo(&rule_log_buffer);
+		MemoryContextSwitchTo(oldcxt);
 	}
 
-	filep = AllocateFile(rule_file, PG_BINARY_R);
-	if (filep == NULL)
-		ereport(ERROR,
-			(errmsg("could not open file \"%s\": %m",
-				rule_file)));
-
-	elog(DEBUG1, "sql_firewall_import_rule: file open, %s", rule_file);
+	memset(&rec, 0, sizeof(rec));
+	rec.op = op;
+	if (key)
+	{
+		key_to_file(&rec.key, key);
+		rec.dbid = key->dbid;
+	}
+	if (counters)
+		rec.counters = *counters;
+	rec.encoding = encoding;
+	rec.query_len = query_len;
+
+	INIT_CRC32(rec.crc);
+	COMP_CRC32(rec.crc, (char *) &rec + sizeof(pg_crc32),
+			   sizeof(rec) - sizeof(pg_crc32));
+	if (query_len > 0)
+		COMP_CRC32(rec.crc, query, query_len);
+	FIN_CRC32(rec.crc);
+
+	appendBinaryStringInfo(&rule_log_buffer, (char *) &rec, sizeof(rec));
+	if (query_len > 0)
+		appendBinaryStringInfo(&rule_log_buffer, query, query_len);
+
+	if (!rule_log_batching ||
+		rule_log_buffer.len >= PGFW_RULE_LOG_BATCH_SIZE)
+		rule_log_flush();
+}
 
-	/*
-	 * 10 | 3294787656 | select * from k1 where uid = ?; |     2
-	ret = pgss_restore(10, 3294787656, "select * from k1 where uid = ?;", 7);
-	 */
+/*
+ * Write the records held back by rule_log_append() in one go, so that only
+ * the last one can be torn.
+ *
+ * The caller must hold pgss->lock as for rule_log_append().  The log stays
+ * open for the next records, until rule_log_truncate() replaces it.
+ */
+static void
+rule_log_flush(void)
+{
+	if (rule_log_buffer.len == 0)
+		return;
 
-	buflen = 256;
-	buf = palloc(buflen);
+	if (rule_log_fd >= 0 &&
+		rule_log_fd_generation != pgss->rule_log_generation)
+	{
+		close(rule_log_fd);
+		rule_log_fd = -1;
+	}
+	if (rule_log_fd < 0)
+	{
+		rule_log_fd = BasicOpenFile(PGFW_RULE_LOG_FILE,
+									O_WRONLY | O_APPEND | O_CREAT | PG_BINARY,
+									S_IRUSR | S_IWUSR);
+		rule_log_fd_generation = pgss->rule_log_generation;
+	}
 
-	line = NULL;
-	while (fgets(buf, buflen, filep) != NULL)
+	if (rule_log_fd < 0 ||
+		write(rule_log_fd, rule_log_buffer.data,
+			  rule_log_buffer.len) != rule_log_buffer.len)
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not write sql_firewall file \"%s\": %m",
+						PGFW_RULE_LOG_FILE)));
+	else
 	{
-		int len;
+		volatile pgssSharedState *s = (volatile pgssSharedState *) pgss;
 
-		/*
-		 * extend a line buffer while reading from the file.
-		 */
-		if (line == NULL)
-		{
-			line = pstrdup(buf);
-		}
-		else
-		{
-			len = strlen(line) + strlen(buf) + 1;
-			line = repalloc(line, len);
-			strncat(line, buf, len);
-		}
-		elog(DEBUG1, "line: %s", line);
+		SpinLockAcquire(&s->mutex);
+		s->rule_log_dirty = true;
+		SpinLockRelease(&s->mutex);
+	}
 
-		len = strlen(line);
-		if (line[len-1] == '\r' || line[len-1] == '\n')
-		{
-			char *values[SQL_FIREWALL_CSV_COLS];
+	resetStringInfo(&rule_log_buffer);
+}
 
-			/*
-			 * if a complete csv record found, parse it, register to the rule,
-			 * and free a memory space.
-			 */
-			if (parse_csv_values(line, values) == SQL_FIREWALL_CSV_COLS)
-			{
-				int j;
-				uint32 queryid;
-				char  *normalized_query = NULL;
-				char  *query            = NULL;
+/*
+ * Redo the rule log on top of the rules just loaded.
+ *
+ * Called by pgss_shmem_startup() only, when no other process is running.
+ * The log is kept as it is, it still applies to PGSS_STATEMENTS_FILE.
+ * A torn record at the end of the log, left by a crash, ends the replay.
+ */
+static void
+rule_log_replay(void)
+{
+	FILE	   *file;
+	pgfwRuleLogRecord rec;
+	char	   *buffer = NULL;
+	int			buffer_size = 0;
+	int			nrecords = 0;
 
+	file = AllocateFile(PGFW_RULE_LOG_FILE, PG_BINARY_R);
+	if (file == NULL)
+	{
+		if (errno != ENOENT)
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("could not read sql_firewall file \"%s\": %m",
+							PGFW_RULE_LOG_FILE)));
+		return;
+	}
 
-				elog(DEBUG1, "sql_firewall_import_rule: complete csv record. ready for parsing.");
+	while (fread(&rec, sizeof(rec), 1, file) == 1)
+	{
+		pg_crc32	crc;
+		pgssHashKey key;
+		pgssEntry  *entry;
 
-				/*
-				 * no query id generated yet, the rule's query is a plain query with constant parameter
-				 * not normalized, we calculate the query id from the plain query and normalize it.
-				 */
-				if (values[1] == NULL || strlen(values[1]) == 0)
+		if (rec.query_len < 0 || rec.query_len >= MaxAllocSize)
+			break;
+		if (rec.query_len >= buffer_size)
+		{
+			buffer_size = Max(2048, rec.query_len + 1);
+			buffer = buffer ? repalloc(buffer, buffer_size) : palloc(buffer_size);
+		}
+		if (fread(buffer, 1, rec.query_len, file) != rec.query_len)
+			break;
+		buffer[rec.query_len] = '\0';
+
+		INIT_CRC32(crc);
+		COMP_CRC32(crc, (char *) &rec + sizeof(pg_crc32),
+				   sizeof(rec) - sizeof(pg_crc32));
+		COMP_CRC32(crc, buffer, rec.query_len);
+		FIN_CRC32(crc);
+		if (!EQ_CRC32(crc, rec.crc))
+			break;
+
+		/* the log may have been written by a version with a char type */
+		key_from_file(&key, &rec.key, rec.dbid, rec.key.type > 0xff);
+
+		switch (rec.op)
+		{
+			case PGFW_RULE_LOG_ADD:
+			case PGFW_RULE_LOG_LEARN:
 				{
-					/*
-					 * calculate query id from query text
-					 */
-					queryid = sql_firewall_queryid(values[2], &normalized_query);
+					Size		query_offset;
+
+					if (!PG_VALID_BE_ENCODING(rec.encoding))
+						break;
+					if (hash_search(pgss_hash, &key, HASH_FIND, NULL))
+						break;
+					if (!qtext_store(buffer, rec.query_len, &query_offset, NULL))
+						break;
+					entry = entry_alloc(&key, NULL, query_offset,
+										rec.query_len, rec.encoding, false,
+										rec.op == PGFW_RULE_LOG_LEARN);
+					if (entry)
+						entry->type = key.type;
 				}
-				else
+				break;
+			case PGFW_RULE_LOG_DELETE:
+				entry_remove(&key);
+				break;
+			case PGFW_RULE_LOG_COUNTERS:
+				entry = hash_search(pgss_hash, &key, HASH_FIND, NULL);
+				if (entry)
 				{
-					queryid = atol(values[1]);
+					entry->counters = rec.counters;
+					entry->logged = rec.counters;
 				}
-				query   = normalized_query ? normalized_query : values[2];
-				ret = pgss_restore(atoi(values[0]),
-								   queryid,
-								   query,
-								   atol(values[3]),
-								   atol(values[4]),  /* values[4] is blacklist rule banned query times */
-								   values[5][0]);    /* values[5][0] is entry type, either whitelist or
-													  * blacklist, 'b' - blacklist, 'w' - whitelist.
-													  */
-
-				for (j = 0 ; j < SQL_FIREWALL_CSV_COLS ; j++)
+				break;
+			case PGFW_RULE_LOG_RESET:
 				{
-					elog(DEBUG1, "sql_firewall_import_rule: values[%d] = %s", j, values[j]);
-					pfree(values[j]);
-				}
+					HASH_SEQ_STATUS hash_seq;
 
-				pfree(line);
-				line = NULL;
-				if (normalized_query)
-					pfree(normalized_query);
-			}
+					hash_seq_init(&hash_seq, pgss_hash);
+					while ((entry = hash_seq_search(&hash_seq)) != NULL)
+						entry_remove(&entry->key);
+				}
+				break;
 		}
+		nrecords++;
 	}
 
-	if (line != NULL)
-		pfree(line);
-
-	if (FreeFile(filep))
-		ereport(ERROR,
-			(errcode_for_file_access(),
-			 errmsg("could not close file \"%s\": %m",
-				rule_file)));
-
-	elog(DEBUG1, "sql_firewall_import_rule: file close, %s", rule_file);
-
-	update_firewall_rule_file();
+	if (buffer)
+		pfree(buffer);
+	FreeFile(file);
 
-	PG_RETURN_BOOL(ret);
+	if (nrecords > 0)
+		ereport(LOG,
+				(errmsg("sql_firewall replayed %d records of the rule log",
+						nrecords)));
 }
 
 /*
- * Estimate shared memory space needed.
+ * Flush the rule log to disk if it was written since the last call.
  */
-static Size
-pgss_memsize(void)
+static void
+rule_log_sync(void)
 {
-	Size		size;
+	volatile pgssSharedState *s = (volatile pgssSharedState *) pgss;
+	bool		dirty;
+	int			fd;
 
-	size = MAXALIGN(sizeof(pgssSharedState));
-	size = add_size(size, hash_estimate_size(pgss_max, sizeof(pgssEntry)));
+	SpinLockAcquire(&s->mutex);
+	dirty = s->rule_log_dirty;
+	s->rule_log_dirty = false;
+	SpinLockRelease(&s->mutex);
 
-	return size;
+	if (!dirty)
+		return;
+
+	fd = OpenTransientFile(PGFW_RULE_LOG_FILE, O_RDWR | PG_BINARY, 0);
+	if (fd < 0 || pg_fsync(fd) != 0)
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not fsync sql_firewall file \"%s\": %m",
+						PGFW_RULE_LOG_FILE)));
+	if (fd >= 0)
+		CloseTransientFile(fd);
 }
 
 /*
- * Allocate a new hashtable entry.
- * caller must hold an exclusive lock on pgss->lock
- *
- * "query" need not be null-terminated; we rely on query_len instead
- *
- * If "sticky" is true, make the new entry artificially sticky so that it will
- * probably still be there when the query finishes execution.  We do this by
- * giving it a median usage value rather than the normal value.  (Strictly
- * speaking, query strings are normalized on a best effort basis, though it
- * would be difficult to demonstrate this even under artificial conditions.)
+ * Append the counters of the rules used since the last call to the rule
+ * log, in batches.
  *
- * Note: despite needing exclusive lock, it's not an error for the target
- * entry to already exist.  This is because pgss_store releases and
- * reacquires lock after failing to find a match; so someone else could
- * have made the entry while we waited to get exclusive lock.
+ * Only the rule writer calls this.
  */
-static pgssEntry *
-entry_alloc(pgssHashKey *key, Size query_offset, int query_len, int encoding,
-			bool sticky)
+static void
+rule_log_checkpoint_counters(void)
 {
+	HASH_SEQ_STATUS hash_seq;
 	pgssEntry  *entry;
-	bool		found;
 
-	/* Ignore queries which exeed the max limit of the learning table */
-	if (hash_get_num_entries(pgss_hash) >= pgss_max)
-	{
-		ereport(WARNING,(errmsg("Number of queries exceeded the <sql_firewall.max> limit.")));
-		return NULL;
-	}
+	pgfw_lock_acquire(LW_SHARED);
 
-	/* Find or create an entry with desired hash code */
-	entry = (pgssEntry *) hash_search(pgss_hash, key, HASH_ENTER, &found);
+	rule_log_batching = true;
 
-	if (!found)
+	hash_seq_init(&hash_seq, pgss_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
 	{
-		/* New entry, initialize it */
+		Counters	tmp;
+		bool		changed;
 
-		/* reset the statistics */
-		memset(&entry->counters, 0, sizeof(Counters));
-		/* re-initialize the mutex each time ... we assume no one using it */
-		SpinLockInit(&entry->mutex);
-		/* ... and don't forget the query text metadata */
-		Assert(query_len >= 0);
-		entry->query_offset = query_offset;
-		entry->query_len = query_len;
-		entry->encoding = encoding;
+		{
+			volatile pgssEntry *e = (volatile pgssEntry *) entry;
+
+			SpinLockAcquire(&e->mutex);
+			tmp = e->counters;
+			changed = (tmp.calls != e->logged.calls ||
+					   tmp.banned != e->logged.banned);
+			e->logged = tmp;
+			SpinLockRelease(&e->mutex);
+		}
+
+		if (changed)
+			rule_log_append(PGFW_RULE_LOG_COUNTERS, &entry->key, &tmp,
+							NULL, 0, 0);
 	}
 
-	return entry;
+	rule_log_batching = false;
+	rule_log_flush();
+
+	LWLockRelease(pgss->lock);
 }
 
-#ifdef NOT_USED
 /*
- * qsort comparator for sorting into increasing usage order
+ * Current size of the rule log, 0 if there is none.
  */
-static int
-entry_cmp(const void *lhs, const void *rhs)
+static off_t
+rule_log_size(void)
 {
-	double		l_usage = (*(pgssEntry *const *) lhs)->counters.usage;
-	double		r_usage = (*(pgssEntry *const *) rhs)->counters.usage;
+	struct stat st;
 
-	if (l_usage < r_usage)
-		return -1;
-	else if (l_usage > r_usage)
-		return +1;
-	else
+	if (stat(PGFW_RULE_LOG_FILE, &st) != 0)
 		return 0;
+	return st.st_size;
 }
-#endif /* NOT_USED */
 
-#ifdef NOT_USED
 /*
- * Deallocate least used entries.
- * Caller must hold an exclusive lock on pgss->lock.
+ * Drop the first "covered" bytes of the rule log, which PGSS_STATEMENTS_FILE
+ * now holds.
+ *
+ * The caller must hold pgss->lock exclusively, or be the only process.  The
+ * records appended since are copied to a new log replacing the old one, and
+ * the other processes reopen it, see rule_log_flush().  If that fails, the
+ * log is kept whole: replaying what the file already holds does no harm.
  */
 static void
-entry_dealloc(void)
+rule_log_truncate(off_t covered)
 {
-	HASH_SEQ_STATUS hash_seq;
-	pgssEntry **entries;
-	pgssEntry  *entry;
-	int			nvictims;
-	int			i;
-	Size		totlen = 0;
-
-	/*
-	 * Sort entries by usage and deallocate USAGE_DEALLOC_PERCENT of them.
-	 * While we're scanning the table, apply the decay factor to the usage
-	 * values.
-	 */
-
-	entries = palloc(hash_get_num_entries(pgss_hash) * sizeof(pgssEntry *));
+	int			src = -1;
+	int			dst = -1;
+	char	   *buffer = NULL;
+	int			nread;
 
-	i = 0;
-	hash_seq_init(&hash_seq, pgss_hash);
-	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	/* even when disabled, as a log left over would be replayed */
+	if (rule_log_size() <= covered)
 	{
-		entries[i++] = entry;
-		/* "Sticky" entries get a different usage decay rate. */
-		if (entry->counters.calls == 0)
-			entry->counters.usage *= STICKY_DECREASE_FACTOR;
-		else
-			entry->counters.usage *= USAGE_DECREASE_FACTOR;
-		/* Accumulate total size, too. */
-		totlen += entry->query_len + 1;
+		if (truncate(PGFW_RULE_LOG_FILE, 0) != 0 && errno != ENOENT)
+			ereport(LOG,
+					(errcode_for_file_access(),
+				   errmsg("could not truncate sql_firewall file \"%s\": %m",
+						  PGFW_RULE_LOG_FILE)));
+		return;
 	}
 
-	qsort(entries, i, sizeof(pgssEntry *), entry_cmp);
+	src = OpenTransientFile(PGFW_RULE_LOG_FILE, O_RDONLY | PG_BINARY, 0);
+	dst = OpenTransientFile(PGFW_RULE_LOG_FILE ".tmp",
+							O_WRONLY | O_CREAT | O_TRUNC | PG_BINARY,
+							S_IRUSR | S_IWUSR);
+	if (src < 0 || dst < 0 || lseek(src, covered, SEEK_SET) != covered)
+		goto error;
 
-	if (i > 0)
+	buffer = palloc(BLCKSZ);
+	while ((nread = read(src, buffer, BLCKSZ)) > 0)
 	{
-		/* Record the (approximate) median usage */
-		pgss->cur_median_usage = entries[i / 2]->counters.usage;
-		/* Record the mean query length */
-		pgss->mean_query_len = totlen / i;
+		if (write(dst, buffer, nread) != nread)
+			goto error;
 	}
+	if (nread < 0 || pg_fsync(dst) != 0)
+		goto error;
 
-	nvictims = Max(10, i * USAGE_DEALLOC_PERCENT / 100);
-	nvictims = Min(nvictims, i);
-
-	for (i = 0; i < nvictims; i++)
+	CloseTransientFile(src);
+	src = -1;
+	if (CloseTransientFile(dst) != 0)
 	{
-		hash_search(pgss_hash, &entries[i]->key, HASH_REMOVE, NULL);
+		dst = -1;
+		goto error;
 	}
+	dst = -1;
 
-	pfree(entries);
+	if (rename(PGFW_RULE_LOG_FILE ".tmp", PGFW_RULE_LOG_FILE) != 0)
+		goto error;
+	fsync_fname(PGSTAT_STAT_PERMANENT_DIRECTORY, true);
+	pgss->rule_log_generation++;
+
+	pfree(buffer);
+	return;
+
+error:
+	ereport(LOG,
+			(errcode_for_file_access(),
+			 errmsg("could not truncate sql_firewall file \"%s\": %m",
+					PGFW_RULE_LOG_FILE)));
+	if (src >= 0)
+		CloseTransientFile(src);
+	if (dst >= 0)
+		CloseTransientFile(dst);
+	if (buffer)
+		pfree(buffer);
+	unlink(PGFW_RULE_LOG_FILE ".tmp");
 }
-#endif /* NOT_USED */
 
 /*
- * Given a null-terminated string, allocate a new entry in the external query
- * text file and store the string there.
- *
- * Although we could compute the string length via strlen(), callers already
- * have it handy, so we require them to pass it too.
- *
- * If successful, returns true, and stores the new entry's offset in the file
- * into *query_offset.  Also, if gc_count isn't NULL, *gc_count is set to the
- * number of garbage collections that have occurred so far.
- *
- * On failure, returns false.
+ * Write all the rules to PGSS_STATEMENTS_FILE and drop the part of the rule
+ * log it covers.
  *
- * At least a shared lock on pgss->lock must be held by the caller, so as
- * to prevent a concurrent garbage collection.  Share-lock-holding callers
- * should pass a gc_count pointer to obtain the number of garbage collections,
- * so that they can recheck the count after obtaining exclusive lock to
- * detect whether a garbage collection occurred (and removed this entry).
+ * The rules are copied under a brief exclusive lock, which also keeps the
+ * log from growing meanwhile, and the file is written and synced without
+ * it; only the log records appended in between are kept.  The rule writer,
+ * sql_firewall_reset() and the imports may all get here at once:
+ * checkpoint_lock makes one at a time the writer of the temporary file.
+ * The statements checked against the rule snapshot don't wait for it.
  */
-static bool
-qtext_store(const char *query, int query_len,
-			Size *query_offset, int *gc_count)
+static void
+checkpoint_rule_file(void)
 {
-	Size		off;
-	int			fd;
+	pgfwRuleImageCopy copy;
 
-	/*
-	 * We use a spinlock to protect extent/n_writers/gc_count, so that
-	 * multiple processes may execute this function concurrently.
-	 */
-	{
-		volatile pgssSharedState *s = (volatile pgssSharedState *) pgss;
-
-		SpinLockAcquire(&s->mutex);
-		off = s->extent;
-		s->extent += query_len + 1;
-		s->n_writers++;
-		if (gc_count)
-			*gc_count = s->gc_count;
-		SpinLockRelease(&s->mutex);
-	}
+	/* add what we counted to the entries before they are written */
+	local_cache_flush_counters();
 
-	*query_offset = off;
+	LWLockAcquire(pgss->checkpoint_lock, LW_EXCLUSIVE);
 
-	/* Now write the data into the successfully-reserved part of the file */
-	fd = OpenTransientFile(PGSS_STATEMENTS_TEMP_FILE, O_RDWR | O_CREAT | PG_BINARY,
-						   S_IRUSR | S_IWUSR);
-	if (fd < 0)
-		goto error;
+	pgfw_lock_acquire(LW_EXCLUSIVE);
+	rule_image_copy(&copy);
+	LWLockRelease(pgss->lock);
 
-	if (lseek(fd, off, SEEK_SET) != off)
-		goto error;
+	if (rule_image_write(&copy, true))
+	{
+		pgfw_lock_acquire(LW_EXCLUSIVE);
+		rule_log_truncate(copy.log_size);
+		LWLockRelease(pgss->lock);
+	}
 
-	if (write(fd, query, query_len + 1) != query_len + 1)
-		goto error;
+	pfree(copy.rules);
+	pfree(copy.query_offsets);
 
-	CloseTransientFile(fd);
+	LWLockRelease(pgss->checkpoint_lock);
+}
 
-	/* Mark our write complete */
-	{
-		volatile pgssSharedState *s = (volatile pgssSharedState *) pgss;
+/*
+ * Signal handlers of the background workers
+ */
+static void
+worker_sighup(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
 
-		SpinLockAcquire(&s->mutex);
-		s->n_writers--;
-		SpinLockRelease(&s->mutex);
-	}
+	worker_got_sighup = true;
+	SetLatch(&MyProc->procLatch);
 
-	return true;
+	errno = save_errno;
+}
 
-error:
-	ereport(LOG,
-			(errcode_for_file_access(),
-			 errmsg("could not write sql_firewall file \"%s\": %m",
-					PGSS_STATEMENTS_TEMP_FILE)));
+static void
+worker_sigterm(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
 
-	if (fd >= 0)
-		CloseTransientFile(fd);
+	worker_got_sigterm = true;
+	SetLatch(&MyProc->procLatch);
 
-	/* Mark our write complete */
+	errno = save_errno;
+}
+
+/*
+ * Main entry point of the learner background worker: ingest the statements
+ * queued by the backends in the learning mode.
+ */
+void
+sql_firewall_learner_main(Datum main_arg)
+{
+	volatile pgfwLearnQueue *queue;
+	MemoryContext batch_cxt;
+
+	pqsignal(SIGHUP, worker_sighup);
+	pqsignal(SIGTERM, worker_sigterm);
+	BackgroundWorkerUnblockSignals();
+
+	if (!pgss || !pgss->learn_queue)
+		proc_exit(0);
+	queue = pgss->learn_queue;
+
+	batch_cxt = AllocSetContextCreate(TopMemoryContext,
+									  "sql_firewall learner",
+									  ALLOCSET_DEFAULT_MINSIZE,
+									  ALLOCSET_DEFAULT_INITSIZE,
+									  ALLOCSET_DEFAULT_MAXSIZE);
+
+	SpinLockAcquire(&queue->mutex);
+	queue->latch = &MyProc->procLatch;
+	SpinLockRelease(&queue->mutex);
+
+	while (!worker_got_sigterm)
 	{
-		volatile pgssSharedState *s = (volatile pgssSharedState *) pgss;
+		int			rc;
 
-		SpinLockAcquire(&s->mutex);
-		s->n_writers--;
-		SpinLockRelease(&s->mutex);
+		ResetLatch(&MyProc->procLatch);
+
+		if (worker_got_sighup)
+		{
+			worker_got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		if (learn_queue_drain(batch_cxt) > 0)
+			continue;
+
+		rc = WaitLatch(&MyProc->procLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   1000L);
+
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
 	}
 
-	return false;
+	SpinLockAcquire(&queue->mutex);
+	queue->latch = NULL;
+	SpinLockRelease(&queue->mutex);
+
+	proc_exit(0);
 }
 
 /*
- * Read the external query text file into a malloc'd buffer.
- *
- * Returns NULL (without throwing an error) if unable to read, eg
- * file not there or insufficient memory.
- *
- * On success, the buffer size is also returned into *buffer_size.
- *
- * This can be called without any lock on pgss->lock, but in that case
- * the caller is responsible for verifying that the result is sane.
+ * Main entry point of the rule writer background worker: fsync the rule log
+ * every sql_firewall.rule_log_sync_delay, append the counters to it every
+ * minute, and fold it into PGSS_STATEMENTS_FILE once it has grown.
  */
-static char *
-qtext_load_file(Size *buffer_size)
+void
+sql_firewall_rule_writer_main(Datum main_arg)
 {
-	char	   *buf;
-	int			fd;
-	struct stat stat;
+	TimestampTz last_checkpoint;
 
-	fd = OpenTransientFile(PGSS_STATEMENTS_TEMP_FILE, O_RDONLY | PG_BINARY, 0);
-	if (fd < 0)
-	{
-		if (errno != ENOENT)
-			ereport(LOG,
-					(errcode_for_file_access(),
-				   errmsg("could not read sql_firewall file \"%s\": %m",
-						  PGSS_STATEMENTS_TEMP_FILE)));
-		return NULL;
-	}
+	pqsignal(SIGHUP, worker_sighup);
+	pqsignal(SIGTERM, worker_sigterm);
+	BackgroundWorkerUnblockSignals();
 
-	/* Get file length */
-	if (fstat(fd, &stat))
-	{
-		ereport(LOG,
-				(errcode_for_file_access(),
-				 errmsg("could not stat sql_firewall file \"%s\": %m",
-						PGSS_STATEMENTS_TEMP_FILE)));
-		CloseTransientFile(fd);
-		return NULL;
-	}
+	if (!pgss || !pgss_hash)
+		proc_exit(0);
 
-	/* Allocate buffer; beware that off_t might be wider than size_t */
-	if (stat.st_size <= MaxAllocSize)
-		buf = (char *) malloc(stat.st_size);
-	else
-		buf = NULL;
-	if (buf == NULL)
-	{
-		ereport(LOG,
-				(errcode(ERRCODE_OUT_OF_MEMORY),
-				 errmsg("out of memory")));
-		CloseTransientFile(fd);
-		return NULL;
-	}
+	last_checkpoint = GetCurrentTimestamp();
 
-	/*
-	 * OK, slurp in the file.  If we get a short read and errno doesn't get
-	 * set, the reason is probably that garbage collection truncated the file
-	 * since we did the fstat(), so we don't log a complaint --- but we don't
-	 * return the data, either, since it's most likely corrupt due to
-	 * concurrent writes from garbage collection.
-	 */
-	errno = 0;
-	if (read(fd, buf, stat.st_size) != stat.st_size)
+	while (!worker_got_sigterm)
 	{
-		if (errno)
-			ereport(LOG,
-					(errcode_for_file_access(),
-				   errmsg("could not read sql_firewall file \"%s\": %m",
-						  PGSS_STATEMENTS_TEMP_FILE)));
-		free(buf);
-		CloseTransientFile(fd);
-		return NULL;
+		TimestampTz now;
+		int			rc;
+
+		ResetLatch(&MyProc->procLatch);
+
+		if (worker_got_sighup)
+		{
+			worker_got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		now = GetCurrentTimestamp();
+		if (TimestampDifferenceExceeds(last_checkpoint, now,
+									   PGFW_RULE_LOG_CHECKPOINT_MS))
+		{
+			rule_log_checkpoint_counters();
+			last_checkpoint = now;
+		}
+
+		if (rule_log_size() >= PGFW_RULE_LOG_COMPACT_SIZE)
+			checkpoint_rule_file();
+
+		rule_log_sync();
+
+		rc = WaitLatch(&MyProc->procLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   pgfw_rule_log_sync_delay);
+
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
 	}
 
-	CloseTransientFile(fd);
+	rule_log_sync();
 
-	*buffer_size = stat.st_size;
-	return buf;
+	proc_exit(0);
 }
 
 /*
- * Locate a query text in the file image previously read by qtext_load_file().
+ * Capture the rule changes about to be made by a rule function of the
+ * current transaction, for rule_changes_enqueue() to queue as it commits.
+ * Nothing is captured on a standby, or if sql_firewall.replicate_rules is
+ * off.
  *
- * We validate the given offset/length, and return NULL if bogus.  Otherwise,
- * the result points to a null-terminated string within the buffer.
+ * The rules may be changed from any database: the rule publisher records
+ * the changes in sql_firewall.replication_database, which the rule
+ * replayers of the standbys read.  The transactions changing the rules take
+ * a lock of no database until they end, so that they go one after the
+ * other and queue their changes in the order they made them, which is the
+ * one the standbys apply them in.  Should the transaction abort, the
+ * changes are undone and not queued, see rule_changes_xact_callback(): the
+ * rules of the primary are then those the standbys see.
  */
-static char *
-qtext_fetch(Size query_offset, int query_len,
-			char *buffer, Size buffer_size)
+static void
+rule_changes_begin(void)
 {
-	/* File read failed? */
-	if (buffer == NULL)
-		return NULL;
-	/* Bogus offset/length? */
-	if (query_len < 0 ||
-		query_offset + query_len >= buffer_size)
-		return NULL;
-	/* As a further sanity check, make sure there's a trailing null */
-	if (buffer[query_offset + query_len] != '\0')
-		return NULL;
-	/* Looks OK */
-	return buffer + query_offset;
+	static bool callbacks_registered = false;
+	LOCKTAG		tag;
+
+	rule_changes_lxid = InvalidLocalTransactionId;
+
+	if (!pgfw_replicate_rules || RecoveryInProgress())
+		return;
+
+	if (!callbacks_registered)
+	{
+		RegisterXactCallback(rule_changes_xact_callback, NULL);
+		RegisterSubXactCallback(rule_changes_subxact_callback, NULL);
+		callbacks_registered = true;
+	}
+
+	/* unlike those of pg_advisory_lock(), the lock is of no database */
+	SET_LOCKTAG_ADVISORY(tag, InvalidOid, 0, RULE_CHANGES_LOCK_KEY, 1);
+	(void) LockAcquire(&tag, ExclusiveLock, false, false);
+
+	rule_changes_lxid = MyProc->lxid;
+	rule_changes_subid = GetCurrentSubTransactionId();
 }
 
 /*
- * Do we need to garbage-collect the external query text file?
+ * Remember a rule change for rule_changes_enqueue(), and how to undo the
+ * creation of a rule.  The removals are saved by entry_remove().
  *
- * Caller should hold at least a shared lock on pgss->lock.
+ * Called by rule_log_append() with pgss->lock held.  The change lives in
+ * TopTransactionContext, and is forgotten with the transaction.
  */
-static bool
-need_gc_qtexts(void)
+static void
+rule_change_capture(uint32 op, const pgssHashKey *key, const char *query,
+					int query_len, int encoding)
 {
-	Size		extent;
+	MemoryContext oldcxt;
+	pgfwRuleChange *change;
 
-	/* Read shared extent pointer */
+	oldcxt = MemoryContextSwitchTo(TopTransactionContext);
+
+	change = (pgfwRuleChange *) palloc0(sizeof(pgfwRuleChange));
+	change->op = op;
+	if (key)
+		change->key = *key;
+	change->encoding = encoding;
+	if (query)
+		change->query = pnstrdup(query, query_len);
+	change->query_len = query_len;
+	change->subid = GetCurrentSubTransactionId();
+
+	rule_changes = lappend(rule_changes, change);
+	rule_changes_size += RULE_CHANGE_SIZE(query ? query_len : 0);
+
+	if (op == PGFW_RULE_LOG_ADD || op == PGFW_RULE_LOG_LEARN)
 	{
-		volatile pgssSharedState *s = (volatile pgssSharedState *) pgss;
+		pgfwRuleUndo *undo = (pgfwRuleUndo *) palloc0(sizeof(pgfwRuleUndo));
 
-		SpinLockAcquire(&s->mutex);
-		extent = s->extent;
-		SpinLockRelease(&s->mutex);
+		undo->recreate = false;
+		undo->key = *key;
+		undo->subid = GetCurrentSubTransactionId();
+		rule_undo = lcons(undo, rule_undo);
 	}
 
-	/* Don't proceed if file does not exceed 512 bytes per possible entry */
-	if (extent < 512 * pgss_max)
-		return false;
+	MemoryContextSwitchTo(oldcxt);
+}
 
-	/*
-	 * Don't proceed if file is less than about 50% bloat.  Nothing can or
-	 * should be done in the event of unusually large query texts accounting
-	 * for file's large size.  We go to the trouble of maintaining the mean
-	 * query length in order to prevent garbage collection from thrashing
-	 * uselessly.
-	 */
-	if (extent < pgss->mean_query_len * pgss_max * 2)
-		return false;
+/*
+ * Remember how to create again a rule about to be removed by a change
+ * captured for the standbys, see rule_change_capture().
+ *
+ * Caller must hold an exclusive lock on pgss->lock.  A rule whose text
+ * can't be read any more isn't saved: it wouldn't be created again anyway.
+ */
+static void
+rule_change_save_removed(const pgssEntry *entry)
+{
+	volatile pgssEntry *e = (volatile pgssEntry *) entry;
+	MemoryContext oldcxt;
+	pgfwRuleUndo *undo;
+	char	   *qstr;
+	int			fd = -1;
 
-	return true;
+	oldcxt = MemoryContextSwitchTo(TopTransactionContext);
+
+	qstr = qtext_read(entry->query_offset, entry->query_len, &fd);
+	if (fd >= 0)
+		CloseTransientFile(fd);
+
+	if (qstr != NULL)
+	{
+		undo = (pgfwRuleUndo *) palloc0(sizeof(pgfwRuleUndo));
+		undo->recreate = true;
+		undo->key = entry->key;
+		undo->rule.dbid = entry->key.dbid;
+		undo->rule.userid = entry->key.userid;
+		undo->rule.queryid = entry->key.queryid;
+		undo->rule.type = entry->type;
+		undo->rule.query = qstr;
+		undo->rule.query_len = entry->query_len;
+		undo->rule.encoding = entry->encoding;
+		undo->rule.learned = entry->learned;
+
+		SpinLockAcquire(&e->mutex);
+		undo->rule.counters = e->counters;
+		SpinLockRelease(&e->mutex);
+
+		undo->subid = GetCurrentSubTransactionId();
+		rule_undo = lcons(undo, rule_undo);
+	}
+
+	MemoryContextSwitchTo(oldcxt);
 }
 
 /*
- * Garbage-collect orphaned query texts in external file.
- *
- * This won't be called often in the typical case, since it's likely that
- * there won't be too much churn, and besides, a similar compaction process
- * occurs when serializing to disk at shutdown or as part of resetting.
- * Despite this, it seems prudent to plan for the edge case where the file
- * becomes unreasonably large, with no other method of compaction likely to
- * occur in the foreseeable future.
+ * Undo the rule changes of the subtransaction subid and of its committed
+ * children, or of the whole transaction if subid is InvalidSubTransactionId,
+ * the latest first.
  *
- * The caller must hold an exclusive lock on pgss->lock.
+ * Called while the (sub)transaction aborts, so nothing is captured any
+ * more: the rules created again or removed are only recorded in the rule
+ * log, and a rule which can't be created again is warned about.
  */
 static void
-gc_qtexts(void)
+rule_changes_undo(SubTransactionId subid)
 {
-	char	   *qbuffer;
-	Size		qbuffer_size;
-	FILE	   *qfile;
-	HASH_SEQ_STATUS hash_seq;
-	pgssEntry  *entry;
-	Size		extent;
-	int			nentries;
+	MemoryContext oldcxt;
+	List	   *kept = NIL;
+	ListCell   *lc;
 
-	/*
-	 * When called from pgss_store, some other session might have proceeded
-	 * with garbage collection in the no-lock-held interim of lock strength
-	 * escalation.  Check once more that this is actually necessary.
-	 */
-	if (!need_gc_qtexts())
-		return;
+	/* the rule function capturing the changes has failed, if any */
+	if (subid == InvalidSubTransactionId || subid == rule_changes_subid)
+		rule_changes_lxid = InvalidLocalTransactionId;
 
-	/*
-	 * Load the old texts file.  If we fail (out of memory, for instance) just
-	 * skip the garbage collection.
-	 */
-	qbuffer = qtext_load_file(&qbuffer_size);
-	if (qbuffer == NULL)
+	/* the standbys never see the changes undone */
+	rule_changes_forget(subid);
+
+	if (rule_undo == NIL || !pgss || !pgss_hash)
 		return;
 
-	/*
-	 * We overwrite the query texts file in place, so as to reduce the risk of
-	 * an out-of-disk-space failure.  Since the file is guaranteed not to get
-	 * larger, this should always work on traditional filesystems; though we
-	 * could still lose on copy-on-write filesystems.
-	 */
-	qfile = AllocateFile(PGSS_STATEMENTS_TEMP_FILE, PG_BINARY_W);
-	if (qfile == NULL)
-	{
-		ereport(LOG,
-				(errcode_for_file_access(),
-				 errmsg("could not write sql_firewall file \"%s\": %m",
-						PGSS_STATEMENTS_TEMP_FILE)));
-		goto gc_fail;
-	}
+	oldcxt = MemoryContextSwitchTo(TopTransactionContext);
 
-	extent = 0;
-	nentries = 0;
+	/* add what we counted to the entries before they go away */
+	local_cache_flush_counters();
 
-	hash_seq_init(&hash_seq, pgss_hash);
-	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	foreach(lc, rule_undo)
 	{
-		int			query_len = entry->query_len;
-		char	   *qry = qtext_fetch(entry->query_offset,
-									  query_len,
-									  qbuffer,
-									  qbuffer_size);
+		pgfwRuleUndo *undo = (pgfwRuleUndo *) lfirst(lc);
 
-		if (qry == NULL)
+		if (subid != InvalidSubTransactionId && undo->subid != subid)
 		{
-			/* Trouble ... drop the text */
-			entry->query_offset = 0;
-			entry->query_len = -1;
+			kept = lappend(kept, undo);
 			continue;
 		}
 
-		if (fwrite(qry, 1, query_len + 1, qfile) != query_len + 1)
+		if (undo->recreate)
 		{
-			ereport(LOG,
-					(errcode_for_file_access(),
-				  errmsg("could not write sql_firewall file \"%s\": %m",
-						 PGSS_STATEMENTS_TEMP_FILE)));
-			hash_seq_term(&hash_seq);
-			goto gc_fail;
+			if (store_rules(&undo->rule, 1, false) == 0)
+				ereport(WARNING,
+						(errmsg("sql_firewall could not restore the rule of query id %u",
+								undo->key.queryid)));
+			continue;
 		}
 
-		entry->query_offset = extent;
-		extent += query_len + 1;
-		nentries++;
+		pgfw_lock_acquire(LW_EXCLUSIVE);
+		if (entry_remove(&undo->key))
+		{
+			invalidate_rule_snapshot();
+			rule_log_append(PGFW_RULE_LOG_DELETE, &undo->key, NULL, NULL, 0, 0);
+		}
+		LWLockRelease(pgss->lock);
 	}
 
-	/*
-	 * Truncate away any now-unused space.  If this fails for some odd reason,
-	 * we log it, but there's no need to fail.
-	 */
-	if (ftruncate(fileno(qfile), extent) != 0)
-		ereport(LOG,
-				(errcode_for_file_access(),
-			   errmsg("could not truncate sql_firewall file \"%s\": %m",
-					  PGSS_STATEMENTS_TEMP_FILE)));
+	rule_undo = kept;
 
-	if (FreeFile(qfile))
+	MemoryContextSwitchTo(oldcxt);
+}
+
+/*
+ * Transaction callback: queue the rule changes of a committed transaction,
+ * undo those of an aborted one.
+ *
+ * The room for the changes in the queue is waited for before the commit,
+ * which can still fail then, and they are queued once it is done, still
+ * under the lock taken by rule_changes_begin().  A prepared transaction
+ * can't change the rules, as whether it will be committed is not known.
+ */
+static void
+rule_changes_xact_callback(XactEvent event, void *arg)
+{
+	switch (event)
 	{
-		ereport(LOG,
-				(errcode_for_file_access(),
-				 errmsg("could not write sql_firewall file \"%s\": %m",
-						PGSS_STATEMENTS_TEMP_FILE)));
-		qfile = NULL;
-		goto gc_fail;
+		case XACT_EVENT_PRE_PREPARE:
+			if (rule_undo != NIL || rule_changes != NIL)
+				ereport(ERROR,
+						(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						 errmsg("cannot PREPARE a transaction that has changed sql_firewall rules")));
+			return;
+		case XACT_EVENT_PRE_COMMIT:
+			rule_changes_wait();
+			return;
+		case XACT_EVENT_COMMIT:
+			rule_changes_enqueue();
+			break;
+		case XACT_EVENT_ABORT:
+			rule_changes_undo(InvalidSubTransactionId);
+			break;
+		case XACT_EVENT_PREPARE:
+			break;
+		default:
+			return;
 	}
 
-	elog(DEBUG1, "pgss gc of queries file shrunk size from %zu to %zu",
-		 pgss->extent, extent);
-
-	/* Reset the shared extent pointer */
-	pgss->extent = extent;
-
-	/*
-	 * Also update the mean query length, to be sure that need_gc_qtexts()
-	 * won't still think we have a problem.
-	 */
-	if (nentries > 0)
-		pgss->mean_query_len = extent / nentries;
-	else
-		pgss->mean_query_len = ASSUMED_LENGTH_INIT;
-
-	free(qbuffer);
+	rule_undo = NIL;
+	rule_changes = NIL;
+	rule_changes_size = 0;
+	rule_changes_lxid = InvalidLocalTransactionId;
+}
 
-	/*
-	 * OK, count a garbage collection cycle.  (Note: even though we have
-	 * exclusive lock on pgss->lock, we must take pgss->mutex for this, since
-	 * other processes may examine gc_count while holding only the mutex.
-	 * Also, we have to advance the count *after* we've rewritten the file,
-	 * else other processes might not realize they read a stale file.)
-	 */
-	record_gc_qtexts();
+/*
+ * Subtransaction callback: undo the rule changes of an aborted
+ * subtransaction, hand those of a committed one over to its parent.
+ */
+static void
+rule_changes_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+							  SubTransactionId parentSubid, void *arg)
+{
+	ListCell   *lc;
 
-	return;
+	switch (event)
+	{
+		case SUBXACT_EVENT_COMMIT_SUB:
+			if (rule_changes_subid == mySubid)
+				rule_changes_subid = parentSubid;
+			foreach(lc, rule_undo)
+			{
+				pgfwRuleUndo *undo = (pgfwRuleUndo *) lfirst(lc);
 
-gc_fail:
-	/* clean up resources */
-	if (qfile)
-		FreeFile(qfile);
-	if (qbuffer)
-		free(qbuffer);
+				if (undo->subid == mySubid)
+					undo->subid = parentSubid;
+			}
+			foreach(lc, rule_changes)
+			{
+				pgfwRuleChange *change = (pgfwRuleChange *) lfirst(lc);
 
-	/*
-	 * Since the contents of the external file are now uncertain, mark all
-	 * hashtable entries as having invalid texts.
-	 */
-	hash_seq_init(&hash_seq, pgss_hash);
-	while ((entry = hash_seq_search(&hash_seq)) != NULL)
-	{
-		entry->query_offset = 0;
-		entry->query_len = -1;
+				if (change->subid == mySubid)
+					change->subid = parentSubid;
+			}
+			break;
+		case SUBXACT_EVENT_ABORT_SUB:
+			rule_changes_undo(mySubid);
+			break;
+		default:
+			break;
 	}
-
-	/* Seems like a good idea to bump the GC count even though we failed */
-	record_gc_qtexts();
 }
 
 /*
- * Release all entries.
+ * End the capture of the rule changes begun by rule_changes_begin().
+ *
+ * The changes are queued as the transaction commits, when it can't fail
+ * any more: a transaction whose changes could never fit in the queue fails
+ * here instead.
  */
 static void
-entry_reset(void)
+rule_changes_end(void)
 {
-	HASH_SEQ_STATUS hash_seq;
-	pgssEntry  *entry;
-	FILE	   *qfile;
+	if (rule_changes_lxid == InvalidLocalTransactionId ||
+		rule_changes_lxid != MyProc->lxid)
+		return;
+	rule_changes_lxid = InvalidLocalTransactionId;
 
-	LWLockAcquire(pgss->lock, LW_EXCLUSIVE);
+	if (rule_changes_size > pgss->rule_change_queue->size)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("sql_firewall rule changes of this transaction do not fit in sql_firewall.replication_queue_size"),
+				 errhint("Change fewer rules per transaction, or raise sql_firewall.replication_queue_size.")));
+}
 
-	hash_seq_init(&hash_seq, pgss_hash);
-	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+/*
+ * Forget the rule changes captured by the subtransaction subid and its
+ * committed children, or by the whole transaction if subid is
+ * InvalidSubTransactionId, so that they are not queued.
+ */
+static void
+rule_changes_forget(SubTransactionId subid)
+{
+	MemoryContext oldcxt;
+	List	   *kept = NIL;
+	ListCell   *lc;
+
+	if (subid == InvalidSubTransactionId)
 	{
-		hash_search(pgss_hash, &entry->key, HASH_REMOVE, NULL);
+		rule_changes = NIL;
+		rule_changes_size = 0;
+		return;
 	}
 
-	/*
-	 * Write new empty query file, perhaps even creating a new one to recover
-	 * if the file was missing.
-	 */
-	qfile = AllocateFile(PGSS_STATEMENTS_TEMP_FILE, PG_BINARY_W);
-	if (qfile == NULL)
+	oldcxt = MemoryContextSwitchTo(TopTransactionContext);
+
+	rule_changes_size = 0;
+	foreach(lc, rule_changes)
 	{
-		ereport(LOG,
-				(errcode_for_file_access(),
-				 errmsg("could not create sql_firewall file \"%s\": %m",
-						PGSS_STATEMENTS_TEMP_FILE)));
-		goto done;
+		pgfwRuleChange *change = (pgfwRuleChange *) lfirst(lc);
+
+		if (change->subid == subid)
+			continue;
+		kept = lappend(kept, change);
+		rule_changes_size += RULE_CHANGE_SIZE(change->query ?
+											  change->query_len : 0);
 	}
+	rule_changes = kept;
 
-	/* If ftruncate fails, log it, but it's not a fatal problem */
-	if (ftruncate(fileno(qfile), 0) != 0)
-		ereport(LOG,
-				(errcode_for_file_access(),
-			   errmsg("could not truncate sql_firewall file \"%s\": %m",
-					  PGSS_STATEMENTS_TEMP_FILE)));
+	MemoryContextSwitchTo(oldcxt);
+}
 
-	FreeFile(qfile);
+/*
+ * Size of the rule change queue in shared memory.
+ */
+static Size
+rule_change_queue_size(void)
+{
+	return add_size(offsetof(pgfwRuleChangeQueue, data),
+					mul_size(pgfw_replication_queue_size, 1024));
+}
 
-done:
-	pgss->extent = 0;
-	/* This counts as a query text garbage collection for our purposes */
-	record_gc_qtexts();
+/*
+ * Copy len bytes to the ring of the queue at position pos, or from it,
+ * wrapping around its end.
+ */
+static void
+rule_change_queue_copy(pgfwRuleChangeQueue *queue, uint64 pos, char *buffer,
+					   Size len, bool write)
+{
+	while (len > 0)
+	{
+		Size		offset = pos % queue->size;
+		Size		chunk = Min(len, queue->size - offset);
 
-	LWLockRelease(pgss->lock);
+		if (write)
+			memcpy(queue->data + offset, buffer, chunk);
+		else
+			memcpy(buffer, queue->data + offset, chunk);
+		pos += chunk;
+		buffer += chunk;
+		len -= chunk;
+	}
 }
 
 /*
- * AppendJumble: Append a value that is substantive in a given query to
- * the current jumble.
+ * Wait until the rule changes of the committing transaction fit in the
+ * queue, as the publisher records those queued before.  Only the
+ * transaction holding the lock of rule_changes_begin() queues anything, so
+ * the room stays until it commits.  The wait can be canceled, which aborts
+ * the transaction.
  */
 static void
-AppendJumble(pgssJumbleState *jstate, const unsigned char *item, Size size)
+rule_changes_wait(void)
 {
-	unsigned char *jumble = jstate->jumble;
-	Size		jumble_len = jstate->jumble_len;
+	volatile pgfwRuleChangeQueue *queue;
 
-	/*
-	 * Whenever the jumble buffer is full, we hash the current contents and
-	 * reset the buffer to contain just that hash value, thus relying on the
-	 * hash to summarize everything so far.
-	 */
-	while (size > 0)
+	if (rule_changes == NIL || !pgss || !pgss->rule_change_queue)
+		return;
+	queue = pgss->rule_change_queue;
+
+	for (;;)
 	{
-		Size		part_size;
+		uint64		used;
 
-		if (jumble_len >= JUMBLE_SIZE)
-		{
-			uint32		start_hash = hash_any(jumble, JUMBLE_SIZE);
+		SpinLockAcquire(&queue->mutex);
+		used = queue->head - queue->tail;
+		SpinLockRelease(&queue->mutex);
 
-			memcpy(jumble, &start_hash, sizeof(start_hash));
-			jumble_len = sizeof(start_hash);
-		}
-		part_size = Min(size, JUMBLE_SIZE - jumble_len);
-		memcpy(jumble + jumble_len, item, part_size);
-		jumble_len += part_size;
-		item += part_size;
-		size -= part_size;
+		if (queue->size - used >= rule_changes_size)
+			break;
+
+		WaitLatch(&MyProc->procLatch, WL_LATCH_SET | WL_TIMEOUT,
+				  pgfw_replication_naptime);
+		ResetLatch(&MyProc->procLatch);
+
+		CHECK_FOR_INTERRUPTS();
 	}
-	jstate->jumble_len = jumble_len;
 }
 
 /*
- * Wrappers around AppendJumble to encapsulate details of serialization
- * of individual local variable elements.
+ * Queue the rule changes of the transaction which has just committed, and
+ * wake up the publisher.  The room was made by rule_changes_wait().
  */
-#define APP_JUMB(item) \
-	AppendJumble(jstate, (const unsigned char *) &(item), sizeof(item))
-#define APP_JUMB_STRING(str) \
-	AppendJumble(jstate, (const unsigned char *) (str), strlen(str) + 1)
+static void
+rule_changes_enqueue(void)
+{
+	pgfwRuleChangeQueue *queue;
+	volatile pgfwRuleChangeQueue *vqueue;
+	uint64		head;
+	uint64		used;
+	Latch	   *latch;
+	ListCell   *lc;
+
+	if (rule_changes == NIL || !pgss || !pgss->rule_change_queue)
+		return;
+	queue = pgss->rule_change_queue;
+	vqueue = queue;
+
+	SpinLockAcquire(&vqueue->mutex);
+	head = vqueue->head;
+	used = vqueue->head - vqueue->tail;
+	SpinLockRelease(&vqueue->mutex);
+
+	/* can't happen, but too late to fail the transaction anyway */
+	if (queue->size - used < rule_changes_size)
+	{
+		ereport(WARNING,
+				(errmsg("sql_firewall could not queue the rule changes for the standbys")));
+		return;
+	}
+
+	foreach(lc, rule_changes)
+	{
+		pgfwRuleChange *change = (pgfwRuleChange *) lfirst(lc);
+		pgfwRuleChangeRecord rec;
+
+		memset(&rec, 0, sizeof(rec));
+		rec.op = change->op;
+		rec.key = change->key;
+		rec.encoding = change->encoding;
+		rec.query_len = change->query ? change->query_len : -1;
+
+		rule_change_queue_copy(queue, head, (char *) &rec, sizeof(rec), true);
+		head += sizeof(rec);
+		if (change->query)
+		{
+			rule_change_queue_copy(queue, head, change->query,
+								   change->query_len, true);
+			head += change->query_len;
+		}
+	}
+
+	SpinLockAcquire(&vqueue->mutex);
+	vqueue->head = head;
+	latch = vqueue->latch;
+	SpinLockRelease(&vqueue->mutex);
+
+	if (latch)
+		SetLatch(latch);
+}
 
 /*
- * JumbleQuery: Selectively serialize the query tree, appending significant
- * data to the "query jumble" while ignoring nonsignificant data.
+ * Record the next batch of the queued rule changes, from position tail on,
+ * in sql_firewall.rule_changes, which the WAL carries to the standbys.
  *
- * Rule of thumb for what to include is that we should ignore anything not
- * semantically significant (such as alias names) as well as anything that can
- * be deduced from child nodes (else we'd just be double-hashing that piece
- * of information).
+ * Called by the rule publisher in a transaction of its own; the changes
+ * stay queued until it commits.  Nothing is recorded until the extension
+ * is created in sql_firewall.replication_database.
+ *
+ * return the position past the changes recorded
  */
-void
-JumbleQuery(pgssJumbleState *jstate, Query *query)
+static uint64
+rule_changes_record(uint64 tail, uint64 head)
 {
-	Assert(IsA(query, Query));
-	Assert(query->utilityStmt == NULL);
+	static bool missing_reported = false;
+	pgfwRuleChangeQueue *queue = pgss->rule_change_queue;
+	Oid			argtypes[7] = {CHAROID, OIDOID, INT8OID, CHAROID, INT4OID, TEXTOID,
+							   OIDOID};
+	Datum		values[7];
+	char		nulls[7];
+	SPIPlanPtr	plan;
+	bool		isnull;
+	int			nchanges = 0;
+
+	if (SPI_execute("SELECT pg_catalog.to_regclass('sql_firewall.rule_changes') IS NOT NULL",
+					true, 1) != SPI_OK_SELECT ||
+		!DatumGetBool(SPI_getbinval(SPI_tuptable->vals[0],
+									SPI_tuptable->tupdesc, 1, &isnull)))
+	{
+		if (!missing_reported)
+			ereport(LOG,
+					(errmsg("sql_firewall rule changes wait for the extension to be created in database \"%s\"",
+							pgfw_replication_database)));
+		missing_reported = true;
+		return tail;
+	}
+	missing_reported = false;
 
-	APP_JUMB(query->commandType);
-	/* resultRelation is usually predictable from commandType */
-	JumbleExpr(jstate, (Node *) query->cteList);
-	JumbleRangeTable(jstate, query->rtable);
-	JumbleExpr(jstate, (Node *) query->jointree);
-	JumbleExpr(jstate, (Node *) query->targetList);
-	JumbleExpr(jstate, (Node *) query->returningList);
-	JumbleExpr(jstate, (Node *) query->groupClause);
-	JumbleExpr(jstate, query->havingQual);
-	JumbleExpr(jstate, (Node *) query->windowClause);
-	JumbleExpr(jstate, (Node *) query->distinctClause);
-	JumbleExpr(jstate, (Node *) query->sortClause);
-	JumbleExpr(jstate, query->limitOffset);
-	JumbleExpr(jstate, query->limitCount);
-	/* we ignore rowMarks */
-	JumbleExpr(jstate, query->setOperations);
+	plan = SPI_prepare("INSERT INTO sql_firewall.rule_changes"
+					   " (op, userid, queryid, type, encoding, query, dbid)"
+					   " VALUES ($1, $2, $3, $4, $5, $6, $7)",
+					   7, argtypes);
+	if (plan == NULL)
+		elog(ERROR, "SPI_prepare failed: %s",
+			 SPI_result_code_string(SPI_result));
+
+	while (tail < head && nchanges < RULE_CHANGES_BATCH)
+	{
+		pgfwRuleChangeRecord rec;
+
+		rule_change_queue_copy(queue, tail, (char *) &rec, sizeof(rec), false);
+		tail += sizeof(rec);
+
+		memset(nulls, ' ', sizeof(nulls));
+		values[0] = CharGetDatum((char) rec.op);
+		values[1] = ObjectIdGetDatum(rec.key.userid);
+		values[2] = Int64GetDatum((int64) rec.key.queryid);
+		values[3] = CharGetDatum((char) rec.key.type);
+		values[4] = Int32GetDatum(rec.encoding);
+		if (rec.query_len >= 0)
+		{
+			char	   *query = palloc(rec.query_len + 1);
+
+			rule_change_queue_copy(queue, tail, query, rec.query_len, false);
+			tail += rec.query_len;
+			values[5] = PointerGetDatum(cstring_to_text_with_len(query,
+																 rec.query_len));
+		}
+		else
+			nulls[5] = 'n';
+		values[6] = ObjectIdGetDatum(rec.key.dbid);
+
+		if (rec.op == PGFW_RULE_LOG_RESET)
+		{
+			nulls[1] = 'n';
+			nulls[2] = 'n';
+			nulls[3] = 'n';
+			nulls[6] = 'n';
+		}
+
+		if (SPI_execute_plan(plan, values, nulls, false, 0) != SPI_OK_INSERT)
+			elog(ERROR, "could not insert into sql_firewall.rule_changes");
+		nchanges++;
+	}
+
+	return tail;
 }
 
 /*
- * Jumble a range table
+ * Apply a replicated rule change to the rules of this standby.
+ *
+ * The changes are idempotent, so that a change applied twice, after a
+ * crash of the standby, does no harm.
  */
 static void
-JumbleRangeTable(pgssJumbleState *jstate, List *rtable)
+rule_change_apply(uint32 op, const pgssHashKey *key, const char *query,
+				  int encoding)
 {
-	ListCell   *lc;
-	Relation rel;
-
-	foreach(lc, rtable)
+	switch (op)
 	{
-		RangeTblEntry *rte = (RangeTblEntry *) lfirst(lc);
-
-		Assert(IsA(rte, RangeTblEntry));
-		APP_JUMB(rte->rtekind);
-		switch (rte->rtekind)
-		{
-			case RTE_RELATION:
-				rel = RelationIdGetRelation(rte->relid);
-				APP_JUMB_STRING(RelationGetRelationName(rel));
-				RelationClose(rel);
-				break;
-			case RTE_SUBQUERY:
-				JumbleQuery(jstate, rte->subquery);
-				break;
-			case RTE_JOIN:
-				APP_JUMB(rte->jointype);
-				break;
-			case RTE_FUNCTION:
-				JumbleExpr(jstate, (Node *) rte->functions);
-				break;
-			case RTE_VALUES:
-				JumbleExpr(jstate, (Node *) rte->values_lists);
-				break;
-			case RTE_CTE:
-
-				/*
-				 * Depending on the CTE name here isn't ideal, but it's the
-				 * only info we have to identify the referenced WITH item.
-				 */
-				APP_JUMB_STRING(rte->ctename);
-				APP_JUMB(rte->ctelevelsup);
-				break;
-			default:
-				elog(ERROR, "unrecognized RTE kind: %d", (int) rte->rtekind);
-				break;
-		}
+		case PGFW_RULE_LOG_ADD:
+		case PGFW_RULE_LOG_LEARN:
+			{
+				pgfwRuleItem item;
+
+				if (query == NULL || !PG_VALID_BE_ENCODING(encoding) ||
+					(key->type != PGFW_WHITELIST_ENTRY &&
+					 key->type != PGFW_BLACKLIST_ENTRY))
+					break;
+
+				memset(&item, 0, sizeof(item));
+				item.dbid = key->dbid;
+				item.userid = key->userid;
+				item.queryid = key->queryid;
+				item.type = key->type;
+				item.query = query;
+				item.query_len = strlen(query);
+				item.encoding = encoding;
+				item.learned = (op == PGFW_RULE_LOG_LEARN);
+
+				if (store_rules(&item, 1, false) == 0)
+					ereport(WARNING,
+							(errmsg("sql_firewall could not apply a replicated rule of query id %u",
+									key->queryid)));
+			}
+			break;
+		case PGFW_RULE_LOG_DELETE:
+			entry_delete(key->dbid, key->userid, key->queryid, key->type);
+			break;
+		case PGFW_RULE_LOG_RESET:
+			entry_reset();
+			break;
 	}
 }
 
 /*
- * Jumble an expression tree
+ * Apply the next batch of the rule changes replicated from the primary.
  *
- * In general this function should handle all the same node types that
- * expression_tree_walker() does, and therefore it's coded to be as parallel
- * to that function as possible.  However, since we are only invoked on
- * queries immediately post-parse-analysis, we need not handle node types
- * that only appear in planning.
+ * Called by the rule replayer in a transaction of its own.  The position
+ * goes back to the start if the table has been recreated on the primary.
  *
- * Note: the reason we don't simply use expression_tree_walker() is that the
- * point of that function is to support tree walkers that don't care about
- * most tree node types, but here we care about all types.  We should complain
- * about any unrecognized node type.
+ * return:
+ *   true    :   there may be more changes to apply
+ *   false   :   all caught up
  */
-static void
-JumbleExpr(pgssJumbleState *jstate, Node *node)
+static bool
+rule_changes_replay(void)
 {
-	ListCell   *temp;
+	volatile pgssSharedState *s = (volatile pgssSharedState *) pgss;
+	Oid			argtypes[1] = {INT8OID};
+	Datum		values[1];
+	int64		position;
+	int64		last;
+	bool		isnull;
+	uint64		i;
+	uint64		nchanges;
 
-	if (node == NULL)
-		return;
+	SpinLockAcquire(&s->mutex);
+	position = s->replicated_seq;
+	SpinLockRelease(&s->mutex);
 
-	/* Guard against stack overflow due to overly complex expressions */
-	check_stack_depth();
+	/* the extension may not be created yet */
+	if (SPI_execute("SELECT pg_catalog.to_regclass('sql_firewall.rule_changes') IS NOT NULL",
+					true, 1) != SPI_OK_SELECT ||
+		!DatumGetBool(SPI_getbinval(SPI_tuptable->vals[0],
+									SPI_tuptable->tupdesc, 1, &isnull)))
+		return false;
 
-	/*
-	 * We always emit the node's NodeTag, then any additional fields that are
-	 * considered significant, and then we recurse to any child nodes.
-	 */
-	APP_JUMB(node->type);
+	if (SPI_execute("SELECT coalesce(max(seq), 0) FROM sql_firewall.rule_changes",
+					true, 1) != SPI_OK_SELECT)
+		elog(ERROR, "could not read sql_firewall.rule_changes");
+	last = DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[0],
+									   SPI_tuptable->tupdesc, 1, &isnull));
+	if (last < position)
+	{
+		ereport(LOG,
+				(errmsg("sql_firewall replays the rule changes from the start, they have been truncated")));
+		position = 0;
+	}
+	if (last == position)
+		return false;
 
-	switch (nodeTag(node))
+	values[0] = Int64GetDatum(position);
+	if (SPI_execute_with_args("SELECT seq, op, userid, queryid, type, encoding, query,"
+							  " coalesce(dbid, 0)"
+							  " FROM sql_firewall.rule_changes"
+							  " WHERE seq > $1 ORDER BY seq LIMIT " CppAsString2(RULE_CHANGES_BATCH),
+							  1, argtypes, values, NULL,
+							  true, 0) != SPI_OK_SELECT)
+		elog(ERROR, "could not read sql_firewall.rule_changes");
+
+	nchanges = SPI_processed;
+	for (i = 0; i < nchanges; i++)
 	{
-		case T_Var:
-			{
-				Var		   *var = (Var *) node;
+		HeapTuple	tuple = SPI_tuptable->vals[i];
+		TupleDesc	tupdesc = SPI_tuptable->tupdesc;
+		pgssHashKey key;
+		uint32		op;
+		Datum		query;
+		int			encoding;
+
+		position = DatumGetInt64(SPI_getbinval(tuple, tupdesc, 1, &isnull));
+		op = (uint32) DatumGetChar(SPI_getbinval(tuple, tupdesc, 2, &isnull));
+
+		memset(&key, 0, sizeof(pgssHashKey));
+		key.userid = DatumGetObjectId(SPI_getbinval(tuple, tupdesc, 3, &isnull));
+		key.queryid = (uint32) DatumGetInt64(SPI_getbinval(tuple, tupdesc, 4, &isnull));
+		key.type = (uint32) DatumGetChar(SPI_getbinval(tuple, tupdesc, 5, &isnull));
+		encoding = DatumGetInt32(SPI_getbinval(tuple, tupdesc, 6, &isnull));
+		key.dbid = DatumGetObjectId(SPI_getbinval(tuple, tupdesc, 8, &isnull));
+		query = SPI_getbinval(tuple, tupdesc, 7, &isnull);
+
+		rule_change_apply(op, &key, isnull ? NULL : TextDatumGetCString(query),
+						  encoding);
+	}
 
-				APP_JUMB(var->varno);
-				APP_JUMB(var->varattno);
-				APP_JUMB(var->varlevelsup);
-			}
-			break;
-		case T_Const:
-			{
-				Const	   *c = (Const *) node;
+	SpinLockAcquire(&s->mutex);
+	s->replicated_seq = position;
+	SpinLockRelease(&s->mutex);
 
-				/* We jumble only the constant's type, not its value */
-				APP_JUMB(c->consttype);
-				/* Also, record its parse location for query normalization */
-				RecordConstLocation(jstate, c->location);
-			}
-			break;
-		case T_Param:
-			{
-				Param	   *p = (Param *) node;
+	return nchanges == RULE_CHANGES_BATCH;
+}
 
-				APP_JUMB(p->paramkind);
-				APP_JUMB(p->paramid); /* FIXME */
-				APP_JUMB(p->paramtype);
-			}
-			break;
-		case T_Aggref:
-			{
-				Aggref	   *expr = (Aggref *) node;
+/*
+ * The position of a standby in the replicated rule changes is saved at
+ * shutdown along with the rules.  A position older than the rules, as
+ * after a crash, only has some changes applied again.
+ */
+static int64
+replication_position_load(void)
+{
+	FILE	   *file;
+	int64		position = 0;
 
-				APP_JUMB(expr->aggfnoid); /* FIXME */
-				JumbleExpr(jstate, (Node *) expr->aggdirectargs);
-				JumbleExpr(jstate, (Node *) expr->args);
-				JumbleExpr(jstate, (Node *) expr->aggorder);
-				JumbleExpr(jstate, (Node *) expr->aggdistinct);
-				JumbleExpr(jstate, (Node *) expr->aggfilter);
-			}
-			break;
-		case T_WindowFunc:
-			{
-				WindowFunc *expr = (WindowFunc *) node;
+	file = AllocateFile(PGFW_REPLICATION_FILE, PG_BINARY_R);
+	if (file == NULL)
+	{
+		if (errno != ENOENT)
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("could not read sql_firewall file \"%s\": %m",
+							PGFW_REPLICATION_FILE)));
+		return 0;
+	}
 
-				APP_JUMB(expr->winfnoid); /* FIXME */
-				APP_JUMB(expr->winref);
-				JumbleExpr(jstate, (Node *) expr->args);
-				JumbleExpr(jstate, (Node *) expr->aggfilter);
-			}
-			break;
-		case T_ArrayRef:
-			{
-				ArrayRef   *aref = (ArrayRef *) node;
+	if (fread(&position, sizeof(position), 1, file) != 1 || position < 0)
+		position = 0;
 
-				JumbleExpr(jstate, (Node *) aref->refupperindexpr);
-				JumbleExpr(jstate, (Node *) aref->reflowerindexpr);
-				JumbleExpr(jstate, (Node *) aref->refexpr);
-				JumbleExpr(jstate, (Node *) aref->refassgnexpr);
-			}
-			break;
-		case T_FuncExpr:
-			{
-				FuncExpr   *expr = (FuncExpr *) node;
-				char *funcname = get_func_name(expr->funcid);
+	FreeFile(file);
 
-				APP_JUMB_STRING(funcname);
-				JumbleExpr(jstate, (Node *) expr->args);
-			}
-			break;
-		case T_NamedArgExpr:
-			{
-				NamedArgExpr *nae = (NamedArgExpr *) node;
+	return position;
+}
 
-				APP_JUMB(nae->argnumber);
-				JumbleExpr(jstate, (Node *) nae->arg);
-			}
-			break;
-		case T_OpExpr:
-		case T_DistinctExpr:	/* struct-equivalent to OpExpr */
-		case T_NullIfExpr:		/* struct-equivalent to OpExpr */
-			{
-				OpExpr	   *expr = (OpExpr *) node;
+static void
+replication_position_save(void)
+{
+	FILE	   *file;
+	int64		position = pgss->replicated_seq;
 
-				APP_JUMB(expr->opno);
-				JumbleExpr(jstate, (Node *) expr->args);
-			}
-			break;
-		case T_ScalarArrayOpExpr:
-			{
-				ScalarArrayOpExpr *expr = (ScalarArrayOpExpr *) node;
+	file = AllocateFile(PGFW_REPLICATION_FILE ".tmp", PG_BINARY_W);
+	if (file == NULL)
+		goto error;
 
-				APP_JUMB(expr->opno);
-				APP_JUMB(expr->useOr);
-				JumbleExpr(jstate, (Node *) expr->args);
-			}
-			break;
-		case T_BoolExpr:
-			{
-				BoolExpr   *expr = (BoolExpr *) node;
+	if (fwrite(&position, sizeof(position), 1, file) != 1)
+		goto error;
 
-				APP_JUMB(expr->boolop);
-				JumbleExpr(jstate, (Node *) expr->args);
-			}
-			break;
-		case T_SubLink:
-			{
-				SubLink    *sublink = (SubLink *) node;
+	if (FreeFile(file))
+	{
+		file = NULL;
+		goto error;
+	}
 
-				APP_JUMB(sublink->subLinkType);
-				JumbleExpr(jstate, (Node *) sublink->testexpr);
-				JumbleQuery(jstate, (Query *) sublink->subselect);
-			}
-			break;
-		case T_FieldSelect:
-			{
-				FieldSelect *fs = (FieldSelect *) node;
+	if (rename(PGFW_REPLICATION_FILE ".tmp", PGFW_REPLICATION_FILE) != 0)
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not rename sql_firewall file \"%s\": %m",
+						PGFW_REPLICATION_FILE ".tmp")));
+	return;
 
-				APP_JUMB(fs->fieldnum);
-				JumbleExpr(jstate, (Node *) fs->arg);
-			}
-			break;
-		case T_FieldStore:
-			{
-				FieldStore *fstore = (FieldStore *) node;
+error:
+	ereport(LOG,
+			(errcode_for_file_access(),
+			 errmsg("could not write sql_firewall file \"%s\": %m",
+					PGFW_REPLICATION_FILE ".tmp")));
+	if (file)
+		FreeFile(file);
+	unlink(PGFW_REPLICATION_FILE ".tmp");
+}
 
-				JumbleExpr(jstate, (Node *) fstore->arg);
-				JumbleExpr(jstate, (Node *) fstore->newvals);
-			}
-			break;
-		case T_RelabelType:
-			{
-				RelabelType *rt = (RelabelType *) node;
+/*
+ * Main entry point of the rule replayer background worker: apply on a
+ * standby the rule changes recorded by the primary in
+ * sql_firewall.rule_changes, every sql_firewall.replication_naptime.
+ * Once the standby is promoted, its rule changes are its own to record.
+ */
+void
+sql_firewall_rule_replayer_main(Datum main_arg)
+{
+	pqsignal(SIGHUP, worker_sighup);
+	pqsignal(SIGTERM, worker_sigterm);
+	BackgroundWorkerUnblockSignals();
 
-				APP_JUMB(rt->resulttype);
-				JumbleExpr(jstate, (Node *) rt->arg);
-			}
-			break;
-		case T_CoerceViaIO:
-			{
-				CoerceViaIO *cio = (CoerceViaIO *) node;
+	if (!pgss || !pgss_hash)
+		proc_exit(0);
 
-				APP_JUMB(cio->resulttype);
-				JumbleExpr(jstate, (Node *) cio->arg);
-			}
-			break;
-		case T_ArrayCoerceExpr:
-			{
-				ArrayCoerceExpr *acexpr = (ArrayCoerceExpr *) node;
+	/* reading the rule changes is no violation of the rules */
+	statements_exempt = true;
 
-				APP_JUMB(acexpr->resulttype);
-				JumbleExpr(jstate, (Node *) acexpr->arg);
-			}
-			break;
-		case T_ConvertRowtypeExpr:
-			{
-				ConvertRowtypeExpr *crexpr = (ConvertRowtypeExpr *) node;
+	BackgroundWorkerInitializeConnection(pgfw_replication_database, NULL);
 
-				APP_JUMB(crexpr->resulttype);
-				JumbleExpr(jstate, (Node *) crexpr->arg);
-			}
-			break;
-		case T_CollateExpr:
-			{
-				CollateExpr *ce = (CollateExpr *) node;
+	while (!worker_got_sigterm)
+	{
+		bool		more;
+		int			rc;
 
-				APP_JUMB(ce->collOid); /* FIXME */
-				JumbleExpr(jstate, (Node *) ce->arg);
-			}
-			break;
-		case T_CaseExpr:
-			{
-				CaseExpr   *caseexpr = (CaseExpr *) node;
+		ResetLatch(&MyProc->procLatch);
 
-				JumbleExpr(jstate, (Node *) caseexpr->arg);
-				foreach(temp, caseexpr->args)
-				{
-					CaseWhen   *when = (CaseWhen *) lfirst(temp);
+		if (worker_got_sighup)
+		{
+			worker_got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
 
-					Assert(IsA(when, CaseWhen));
-					JumbleExpr(jstate, (Node *) when->expr);
-					JumbleExpr(jstate, (Node *) when->result);
-				}
-				JumbleExpr(jstate, (Node *) caseexpr->defresult);
-			}
+		if (!RecoveryInProgress())
 			break;
-		case T_CaseTestExpr:
-			{
-				CaseTestExpr *ct = (CaseTestExpr *) node;
 
-				APP_JUMB(ct->typeId);
-			}
-			break;
-		case T_ArrayExpr:
-			JumbleExpr(jstate, (Node *) ((ArrayExpr *) node)->elements);
-			break;
-		case T_RowExpr:
-			JumbleExpr(jstate, (Node *) ((RowExpr *) node)->args);
-			break;
-		case T_RowCompareExpr:
-			{
-				RowCompareExpr *rcexpr = (RowCompareExpr *) node;
+		SetCurrentStatementStartTimestamp();
+		StartTransactionCommand();
+		if (SPI_connect() != SPI_OK_CONNECT)
+			elog(ERROR, "SPI_connect failed");
+		PushActiveSnapshot(GetTransactionSnapshot());
 
-				APP_JUMB(rcexpr->rctype);
-				JumbleExpr(jstate, (Node *) rcexpr->largs);
-				JumbleExpr(jstate, (Node *) rcexpr->rargs);
-			}
-			break;
-		case T_CoalesceExpr:
-			JumbleExpr(jstate, (Node *) ((CoalesceExpr *) node)->args);
-			break;
-		case T_MinMaxExpr:
-			{
-				MinMaxExpr *mmexpr = (MinMaxExpr *) node;
+		more = rule_changes_replay();
 
-				APP_JUMB(mmexpr->op);
-				JumbleExpr(jstate, (Node *) mmexpr->args);
-			}
-			break;
-		case T_XmlExpr:
-			{
-				XmlExpr    *xexpr = (XmlExpr *) node;
+		SPI_finish();
+		PopActiveSnapshot();
+		CommitTransactionCommand();
 
-				APP_JUMB(xexpr->op);
-				JumbleExpr(jstate, (Node *) xexpr->named_args);
-				JumbleExpr(jstate, (Node *) xexpr->args);
-			}
+		if (more)
+			continue;
+
+		rc = WaitLatch(&MyProc->procLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   pgfw_replication_naptime);
+
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+	}
+
+	proc_exit(0);
+}
+
+/*
+ * Main entry point of the rule publisher background worker: record in
+ * sql_firewall.rule_changes the rule changes committed on the primary,
+ * whichever database they were made in, as they are queued.  What is left
+ * in the queue is recorded before it quits.
+ */
+void
+sql_firewall_rule_publisher_main(Datum main_arg)
+{
+	volatile pgfwRuleChangeQueue *queue;
+
+	pqsignal(SIGHUP, worker_sighup);
+	pqsignal(SIGTERM, worker_sigterm);
+	BackgroundWorkerUnblockSignals();
+
+	if (!pgss || !pgss->rule_change_queue)
+		proc_exit(0);
+	queue = pgss->rule_change_queue;
+
+	/* recording the rule changes is no violation of the rules */
+	statements_exempt = true;
+
+	BackgroundWorkerInitializeConnection(pgfw_replication_database, NULL);
+
+	SpinLockAcquire(&queue->mutex);
+	queue->latch = &MyProc->procLatch;
+	SpinLockRelease(&queue->mutex);
+
+	for (;;)
+	{
+		uint64		head;
+		uint64		tail;
+		uint64		recorded;
+		int			rc;
+
+		ResetLatch(&MyProc->procLatch);
+
+		if (worker_got_sighup)
+		{
+			worker_got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		SpinLockAcquire(&queue->mutex);
+		head = queue->head;
+		tail = queue->tail;
+		SpinLockRelease(&queue->mutex);
+
+		if (head != tail)
+		{
+			SetCurrentStatementStartTimestamp();
+			StartTransactionCommand();
+			if (SPI_connect() != SPI_OK_CONNECT)
+				elog(ERROR, "SPI_connect failed");
+			PushActiveSnapshot(GetTransactionSnapshot());
+
+			recorded = rule_changes_record(tail, head);
+
+			SPI_finish();
+			PopActiveSnapshot();
+			CommitTransactionCommand();
+
+			SpinLockAcquire(&queue->mutex);
+			queue->tail = recorded;
+			SpinLockRelease(&queue->mutex);
+
+			if (recorded != tail)
+				continue;
+		}
+
+		if (worker_got_sigterm)
 			break;
-		case T_NullTest:
-			{
-				NullTest   *nt = (NullTest *) node;
 
-				APP_JUMB(nt->nulltesttype);
-				JumbleExpr(jstate, (Node *) nt->arg);
-			}
-			break;
-		case T_BooleanTest:
-			{
-				BooleanTest *bt = (BooleanTest *) node;
+		rc = WaitLatch(&MyProc->procLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   pgfw_replication_naptime);
+
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+	}
+
+	SpinLockAcquire(&queue->mutex);
+	queue->latch = NULL;
+	SpinLockRelease(&queue->mutex);
+
+	proc_exit(0);
+}
+
+/*
+ * Reset all statement statistics.
+ *
+ * keep blacklist entries ?
+ */
+Datum
+sql_firewall_reset(PG_FUNCTION_ARGS)
+{
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 (errmsg("must be superuser to use sql_firewall_reset"))));
+
+	if (pgfw_mode != PGFW_MODE_DISABLED)
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("sql_firewall_reset() is available only under the disable mode")));
+
+	if (!pgss || !pgss_hash)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("sql_firewall must be loaded via shared_preload_libraries")));
+	rule_changes_begin();
+	entry_reset();
+	rule_changes_end();
+
+	structural_reset();
+
+	checkpoint_rule_file();
+
+	PG_RETURN_VOID();
+}
+
+/* Number of output arguments (columns) for various API versions */
+#define SQL_FIREWALL_COLS			    6		/* maximum of above */
+#define SQL_FIREWALL_CSV_COLS_V0_8		6
+#define SQL_FIREWALL_CSV_COLS_V0_9		7
+#define SQL_FIREWALL_CSV_COLS			7		/* maximum of above */
+
+/*
+ * Retrieve statement statistics.
+ *
+ * The SQL API of this function has changed multiple times, and will likely
+ * do so again in future.  To support the case where a newer version of this
+ * loadable module is being used with an old SQL declaration of the function,
+ * we continue to support the older API versions.  For 1.2 and later, the
+ * expected API version is identified by embedding it in the C name of the
+ * function.  Unfortunately we weren't bright enough to do that for 1.1.
+ */
+Datum
+sql_firewall_statements(PG_FUNCTION_ARGS)
+{
+	bool		showtext = PG_GETARG_BOOL(0);
+
+	pg_stat_statements_internal(fcinfo, showtext);
+
+	return (Datum) 0;
+}
+
+/* Common code for all versions of pg_stat_statements() */
+static void
+pg_stat_statements_internal(FunctionCallInfo fcinfo,
+							bool showtext)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	Oid			userid = GetUserId();
+	bool		is_superuser = superuser();
+	char	   *qbuffer = NULL;
+	Size		qbuffer_size = 0;
+	Size		extent = 0;
+	int			gc_count = 0;
+	HASH_SEQ_STATUS hash_seq;
+	pgssEntry  *entry;
+
+	/* hash table must exist already */
+	if (!pgss || !pgss_hash)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("sql_firewall must be loaded via shared_preload_libraries")));
+
+	/* show the calls counted by this backend so far */
+	local_cache_flush_counters();
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	/*
+	 * Check we have the expected number of output arguments.  Aside from
+	 * being a good safety check, we need a kluge here to detect API version
+	 * 1.1, which was wedged into the code in an ill-considered way.
+	 */
+	Assert(tupdesc->natts == SQL_FIREWALL_COLS);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	/*
+	 * We'd like to load the query text file (if needed) while not holding any
+	 * lock on pgss->lock.  In the worst case we'll have to do this again
+	 * after we have the lock, but it's unlikely enough to make this a win
+	 * despite occasional duplicated work.  We need to reload if anybody
+	 * writes to the file (either a retail qtext_store(), or a garbage
+	 * collection) between this point and where we've gotten shared lock.  If
+	 * a qtext_store is actually in progress when we look, we might as well
+	 * skip the speculative load entirely.
+	 */
+	if (showtext)
+	{
+		int			n_writers;
+
+		/* Take the mutex so we can examine variables */
+		{
+			volatile pgssSharedState *s = (volatile pgssSharedState *) pgss;
+
+			SpinLockAcquire(&s->mutex);
+			extent = s->extent;
+			n_writers = s->n_writers;
+			gc_count = s->gc_count;
+			SpinLockRelease(&s->mutex);
+		}
+
+		/* No point in loading file now if there are active writers */
+		if (n_writers == 0)
+			qbuffer = qtext_load_file(&qbuffer_size);
+	}
+
+	/*
+	 * Get shared lock, load or reload the query text file if we must, and
+	 * iterate over the hashtable entries.
+	 *
+	 * With a large hash table, we might be holding the lock rather longer
+	 * than one could wish.  However, this only blocks creation of new hash
+	 * table entries, and the larger the hash table the less likely that is to
+	 * be needed.  So we can hope this is okay.  Perhaps someday we'll decide
+	 * we need to partition the hash table to limit the time spent holding any
+	 * one lock.
+	 */
+	pgfw_lock_acquire(LW_SHARED);
+
+	if (showtext)
+	{
+		/*
+		 * Here it is safe to examine extent and gc_count without taking the
+		 * mutex.  Note that although other processes might change
+		 * pgss->extent just after we look at it, the strings they then write
+		 * into the file cannot yet be referenced in the hashtable, so we
+		 * don't care whether we see them or not.
+		 *
+		 * If qtext_load_file fails, we just press on; we'll return NULL for
+		 * every query text.
+		 */
+		if (qbuffer == NULL ||
+			pgss->extent != extent ||
+			pgss->gc_count != gc_count)
+		{
+			if (qbuffer)
+				qtext_release(qbuffer);
+			qbuffer = qtext_load_file(&qbuffer_size);
+		}
+	}
+
+	hash_seq_init(&hash_seq, pgss_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		Datum		values[SQL_FIREWALL_COLS];
+		bool		nulls[SQL_FIREWALL_COLS];
+		int			i = 0;
+		Counters	tmp;
+		int64		queryid = entry->key.queryid;
+
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
+
+		values[i++] = ObjectIdGetDatum(entry->key.userid);
+
+		if (is_superuser || entry->key.userid == userid)
+		{
+			values[i++] = Int64GetDatumFast(queryid);
+
+			if (showtext)
+			{
+				char	   *qstr = qtext_fetch(entry->query_offset,
+											   entry->query_len,
+											   qbuffer,
+											   qbuffer_size);
+
+				if (qstr)
+				{
+					char	   *enc;
+
+					enc = pg_any_to_server(qstr,
+										   entry->query_len,
+										   entry->encoding);
+
+					values[i++] = CStringGetTextDatum(enc);
+
+					if (enc != qstr)
+						pfree(enc);
+				}
+				else
+				{
+					/* Just return a null if we fail to find the text */
+					nulls[i++] = true;
+				}
+			}
+			else
+			{
+				/* Query text not requested */
+				nulls[i++] = true;
+			}
+		}
+		else
+		{
+			/* Don't show queryid */
+			nulls[i++] = true;
+
+			/*
+			 * Don't show query text, but hint as to the reason for not doing
+			 * so if it was requested
+			 */
+			if (showtext)
+				values[i++] = CStringGetTextDatum("<insufficient privilege>");
+			else
+				nulls[i++] = true;
+		}
+
+		/* copy counters to a local variable to keep locking time short */
+		{
+			volatile pgssEntry *e = (volatile pgssEntry *) entry;
+
+			SpinLockAcquire(&e->mutex);
+			tmp = e->counters;
+			SpinLockRelease(&e->mutex);
+		}
+
+		/* Skip entry if unexecuted (ie, it's a pending "sticky" entry) */
+		/* if (tmp.calls == 0)
+		   continue; */
+
+		values[i++] = Int64GetDatumFast(tmp.calls);
+		values[i++] = Int64GetDatumFast(tmp.banned);
+		/* rule entry type */
+		values[i++] = CStringGetTextDatum(rule_typename(entry->type));
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	/* clean up and return the tuplestore */
+	LWLockRelease(pgss->lock);
+
+	if (qbuffer)
+		qtext_release(qbuffer);
+
+	tuplestore_donestoring(tupstore);
+}
+
+/* Number of output arguments of sql_firewall_rules() */
+#define SQL_FIREWALL_RULES_COLS			7
+
+/* # of rules whose texts are read under one acquisition of pgss->lock */
+#define PGFW_RULES_BATCH				64
+
+/*
+ * A rule returned by sql_firewall_rules(), copied out of its entry.
+ */
+typedef struct pgfwRuleRow
+{
+	pgssHashKey key;			/* hash key of the entry */
+	uint32		type;			/* rule type of the entry */
+	Counters	counters;		/* the counters when the text was read */
+	char	   *query;			/* palloc'd text, or NULL */
+	int			query_len;		/* # of valid bytes in query */
+	int			encoding;		/* query text encoding */
+} pgfwRuleRow;
+
+/*
+ * qsort comparator, the order of the pages of sql_firewall_rules().
+ */
+static int
+rule_key_cmp(const void *a, const void *b)
+{
+	const pgssHashKey *ka = (const pgssHashKey *) a;
+	const pgssHashKey *kb = (const pgssHashKey *) b;
+
+	if (ka->queryid != kb->queryid)
+		return ka->queryid < kb->queryid ? -1 : 1;
+	if (ka->userid != kb->userid)
+		return ka->userid < kb->userid ? -1 : 1;
+	if (ka->dbid != kb->dbid)
+		return ka->dbid < kb->dbid ? -1 : 1;
+	if (ka->type != kb->type)
+		return ka->type < kb->type ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Read one query text into a palloc'd string, or return NULL if it can't
+ * be read.  The text file is read at the offset of the text only, rather
+ * than as a whole as qtext_load_file() does; *fd is the file, opened by the
+ * first call which needs it and to be closed by the caller before it
+ * releases the lock.
+ *
+ * Caller must hold a shared lock on pgss->lock, so that no garbage
+ * collection moves the text meanwhile.
+ */
+static char *
+qtext_read(Size query_offset, int query_len, int *fd)
+{
+	char	   *buf;
+
+	if (query_len < 0)
+		return NULL;
+
+	/* the arena is read in place, see qtext_load_file() */
+	if (pgss->qtext_arena)
+	{
+		char	   *qstr = qtext_fetch(query_offset, query_len,
+									   pgss->qtext_arena, pgss->extent);
+
+		return qstr ? pnstrdup(qstr, query_len) : NULL;
+	}
+
+	if (*fd < 0)
+	{
+		*fd = OpenTransientFile(PGSS_STATEMENTS_TEMP_FILE,
+								O_RDONLY | PG_BINARY, 0);
+		if (*fd < 0)
+		{
+			if (errno != ENOENT)
+				ereport(LOG,
+						(errcode_for_file_access(),
+						 errmsg("could not read sql_firewall file \"%s\": %m",
+								PGSS_STATEMENTS_TEMP_FILE)));
+			return NULL;
+		}
+	}
+
+	buf = (char *) palloc(query_len + 1);
+
+	/* as in qtext_fetch(), the text must be followed by its trailing null */
+	errno = 0;
+	if (lseek(*fd, (off_t) query_offset, SEEK_SET) != (off_t) query_offset ||
+		read(*fd, buf, query_len + 1) != query_len + 1 ||
+		buf[query_len] != '\0')
+	{
+		if (errno)
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("could not read sql_firewall file \"%s\": %m",
+							PGSS_STATEMENTS_TEMP_FILE)));
+		pfree(buf);
+		return NULL;
+	}
+
+	return buf;
+}
+
+/*
+ * The rules, filtered by type, user and range of queryids, and optionally
+ * a page of them.
+ *
+ * Unlike sql_firewall_statements(), the filters are applied during the scan
+ * of the hashtable, which copies out the keys of the matching rules only;
+ * their texts and counters are then read in batches of PGFW_RULES_BATCH
+ * rules, under a shared lock released between the batches, and the text
+ * file is read at the offsets of these texts only.  The rules deleted in
+ * between are not returned.
+ *
+ * With row_offset or row_limit, the rules are ordered by queryid, userid,
+ * dbid and type, and the page is cut out of the keys before any text is
+ * read.  Otherwise, they come in the order of the hashtable, the order of
+ * sql_firewall_statements().
+ */
+Datum
+sql_firewall_rules(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	Oid			userid = GetUserId();
+	bool		is_superuser = superuser();
+	bool		by_type = !PG_ARGISNULL(0);
+	bool		by_user = !PG_ARGISNULL(1);
+	bool		by_queryid_min = !PG_ARGISNULL(2);
+	bool		by_queryid_max = !PG_ARGISNULL(3);
+	bool		paged = !PG_ARGISNULL(4) || !PG_ARGISNULL(5);
+	uint32		rule_type = PGFW_DUMMY_ENTRY;
+	Oid			rule_userid = InvalidOid;
+	int64		queryid_min = by_queryid_min ? PG_GETARG_INT64(2) : 0;
+	int64		queryid_max = by_queryid_max ? PG_GETARG_INT64(3) : 0;
+	int64		row_offset = PG_ARGISNULL(4) ? 0 : PG_GETARG_INT64(4);
+	int64		row_limit = PG_ARGISNULL(5) ? -1 : PG_GETARG_INT64(5);
+	HASH_SEQ_STATUS hash_seq;
+	pgssEntry  *entry;
+	pgssHashKey *keys;
+	int			nkeys;
+	int			first;
+	int			last;
+	pgfwRuleRow rows[PGFW_RULES_BATCH];
+
+	/* hash table must exist already */
+	if (!pgss || !pgss_hash)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("sql_firewall must be loaded via shared_preload_libraries")));
+
+	if (by_type)
+	{
+		char	   *rule_type_name = text_to_cstring(PG_GETARG_TEXT_P(0));
+
+		rule_type = rule_typeid(rule_type_name);
+		if (rule_type == PGFW_DUMMY_ENTRY && strcmp(rule_type_name, "dummy") != 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("rule type must be one of [\'whitelist\', \'blacklist\', \'dummy\']")));
+	}
+	if (by_user)
+		rule_userid = PG_GETARG_OID(1);
+	if (row_offset < 0 || (!PG_ARGISNULL(5) && row_limit < 0))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("row_offset and row_limit must not be negative")));
+
+	/* show the calls counted by this backend so far */
+	local_cache_flush_counters();
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	Assert(tupdesc->natts == SQL_FIREWALL_RULES_COLS);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	/*
+	 * Copy out the keys of the matching rules.  The queryids of the rules of
+	 * other users are not shown, so they don't match any range of queryids
+	 * either.
+	 */
+	pgfw_lock_acquire(LW_SHARED);
+
+	keys = (pgssHashKey *) palloc(Max(hash_get_num_entries(pgss_hash), 1) *
+								  sizeof(pgssHashKey));
+	nkeys = 0;
+
+	hash_seq_init(&hash_seq, pgss_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (by_type && entry->type != rule_type)
+			continue;
+		if (by_user && entry->key.userid != rule_userid)
+			continue;
+		if ((by_queryid_min || by_queryid_max) &&
+			!is_superuser && entry->key.userid != userid)
+			continue;
+		if (by_queryid_min && (int64) entry->key.queryid < queryid_min)
+			continue;
+		if (by_queryid_max && (int64) entry->key.queryid > queryid_max)
+			continue;
+
+		keys[nkeys++] = entry->key;
+	}
+
+	LWLockRelease(pgss->lock);
+
+	/* cut the page out */
+	first = 0;
+	last = nkeys;
+	if (paged)
+	{
+		qsort(keys, nkeys, sizeof(pgssHashKey), rule_key_cmp);
+
+		first = (int) Min(row_offset, (int64) nkeys);
+		if (row_limit >= 0)
+			last = (int) Min((int64) first + row_limit, (int64) nkeys);
+	}
+
+	while (first < last)
+	{
+		int			nrows = 0;
+		int			fd = -1;
+		int			n;
+
+		pgfw_lock_acquire(LW_SHARED);
+
+		for (n = first; n < last && nrows < PGFW_RULES_BATCH; n++)
+		{
+			pgfwRuleRow *row = &rows[nrows];
+
+			entry = (pgssEntry *) hash_search(pgss_hash, &keys[n], HASH_FIND, NULL);
+			if (entry == NULL)
+				continue;
+
+			row->key = entry->key;
+			row->type = entry->type;
+			row->query_len = entry->query_len;
+			row->encoding = entry->encoding;
+			row->query = NULL;
+			if (is_superuser || entry->key.userid == userid)
+				row->query = qtext_read(entry->query_offset,
+										entry->query_len, &fd);
+
+			/* copy counters to a local variable to keep locking time short */
+			{
+				volatile pgssEntry *e = (volatile pgssEntry *) entry;
+
+				SpinLockAcquire(&e->mutex);
+				row->counters = e->counters;
+				SpinLockRelease(&e->mutex);
+			}
+			nrows++;
+		}
+		first = n;
+
+		/* the file may be replaced once the lock is released */
+		if (fd >= 0)
+		{
+			CloseTransientFile(fd);
+			fd = -1;
+		}
+
+		LWLockRelease(pgss->lock);
+
+		for (n = 0; n < nrows; n++)
+		{
+			pgfwRuleRow *row = &rows[n];
+			Datum		values[SQL_FIREWALL_RULES_COLS];
+			bool		nulls[SQL_FIREWALL_RULES_COLS];
+			int			i = 0;
+			int64		queryid = row->key.queryid;
+
+			memset(values, 0, sizeof(values));
+			memset(nulls, 0, sizeof(nulls));
+
+			values[i++] = ObjectIdGetDatum(row->key.userid);
+			values[i++] = ObjectIdGetDatum(row->key.dbid);
+
+			if (is_superuser || row->key.userid == userid)
+			{
+				values[i++] = Int64GetDatumFast(queryid);
+
+				if (row->query)
+				{
+					char	   *enc;
+
+					enc = pg_any_to_server(row->query,
+										   row->query_len,
+										   row->encoding);
+
+					values[i++] = CStringGetTextDatum(enc);
+
+					if (enc != row->query)
+						pfree(enc);
+					pfree(row->query);
+				}
+				else
+				{
+					/* Just return a null if we fail to find the text */
+					nulls[i++] = true;
+				}
+			}
+			else
+			{
+				/* Don't show queryid, nor query text */
+				nulls[i++] = true;
+				values[i++] = CStringGetTextDatum("<insufficient privilege>");
+			}
+
+			values[i++] = Int64GetDatumFast(row->counters.calls);
+			values[i++] = Int64GetDatumFast(row->counters.banned);
+			values[i++] = CStringGetTextDatum(rule_typename(row->type));
+
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
+	}
+
+	pfree(keys);
+
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+Datum
+sql_firewall_stat_warning_count(PG_FUNCTION_ARGS)
+{
+	int64 warnings;
+	int64 errors;
+
+	stat_counter_totals(&warnings, &errors);
+
+	PG_RETURN_INT64(warnings);
+}
+
+Datum
+sql_firewall_stat_error_count(PG_FUNCTION_ARGS)
+{
+	int64 warnings;
+	int64 errors;
+
+	stat_counter_totals(&warnings, &errors);
+
+	PG_RETURN_INT64(errors);
+}
+
+/*
+ * The backend counters are written without any lock, so they are never
+ * cleared; the shared counters are set to minus their sum instead.
+ */
+Datum
+sql_firewall_stat_reset(PG_FUNCTION_ARGS)
+{
+	volatile pgssSharedState *s = (volatile pgssSharedState *) pgss;
+	int64		warnings = 0;
+	int64		errors = 0;
+	int			nslots = backend_counter_slots();
+	int			i;
+
+	for (i = 0; i < nslots; i++)
+	{
+		warnings += s->backend_counters[i].warning_count;
+		errors += s->backend_counters[i].error_count;
+	}
+
+	SpinLockAcquire(&s->mutex);
+	s->warning_count = -warnings;
+	s->error_count = -errors;
+	s->evictions = 0;
+	s->rejected = 0;
+	SpinLockRelease(&s->mutex);
+
+	shadow_counter_reset();
+
+	/* the timings are kept the same way, from the sums at the reset */
+	{
+		pgfwBackendTimings totals;
+		int			stage;
+		int			bucket;
+
+		timing_totals(&totals);
+
+		SpinLockAcquire(&s->mutex);
+		for (stage = 0; stage < PGFW_NUM_TIMINGS; stage++)
+		{
+			for (bucket = 0; bucket < PGFW_TIMING_BUCKETS; bucket++)
+				s->timings_reset.stages[stage].counts[bucket] +=
+					totals.stages[stage].counts[bucket];
+			s->timings_reset.stages[stage].total_us +=
+				totals.stages[stage].total_us;
+		}
+		SpinLockRelease(&s->mutex);
+	}
+
+	/* the violations go as well, and the reports start over */
+	{
+		volatile pgfwViolationRing *ring = s->violations;
+
+		SpinLockAcquire(&ring->mutex);
+		ring->first = ring->next;
+		ring->last_report = 0;
+		ring->not_reported = 0;
+		SpinLockRelease(&ring->mutex);
+	}
+
+	local_cache_hits = 0;
+	local_cache_misses = 0;
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Hits and misses of the rule cache of the current backend.
+ */
+Datum
+sql_firewall_cache_hit_count(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_INT64(local_cache_hits);
+}
+
+Datum
+sql_firewall_cache_miss_count(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_INT64(local_cache_misses);
+}
+
+/*
+ * Learned rules evicted, and rules dropped because the table was full.
+ */
+Datum
+sql_firewall_eviction_count(PG_FUNCTION_ARGS)
+{
+	volatile pgssSharedState *s = (volatile pgssSharedState *) pgss;
+	int64		evictions;
+
+	SpinLockAcquire(&s->mutex);
+	evictions = s->evictions;
+	SpinLockRelease(&s->mutex);
+
+	PG_RETURN_INT64(evictions);
+}
+
+Datum
+sql_firewall_rejected_count(PG_FUNCTION_ARGS)
+{
+	volatile pgssSharedState *s = (volatile pgssSharedState *) pgss;
+	int64		rejected;
+
+	SpinLockAcquire(&s->mutex);
+	rejected = s->rejected;
+	SpinLockRelease(&s->mutex);
+
+	PG_RETURN_INT64(rejected);
+}
+
+#define SQL_FIREWALL_STAT_TIMING_COLS	5
+
+/*
+ * The histograms of sql_firewall.track_timing, one row per stage and
+ * bucket holding any sample.
+ */
+Datum
+sql_firewall_stat_timing(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	pgfwBackendTimings totals;
+	int			stage;
+	int			bucket;
+
+	/* hash table must exist already */
+	if (!pgss || !pgss_hash)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("sql_firewall must be loaded via shared_preload_libraries")));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	Assert(tupdesc->natts == SQL_FIREWALL_STAT_TIMING_COLS);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	timing_totals(&totals);
+
+	for (stage = 0; stage < PGFW_NUM_TIMINGS; stage++)
+	{
+		pgfwTimingHistogram *hist = &totals.stages[stage];
+
+		for (bucket = 0; bucket < PGFW_TIMING_BUCKETS; bucket++)
+		{
+			Datum		values[SQL_FIREWALL_STAT_TIMING_COLS];
+			bool		nulls[SQL_FIREWALL_STAT_TIMING_COLS];
+			int			i = 0;
+
+			if (hist->counts[bucket] <= 0)
+				continue;
+
+			memset(nulls, 0, sizeof(nulls));
+
+			values[i++] = CStringGetTextDatum(pgfw_timing_names[stage]);
+			values[i++] = Int64GetDatum(bucket == 0 ? (int64) 0 :
+										(int64) 1 << (bucket - 1));
+			if (bucket == PGFW_TIMING_BUCKETS - 1)
+				nulls[i++] = true;
+			else
+				values[i++] = Int64GetDatum((int64) 1 << bucket);
+			values[i++] = Int64GetDatumFast(hist->counts[bucket]);
+			values[i++] = Int64GetDatumFast(hist->total_us);
+
+			Assert(i == SQL_FIREWALL_STAT_TIMING_COLS);
+
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
+	}
+
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+#define SQL_FIREWALL_PARTITIONS_COLS	2
+
+/*
+ * The number of rules of each database, see sql_firewall.rule_scope.  The
+ * rules applied to all databases are shown as those of database 0.
+ */
+Datum
+sql_firewall_partitions(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	HASH_SEQ_STATUS hash_seq;
+	pgfwPartition *partition;
+	Datum		values[SQL_FIREWALL_PARTITIONS_COLS];
+	bool		nulls[SQL_FIREWALL_PARTITIONS_COLS];
+
+	/* hash table must exist already */
+	if (!pgss || !pgss_hash)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("sql_firewall must be loaded via shared_preload_libraries")));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	Assert(tupdesc->natts == SQL_FIREWALL_PARTITIONS_COLS);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	memset(nulls, 0, sizeof(nulls));
+
+	pgfw_lock_acquire(LW_SHARED);
+
+	values[0] = ObjectIdGetDatum(InvalidOid);
+	values[1] = Int64GetDatum((int64) hash_get_num_entries(pgss_hash) -
+							  pgss->database_rules);
+	tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+
+	hash_seq_init(&hash_seq, pgfw_partitions);
+	while ((partition = hash_seq_search(&hash_seq)) != NULL)
+	{
+		values[0] = ObjectIdGetDatum(partition->dbid);
+		values[1] = Int64GetDatumFast(partition->nrules);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	LWLockRelease(pgss->lock);
+
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+
+/*
+ * Copy the rules of all databases out, with their texts, in the current
+ * memory context.
+ *
+ * The shared lock is only held while copying, so that the exports built on
+ * the copy are consistent snapshots of the rules, which don't hold up the
+ * learning while they are written out.
+ */
+static pgfwRuleItem *
+copy_rules(int *nrules_p)
+{
+	char	   *qbuffer = NULL;
+	Size		qbuffer_size = 0;
+	HASH_SEQ_STATUS hash_seq;
+	pgssEntry  *entry;
+	pgfwRuleItem *rules;
+	int			nrules;
+
+	local_cache_flush_counters();
+
+	pgfw_lock_acquire(LW_SHARED);
+
+	qbuffer = qtext_load_file(&qbuffer_size);
+
+	rules = (pgfwRuleItem *) palloc(Max(hash_get_num_entries(pgss_hash), 1) *
+									sizeof(pgfwRuleItem));
+	nrules = 0;
+
+	hash_seq_init(&hash_seq, pgss_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		pgfwRuleItem *rule = &rules[nrules];
+		char	   *qstr;
+
+		qstr = qtext_fetch(entry->query_offset,
+				   entry->query_len,
+				   qbuffer,
+				   qbuffer_size);
+		if (qstr == NULL)
+			continue;			/* Ignore any entries with bogus texts */
+
+		memset(rule, 0, sizeof(pgfwRuleItem));
+		rule->dbid = entry->key.dbid;
+		rule->userid = entry->key.userid;
+		rule->queryid = entry->key.queryid;
+		rule->type = entry->type;
+		rule->query = pnstrdup(qstr, entry->query_len);
+		rule->query_len = entry->query_len;
+		rule->encoding = entry->encoding;
+
+		{
+			volatile pgssEntry *e = (volatile pgssEntry *) entry;
+
+			SpinLockAcquire(&e->mutex);
+			rule->counters = e->counters;
+			SpinLockRelease(&e->mutex);
+		}
+		nrules++;
+	}
+
+	LWLockRelease(pgss->lock);
+
+	if (qbuffer)
+		qtext_release(qbuffer);
+
+	*nrules_p = nrules;
+	return rules;
+}
+
+/*
+ * Export firewall rule in the sql_firewall_statements
+ *
+ * sql_firewall_export_rule() exports only part of pgssEntry members
+ * (userid, queryid, query string, number of calls, type and database) in
+ * CSV format.
+ *
+ * To import the rule, query_offset, query_len and encoding need to be
+ * re-computed.
+ */
+Datum
+sql_firewall_export_rule(PG_FUNCTION_ARGS)
+{
+	char	   *rule_file = text_to_cstring(PG_GETARG_TEXT_P(0));
+	pgfwRuleItem *rules;
+	int			nrules;
+	int			n;
+	FILE *filep;
+
+	/* hash table must exist already */
+	if (!pgss || !pgss_hash)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("sql_firewall must be loaded via shared_preload_libraries")));
+
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 (errmsg("must be superuser to use sql_firewall_export_rule"))));
+
+	elog(DEBUG1, "rule file=%s", rule_file);
+
+	rules = copy_rules(&nrules);
+
+	filep = AllocateFile(rule_file, PG_BINARY_W);
+	if (filep == NULL)
+		ereport(ERROR,
+			(errmsg("could not open file \"%s\": %m",
+				rule_file)));
+
+	for (n = 0; n < nrules; n++)
+	{
+		pgfwRuleItem *rule = &rules[n];
+		const char *qstr;
+		size_t	qlen;
+		int		need_quote = 0;
+
+		qstr = pg_any_to_server(rule->query, rule->query_len, rule->encoding);
+		qlen = strlen(qstr);
+
+		if (strpbrk(qstr, "\n\r,\"") != NULL)
+			need_quote = 1;
+
+		fprintf(filep, "%d,%u,", rule->userid, rule->queryid);
+		if (need_quote)
+			fprintf(filep, "\"");
+
+		/* write the text in runs, doubling the quotes in between */
+		{
+			const char *run = qstr;
+			const char *quote;
+
+			while ((quote = memchr(run, '"', qlen - (run - qstr))) != NULL)
+			{
+				fwrite(run, 1, quote - run + 1, filep);
+				fputc('"', filep);
+				run = quote + 1;
+			}
+			fwrite(run, 1, qlen - (run - qstr), filep);
+		}
+
+		if (need_quote)
+			fprintf(filep, "\"");
+
+		fprintf(filep, ",%ld,%ld,%c,%u\n", rule->counters.calls,
+				rule->counters.banned, rule->type, rule->dbid);
+
+		//#ifdef NOT_USED
+		elog(DEBUG1, "user=%d, queryid=%u, query=%s, len=%zd, query_len=%d, calls=%ld, "
+			 "banned=%ld, type=%c, dbid=%u",
+			 rule->userid,
+		     rule->queryid, qstr, qlen, rule->query_len,
+			 rule->counters.calls,
+			 rule->counters.banned,
+			 rule->type,
+			 rule->dbid);
+		//#endif
+
+		if (qstr != rule->query)
+			pfree((char *) qstr);
+		pfree((char *) rule->query);
+	}
+
+	if (FreeFile(filep))
+		ereport(ERROR,
+			(errcode_for_file_access(),
+			 errmsg("could not close file \"%s\": %m",
+				rule_file)));
+
+	pfree(rules);
+
+	PG_RETURN_BOOL(true);
+}
+
+/*
+ * rule type can be whitelist or blacklist
+ *
+ */
+static bool
+pgss_restore(Oid userid, uint32 queryid, const char *query, int64 calls,
+			 int64 banned,
+			 uint32 rule_type)
+{
+	pgfwRuleItem item;
+
+	/*
+	 * 10 | 3294787656 | select * from k1 where uid = ?; |     2
+	 */
+	memset(&item, 0, sizeof(item));
+	item.dbid    = pgfw_current_dbid();
+	item.userid  = userid;
+	item.queryid = queryid;
+	item.type    = rule_type;
+	item.query = query;
+	item.query_len = strlen(query);
+	item.encoding = GetDatabaseEncoding();
+	item.counters.calls  = calls;
+	item.counters.banned = banned;
+
+	if (store_rules(&item, 1, false) == 0)
+		elog(ERROR, "Could not allocate an entry in the hash table.");
+
+	return true;
+}
+
+/*
+ * Binary exchange format of the rules, see sql_firewall_export_rules_binary().
+ *
+ * All integers are in network byte order.  The header is the magic number,
+ * the format version, the PostgreSQL major version and the number of rules.
+ * Each rule follows as dbid (from version 2 on), userid, queryid, type (one
+ * byte), calls, banned, encoding, then the length of its query text and the
+ * text itself.
+ */
+#define PGFW_EXCHANGE_MAGIC		0x50474652	/* "PGFR" */
+#define PGFW_EXCHANGE_VERSION	2
+
+/* Least size of a rule in an image of the given version, without its text */
+#define PGFW_EXCHANGE_RULE_SIZE(version)	((version) >= 2 ? 37 : 33)
+
+/* Number of output arguments (columns) of sql_firewall_export_rules() */
+#define SQL_FIREWALL_EXPORT_COLS	7
+
+/*
+ * Return the rules as a set, type being 'w' or 'b' as in the CSV files.
+ *
+ * Meant to be streamed with COPY (SELECT * FROM sql_firewall.export_rules())
+ * TO STDOUT, which needs no file on the server.
+ */
+Datum
+sql_firewall_export_rules(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	pgfwRuleItem *rules;
+	int			nrules;
+	int			n;
+
+	/* hash table must exist already */
+	if (!pgss || !pgss_hash)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("sql_firewall must be loaded via shared_preload_libraries")));
+
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 (errmsg("must be superuser to use sql_firewall_export_rules"))));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	Assert(tupdesc->natts == SQL_FIREWALL_EXPORT_COLS);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	rules = copy_rules(&nrules);
+
+	for (n = 0; n < nrules; n++)
+	{
+		pgfwRuleItem *rule = &rules[n];
+		Datum		values[SQL_FIREWALL_EXPORT_COLS];
+		bool		nulls[SQL_FIREWALL_EXPORT_COLS];
+		char	   *qstr;
+		int			i = 0;
+
+		memset(nulls, 0, sizeof(nulls));
+
+		qstr = pg_any_to_server(rule->query, rule->query_len, rule->encoding);
+
+		values[i++] = ObjectIdGetDatum(rule->userid);
+		values[i++] = Int64GetDatum((int64) rule->queryid);
+		values[i++] = CStringGetTextDatum(qstr);
+		values[i++] = Int64GetDatumFast(rule->counters.calls);
+		values[i++] = Int64GetDatumFast(rule->counters.banned);
+		values[i++] = CharGetDatum((char) rule->type);
+		values[i++] = ObjectIdGetDatum(rule->dbid);
+
+		Assert(i == SQL_FIREWALL_EXPORT_COLS);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+
+		if (qstr != rule->query)
+			pfree(qstr);
+		pfree((char *) rule->query);
+	}
+
+	pfree(rules);
+
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+/*
+ * Return the rules in the binary exchange format, which
+ * sql_firewall_import_rules() reads back.  The texts keep their encoding.
+ */
+Datum
+sql_firewall_export_rules_binary(PG_FUNCTION_ARGS)
+{
+	pgfwRuleItem *rules;
+	int			nrules;
+	int			n;
+	StringInfoData buf;
+
+	/* hash table must exist already */
+	if (!pgss || !pgss_hash)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("sql_firewall must be loaded via shared_preload_libraries")));
+
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 (errmsg("must be superuser to use sql_firewall_export_rules_binary"))));
+
+	rules = copy_rules(&nrules);
+
+	pq_begintypsend(&buf);
+	pq_sendint(&buf, PGFW_EXCHANGE_MAGIC, 4);
+	pq_sendint(&buf, PGFW_EXCHANGE_VERSION, 4);
+	pq_sendint(&buf, PGSS_PG_MAJOR_VERSION, 4);
+	pq_sendint(&buf, nrules, 4);
+
+	for (n = 0; n < nrules; n++)
+	{
+		pgfwRuleItem *rule = &rules[n];
+
+		pq_sendint(&buf, rule->dbid, 4);
+		pq_sendint(&buf, rule->userid, 4);
+		pq_sendint(&buf, rule->queryid, 4);
+		pq_sendbyte(&buf, (int) rule->type);
+		pq_sendint64(&buf, rule->counters.calls);
+		pq_sendint64(&buf, rule->counters.banned);
+		pq_sendint(&buf, rule->encoding, 4);
+		pq_sendint(&buf, rule->query_len, 4);
+		pq_sendbytes(&buf, rule->query, rule->query_len);
+
+		pfree((char *) rule->query);
+	}
+
+	pfree(rules);
+
+	PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+/*
+ * Read the rules written by sql_firewall_export_rules_binary(), in the
+ * current memory context.  The rules of an image of version 1, which has
+ * no databases, get the database of the new rules, see pgfw_current_dbid().
+ */
+static pgfwRuleItem *
+rule_image_read(bytea *image, int *nitems_p)
+{
+	StringInfoData buf;
+	pgfwRuleItem *items;
+	int			version;
+	int			nitems;
+	int			n;
+
+	/* read the image in place, pq_getmsg* complain if it is short */
+	buf.data = VARDATA(image);
+	buf.len = VARSIZE(image) - VARHDRSZ;
+	buf.maxlen = buf.len;
+	buf.cursor = 0;
+
+	if (pq_getmsgint(&buf, 4) != PGFW_EXCHANGE_MAGIC)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("invalid sql_firewall rule image")));
+	version = pq_getmsgint(&buf, 4);
+	if (version < 1 || version > PGFW_EXCHANGE_VERSION)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("unsupported version of sql_firewall rule image")));
+	if (pq_getmsgint(&buf, 4) != PGSS_PG_MAJOR_VERSION)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("sql_firewall rule image is from another PostgreSQL major version")));
+
+	nitems = pq_getmsgint(&buf, 4);
+	if (nitems < 0 ||
+		nitems > (buf.len - buf.cursor) / PGFW_EXCHANGE_RULE_SIZE(version))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("invalid number of rules in sql_firewall rule image")));
+
+	items = (pgfwRuleItem *) palloc0(Max(nitems, 1) * sizeof(pgfwRuleItem));
+	for (n = 0; n < nitems; n++)
+	{
+		pgfwRuleItem *item = &items[n];
+
+		item->dbid = (version >= 2) ? pq_getmsgint(&buf, 4) :
+			pgfw_current_dbid();
+		item->userid = pq_getmsgint(&buf, 4);
+		item->queryid = pq_getmsgint(&buf, 4);
+		item->type = pq_getmsgbyte(&buf);
+		item->counters.calls = pq_getmsgint64(&buf);
+		item->counters.banned = pq_getmsgint64(&buf);
+		item->encoding = pq_getmsgint(&buf, 4);
+		item->query_len = pq_getmsgint(&buf, 4);
+		if (item->query_len < 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+					 errmsg("invalid query length in sql_firewall rule image")));
+		item->query = pnstrdup(pq_getmsgbytes(&buf, item->query_len),
+							   item->query_len);
+
+		if ((item->type != PGFW_WHITELIST_ENTRY &&
+			 item->type != PGFW_BLACKLIST_ENTRY) ||
+			!PG_VALID_BE_ENCODING(item->encoding))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+					 errmsg("invalid rule in sql_firewall rule image")));
+	}
+	pq_getmsgend(&buf);
+
+	*nitems_p = nitems;
+	return items;
+}
+
+/*
+ * Add the rules written by sql_firewall_export_rules_binary().  As for
+ * sql_firewall_import_rule(), they are added all at once, the rules already
+ * there are kept.
+ *
+ * return the number of rules read
+ */
+Datum
+sql_firewall_import_rules(PG_FUNCTION_ARGS)
+{
+	bytea	   *image = PG_GETARG_BYTEA_P(0);
+	pgfwRuleItem *items;
+	int			nitems;
+	int			n;
+
+	/* hash table must exist already */
+	if (!pgss || !pgss_hash)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("sql_firewall must be loaded via shared_preload_libraries")));
+
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 (errmsg("must be superuser to use sql_firewall_import_rules"))));
+
+	items = rule_image_read(image, &nitems);
+
+	rule_changes_begin();
+	if (nitems > 0 && store_rules(items, nitems, true) < nitems)
+		elog(ERROR, "Could not allocate an entry in the hash table.");
+	rule_changes_end();
+
+	for (n = 0; n < nitems; n++)
+		pfree((char *) items[n].query);
+	pfree(items);
+
+	checkpoint_rule_file();
+
+	PG_RETURN_INT64(nitems);
+}
+
+/*
+ * The shadow rule set must have been given room, see sql_firewall.shadow_max.
+ */
+static void
+shadow_check_enabled(const char *funcname)
+{
+	/* hash table must exist already */
+	if (!pgss || !pgss_hash)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("sql_firewall must be loaded via shared_preload_libraries")));
+
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 (errmsg("must be superuser to use %s", funcname))));
+
+	if (pgfw_shadow_hash == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("the sql_firewall shadow rule set is disabled"),
+				 errhint("Set sql_firewall.shadow_max to the number of rules of the shadow rule set.")));
+}
+
+/*
+ * Replace the shadow rule set with the rules written by
+ * sql_firewall_export_rules_binary().  The divergences and the shadow
+ * counters start over.
+ *
+ * return the number of rules read
+ */
+Datum
+sql_firewall_shadow_load(PG_FUNCTION_ARGS)
+{
+	bytea	   *image = PG_GETARG_BYTEA_P(0);
+	pgfwRuleItem *items;
+	int			nitems;
+	int			n;
+
+	shadow_check_enabled("sql_firewall_shadow_load");
+
+	items = rule_image_read(image, &nitems);
+	if (nitems > pgfw_shadow_max)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("too many rules for the sql_firewall shadow rule set"),
+				 errdetail("The image has %d rules, sql_firewall.shadow_max is %d.",
+						   nitems, pgfw_shadow_max)));
+
+	pgfw_lock_acquire(LW_EXCLUSIVE);
+
+	shadow_clear();
+
+	for (n = 0; n < nitems; n++)
+	{
+		pgssHashKey key;
+		bool		found;
+
+		memset(&key, 0, sizeof(key));
+		key.userid = items[n].userid;
+		key.queryid = items[n].queryid;
+		key.type = items[n].type;
+		key.dbid = items[n].dbid;
+
+		if (hash_search(pgfw_shadow_hash, &key, HASH_ENTER_NULL, &found) == NULL)
+			elog(ERROR, "Could not allocate an entry in the hash table.");
+		if (!found)
+		{
+			pgss->shadow_rules++;
+			if (key.dbid != InvalidOid)
+				pgss->shadow_database_rules++;
+		}
+	}
+	pgss->shadow_loaded = true;
+
+	LWLockRelease(pgss->lock);
+
+	shadow_counter_reset();
+
+	for (n = 0; n < nitems; n++)
+		pfree((char *) items[n].query);
+	pfree(items);
+
+	PG_RETURN_INT64(nitems);
+}
+
+/*
+ * Drop the shadow rule set and its divergences.
+ */
+Datum
+sql_firewall_shadow_clear(PG_FUNCTION_ARGS)
+{
+	shadow_check_enabled("sql_firewall_shadow_clear");
+
+	pgfw_lock_acquire(LW_EXCLUSIVE);
+	shadow_clear();
+	LWLockRelease(pgss->lock);
+
+	shadow_counter_reset();
+
+	PG_RETURN_VOID();
+}
+
+#define SQL_FIREWALL_SHADOW_STAT_COLS	6
+
+/*
+ * The counters of the shadow rule set, in a single row.  All of them are
+ * zero while there is no shadow rule set.
+ */
+Datum
+sql_firewall_shadow_stat(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Datum		values[SQL_FIREWALL_SHADOW_STAT_COLS];
+	bool		nulls[SQL_FIREWALL_SHADOW_STAT_COLS];
+	int64		checks = 0;
+	int64		rejects = 0;
+	int64		allows = 0;
+	int64		rules = 0;
+	int64		divergences = 0;
+	int64		dropped = 0;
+
+	/* hash table must exist already */
+	if (!pgss || !pgss_hash)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("sql_firewall must be loaded via shared_preload_libraries")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	Assert(tupdesc->natts == SQL_FIREWALL_SHADOW_STAT_COLS);
+
+	if (pgfw_shadow_hash != NULL)
+	{
+		volatile pgssSharedState *s = (volatile pgssSharedState *) pgss;
+
+		shadow_counter_totals(&checks, &rejects, &allows);
+
+		pgfw_lock_acquire(LW_SHARED);
+		rules = pgss->shadow_rules;
+		divergences = hash_get_num_entries(pgfw_divergences);
+		LWLockRelease(pgss->lock);
+
+		SpinLockAcquire(&s->mutex);
+		dropped = s->shadow_dropped;
+		SpinLockRelease(&s->mutex);
+	}
+
+	memset(nulls, 0, sizeof(nulls));
+	values[0] = Int64GetDatumFast(rules);
+	values[1] = Int64GetDatumFast(checks);
+	values[2] = Int64GetDatumFast(rejects);
+	values[3] = Int64GetDatumFast(allows);
+	values[4] = Int64GetDatumFast(divergences);
+	values[5] = Int64GetDatumFast(dropped);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+#define SQL_FIREWALL_DIVERGENCES_COLS	9
+
+/*
+ * The statements the shadow rules decide otherwise than the live rules.
+ * Only superusers see the statements of the other users.
+ */
+Datum
+sql_firewall_shadow_divergences(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	HASH_SEQ_STATUS hash_seq;
+	pgfwDivergence *entry;
+	Oid			userid = GetUserId();
+	bool		is_superuser = superuser();
+
+	/* hash table must exist already */
+	if (!pgss || !pgss_hash)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("sql_firewall must be loaded via shared_preload_libraries")));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	Assert(tupdesc->natts == SQL_FIREWALL_DIVERGENCES_COLS);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	if (pgfw_divergences == NULL)
+	{
+		tuplestore_donestoring(tupstore);
+		return (Datum) 0;
+	}
+
+	pgfw_lock_acquire(LW_SHARED);
+
+	hash_seq_init(&hash_seq, pgfw_divergences);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		Datum		values[SQL_FIREWALL_DIVERGENCES_COLS];
+		bool		nulls[SQL_FIREWALL_DIVERGENCES_COLS];
+		pgfwDivergence tmp;
+
+		/* copy the entry out to keep the spinlock time short */
+		{
+			volatile pgfwDivergence *d = (volatile pgfwDivergence *) entry;
+
+			SpinLockAcquire(&d->mutex);
+			tmp = *entry;
+			SpinLockRelease(&d->mutex);
+		}
+
+		memset(nulls, 0, sizeof(nulls));
+
+		values[0] = ObjectIdGetDatum(tmp.key.userid);
+		values[1] = ObjectIdGetDatum(tmp.key.dbid);
+		values[2] = Int64GetDatum((int64) tmp.key.queryid);
+		values[3] = CStringGetTextDatum(tmp.shadow_prohibited ?
+										"allowed" : "prohibited");
+		values[4] = CStringGetTextDatum(tmp.shadow_prohibited ?
+										"prohibited" : "allowed");
+		values[5] = Int64GetDatumFast(tmp.count);
+		values[6] = TimestampTzGetDatum(tmp.first_seen);
+		values[7] = TimestampTzGetDatum(tmp.last_seen);
+		if (is_superuser || tmp.key.userid == userid)
+			values[8] = CStringGetTextDatum(tmp.query);
+		else
+			values[8] = CStringGetTextDatum("<insufficient privilege>");
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	LWLockRelease(pgss->lock);
+
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+#define SQL_FIREWALL_SHADOW_DIFF_COLS	5
+
+/*
+ * The rules of one rule set only, the live ("live") or the shadow one
+ * ("shadow"): the rules learned since the shadow rule set was taken, say,
+ * or those it would drop.  Only the keys of the rules are compared.
+ */
+Datum
+sql_firewall_shadow_rule_diff(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	HASH_SEQ_STATUS hash_seq;
+	pgssEntry  *entry;
+	pgfwShadowRule *rule;
+	Datum		values[SQL_FIREWALL_SHADOW_DIFF_COLS];
+	bool		nulls[SQL_FIREWALL_SHADOW_DIFF_COLS];
+
+	shadow_check_enabled("sql_firewall_shadow_rule_diff");
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	Assert(tupdesc->natts == SQL_FIREWALL_SHADOW_DIFF_COLS);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	memset(nulls, 0, sizeof(nulls));
+
+	pgfw_lock_acquire(LW_SHARED);
+
+	hash_seq_init(&hash_seq, pgss_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if ((entry->key.type != PGFW_WHITELIST_ENTRY &&
+			 entry->key.type != PGFW_BLACKLIST_ENTRY) ||
+			hash_search(pgfw_shadow_hash, &entry->key, HASH_FIND, NULL) != NULL)
+			continue;
+
+		values[0] = CStringGetTextDatum("live");
+		values[1] = ObjectIdGetDatum(entry->key.userid);
+		values[2] = ObjectIdGetDatum(entry->key.dbid);
+		values[3] = Int64GetDatum((int64) entry->key.queryid);
+		values[4] = CStringGetTextDatum(rule_typename(entry->key.type));
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	hash_seq_init(&hash_seq, pgfw_shadow_hash);
+	while ((rule = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (hash_search(pgss_hash, &rule->key, HASH_FIND, NULL) != NULL)
+			continue;
+
+		values[0] = CStringGetTextDatum("shadow");
+		values[1] = ObjectIdGetDatum(rule->key.userid);
+		values[2] = ObjectIdGetDatum(rule->key.dbid);
+		values[3] = Int64GetDatum((int64) rule->key.queryid);
+		values[4] = CStringGetTextDatum(rule_typename(rule->key.type));
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	LWLockRelease(pgss->lock);
+
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+/* Read buffer size of sql_firewall_import_rule() */
+#define IMPORT_READ_SIZE		65536
+
+#define CSV_DEFAULT     1
+#define CSV_SEPARATOR   2
+#define CSV_NON_QUOTED  3
+#define CSV_QUOTED      4
+
+static int
+parse_csv_values(const char *buf, char **values)
+{
+	int i;
+	int cols = 1;
+	int off = 0;
+	int buflen = strlen(buf);
+	int len = 0;
+	int mode = CSV_DEFAULT;
+
+	int buf2len = 512;
+	char *buf2 = palloc(buf2len);
+	memset(buf2, 0, buf2len);
+
+	/*
+	 * the last character of the input buf is \n
+	 */
+	for (i = 0 ; i < buflen ; i++)
+	{
+		int field_end = false;
+
+		switch (buf[i])
+		{
+			case '"':
+				switch (mode)
+				{
+					case CSV_DEFAULT:
+					case CSV_SEPARATOR:
+						mode = CSV_QUOTED;
+						off++;
+						/* len should still be zero. */
+						break;
+
+					case CSV_NON_QUOTED:
+						/* it's not correct csv format, but ok. */
+						buf2[len++] = buf[i];
+						break;
+
+					case CSV_QUOTED:
+						if (i < buflen - 1 && buf[i+1] == '"')
+						{
+							/* skip next char, and continue reading */
+							i++;
+							buf2[len++] = buf[i];
+						}
+						else
+						{
+							field_end = true;
+						
+							mode = CSV_DEFAULT;
+						}
+						break;
+				}
+				break;
+
+			case '\n':
+			case ',':
+				switch (mode)
+				{
+					case CSV_DEFAULT:
+						break;
+
+					case CSV_SEPARATOR:
+					case CSV_NON_QUOTED:
+						/* end of the field */
+						field_end = true;
+						
+						mode = CSV_SEPARATOR;
+						break;
+
+					case CSV_QUOTED:
+						buf2[len++] = buf[i];
+						break;
+				}
+				break;
+
+			default:
+				switch (mode)
+				{
+					case CSV_DEFAULT:
+					case CSV_SEPARATOR:
+						off = i;
+						mode = CSV_NON_QUOTED;
+						break;
+				}
+				buf2[len++] = buf[i];
+				break;
+		}
+		if (field_end == true)
+		{
+			/* end of the field */
+			values[cols-1] = palloc(len + 1);
+			memset(values[cols-1], 0, len + 1);
+			strncpy(values[cols-1], buf2, len);
+
+			memset(buf2, 0, buf2len);
+			
+			off = i + 1;
+			len = 0;
+			cols++;
+
+			field_end = false;
+		}
+
+		if (strlen(buf2) == buf2len - 1)
+		{
+			buf2 = repalloc(buf2, buf2len * 2);
+			memset(buf2 + buf2len, 0, buf2len);
+			buf2len = buf2len * 2;
+		}
+	}
+
+	/*
+	 * we should not take the last two characters " \n\0" as a field
+	 */
+	if ((len > 0) && (off > 0))
+	{
+		/* end of the field */
+		values[cols-1] = palloc(len + 1);
+		memset(values[cols-1], 0, len + 1);
+		strncpy(values[cols-1], buf2, len);
+
+		memset(buf2, 0, buf2len);
+						
+		cols++;
+	}
+
+	pfree(buf2);
+
+	return cols - 1;
+}
+
+/*
+ * the rules file may be sourced from a human maintained file,
+ * so we re calculate the query id from the query text, and
+ * ignore the query id.
+ *
+ *  */
+Datum
+sql_firewall_import_rule(PG_FUNCTION_ARGS)
+{
+	char	   *rule_file = text_to_cstring(PG_GETARG_TEXT_P(0));
+	FILE *filep;
+	bool  ret = false;
+	char *buf;
+	StringInfoData line;
+	size_t buflen;
+	pgfwRuleItem *items;
+	int    nitems;
+	int    maxitems;
+	MemoryContext import_cxt;
+
+	/* hash table must exist already */
+	if (!pgss || !pgss_hash)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("sql_firewall must be loaded via shared_preload_libraries")));
+
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 (errmsg("must be superuser to use sql_firewall_import_rule"))));
+
+	{
+		struct stat st;
+
+		if (stat(rule_file, &st) != 0)
+		{
+			ereport(ERROR,
+				(errmsg("could not stat file \"%s\": %m",
+					rule_file)));
+		}
+		if (!S_ISREG(st.st_mode))
+		{
+			ereport(ERROR,
+				(errmsg("\"%s\" is not a regular file",
+					rule_file)));
+		}
+	}
+
+	filep = AllocateFile(rule_file, PG_BINARY_R);
+	if (filep == NULL)
+		ereport(ERROR,
+			(errmsg("could not open file \"%s\": %m",
+				rule_file)));
+
+	elog(DEBUG1, "sql_firewall_import_rule: file open, %s", rule_file);
+
+	/*
+	 * 10 | 3294787656 | select * from k1 where uid = ?; |     2
+	ret = pgss_restore(10, 3294787656, "select * from k1 where uid = ?;", 7);
+	 */
+
+	/*
+	 * The file is read in large chunks and a record may span several lines,
+	 * so the lines are gathered in a StringInfo.  The whole rule set is
+	 * built aside, then created under a single exclusive lock, so that
+	 * other sessions, enforcing the rules meanwhile, see either none or all
+	 * of it.
+	 */
+	import_cxt = AllocSetContextCreate(CurrentMemoryContext,
+									   "sql_firewall import",
+									   ALLOCSET_DEFAULT_MINSIZE,
+									   ALLOCSET_DEFAULT_INITSIZE,
+									   ALLOCSET_DEFAULT_MAXSIZE);
+	maxitems = 1024;
+	items = (pgfwRuleItem *) palloc(maxitems * sizeof(pgfwRuleItem));
+	nitems = 0;
+
+	setvbuf(filep, NULL, _IOFBF, IMPORT_READ_SIZE);
+	buflen = IMPORT_READ_SIZE;
+	buf = palloc(buflen);
+
+	initStringInfo(&line);
+	while (fgets(buf, buflen, filep) != NULL)
+	{
+		/*
+		 * extend a line buffer while reading from the file.
+		 */
+		appendStringInfoString(&line, buf);
+		elog(DEBUG1, "line: %s", line.data);
+
+		if (line.len > 0 &&
+			(line.data[line.len-1] == '\r' || line.data[line.len-1] == '\n'))
+		{
+			char *values[SQL_FIREWALL_CSV_COLS];
+			int   ncols;
+
+			/*
+			 * if a complete csv record found, parse it, register to the rule,
+			 * and free a memory space.  The files of 0.8 have no database.
+			 */
+			ncols = parse_csv_values(line.data, values);
+			if (ncols == SQL_FIREWALL_CSV_COLS_V0_8 ||
+				ncols == SQL_FIREWALL_CSV_COLS_V0_9)
+			{
+				int j;
+				uint32 queryid;
+				char  *normalized_query = NULL;
+				char  *query            = NULL;
+				pgfwRuleItem *item;
+				MemoryContext oldcxt;
+
+				elog(DEBUG1, "sql_firewall_import_rule: complete csv record. ready for parsing.");
+
+				/*
+				 * no query id generated yet, the rule's query is a plain query with constant parameter
+				 * not normalized, we calculate the query id from the plain query and normalize it.
+				 */
+				if (values[1] == NULL || strlen(values[1]) == 0)
+				{
+					/*
+					 * calculate query id from query text
+					 */
+					queryid = sql_firewall_queryid(values[2], &normalized_query);
+				}
+				else
+				{
+					queryid = atol(values[1]);
+				}
+				query   = normalized_query ? normalized_query : values[2];
+
+				if (nitems == maxitems)
+				{
+					maxitems *= 2;
+					items = (pgfwRuleItem *) repalloc(items,
+													  maxitems * sizeof(pgfwRuleItem));
+				}
+				item = &items[nitems++];
+				memset(item, 0, sizeof(pgfwRuleItem));
+				item->dbid = (ncols >= SQL_FIREWALL_CSV_COLS_V0_9) ?
+					atooid(values[6]) : pgfw_current_dbid();
+				item->userid = atoi(values[0]);
+				item->queryid = queryid;
+				item->type = values[5][0];		/* values[5][0] is entry type, either whitelist or
+												 * blacklist, 'b' - blacklist, 'w' - whitelist.
+												 */
+				oldcxt = MemoryContextSwitchTo(import_cxt);
+				item->query = pstrdup(query);
+				MemoryContextSwitchTo(oldcxt);
+				item->query_len = strlen(query);
+				item->encoding = GetDatabaseEncoding();
+				item->counters.calls = atol(values[3]);
+				item->counters.banned = atol(values[4]);	/* values[4] is blacklist rule banned
+															 * query times */
+
+				for (j = 0 ; j < ncols ; j++)
+				{
+					elog(DEBUG1, "sql_firewall_import_rule: values[%d] = %s", j, values[j]);
+					pfree(values[j]);
+				}
+
+				resetStringInfo(&line);
+				if (normalized_query)
+					pfree(normalized_query);
+
+				ret = true;
+			}
+		}
+	}
+
+	rule_changes_begin();
+	if (nitems > 0 && store_rules(items, nitems, true) < nitems)
+		elog(ERROR, "Could not allocate an entry in the hash table.");
+	rule_changes_end();
+
+	pfree(line.data);
+	pfree(buf);
+	pfree(items);
+	MemoryContextDelete(import_cxt);
+
+	if (FreeFile(filep))
+		ereport(ERROR,
+			(errcode_for_file_access(),
+			 errmsg("could not close file \"%s\": %m",
+				rule_file)));
+
+	elog(DEBUG1, "sql_firewall_import_rule: file close, %s", rule_file);
+
+	checkpoint_rule_file();
+
+	PG_RETURN_BOOL(ret);
+}
+
+/*
+ * Estimate shared memory space needed.
+ */
+static Size
+pgss_memsize(void)
+{
+	Size		size;
+
+	size = MAXALIGN(sizeof(pgssSharedState));
+	size = add_size(size, hash_estimate_size(pgss_max, sizeof(pgssEntry)));
+	size = add_size(size, hash_estimate_size(PGFW_MAX_PARTITIONS,
+											 sizeof(pgfwPartition)));
+	size = add_size(size, mul_size(rule_snapshot_size(), 2));
+	size = add_size(size, sizeof(pgfwStructuralRules));
+	size = add_size(size, mul_size(backend_counter_slots(),
+								   sizeof(pgfwBackendCounters)));
+	size = add_size(size, mul_size(backend_counter_slots(),
+								   sizeof(pgfwBackendTimings)));
+	if (pgfw_learn_queue_size > 0)
+		size = add_size(size, learn_queue_size());
+	if (pgfw_replicate_rules)
+		size = add_size(size, rule_change_queue_size());
+	size = add_size(size, violation_ring_size());
+	if (pgfw_shadow_max > 0)
+	{
+		size = add_size(size, hash_estimate_size(pgfw_shadow_max,
+												 sizeof(pgfwShadowRule)));
+		size = add_size(size, hash_estimate_size(PGFW_MAX_DIVERGENCES,
+												 sizeof(pgfwDivergence)));
+	}
+	if (pgfw_text_arena_size > 0)
+		size = add_size(size, mul_size(pgfw_text_arena_size, 1024));
+
+	return size;
+}
+
+/*
+ * Allocate a new hashtable entry.
+ * caller must hold an exclusive lock on pgss->lock
+ *
+ * "query" need not be null-terminated; we rely on query_len instead.  It is
+ * only used for the rule log, and is NULL for the rules loaded from the disk.
+ *
+ * "learned" marks the rules created by the learning mode, the only ones that
+ * entry_dealloc() may evict.
+ *
+ * If "sticky" is true, make the new entry artificially sticky so that it will
+ * probably still be there when the query finishes execution.  We do this by
+ * giving it a median usage value rather than the normal value.  (Strictly
+ * speaking, query strings are normalized on a best effort basis, though it
+ * would be difficult to demonstrate this even under artificial conditions.)
+ *
+ * Note: despite needing exclusive lock, it's not an error for the target
+ * entry to already exist.  This is because pgss_store releases and
+ * reacquires lock after failing to find a match; so someone else could
+ * have made the entry while we waited to get exclusive lock.
+ */
+static pgssEntry *
+entry_alloc(pgssHashKey *key, const char *query, Size query_offset,
+			int query_len, int encoding, bool sticky, bool learned)
+{
+	pgssEntry  *entry;
+	bool		found;
+
+	/* Find or create an entry with desired hash code */
+	entry = (pgssEntry *) hash_search(pgss_hash, key, HASH_FIND, NULL);
+	if (entry != NULL)
+		return entry;
+
+	/* Ignore queries which exeed the max limit of the learning table */
+	if (hash_get_num_entries(pgss_hash) >= pgss_max)
+	{
+		volatile pgssSharedState *s = (volatile pgssSharedState *) pgss;
+
+		SpinLockAcquire(&s->mutex);
+		s->rejected++;
+		SpinLockRelease(&s->mutex);
+
+		ereport(WARNING,(errmsg("Number of queries exceeded the <sql_firewall.max> limit.")));
+		return NULL;
+	}
+
+	/* ... and the limit of its database */
+	if (key->dbid != InvalidOid && !partition_admit(key->dbid))
+	{
+		volatile pgssSharedState *s = (volatile pgssSharedState *) pgss;
+
+		SpinLockAcquire(&s->mutex);
+		s->rejected++;
+		SpinLockRelease(&s->mutex);
+
+		return NULL;
+	}
+
+	entry = (pgssEntry *) hash_search(pgss_hash, key, HASH_ENTER, &found);
+
+	if (!found)
+	{
+		/* New entry, initialize it */
+		invalidate_rule_snapshot();
+		partition_count(key->dbid, 1);
+
+		/* reset the statistics */
+		memset(&entry->counters, 0, sizeof(Counters));
+		memset(&entry->logged, 0, sizeof(Counters));
+		/* re-initialize the mutex each time ... we assume no one using it */
+		SpinLockInit(&entry->mutex);
+		/* ... and don't forget the query text metadata */
+		Assert(query_len >= 0);
+		entry->query_offset = query_offset;
+		entry->query_len = query_len;
+		entry->encoding = encoding;
+		entry->learned = learned;
+		/* set the appropriate initial usage count */
+		entry->usage = sticky ? pgss->cur_median_usage : USAGE_INIT;
+
+		/* a new rule, unless it is being loaded from the disk */
+		if (query)
+			rule_log_append(learned ? PGFW_RULE_LOG_LEARN : PGFW_RULE_LOG_ADD,
+							key, NULL, query, query_len, encoding);
+	}
+
+	return entry;
+}
+
+/*
+ * qsort comparator for sorting into increasing usage order
+ */
+static int
+entry_cmp(const void *lhs, const void *rhs)
+{
+	double		l_usage = (*(pgssEntry *const *) lhs)->usage;
+	double		r_usage = (*(pgssEntry *const *) rhs)->usage;
+
+	if (l_usage < r_usage)
+		return -1;
+	else if (l_usage > r_usage)
+		return +1;
+	else
+		return 0;
+}
+
+/*
+ * Deallocate least used learned entries, see sql_firewall.learning_eviction.
+ * The configured rules are never evicted.
+ * Caller must hold an exclusive lock on pgss->lock.
+ *
+ * return the number of the entries deallocated
+ */
+static int
+entry_dealloc(void)
+{
+	volatile pgssSharedState *s = (volatile pgssSharedState *) pgss;
+	HASH_SEQ_STATUS hash_seq;
+	pgssEntry **entries;
+	pgssEntry  *entry;
+	int			nentries = 0;
+	int			nvictims;
+	int			i;
+	Size		totlen = 0;
+
+	/*
+	 * Sort learned entries by usage and deallocate USAGE_DEALLOC_PERCENT of
+	 * the table.  While we're scanning the table, apply the decay factor to
+	 * the usage values.
+	 */
+
+	entries = palloc(Max(hash_get_num_entries(pgss_hash), 1) * sizeof(pgssEntry *));
+
+	i = 0;
+	hash_seq_init(&hash_seq, pgss_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		volatile pgssEntry *e = (volatile pgssEntry *) entry;
+
+		nentries++;
+		/* Accumulate total size, too. */
+		totlen += entry->query_len + 1;
+
+		if (!entry->learned)
+			continue;
+
+		entries[i++] = entry;
+		SpinLockAcquire(&e->mutex);
+		/* "Sticky" entries get a different usage decay rate. */
+		if (e->counters.calls == 0)
+			e->usage *= STICKY_DECREASE_FACTOR;
+		else
+			e->usage *= USAGE_DECREASE_FACTOR;
+		SpinLockRelease(&e->mutex);
+	}
+
+	qsort(entries, i, sizeof(pgssEntry *), entry_cmp);
+
+	if (i > 0)
+		/* Record the (approximate) median usage */
+		pgss->cur_median_usage = entries[i / 2]->usage;
+	if (nentries > 0)
+		/* Record the mean query length */
+		pgss->mean_query_len = totlen / nentries;
+
+	nvictims = Max(10, nentries * USAGE_DEALLOC_PERCENT / 100);
+	nvictims = Min(nvictims, i);
+
+	for (i = 0; i < nvictims; i++)
+	{
+		pgssHashKey key = entries[i]->key;
+
+		entry_remove(&key);
+		rule_log_append(PGFW_RULE_LOG_DELETE, &key, NULL, NULL, 0, 0);
+	}
+
+	if (nvictims > 0)
+	{
+		invalidate_rule_snapshot();
+
+		SpinLockAcquire(&s->mutex);
+		s->evictions += nvictims;
+		SpinLockRelease(&s->mutex);
+	}
+
+	pfree(entries);
+
+	return nvictims;
+}
+
+/*
+ * Given a null-terminated string, allocate a new entry in the external query
+ * text file and store the string there.
+ *
+ * Although we could compute the string length via strlen(), callers already
+ * have it handy, so we require them to pass it too.
+ *
+ * If successful, returns true, and stores the new entry's offset in the file
+ * into *query_offset.  Also, if gc_count isn't NULL, *gc_count is set to the
+ * number of garbage collections that have occurred so far.
+ *
+ * On failure, returns false.
+ *
+ * At least a shared lock on pgss->lock must be held by the caller, so as
+ * to prevent a concurrent garbage collection.  Share-lock-holding callers
+ * should pass a gc_count pointer to obtain the number of garbage collections,
+ * so that they can recheck the count after obtaining exclusive lock to
+ * detect whether a garbage collection occurred (and removed this entry).
+ */
+static bool
+qtext_store(const char *query, int query_len,
+			Size *query_offset, int *gc_count)
+{
+	Size		off;
+	int			fd;
+
+	if (pgss->qtext_arena)
+		return qtext_arena_store(query, query_len, query_offset, gc_count);
+
+	/*
+	 * We use a spinlock to protect extent/n_writers/gc_count, so that
+	 * multiple processes may execute this function concurrently.
+	 */
+	{
+		volatile pgssSharedState *s = (volatile pgssSharedState *) pgss;
+
+		SpinLockAcquire(&s->mutex);
+		off = s->extent;
+		s->extent += query_len + 1;
+		s->n_writers++;
+		if (gc_count)
+			*gc_count = s->gc_count;
+		SpinLockRelease(&s->mutex);
+	}
+
+	*query_offset = off;
+
+	/* Now write the data into the successfully-reserved part of the file */
+	fd = OpenTransientFile(PGSS_STATEMENTS_TEMP_FILE, O_RDWR | O_CREAT | PG_BINARY,
+						   S_IRUSR | S_IWUSR);
+	if (fd < 0)
+		goto error;
+
+	if (lseek(fd, off, SEEK_SET) != off)
+		goto error;
+
+	if (write(fd, query, query_len + 1) != query_len + 1)
+		goto error;
+
+	CloseTransientFile(fd);
+
+	/* Mark our write complete */
+	{
+		volatile pgssSharedState *s = (volatile pgssSharedState *) pgss;
+
+		SpinLockAcquire(&s->mutex);
+		s->n_writers--;
+		SpinLockRelease(&s->mutex);
+	}
+
+	return true;
+
+error:
+	ereport(LOG,
+			(errcode_for_file_access(),
+			 errmsg("could not write sql_firewall file \"%s\": %m",
+					PGSS_STATEMENTS_TEMP_FILE)));
+
+	if (fd >= 0)
+		CloseTransientFile(fd);
+
+	/* Mark our write complete */
+	{
+		volatile pgssSharedState *s = (volatile pgssSharedState *) pgss;
+
+		SpinLockAcquire(&s->mutex);
+		s->n_writers--;
+		SpinLockRelease(&s->mutex);
+	}
+
+	return false;
+}
+
+/*
+ * Read the external query text file into a malloc'd buffer.
+ *
+ * Returns NULL (without throwing an error) if unable to read, eg
+ * file not there or insufficient memory.
+ *
+ * On success, the buffer size is also returned into *buffer_size.
+ *
+ * This can be called without any lock on pgss->lock, but in that case
+ * the caller is responsible for verifying that the result is sane.
+ */
+static char *
+qtext_load_file(Size *buffer_size)
+{
+	char	   *buf;
+	int			fd;
+	struct stat stat;
+
+	/*
+	 * The arena needs no copy, its current extent is the image.  The texts
+	 * of the entries read under pgss->lock are complete in it, as for the
+	 * file.
+	 */
+	if (pgss->qtext_arena)
+	{
+		volatile pgssSharedState *s = (volatile pgssSharedState *) pgss;
+
+		SpinLockAcquire(&s->mutex);
+		*buffer_size = s->extent;
+		SpinLockRelease(&s->mutex);
+
+		return pgss->qtext_arena;
+	}
+
+	fd = OpenTransientFile(PGSS_STATEMENTS_TEMP_FILE, O_RDONLY | PG_BINARY, 0);
+	if (fd < 0)
+	{
+		if (errno != ENOENT)
+			ereport(LOG,
+					(errcode_for_file_access(),
+				   errmsg("could not read sql_firewall file \"%s\": %m",
+						  PGSS_STATEMENTS_TEMP_FILE)));
+		return NULL;
+	}
+
+	/* Get file length */
+	if (fstat(fd, &stat))
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not stat sql_firewall file \"%s\": %m",
+						PGSS_STATEMENTS_TEMP_FILE)));
+		CloseTransientFile(fd);
+		return NULL;
+	}
+
+	/* Allocate buffer; beware that off_t might be wider than size_t */
+	if (stat.st_size <= MaxAllocSize)
+		buf = (char *) malloc(stat.st_size);
+	else
+		buf = NULL;
+	if (buf == NULL)
+	{
+		ereport(LOG,
+				(errcode(ERRCODE_OUT_OF_MEMORY),
+				 errmsg("out of memory")));
+		CloseTransientFile(fd);
+		return NULL;
+	}
+
+	/*
+	 * OK, slurp in the file.  If we get a short read and errno doesn't get
+	 * set, the reason is probably that garbage collection truncated the file
+	 * since we did the fstat(), so we don't log a complaint --- but we don't
+	 * return the data, either, since it's most likely corrupt due to
+	 * concurrent writes from garbage collection.
+	 */
+	errno = 0;
+	if (read(fd, buf, stat.st_size) != stat.st_size)
+	{
+		if (errno)
+			ereport(LOG,
+					(errcode_for_file_access(),
+				   errmsg("could not read sql_firewall file \"%s\": %m",
+						  PGSS_STATEMENTS_TEMP_FILE)));
+		free(buf);
+		CloseTransientFile(fd);
+		return NULL;
+	}
+
+	CloseTransientFile(fd);
+
+	*buffer_size = stat.st_size;
+	return buf;
+}
+
+/*
+ * Release an image returned by qtext_load_file().
+ */
+static void
+qtext_release(char *buffer)
+{
+	if (buffer != pgss->qtext_arena)
+		free(buffer);
+}
+
+/*
+ * qtext_store() for the query text arena.
+ *
+ * Fails if the arena has no room left for the text.
+ */
+static bool
+qtext_arena_store(const char *query, int query_len,
+				  Size *query_offset, int *gc_count)
+{
+	volatile pgssSharedState *s = (volatile pgssSharedState *) pgss;
+	Size		off;
+
+	SpinLockAcquire(&s->mutex);
+	off = s->extent;
+	if (off + query_len + 1 > s->qtext_arena_size)
+	{
+		SpinLockRelease(&s->mutex);
+		ereport(LOG,
+				(errcode(ERRCODE_OUT_OF_MEMORY),
+				 errmsg("sql_firewall query text arena is full"),
+				 errhint("Increase sql_firewall.text_arena_size.")));
+		return false;
+	}
+	s->extent += query_len + 1;
+	if (gc_count)
+		*gc_count = s->gc_count;
+	SpinLockRelease(&s->mutex);
+
+	/* the reserved part of the arena is ours, no lock needed */
+	memcpy(pgss->qtext_arena + off, query, query_len + 1);
+
+	*query_offset = off;
+	return true;
+}
+
+/*
+ * Locate a query text in the file image previously read by qtext_load_file().
+ *
+ * We validate the given offset/length, and return NULL if bogus.  Otherwise,
+ * the result points to a null-terminated string within the buffer.
+ */
+static char *
+qtext_fetch(Size query_offset, int query_len,
+			char *buffer, Size buffer_size)
+{
+	/* File read failed? */
+	if (buffer == NULL)
+		return NULL;
+	/* Bogus offset/length? */
+	if (query_len < 0 ||
+		query_offset + query_len >= buffer_size)
+		return NULL;
+	/* As a further sanity check, make sure there's a trailing null */
+	if (buffer[query_offset + query_len] != '\0')
+		return NULL;
+	/* Looks OK */
+	return buffer + query_offset;
+}
+
+/*
+ * Do we need to garbage-collect the external query text file?
+ *
+ * Caller should hold at least a shared lock on pgss->lock.
+ */
+static bool
+need_gc_qtexts(void)
+{
+	Size		extent;
+
+	/* Read shared extent pointer */
+	{
+		volatile pgssSharedState *s = (volatile pgssSharedState *) pgss;
+
+		SpinLockAcquire(&s->mutex);
+		extent = s->extent;
+		SpinLockRelease(&s->mutex);
+	}
+
+	/*
+	 * The arena is compacted once half of it is used, if half of that is
+	 * garbage.
+	 */
+	if (pgss->qtext_arena)
+		return extent > pgss->qtext_arena_size / 2 &&
+			extent >= pgss->mean_query_len * hash_get_num_entries(pgss_hash) * 2;
+
+	/* Don't proceed if file does not exceed 512 bytes per possible entry */
+	if (extent < 512 * pgss_max)
+		return false;
+
+	/*
+	 * Don't proceed if file is less than about 50% bloat.  Nothing can or
+	 * should be done in the event of unusually large query texts accounting
+	 * for file's large size.  We go to the trouble of maintaining the mean
+	 * query length in order to prevent garbage collection from thrashing
+	 * uselessly.
+	 */
+	if (extent < pgss->mean_query_len * pgss_max * 2)
+		return false;
+
+	return true;
+}
+
+/*
+ * Garbage-collect orphaned query texts in external file.
+ *
+ * This won't be called often in the typical case, since it's likely that
+ * there won't be too much churn, and besides, a similar compaction process
+ * occurs when serializing to disk at shutdown or as part of resetting.
+ * Despite this, it seems prudent to plan for the edge case where the file
+ * becomes unreasonably large, with no other method of compaction likely to
+ * occur in the foreseeable future.
+ *
+ * The caller must hold an exclusive lock on pgss->lock.
+ */
+static void
+gc_qtexts(void)
+{
+	char	   *qbuffer;
+	Size		qbuffer_size;
+	FILE	   *qfile;
+	HASH_SEQ_STATUS hash_seq;
+	pgssEntry  *entry;
+	Size		extent;
+	int			nentries;
+
+	/*
+	 * When called from pgss_store, some other session might have proceeded
+	 * with garbage collection in the no-lock-held interim of lock strength
+	 * escalation.  Check once more that this is actually necessary.
+	 */
+	if (!need_gc_qtexts())
+		return;
+
+	if (pgss->qtext_arena)
+	{
+		if (gc_qtexts_arena())
+			record_gc_qtexts();
+		return;
+	}
+
+	/*
+	 * Load the old texts file.  If we fail (out of memory, for instance) just
+	 * skip the garbage collection.
+	 */
+	qbuffer = qtext_load_file(&qbuffer_size);
+	if (qbuffer == NULL)
+		return;
+
+	/*
+	 * We overwrite the query texts file in place, so as to reduce the risk of
+	 * an out-of-disk-space failure.  Since the file is guaranteed not to get
+	 * larger, this should always work on traditional filesystems; though we
+	 * could still lose on copy-on-write filesystems.
+	 */
+	qfile = AllocateFile(PGSS_STATEMENTS_TEMP_FILE, PG_BINARY_W);
+	if (qfile == NULL)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not write sql_firewall file \"%s\": %m",
+						PGSS_STATEMENTS_TEMP_FILE)));
+		goto gc_fail;
+	}
+
+	extent = 0;
+	nentries = 0;
+
+	hash_seq_init(&hash_seq, pgss_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		int			query_len = entry->query_len;
+		char	   *qry = qtext_fetch(entry->query_offset,
+									  query_len,
+									  qbuffer,
+									  qbuffer_size);
+
+		if (qry == NULL)
+		{
+			/* Trouble ... drop the text */
+			entry->query_offset = 0;
+			entry->query_len = -1;
+			continue;
+		}
+
+		if (fwrite(qry, 1, query_len + 1, qfile) != query_len + 1)
+		{
+			ereport(LOG,
+					(errcode_for_file_access(),
+				  errmsg("could not write sql_firewall file \"%s\": %m",
+						 PGSS_STATEMENTS_TEMP_FILE)));
+			hash_seq_term(&hash_seq);
+			goto gc_fail;
+		}
+
+		entry->query_offset = extent;
+		extent += query_len + 1;
+		nentries++;
+	}
+
+	/*
+	 * Truncate away any now-unused space.  If this fails for some odd reason,
+	 * we log it, but there's no need to fail.
+	 */
+	if (ftruncate(fileno(qfile), extent) != 0)
+		ereport(LOG,
+				(errcode_for_file_access(),
+			   errmsg("could not truncate sql_firewall file \"%s\": %m",
+					  PGSS_STATEMENTS_TEMP_FILE)));
+
+	if (FreeFile(qfile))
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not write sql_firewall file \"%s\": %m",
+						PGSS_STATEMENTS_TEMP_FILE)));
+		qfile = NULL;
+		goto gc_fail;
+	}
+
+	elog(DEBUG1, "pgss gc of queries file shrunk size from %zu to %zu",
+		 pgss->extent, extent);
+
+	/* Reset the shared extent pointer */
+	pgss->extent = extent;
+
+	/*
+	 * Also update the mean query length, to be sure that need_gc_qtexts()
+	 * won't still think we have a problem.
+	 */
+	if (nentries > 0)
+		pgss->mean_query_len = extent / nentries;
+	else
+		pgss->mean_query_len = ASSUMED_LENGTH_INIT;
+
+	qtext_release(qbuffer);
+
+	/*
+	 * OK, count a garbage collection cycle.  (Note: even though we have
+	 * exclusive lock on pgss->lock, we must take pgss->mutex for this, since
+	 * other processes may examine gc_count while holding only the mutex.
+	 * Also, we have to advance the count *after* we've rewritten the file,
+	 * else other processes might not realize they read a stale file.)
+	 */
+	record_gc_qtexts();
+
+	return;
+
+gc_fail:
+	/* clean up resources */
+	if (qfile)
+		FreeFile(qfile);
+	if (qbuffer)
+		qtext_release(qbuffer);
+
+	/*
+	 * Since the contents of the external file are now uncertain, mark all
+	 * hashtable entries as having invalid texts.
+	 */
+	hash_seq_init(&hash_seq, pgss_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		entry->query_offset = 0;
+		entry->query_len = -1;
+	}
+
+	/* Seems like a good idea to bump the GC count even though we failed */
+	record_gc_qtexts();
+}
+
+/*
+ * Key of the texts shared by the entries while compacting the arena
+ */
+typedef struct pgfwTextKey
+{
+	uint32		queryid;		/* query identifier */
+	int			query_len;		/* # of valid bytes in query */
+} pgfwTextKey;
+
+typedef struct pgfwTextOffset
+{
+	pgfwTextKey key;			/* hash key, must be first */
+	Size		query_offset;	/* offset of the text in the new arena */
+} pgfwTextOffset;
+
+/*
+ * gc_qtexts() for the query text arena.
+ *
+ * The live texts are copied out and back to the start of the arena.  The
+ * whitelist and blacklist rules of a query, and the rules of the users
+ * running it, share one copy of its text from then on.
+ *
+ * The caller must hold an exclusive lock on pgss->lock.
+ *
+ * return false if out of memory, leaving the arena untouched
+ */
+static bool
+gc_qtexts_arena(void)
+{
+	HASH_SEQ_STATUS hash_seq;
+	HASHCTL		ctl;
+	HTAB	   *texts;
+	pgssEntry  *entry;
+	char	   *image;
+	Size		extent;
+	int			nentries;
+
+	image = (char *) malloc(Max(pgss->extent, 1));
+	if (image == NULL)
+	{
+		ereport(LOG,
+				(errcode(ERRCODE_OUT_OF_MEMORY),
+				 errmsg("out of memory")));
+		return false;
+	}
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(pgfwTextKey);
+	ctl.entrysize = sizeof(pgfwTextOffset);
+	ctl.hash = tag_hash;
+	ctl.hcxt = CurrentMemoryContext;
+	texts = hash_create("sql_firewall query texts", pgss_max, &ctl,
+						HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+
+	extent = 0;
+	nentries = 0;
+
+	hash_seq_init(&hash_seq, pgss_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		int			query_len = entry->query_len;
+		char	   *qry = qtext_fetch(entry->query_offset,
+									  query_len,
+									  pgss->qtext_arena,
+									  pgss->extent);
+		pgfwTextKey key;
+		pgfwTextOffset *text;
+		bool		found;
+
+		if (qry == NULL)
+		{
+			/* Trouble ... drop the text */
+			entry->query_offset = 0;
+			entry->query_len = -1;
+			continue;
+		}
+
+		key.queryid = entry->key.queryid;
+		key.query_len = query_len;
+		text = hash_search(texts, &key, HASH_ENTER, &found);
+		nentries++;
+		if (found && memcmp(image + text->query_offset, qry, query_len) == 0)
+		{
+			entry->query_offset = text->query_offset;
+			continue;
+		}
+
+		memcpy(image + extent, qry, query_len + 1);
+		if (!found)
+			text->query_offset = extent;
+		entry->query_offset = extent;
+		extent += query_len + 1;
+	}
+
+	hash_destroy(texts);
+
+	memcpy(pgss->qtext_arena, image, extent);
+	free(image);
+
+	elog(DEBUG1, "pgss gc of query text arena shrunk size from %zu to %zu",
+		 pgss->extent, extent);
+
+	pgss->extent = extent;
+
+	if (nentries > 0)
+		pgss->mean_query_len = extent / nentries;
+	else
+		pgss->mean_query_len = ASSUMED_LENGTH_INIT;
+
+	return true;
+}
+
+/*
+ * Release all entries.
+ */
+static void
+entry_reset(void)
+{
+	HASH_SEQ_STATUS hash_seq;
+	pgssEntry  *entry;
+	FILE	   *qfile;
+
+	/* the rules are going away, don't keep pointers to them */
+	local_cache_flush();
+
+	pgfw_lock_acquire(LW_EXCLUSIVE);
+
+	hash_seq_init(&hash_seq, pgss_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		entry_remove(&entry->key);
+	}
+	invalidate_rule_snapshot();
+	rule_log_append(PGFW_RULE_LOG_RESET, NULL, NULL, NULL, 0, 0);
+
+	/* The arena is emptied just by resetting its extent */
+	if (pgss->qtext_arena)
+		goto done;
+
+	/*
+	 * Write new empty query file, perhaps even creating a new one to recover
+	 * if the file was missing.
+	 */
+	qfile = AllocateFile(PGSS_STATEMENTS_TEMP_FILE, PG_BINARY_W);
+	if (qfile == NULL)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not create sql_firewall file \"%s\": %m",
+						PGSS_STATEMENTS_TEMP_FILE)));
+		goto done;
+	}
+
+	/* If ftruncate fails, log it, but it's not a fatal problem */
+	if (ftruncate(fileno(qfile), 0) != 0)
+		ereport(LOG,
+				(errcode_for_file_access(),
+			   errmsg("could not truncate sql_firewall file \"%s\": %m",
+					  PGSS_STATEMENTS_TEMP_FILE)));
+
+	FreeFile(qfile);
+
+done:
+	pgss->extent = 0;
+	/* This counts as a query text garbage collection for our purposes */
+	record_gc_qtexts();
+
+	LWLockRelease(pgss->lock);
+}
+
+/*
+ * Get the jumble workspace of this backend ready for a new statement.
+ *
+ * The buffers live in TopMemoryContext and are reused from one statement to
+ * the next, instead of being allocated for each of them.  clocations only
+ * grows, through RecordConstLocation(), which repallocs it in place in the
+ * workspace, so an error thrown half way leaves nothing dangling.
+ *
+ * The workspace is in use until the caller is done with the normalized
+ * query; nothing in between parses, hence jumbles, another statement.
+ */
+static pgssJumbleState *
+jumble_workspace_reset(void)
+{
+	pgssJumbleState *jstate = &jumble_workspace;
+
+	if (jstate->clocations != NULL &&
+		jstate->clocations_buf_size > JUMBLE_MAX_KEPT_CLOCATIONS)
+	{
+		pfree(jstate->clocations);
+		jstate->clocations = NULL;
+	}
+
+	if (jstate->jumble == NULL)
+		jstate->jumble = (unsigned char *)
+			MemoryContextAlloc(TopMemoryContext, JUMBLE_SIZE);
+
+	if (jstate->clocations == NULL)
+	{
+		jstate->clocations_buf_size = 32;
+		jstate->clocations = (pgssLocationLen *)
+			MemoryContextAlloc(TopMemoryContext,
+							   jstate->clocations_buf_size *
+							   sizeof(pgssLocationLen));
+	}
+
+	jstate->jumble_len = 0;
+	jstate->clocations_count = 0;
+
+	return jstate;
+}
+
+/*
+ * AppendJumble: Append a value that is substantive in a given query to
+ * the current jumble.
+ */
+static void
+AppendJumble(pgssJumbleState *jstate, const unsigned char *item, Size size)
+{
+	unsigned char *jumble = jstate->jumble;
+	Size		jumble_len = jstate->jumble_len;
+
+	/*
+	 * Whenever the jumble buffer is full, we hash the current contents and
+	 * reset the buffer to contain just that hash value, thus relying on the
+	 * hash to summarize everything so far.
+	 *
+	 * The query ids are still the 32-bit hash_any() of this buffer.  Neither
+	 * a streaming hash nor a 64-bit id has been done: 9.4 carries the id in
+	 * the uint32 Query.queryId and PlannedStmt.queryId, which is all the
+	 * executor hooks see, and changing the hash changes every id stored in
+	 * the rule files and exports.  See "Compatibility" in the README.
+	 */
+	while (size > 0)
+	{
+		Size		part_size;
+
+		if (jumble_len >= JUMBLE_SIZE)
+		{
+			uint32		start_hash = hash_any(jumble, JUMBLE_SIZE);
+
+			memcpy(jumble, &start_hash, sizeof(start_hash));
+			jumble_len = sizeof(start_hash);
+		}
+		part_size = Min(size, JUMBLE_SIZE - jumble_len);
+		memcpy(jumble + jumble_len, item, part_size);
+		jumble_len += part_size;
+		item += part_size;
+		size -= part_size;
+	}
+	jstate->jumble_len = jumble_len;
+}
+
+/*
+ * Wrappers around AppendJumble to encapsulate details of serialization
+ * of individual local variable elements.
+ */
+#define APP_JUMB(item) \
+	AppendJumble(jstate, (const unsigned char *) &(item), sizeof(item))
+#define APP_JUMB_STRING(str) \
+	AppendJumble(jstate, (const unsigned char *) (str), strlen(str) + 1)
+
+/*
+ * JumbleQuery: Selectively serialize the query tree, appending significant
+ * data to the "query jumble" while ignoring nonsignificant data.
+ *
+ * Rule of thumb for what to include is that we should ignore anything not
+ * semantically significant (such as alias names) as well as anything that can
+ * be deduced from child nodes (else we'd just be double-hashing that piece
+ * of information).
+ */
+void
+JumbleQuery(pgssJumbleState *jstate, Query *query)
+{
+	Assert(IsA(query, Query));
+	Assert(query->utilityStmt == NULL);
+
+	APP_JUMB(query->commandType);
+	/* resultRelation is usually predictable from commandType */
+	JumbleExpr(jstate, (Node *) query->cteList);
+	JumbleRangeTable(jstate, query->rtable);
+	JumbleExpr(jstate, (Node *) query->jointree);
+	JumbleExpr(jstate, (Node *) query->targetList);
+	JumbleExpr(jstate, (Node *) query->returningList);
+	JumbleExpr(jstate, (Node *) query->groupClause);
+	JumbleExpr(jstate, query->havingQual);
+	JumbleExpr(jstate, (Node *) query->windowClause);
+	JumbleExpr(jstate, (Node *) query->distinctClause);
+	JumbleExpr(jstate, (Node *) query->sortClause);
+	JumbleExpr(jstate, query->limitOffset);
+	JumbleExpr(jstate, query->limitCount);
+	/* we ignore rowMarks */
+	JumbleExpr(jstate, query->setOperations);
+}
+
+/*
+ * Jumble a range table
+ */
+static void
+JumbleRangeTable(pgssJumbleState *jstate, List *rtable)
+{
+	ListCell   *lc;
+	Relation rel;
+
+	foreach(lc, rtable)
+	{
+		RangeTblEntry *rte = (RangeTblEntry *) lfirst(lc);
+
+		Assert(IsA(rte, RangeTblEntry));
+		APP_JUMB(rte->rtekind);
+		switch (rte->rtekind)
+		{
+			case RTE_RELATION:
+				rel = RelationIdGetRelation(rte->relid);
+				APP_JUMB_STRING(RelationGetRelationName(rel));
+				RelationClose(rel);
+				break;
+			case RTE_SUBQUERY:
+				JumbleQuery(jstate, rte->subquery);
+				break;
+			case RTE_JOIN:
+				APP_JUMB(rte->jointype);
+				break;
+			case RTE_FUNCTION:
+				JumbleExpr(jstate, (Node *) rte->functions);
+				break;
+			case RTE_VALUES:
+				JumbleExpr(jstate, (Node *) rte->values_lists);
+				break;
+			case RTE_CTE:
+
+				/*
+				 * Depending on the CTE name here isn't ideal, but it's the
+				 * only info we have to identify the referenced WITH item.
+				 */
+				APP_JUMB_STRING(rte->ctename);
+				APP_JUMB(rte->ctelevelsup);
+				break;
+			default:
+				elog(ERROR, "unrecognized RTE kind: %d", (int) rte->rtekind);
+				break;
+		}
+	}
+}
+
+/*
+ * Jumble an expression tree
+ *
+ * In general this function should handle all the same node types that
+ * expression_tree_walker() does, and therefore it's coded to be as parallel
+ * to that function as possible.  However, since we are only invoked on
+ * queries immediately post-parse-analysis, we need not handle node types
+ * that only appear in planning.
+ *
+ * Note: the reason we don't simply use expression_tree_walker() is that the
+ * point of that function is to support tree walkers that don't care about
+ * most tree node types, but here we care about all types.  We should complain
+ * about any unrecognized node type.
+ */
+static void
+JumbleExpr(pgssJumbleState *jstate, Node *node)
+{
+	ListCell   *temp;
+
+	if (node == NULL)
+		return;
+
+	/* Guard against stack overflow due to overly complex expressions */
+	check_stack_depth();
+
+	/*
+	 * We always emit the node's NodeTag, then any additional fields that are
+	 * considered significant, and then we recurse to any child nodes.
+	 */
+	APP_JUMB(node->type);
+
+	switch (nodeTag(node))
+	{
+		case T_Var:
+			{
+				Var		   *var = (Var *) node;
+
+				APP_JUMB(var->varno);
+				APP_JUMB(var->varattno);
+				APP_JUMB(var->varlevelsup);
+			}
+			break;
+		case T_Const:
+			{
+				Const	   *c = (Const *) node;
+
+				/* We jumble only the constant's type, not its value */
+				APP_JUMB(c->consttype);
+				/* Also, record its parse location for query normalization */
+				RecordConstLocation(jstate, c->location);
+			}
+			break;
+		case T_Param:
+			{
+				Param	   *p = (Param *) node;
+
+				APP_JUMB(p->paramkind);
+				APP_JUMB(p->paramid); /* FIXME */
+				APP_JUMB(p->paramtype);
+			}
+			break;
+		case T_Aggref:
+			{
+				Aggref	   *expr = (Aggref *) node;
+
+				APP_JUMB(expr->aggfnoid); /* FIXME */
+				JumbleExpr(jstate, (Node *) expr->aggdirectargs);
+				JumbleExpr(jstate, (Node *) expr->args);
+				JumbleExpr(jstate, (Node *) expr->aggorder);
+				JumbleExpr(jstate, (Node *) expr->aggdistinct);
+				JumbleExpr(jstate, (Node *) expr->aggfilter);
+			}
+			break;
+		case T_WindowFunc:
+			{
+				WindowFunc *expr = (WindowFunc *) node;
+
+				APP_JUMB(expr->winfnoid); /* FIXME */
+				APP_JUMB(expr->winref);
+				JumbleExpr(jstate, (Node *) expr->args);
+				JumbleExpr(jstate, (Node *) expr->aggfilter);
+			}
+			break;
+		case T_ArrayRef:
+			{
+				ArrayRef   *aref = (ArrayRef *) node;
+
+				JumbleExpr(jstate, (Node *) aref->refupperindexpr);
+				JumbleExpr(jstate, (Node *) aref->reflowerindexpr);
+				JumbleExpr(jstate, (Node *) aref->refexpr);
+				JumbleExpr(jstate, (Node *) aref->refassgnexpr);
+			}
+			break;
+		case T_FuncExpr:
+			{
+				FuncExpr   *expr = (FuncExpr *) node;
+				char *funcname = get_func_name(expr->funcid);
+
+				APP_JUMB_STRING(funcname);
+				JumbleExpr(jstate, (Node *) expr->args);
+			}
+			break;
+		case T_NamedArgExpr:
+			{
+				NamedArgExpr *nae = (NamedArgExpr *) node;
+
+				APP_JUMB(nae->argnumber);
+				JumbleExpr(jstate, (Node *) nae->arg);
+			}
+			break;
+		case T_OpExpr:
+		case T_DistinctExpr:	/* struct-equivalent to OpExpr */
+		case T_NullIfExpr:		/* struct-equivalent to OpExpr */
+			{
+				OpExpr	   *expr = (OpExpr *) node;
+
+				APP_JUMB(expr->opno);
+				JumbleExpr(jstate, (Node *) expr->args);
+			}
+			break;
+		case T_ScalarArrayOpExpr:
+			{
+				ScalarArrayOpExpr *expr = (ScalarArrayOpExpr *) node;
+
+				APP_JUMB(expr->opno);
+				APP_JUMB(expr->useOr);
+				JumbleExpr(jstate, (Node *) expr->args);
+			}
+			break;
+		case T_BoolExpr:
+			{
+				BoolExpr   *expr = (BoolExpr *) node;
+
+				APP_JUMB(expr->boolop);
+				JumbleExpr(jstate, (Node *) expr->args);
+			}
+			break;
+		case T_SubLink:
+			{
+				SubLink    *sublink = (SubLink *) node;
+
+				APP_JUMB(sublink->subLinkType);
+				JumbleExpr(jstate, (Node *) sublink->testexpr);
+				JumbleQuery(jstate, (Query *) sublink->subselect);
+			}
+			break;
+		case T_FieldSelect:
+			{
+				FieldSelect *fs = (FieldSelect *) node;
+
+				APP_JUMB(fs->fieldnum);
+				JumbleExpr(jstate, (Node *) fs->arg);
+			}
+			break;
+		case T_FieldStore:
+			{
+				FieldStore *fstore = (FieldStore *) node;
+
+				JumbleExpr(jstate, (Node *) fstore->arg);
+				JumbleExpr(jstate, (Node *) fstore->newvals);
+			}
+			break;
+		case T_RelabelType:
+			{
+				RelabelType *rt = (RelabelType *) node;
+
+				APP_JUMB(rt->resulttype);
+				JumbleExpr(jstate, (Node *) rt->arg);
+			}
+			break;
+		case T_CoerceViaIO:
+			{
+				CoerceViaIO *cio = (CoerceViaIO *) node;
+
+				APP_JUMB(cio->resulttype);
+				JumbleExpr(jstate, (Node *) cio->arg);
+			}
+			break;
+		case T_ArrayCoerceExpr:
+			{
+				ArrayCoerceExpr *acexpr = (ArrayCoerceExpr *) node;
+
+				APP_JUMB(acexpr->resulttype);
+				JumbleExpr(jstate, (Node *) acexpr->arg);
+			}
+			break;
+		case T_ConvertRowtypeExpr:
+			{
+				ConvertRowtypeExpr *crexpr = (ConvertRowtypeExpr *) node;
+
+				APP_JUMB(crexpr->resulttype);
+				JumbleExpr(jstate, (Node *) crexpr->arg);
+			}
+			break;
+		case T_CollateExpr:
+			{
+				CollateExpr *ce = (CollateExpr *) node;
+
+				APP_JUMB(ce->collOid); /* FIXME */
+				JumbleExpr(jstate, (Node *) ce->arg);
+			}
+			break;
+		case T_CaseExpr:
+			{
+				CaseExpr   *caseexpr = (CaseExpr *) node;
+
+				JumbleExpr(jstate, (Node *) caseexpr->arg);
+				foreach(temp, caseexpr->args)
+				{
+					CaseWhen   *when = (CaseWhen *) lfirst(temp);
+
+					Assert(IsA(when, CaseWhen));
+					JumbleExpr(jstate, (Node *) when->expr);
+					JumbleExpr(jstate, (Node *) when->result);
+				}
+				JumbleExpr(jstate, (Node *) caseexpr->defresult);
+			}
+			break;
+		case T_CaseTestExpr:
+			{
+				CaseTestExpr *ct = (CaseTestExpr *) node;
+
+				APP_JUMB(ct->typeId);
+			}
+			break;
+		case T_ArrayExpr:
+			JumbleExpr(jstate, (Node *) ((ArrayExpr *) node)->elements);
+			break;
+		case T_RowExpr:
+			JumbleExpr(jstate, (Node *) ((RowExpr *) node)->args);
+			break;
+		case T_RowCompareExpr:
+			{
+				RowCompareExpr *rcexpr = (RowCompareExpr *) node;
+
+				APP_JUMB(rcexpr->rctype);
+				JumbleExpr(jstate, (Node *) rcexpr->largs);
+				JumbleExpr(jstate, (Node *) rcexpr->rargs);
+			}
+			break;
+		case T_CoalesceExpr:
+			JumbleExpr(jstate, (Node *) ((CoalesceExpr *) node)->args);
+			break;
+		case T_MinMaxExpr:
+			{
+				MinMaxExpr *mmexpr = (MinMaxExpr *) node;
+
+				APP_JUMB(mmexpr->op);
+				JumbleExpr(jstate, (Node *) mmexpr->args);
+			}
+			break;
+		case T_XmlExpr:
+			{
+				XmlExpr    *xexpr = (XmlExpr *) node;
+
+				APP_JUMB(xexpr->op);
+				JumbleExpr(jstate, (Node *) xexpr->named_args);
+				JumbleExpr(jstate, (Node *) xexpr->args);
+			}
+			break;
+		case T_NullTest:
+			{
+				NullTest   *nt = (NullTest *) node;
+
+				APP_JUMB(nt->nulltesttype);
+				JumbleExpr(jstate, (Node *) nt->arg);
+			}
+			break;
+		case T_BooleanTest:
+			{
+				BooleanTest *bt = (BooleanTest *) node;
+
+				APP_JUMB(bt->booltesttype);
+				JumbleExpr(jstate, (Node *) bt->arg);
+			}
+			break;
+		case T_CoerceToDomain:
+			{
+				CoerceToDomain *cd = (CoerceToDomain *) node;
+
+				APP_JUMB(cd->resulttype);
+				JumbleExpr(jstate, (Node *) cd->arg);
+			}
+			break;
+		case T_CoerceToDomainValue:
+			{
+				CoerceToDomainValue *cdv = (CoerceToDomainValue *) node;
+
+				APP_JUMB(cdv->typeId); /* FIXME */
+			}
+			break;
+		case T_SetToDefault:
+			{
+				SetToDefault *sd = (SetToDefault *) node;
+
+				APP_JUMB(sd->typeId); /* FIXME */
+			}
+			break;
+		case T_CurrentOfExpr:
+			{
+				CurrentOfExpr *ce = (CurrentOfExpr *) node;
+
+				APP_JUMB(ce->cvarno);
+				if (ce->cursor_name)
+					APP_JUMB_STRING(ce->cursor_name);
+				APP_JUMB(ce->cursor_param);
+			}
+			break;
+		case T_TargetEntry:
+			{
+				TargetEntry *tle = (TargetEntry *) node;
+
+				APP_JUMB(tle->resno);
+				APP_JUMB(tle->ressortgroupref);
+				JumbleExpr(jstate, (Node *) tle->expr);
+			}
+			break;
+		case T_RangeTblRef:
+			{
+				RangeTblRef *rtr = (RangeTblRef *) node;
+
+				APP_JUMB(rtr->rtindex);
+			}
+			break;
+		case T_JoinExpr:
+			{
+				JoinExpr   *join = (JoinExpr *) node;
+
+				APP_JUMB(join->jointype);
+				APP_JUMB(join->isNatural);
+				APP_JUMB(join->rtindex);
+				JumbleExpr(jstate, join->larg);
+				JumbleExpr(jstate, join->rarg);
+				JumbleExpr(jstate, join->quals);
+			}
+			break;
+		case T_FromExpr:
+			{
+				FromExpr   *from = (FromExpr *) node;
+
+				JumbleExpr(jstate, (Node *) from->fromlist);
+				JumbleExpr(jstate, from->quals);
+			}
+			break;
+		case T_List:
+			foreach(temp, (List *) node)
+			{
+				JumbleExpr(jstate, (Node *) lfirst(temp));
+			}
+			break;
+		case T_SortGroupClause:
+			{
+				SortGroupClause *sgc = (SortGroupClause *) node;
+
+				APP_JUMB(sgc->tleSortGroupRef);
+				APP_JUMB(sgc->eqop);
+				APP_JUMB(sgc->sortop);
+				APP_JUMB(sgc->nulls_first);
+			}
+			break;
+		case T_WindowClause:
+			{
+				WindowClause *wc = (WindowClause *) node;
+
+				APP_JUMB(wc->winref);
+				APP_JUMB(wc->frameOptions);
+				JumbleExpr(jstate, (Node *) wc->partitionClause);
+				JumbleExpr(jstate, (Node *) wc->orderClause);
+				JumbleExpr(jstate, wc->startOffset);
+				JumbleExpr(jstate, wc->endOffset);
+			}
+			break;
+		case T_CommonTableExpr:
+			{
+				CommonTableExpr *cte = (CommonTableExpr *) node;
+
+				/* we store the string name because RTE_CTE RTEs need it */
+				APP_JUMB_STRING(cte->ctename);
+				JumbleQuery(jstate, (Query *) cte->ctequery);
+			}
+			break;
+		case T_SetOperationStmt:
+			{
+				SetOperationStmt *setop = (SetOperationStmt *) node;
+
+				APP_JUMB(setop->op);
+				APP_JUMB(setop->all);
+				JumbleExpr(jstate, setop->larg);
+				JumbleExpr(jstate, setop->rarg);
+			}
+			break;
+		case T_RangeTblFunction:
+			{
+				RangeTblFunction *rtfunc = (RangeTblFunction *) node;
+
+				JumbleExpr(jstate, rtfunc->funcexpr);
+			}
+			break;
+		default:
+			/* Only a warning, since we can stumble along anyway */
+			elog(WARNING, "unrecognized node type: %d",
+				 (int) nodeTag(node));
+			break;
+	}
+}
+
+/*
+ * Record location of constant within query string of query tree
+ * that is currently being walked.
+ */
+static void
+RecordConstLocation(pgssJumbleState *jstate, int location)
+{
+	/* -1 indicates unknown or undefined location */
+	if (location >= 0)
+	{
+		/* enlarge array if needed */
+		if (jstate->clocations_count >= jstate->clocations_buf_size)
+		{
+			jstate->clocations_buf_size *= 2;
+			jstate->clocations = (pgssLocationLen *)
+				repalloc(jstate->clocations,
+						 jstate->clocations_buf_size *
+						 sizeof(pgssLocationLen));
+		}
+		jstate->clocations[jstate->clocations_count].location = location;
+		/* initialize lengths to -1 to simplify fill_in_constant_lengths */
+		jstate->clocations[jstate->clocations_count].length = -1;
+		jstate->clocations_count++;
+	}
+}
+
+/*
+ * Generate a normalized version of the query string that will be used to
+ * represent all similar queries.
+ *
+ * Note that the normalized representation may well vary depending on
+ * just which "equivalent" query is used to create the hashtable entry.
+ * We assume this is OK.
+ *
+ * *query_len_p contains the input string length, and is updated with
+ * the result string length (which cannot be longer) on exit.
+ *
+ * Returns a palloc'd string.
+ */
+static char *
+generate_normalized_query(pgssJumbleState *jstate, const char *query,
+						  int *query_len_p, int encoding)
+{
+	char	   *norm_query;
+	int			query_len = *query_len_p;
+	int			i,
+				len_to_wrt,		/* Length (in bytes) to write */
+				quer_loc = 0,	/* Source query byte location */
+				n_quer_loc = 0, /* Normalized query byte location */
+				last_off = 0,	/* Offset from start for previous tok */
+				last_tok_len = 0;		/* Length (in bytes) of that tok */
+
+	/*
+	 * Get constants' lengths (core system only gives us locations).  Note
+	 * this also ensures the items are sorted by location.
+	 */
+	fill_in_constant_lengths(jstate, query);
+
+	/* Allocate result buffer */
+	norm_query = palloc(query_len + 1);
+
+	for (i = 0; i < jstate->clocations_count; i++)
+	{
+		int			off,		/* Offset from start for cur tok */
+					tok_len;	/* Length (in bytes) of that tok */
+
+		off = jstate->clocations[i].location;
+		tok_len = jstate->clocations[i].length;
+
+		if (tok_len < 0)
+			continue;			/* ignore any duplicates */
+
+		/* Copy next chunk (what precedes the next constant) */
+		len_to_wrt = off - last_off;
+		len_to_wrt -= last_tok_len;
+
+		Assert(len_to_wrt >= 0);
+		memcpy(norm_query + n_quer_loc, query + quer_loc, len_to_wrt);
+		n_quer_loc += len_to_wrt;
+
+		/* And insert a '?' in place of the constant token */
+		norm_query[n_quer_loc++] = '?';
+
+		quer_loc = off + tok_len;
+		last_off = off;
+		last_tok_len = tok_len;
+	}
+
+	/*
+	 * We've copied up until the last ignorable constant.  Copy over the
+	 * remaining bytes of the original query string.
+	 */
+	len_to_wrt = query_len - quer_loc;
+
+	Assert(len_to_wrt >= 0);
+	memcpy(norm_query + n_quer_loc, query + quer_loc, len_to_wrt);
+	n_quer_loc += len_to_wrt;
+
+	Assert(n_quer_loc <= query_len);
+	norm_query[n_quer_loc] = '\0';
+
+	*query_len_p = n_quer_loc;
+	return norm_query;
+}
+
+/*
+ * Given a valid SQL string and an array of constant-location records,
+ * fill in the textual lengths of those constants.
+ *
+ * The constants may use any allowed constant syntax, such as float literals,
+ * bit-strings, single-quoted strings and dollar-quoted strings.  This is
+ * accomplished by using the public API for the core scanner.
+ *
+ * It is the caller's job to ensure that the string is a valid SQL statement
+ * with constants at the indicated locations.  Since in practice the string
+ * has already been parsed, and the locations that the caller provides will
+ * have originated from within the authoritative parser, this should not be
+ * a problem.
+ *
+ * Duplicate constant pointers are possible, and will have their lengths
+ * marked as '-1', so that they are later ignored.  (Actually, we assume the
+ * lengths were initialized as -1 to start with, and don't change them here.)
+ *
+ * N.B. There is an assumption that a '-' character at a Const location begins
+ * a negative numeric constant.  This precludes there ever being another
+ * reason for a constant to start with a '-'.
+ */
+static void
+fill_in_constant_lengths(pgssJumbleState *jstate, const char *query)
+{
+	pgssLocationLen *locs;
+	core_yyscan_t yyscanner;
+	core_yy_extra_type yyextra;
+	core_YYSTYPE yylval;
+	YYLTYPE		yylloc;
+	int			last_loc = -1;
+	int			i;
+
+	/*
+	 * Sort the records by location so that we can process them in order while
+	 * scanning the query text.
+	 */
+	if (jstate->clocations_count > 1)
+		qsort(jstate->clocations, jstate->clocations_count,
+			  sizeof(pgssLocationLen), comp_location);
+	locs = jstate->clocations;
+
+	/* initialize the flex scanner --- should match raw_parser() */
+	yyscanner = scanner_init(query,
+							 &yyextra,
+							 ScanKeywords,
+							 NumScanKeywords);
+
+	/* Search for each constant, in sequence */
+	for (i = 0; i < jstate->clocations_count; i++)
+	{
+		int			loc = locs[i].location;
+		int			tok;
+
+		Assert(loc >= 0);
+
+		if (loc <= last_loc)
+			continue;			/* Duplicate constant, ignore */
+
+		/* Lex tokens until we find the desired constant */
+		for (;;)
+		{
+			tok = core_yylex(&yylval, &yylloc, yyscanner);
+
+			/* We should not hit end-of-string, but if we do, behave sanely */
+			if (tok == 0)
+				break;			/* out of inner for-loop */
+
+			/*
+			 * We should find the token position exactly, but if we somehow
+			 * run past it, work with that.
+			 */
+			if (yylloc >= loc)
+			{
+				if (query[loc] == '-')
+				{
+					/*
+					 * It's a negative value - this is the one and only case
+					 * where we replace more than a single token.
+					 *
+					 * Do not compensate for the core system's special-case
+					 * adjustment of location to that of the leading '-'
+					 * operator in the event of a negative constant.  It is
+					 * also useful for our purposes to start from the minus
+					 * symbol.  In this way, queries like "select * from foo
+					 * where bar = 1" and "select * from foo where bar = -2"
+					 * will have identical normalized query strings.
+					 */
+					tok = core_yylex(&yylval, &yylloc, yyscanner);
+					if (tok == 0)
+						break;	/* out of inner for-loop */
+				}
+
+				/*
+				 * We now rely on the assumption that flex has placed a zero
+				 * byte after the text of the current token in scanbuf.
+				 */
+				locs[i].length = strlen(yyextra.scanbuf + loc);
+				break;			/* out of inner for-loop */
+			}
+		}
+
+		/* If we hit end-of-string, give up, leaving remaining lengths -1 */
+		if (tok == 0)
+			break;
+
+		last_loc = loc;
+	}
+
+	scanner_finish(yyscanner);
+}
+
+/*
+ * comp_location: comparator for qsorting pgssLocationLen structs by location
+ */
+static int
+comp_location(const void *a, const void *b)
+{
+	int			l = ((const pgssLocationLen *) a)->location;
+	int			r = ((const pgssLocationLen *) b)->location;
+
+	if (l < r)
+		return -1;
+	else if (l > r)
+		return +1;
+	else
+		return 0;
+}
+
+/*
+ * parse a sql firewall rule engine name to its engine id
+ *
+ * TODO: capital consideration
+ */
+static uint32
+rule_typeid(const char *rule_type_name)
+{
+	uint32 rule_type = (uint32)PGFW_DUMMY_ENTRY;
+
+	for (int i = 0; rule_type_options[i].name != NULL; i++)
+	{
+		if (!strcmp(rule_type_name, rule_type_options[i].name))
+		{
+			rule_type = rule_type_options[i].val;
+			break;
+		}
+	}
+
+	return rule_type;
+}
+
+/*
+ * used for user display only, make a more readable display
+ */
+static char *
+rule_typename(char rule_type)
+{
+	char *typename = "unknown";
+
+	switch (rule_type)
+	{
+	case PGFW_DUMMY_ENTRY:
+		typename = "dummy";
+		break;
+	case PGFW_WHITELIST_ENTRY:
+		typename = "whitelist";
+		break;
+	case PGFW_BLACKLIST_ENTRY:
+		typename = "blacklist";
+		break;
+	}
+
+	return typename;
+}
+
+/*
+ * add a sql firewall rule, it is a blacklist rule. This rule would
+ * prohibit user to query database.
+ *
+ * user name is empty '', means the rule would prohibit all user's query.
+ *
+ * engine can be one of [white, black]:
+ *   white: means it is a rule entry to be inserted to whitelist
+ *   black: means it is a rule entry to be inserted to blacklist
+ *
+ */
+Datum
+sql_firewall_add_rule(PG_FUNCTION_ARGS)
+{
+	char	   *username        = text_to_cstring(PG_GETARG_TEXT_P(0));
+	char	   *query_string    = text_to_cstring(PG_GETARG_TEXT_P(1));
+	char	   *rule_type_name  = text_to_cstring(PG_GETARG_TEXT_P(2));
+	uint32	    rule_type       = rule_typeid(rule_type_name);
+
+	/* hash table must exist already */
+	if (!pgss || !pgss_hash)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("sql_firewall must be loaded via shared_preload_libraries")));
+
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 (errmsg("must be superuser to use sql_firewall_add_rule"))));
+
+	if (pgfw_mode != PGFW_MODE_DISABLED)
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("sql_firewall_add_rule() is available only under the disable mode")));
+
+	if (rule_type == PGFW_DUMMY_ENTRY)
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("sql_firewall_add_rule() engine must be one of [\'whitelist\', \'blacklist\']")));
+
+
+	rule_changes_begin();
+	add_rule(username, query_string, rule_type);
+	rule_changes_end();
+
+	PG_RETURN_BOOL(true);
+}
+
+/*
+ * delete a sql firewall rule, it is a blacklist rule.
+ *
+ * user name is empty '', means the rule would prohibit all user's query.
+ *
+ * engine can be one of [white, black, both]:
+ *   white: means only delete the mathed rule entry from whitelist
+ *   black: means only delete the mathed rule entry from blacklist
+ *   both : means only delete the mathed rule entry from whitelist and blacklist
+ */
+Datum
+sql_firewall_del_rule(PG_FUNCTION_ARGS)
+{
+	char	   *username        = text_to_cstring(PG_GETARG_TEXT_P(0));
+	char	   *query_string    = text_to_cstring(PG_GETARG_TEXT_P(1));
+	char	   *rule_type_name  = text_to_cstring(PG_GETARG_TEXT_P(2));
+	uint32	    rule_type       = rule_typeid(rule_type_name);
+
+	/* hash table must exist already */
+	if (!pgss || !pgss_hash)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("sql_firewall must be loaded via shared_preload_libraries")));
+
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 (errmsg("must be superuser to use sql_firewall_del_rule"))));
+
+	if (pgfw_mode != PGFW_MODE_DISABLED)
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("sql_firewall_del_rule() is available only under the disable mode")));
+
+	rule_changes_begin();
+	del_rule(username, query_string, rule_type);
+	rule_changes_end();
+
+	PG_RETURN_BOOL(true);
+}
+
+static int
+__add_rule(Oid user, uint32 queryid, const char *query_string, uint32 rule_type)
+{
+	bool ret;
+
+	elog(DEBUG1, "sql firewall: __add_rule: [:user_id %u, :query_id %u, query: %s, rule_type: %c]",
+		 user, queryid, query_string, rule_type);
+
+	ret = pgss_restore(user,
+					   queryid,
+					   query_string,
+					   0,
+					   0,
+					   rule_type);
+
+	elog(DEBUG1, "sql firewall: __add_rule: result %d", ret);
+
+	return 0;
+}
+
+/*
+ * add a firewall rule
+ */
+static int
+add_rule(const char* user, const char *query_string, uint32 rule_type)
+{
+	Oid          userid;
+	uint32       queryid;
+	int          ret;
+	char        *normalized_query = NULL;
+	char        *query            = NULL;
+
+	/*
+	 * InvalidOid as user id, means any user.
+	 */
+	userid   = get_role_oid(user, true);
+	queryid  = sql_firewall_queryid(query_string, &normalized_query);
+	query    = normalized_query ? normalized_query : (char *)query_string;
+	ret      = __add_rule(userid, queryid, query, rule_type);
+	
+	if (normalized_query)
+		pfree(normalized_query);
+
+	return ret;
+}
+
+/*
+ * delete an entry of the given key (userid, queryid) from the hash table.
+ */
+static int
+entry_delete(Oid dbid, Oid userid, uint32 queryid, uint32 rule_type)
+{
+	pgssHashKey key;
+
+	/*
+	 * 10 | 3294787656 | select * from k1 where uid = ?; |     2
+	 */
+	key.userid   = userid;
+	key.queryid  = queryid;
+	key.type     = rule_type;
+	key.dbid     = dbid;
+
+	/* add what we counted to the entry before it goes away */
+	local_cache_flush_counters();
+
+	/*
+	 * remove the entry from the hash table.
+	 */
+	pgfw_lock_acquire(LW_EXCLUSIVE);
+	if (entry_remove(&key))
+	{
+		invalidate_rule_snapshot();
+		rule_log_append(PGFW_RULE_LOG_DELETE, &key, NULL, NULL, 0, 0);
+	}
+	LWLockRelease(pgss->lock);
+
+	return 0;
+}
+
+/*
+ * Remove an entry from the hashtable, and from the count of its database.
+ * caller must hold an exclusive lock on pgss->lock
+ *
+ * return false if there was no such entry
+ */
+static bool
+entry_remove(const pgssHashKey *key)
+{
+	/* a rule change for the standbys, to be undone if it aborts? */
+	if (rule_changes_lxid != InvalidLocalTransactionId &&
+		rule_changes_lxid == MyProc->lxid)
+	{
+		pgssEntry  *entry = hash_search(pgss_hash, key, HASH_FIND, NULL);
+
+		if (entry != NULL)
+			rule_change_save_removed(entry);
+	}
+
+	if (hash_search(pgss_hash, key, HASH_REMOVE, NULL) == NULL)
+		return false;
+
+	partition_count(key->dbid, -1);
+	return true;
+}
+
+/*
+ * May a rule be created in the database dbid?  If not, why is warned about.
+ * caller must hold an exclusive lock on pgss->lock
+ */
+static bool
+partition_admit(Oid dbid)
+{
+	pgfwPartition *partition;
+
+	partition = (pgfwPartition *) hash_search(pgfw_partitions, &dbid,
+											  HASH_FIND, NULL);
+
+	/*
+	 * A shared hashtable takes what shared memory is left once it is full,
+	 * so its size is no limit: check the number of partitions ourselves.
+	 */
+	if (partition == NULL &&
+		hash_get_num_entries(pgfw_partitions) < PGFW_MAX_PARTITIONS)
+	{
+		partition = (pgfwPartition *) hash_search(pgfw_partitions, &dbid,
+												  HASH_ENTER_NULL, NULL);
+		if (partition != NULL)
+			partition->nrules = 0;
+	}
+	if (partition == NULL)
+	{
+		ereport(WARNING,
+				(errmsg("Number of databases with rules exceeded the limit of %d.",
+						PGFW_MAX_PARTITIONS)));
+		return false;
+	}
+
+	if (pgfw_max_per_database > 0 &&
+		partition->nrules >= pgfw_max_per_database)
+	{
+		ereport(WARNING,
+				(errmsg("Number of queries of database %u exceeded the <sql_firewall.max_per_database> limit.",
+						dbid)));
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Count a rule created (delta 1) or removed (delta -1) in the database dbid.
+ * caller must hold an exclusive lock on pgss->lock
+ */
+static void
+partition_count(Oid dbid, int delta)
+{
+	pgfwPartition *partition;
+
+	if (dbid == InvalidOid)
+		return;
+
+	/* partition_admit() made the partition of every rule created */
+	partition = (pgfwPartition *) hash_search(pgfw_partitions, &dbid,
+											  HASH_FIND, NULL);
+	if (partition == NULL)
+		return;
+
+	partition->nrules += delta;
+	pgss->database_rules += delta;
+
+	if (partition->nrules <= 0)
+		hash_search(pgfw_partitions, &dbid, HASH_REMOVE, NULL);
+}
+
+static int
+__del_rule(Oid userid, uint32 queryid, const char *query_string, uint32 rule_type)
+{
+	int      ret;
+
+	elog(DEBUG1, "sql firewall: __del_rule: [:user_id %u, :query_id %u, query: %s, rule_type:%c]",
+		 userid, queryid, query_string, rule_type);
+
+	ret = entry_delete(pgfw_current_dbid(), userid, queryid, rule_type);
+
+	elog(DEBUG1, "sql firewall: __del_rule: result %d", ret);
+
+	return ret;
+}
+
+/*
+ * delete a firewall rule
+ */
+static int
+del_rule(const char* user, const char *query_string, uint32 rule_type)
+{
+	Oid          userid;
+	uint32       queryid;
+	int          ret;
+
+	/*
+	 * InvalidOid as user id, means any user.
+	 */
+	userid   = get_role_oid(user, true);
+	queryid  = sql_firewall_queryid(query_string, NULL);
+	ret      = __del_rule(userid, queryid, query_string, rule_type);
+	
+	return ret;
+}
+
+/*
+ * add a structural rule: let the user run the operations on a relation, or
+ * on the relations of a schema, of the current database.
+ *
+ * user name is empty '', means the rule would allow all users.
+ *
+ * operation is a comma-separated list of [select, insert, update, delete],
+ * or all.  object is a relation name, or a schema name followed by '.*'.
+ */
+Datum
+sql_firewall_add_structural_rule(PG_FUNCTION_ARGS)
+{
+	char	   *username  = text_to_cstring(PG_GETARG_TEXT_P(0));
+	char	   *operation = text_to_cstring(PG_GETARG_TEXT_P(1));
+	char	   *object    = text_to_cstring(PG_GETARG_TEXT_P(2));
+	AclMode		operations;
+	char		kind;
+	Oid			objid;
+
+	/* hash table must exist already */
+	if (!pgss || !pgss_hash)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("sql_firewall must be loaded via shared_preload_libraries")));
+
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 (errmsg("must be superuser to use sql_firewall_add_structural_rule"))));
+
+	if (pgfw_mode != PGFW_MODE_DISABLED)
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("sql_firewall_add_structural_rule() is available only under the disable mode")));
+
+	operations = structural_operations(operation);
+	structural_object(object, &kind, &objid);
+
+	structural_change(get_role_oid(username, true), kind, objid,
+					  operations, true);
+
+	PG_RETURN_BOOL(true);
+}
+
+/*
+ * delete the operations from a structural rule, and the rule itself once
+ * it allows none.  Arguments as for sql_firewall_add_structural_rule().
+ *
+ * return false if there was no such rule
+ */
+Datum
+sql_firewall_del_structural_rule(PG_FUNCTION_ARGS)
+{
+	char	   *username  = text_to_cstring(PG_GETARG_TEXT_P(0));
+	char	   *operation = text_to_cstring(PG_GETARG_TEXT_P(1));
+	char	   *object    = text_to_cstring(PG_GETARG_TEXT_P(2));
+	AclMode		operations;
+	char		kind;
+	Oid			objid;
+
+	/* hash table must exist already */
+	if (!pgss || !pgss_hash)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("sql_firewall must be loaded via shared_preload_libraries")));
+
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 (errmsg("must be superuser to use sql_firewall_del_structural_rule"))));
+
+	if (pgfw_mode != PGFW_MODE_DISABLED)
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("sql_firewall_del_structural_rule() is available only under the disable mode")));
+
+	operations = structural_operations(operation);
+	structural_object(object, &kind, &objid);
+
+	PG_RETURN_BOOL(structural_change(get_role_oid(username, true), kind,
+									 objid, operations, false));
+}
+
+#define SQL_FIREWALL_STRUCTURAL_COLS	5
+
+/*
+ * The structural rules of all databases.
+ */
+Datum
+sql_firewall_structural_rules(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	pgfwStructuralRules *rules;
+	int			i;
+	Datum		values[SQL_FIREWALL_STRUCTURAL_COLS];
+	bool		nulls[SQL_FIREWALL_STRUCTURAL_COLS];
+
+	/* hash table must exist already */
+	if (!pgss || !pgss_hash)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("sql_firewall must be loaded via shared_preload_libraries")));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	Assert(tupdesc->natts == SQL_FIREWALL_STRUCTURAL_COLS);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	memset(nulls, 0, sizeof(nulls));
+
+	pgfw_lock_acquire(LW_SHARED);
+
+	rules = pgss->structural;
+	for (i = 0; i < rules->nrules; i++)
+	{
+		pgfwStructuralRule *rule = &rules->rules[i];
+		StringInfoData buf;
+
+		initStringInfo(&buf);
+		if (rule->operations & ACL_SELECT)
+			appendStringInfoString(&buf, ",select");
+		if (rule->operations & ACL_INSERT)
+			appendStringInfoString(&buf, ",insert");
+		if (rule->operations & ACL_UPDATE)
+			appendStringInfoString(&buf, ",update");
+		if (rule->operations & ACL_DELETE)
+			appendStringInfoString(&buf, ",delete");
+
+		values[0] = ObjectIdGetDatum(rule->userid);
+		values[1] = ObjectIdGetDatum(rule->dbid);
+		values[2] = CharGetDatum(rule->kind);
+		values[3] = ObjectIdGetDatum(rule->objid);
+		values[4] = CStringGetTextDatum(buf.len > 0 ? buf.data + 1 : "");
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	LWLockRelease(pgss->lock);
+
+	MemoryContextSwitchTo(oldcontext);
+
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+#define SQL_FIREWALL_VIOLATIONS_COLS	6
+
+/*
+ * The violations kept in the ring, the oldest first.  Only superusers see
+ * the statements of the other users.
+ */
+Datum
+sql_firewall_violations(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	volatile pgfwViolationRing *ring;
+	uint64		next;
+	uint64		first;
+	uint64		i;
+	Oid			userid = GetUserId();
+	bool		is_superuser = superuser();
+	Datum		values[SQL_FIREWALL_VIOLATIONS_COLS];
+	bool		nulls[SQL_FIREWALL_VIOLATIONS_COLS];
+
+	/* hash table must exist already */
+	if (!pgss || !pgss_hash)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("sql_firewall must be loaded via shared_preload_libraries")));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	Assert(tupdesc->natts == SQL_FIREWALL_VIOLATIONS_COLS);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	ring = pgss->violations;
+
+	/*
+	 * Only the range of the events is read under the lock of the ring.  The
+	 * events are copied out one at a time under the lock of their slot, so
+	 * that neither lock is held long; those overwritten meanwhile, or still
+	 * being written, are left out.
+	 */
+	SpinLockAcquire(&ring->mutex);
+	next = ring->next;
+	first = ring->first;
+	SpinLockRelease(&ring->mutex);
+
+	if (next - first > ring->nevents)
+		first = next - ring->nevents;
+
+	memset(nulls, 0, sizeof(nulls));
+
+	for (i = first; i < next; i++)
+	{
+		volatile pgfwViolation *slot = &ring->events[i % ring->nevents];
+		pgfwViolation event;
+		bool		valid;
+
+		SpinLockAcquire(&slot->mutex);
+		valid = (slot->seq == i + 1);
+		if (valid)
+			memcpy(&event, (pgfwViolation *) slot, sizeof(pgfwViolation));
+		SpinLockRelease(&slot->mutex);
+
+		if (!valid)
+			continue;
+
+		values[0] = TimestampTzGetDatum(event.time);
+		values[1] = ObjectIdGetDatum(event.userid);
+		values[2] = ObjectIdGetDatum(event.dbid);
+		values[3] = Int64GetDatum((int64) event.queryid);
+		values[4] = CStringGetTextDatum(event.enforced ? "error" : "warning");
+		if (is_superuser || event.userid == userid)
+			values[5] = CStringGetTextDatum(event.query);
+		else
+			values[5] = CStringGetTextDatum("<insufficient privilege>");
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+/*
+ * Do the structural rules allow this statement?
+ *
+ * They do when the statement accesses at least one relation, and the
+ * structural rules of the user, or of all users, in this database allow
+ * every access: the privileges the executor checks on each relation, like
+ * GRANT does.  Relations read through a view are checked as the view
+ * owner, so only the view needs a rule.  Functions scanned in FROM are
+ * not covered by any rule, nor are utility statements.
+ *
+ * The plan has all the range tables of the statement in one list, the
+ * parsed statement has them in its subqueries, which are walked.
+ */
+static bool
+structural_rules_allow(Query *parse, const PlannedStmt *plan)
+{
+	Oid			userid = GetUserId();
+	uint32		generation;
+	bool		covered = false;
+
+	if (pgss->structural->nrules == 0)
+		return false;
+
+	if (plan != NULL ? plan->commandType == CMD_UTILITY :
+		(parse == NULL || parse->utilityStmt != NULL))
+		return false;
+
+	generation = ((volatile pgssSharedState *) pgss)->rules_generation;
+	pg_read_barrier();
+
+	if (!structural_valid ||
+		structural_userid != userid ||
+		structural_generation != generation)
+		structural_compile(userid, generation);
+
+	if (structural_nlocal == 0)
+		return false;
+
+	if (plan != NULL)
+		return structural_check_rtable(plan->rtable, &covered) && covered;
+
+	return !structural_query_walker((Node *) parse, &covered) && covered;
+}
+
+/*
+ * Walk the queries of a parsed statement, stopping at the first relation
+ * access not allowed.
+ */
+static bool
+structural_query_walker(Node *node, bool *covered)
+{
+	if (node == NULL)
+		return false;
+
+	if (IsA(node, Query))
+	{
+		Query	   *query = (Query *) node;
+
+		if (query->utilityStmt != NULL ||
+			!structural_check_rtable(query->rtable, covered))
+			return true;
+
+		return query_tree_walker(query, structural_query_walker,
+								 (void *) covered, 0);
+	}
+
+	return expression_tree_walker(node, structural_query_walker,
+								  (void *) covered);
+}
+
+/*
+ * Does a range table access only what the structural rules allow?
+ * *covered is set once a relation access is allowed.
+ */
+static bool
+structural_check_rtable(List *rtable, bool *covered)
+{
+	ListCell   *lc;
+
+	foreach(lc, rtable)
+	{
+		RangeTblEntry *rte = (RangeTblEntry *) lfirst(lc);
+
+		switch (rte->rtekind)
+		{
+			case RTE_RELATION:
+				/* nothing checked, or checked as the owner of a view */
+				if (rte->requiredPerms == 0 || OidIsValid(rte->checkAsUser))
+					break;
+				if ((rte->requiredPerms & ~structural_grant(rte->relid)) != 0)
+					return false;
+				*covered = true;
+				break;
+			case RTE_FUNCTION:
+				return false;
+			default:
+				break;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Compile the structural rules of a user in this database: copy them, and
+ * start with no relation resolved.
+ */
+static void
+structural_compile(Oid userid, uint32 generation)
+{
+	static bool callback_registered = false;
+	pgfwStructuralRules *rules;
+	int			i;
+
+	if (!callback_registered)
+	{
+		CacheRegisterRelcacheCallback(structural_relcache_callback,
+									  (Datum) 0);
+		callback_registered = true;
+	}
+
+	if (structural_local != NULL)
+		pfree(structural_local);
+	structural_local = NULL;
+	structural_nlocal = 0;
+	structural_relcache_callback((Datum) 0, InvalidOid);
+
+	pgfw_lock_acquire(LW_SHARED);
+
+	rules = pgss->structural;
+	if (rules->nrules > 0)
+		structural_local = MemoryContextAlloc(TopMemoryContext,
+											  rules->nrules *
+											  sizeof(pgfwStructuralRule));
+	for (i = 0; i < rules->nrules; i++)
+	{
+		pgfwStructuralRule *rule = &rules->rules[i];
+
+		if (rule->dbid == MyDatabaseId &&
+			(rule->userid == InvalidOid || rule->userid == userid))
+			structural_local[structural_nlocal++] = *rule;
+	}
+
+	LWLockRelease(pgss->lock);
+
+	structural_valid = true;
+	structural_userid = userid;
+	structural_generation = generation;
+}
+
+/*
+ * The operations the compiled rules allow on a relation, those of the
+ * rules of its schema included.  Each relation is resolved once, until
+ * the relcache is invalidated.
+ */
+static AclMode
+structural_grant(Oid relid)
+{
+	pgfwStructuralGrant *grant;
+	AclMode		operations = 0;
+	Oid			nspid;
+	bool		found;
+	int			i;
+
+	if (structural_grants != NULL)
+	{
+		grant = (pgfwStructuralGrant *) hash_search(structural_grants,
+													&relid, HASH_FIND, NULL);
+		if (grant != NULL)
+			return grant->operations;
+	}
+
+	/* this may flush structural_grants */
+	nspid = get_rel_namespace(relid);
+
+	for (i = 0; i < structural_nlocal; i++)
+	{
+		pgfwStructuralRule *rule = &structural_local[i];
+
+		if ((rule->kind == PGFW_STRUCTURAL_RELATION && rule->objid == relid) ||
+			(rule->kind == PGFW_STRUCTURAL_SCHEMA && rule->objid == nspid))
+			operations |= rule->operations;
+	}
+
+	if (structural_grants == NULL)
+	{
+		HASHCTL		info;
+
+		memset(&info, 0, sizeof(info));
+		info.keysize = sizeof(Oid);
+		info.entrysize = sizeof(pgfwStructuralGrant);
+		info.hash = oid_hash;
+
+		structural_grants = hash_create("sql_firewall structural grants",
+										256,
+										&info,
+										HASH_ELEM | HASH_FUNCTION);
+	}
+
+	grant = (pgfwStructuralGrant *) hash_search(structural_grants,
+												&relid, HASH_ENTER, &found);
+	grant->operations = operations;
+
+	return operations;
+}
+
+/*
+ * A relation may have been moved to another schema, or dropped and its OID
+ * reused: resolve the relations again.
+ */
+static void
+structural_relcache_callback(Datum arg, Oid relid)
+{
+	if (structural_grants != NULL)
+	{
+		hash_destroy(structural_grants);
+		structural_grants = NULL;
+	}
+}
+
+/*
+ * Parse the operations of a structural rule.
+ */
+static AclMode
+structural_operations(const char *operation)
+{
+	char	   *rawstring = pstrdup(operation);
+	List	   *elemlist;
+	ListCell   *lc;
+	AclMode		operations = 0;
+
+	if (!SplitIdentifierString(rawstring, ',', &elemlist) ||
+		elemlist == NIL)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid list of operations \"%s\"", operation)));
+
+	foreach(lc, elemlist)
+	{
+		char	   *name = (char *) lfirst(lc);
+
+		if (strcmp(name, "select") == 0)
+			operations |= ACL_SELECT;
+		else if (strcmp(name, "insert") == 0)
+			operations |= ACL_INSERT;
+		else if (strcmp(name, "update") == 0)
+			operations |= ACL_UPDATE;
+		else if (strcmp(name, "delete") == 0)
+			operations |= ACL_DELETE;
+		else if (strcmp(name, "all") == 0)
+			operations |= PGFW_STRUCTURAL_OPERATIONS;
+		else
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("invalid operation \"%s\"", name),
+					 errhint("Operations are select, insert, update, delete and all.")));
+	}
+
+	list_free(elemlist);
+	pfree(rawstring);
+
+	return operations;
+}
+
+/*
+ * Resolve the object of a structural rule: a relation, or a schema when
+ * the name ends with '.*'.
+ */
+static void
+structural_object(const char *object, char *kind, Oid *objid)
+{
+	int			len = strlen(object);
+
+	if (len > 2 && strcmp(object + len - 2, ".*") == 0)
+	{
+		List	   *names = stringToQualifiedNameList(pnstrdup(object, len - 2));
+
+		if (list_length(names) != 1)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_NAME),
+					 errmsg("invalid schema name \"%s\"", object)));
+
+		*kind = PGFW_STRUCTURAL_SCHEMA;
+		*objid = get_namespace_oid(strVal(linitial(names)), false);
+	}
+	else
+	{
+		RangeVar   *relvar;
+
+		relvar = makeRangeVarFromNameList(stringToQualifiedNameList(object));
+
+		*kind = PGFW_STRUCTURAL_RELATION;
+		*objid = RangeVarGetRelid(relvar, NoLock, false);
+	}
+}
+
+/*
+ * Add operations to the structural rule of (userid, object) in the current
+ * database, creating it if needed, or remove them, dropping the rule once
+ * it allows none.
+ *
+ * return false if there was no rule to remove from
+ */
+static bool
+structural_change(Oid userid, char kind, Oid objid, AclMode operations,
+				  bool add)
+{
+	pgfwStructuralRules *rules = pgss->structural;
+	bool		found = false;
+	int			i;
+
+	pgfw_lock_acquire(LW_EXCLUSIVE);
 
-				APP_JUMB(bt->booltesttype);
-				JumbleExpr(jstate, (Node *) bt->arg);
-			}
-			break;
-		case T_CoerceToDomain:
-			{
-				CoerceToDomain *cd = (CoerceToDomain *) node;
+	for (i = 0; i < rules->nrules; i++)
+	{
+		pgfwStructuralRule *rule = &rules->rules[i];
 
-				APP_JUMB(cd->resulttype);
-				JumbleExpr(jstate, (Node *) cd->arg);
-			}
+		if (rule->userid == userid && rule->dbid == MyDatabaseId &&
+			rule->kind == kind && rule->objid == objid)
 			break;
-		case T_CoerceToDomainValue:
-			{
-				CoerceToDomainValue *cdv = (CoerceToDomainValue *) node;
+	}
 
-				APP_JUMB(cdv->typeId); /* FIXME */
-			}
-			break;
-		case T_SetToDefault:
+	if (add)
+	{
+		if (i == rules->nrules)
+		{
+			if (rules->nrules >= PGFW_MAX_STRUCTURAL_RULES)
 			{
-				SetToDefault *sd = (SetToDefault *) node;
-
-				APP_JUMB(sd->typeId); /* FIXME */
+				LWLockRelease(pgss->lock);
+				ereport(ERROR,
+						(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+						 errmsg("too many sql_firewall structural rules"),
+						 errdetail("At most %d structural rules can be defined.",
+								   PGFW_MAX_STRUCTURAL_RULES)));
 			}
-			break;
-		case T_CurrentOfExpr:
-			{
-				CurrentOfExpr *ce = (CurrentOfExpr *) node;
 
-				APP_JUMB(ce->cvarno);
-				if (ce->cursor_name)
-					APP_JUMB_STRING(ce->cursor_name);
-				APP_JUMB(ce->cursor_param);
-			}
-			break;
-		case T_TargetEntry:
-			{
-				TargetEntry *tle = (TargetEntry *) node;
+			rules->rules[i].userid = userid;
+			rules->rules[i].dbid = MyDatabaseId;
+			rules->rules[i].objid = objid;
+			rules->rules[i].kind = kind;
+			rules->rules[i].operations = 0;
+			rules->nrules++;
+		}
 
-				APP_JUMB(tle->resno);
-				APP_JUMB(tle->ressortgroupref);
-				JumbleExpr(jstate, (Node *) tle->expr);
-			}
-			break;
-		case T_RangeTblRef:
-			{
-				RangeTblRef *rtr = (RangeTblRef *) node;
+		rules->rules[i].operations |= operations;
+		found = true;
+	}
+	else if (i < rules->nrules)
+	{
+		rules->rules[i].operations &= ~operations;
+		if (rules->rules[i].operations == 0)
+			rules->rules[i] = rules->rules[--rules->nrules];
+		found = true;
+	}
 
-				APP_JUMB(rtr->rtindex);
-			}
-			break;
-		case T_JoinExpr:
-			{
-				JoinExpr   *join = (JoinExpr *) node;
+	if (found)
+	{
+		/* the rule snapshot doesn't have them, it stays valid */
+		pgss->rules_generation++;
+		pg_write_barrier();
+		structural_rules_save();
+	}
 
-				APP_JUMB(join->jointype);
-				APP_JUMB(join->isNatural);
-				APP_JUMB(join->rtindex);
-				JumbleExpr(jstate, join->larg);
-				JumbleExpr(jstate, join->rarg);
-				JumbleExpr(jstate, join->quals);
-			}
-			break;
-		case T_FromExpr:
-			{
-				FromExpr   *from = (FromExpr *) node;
+	LWLockRelease(pgss->lock);
 
-				JumbleExpr(jstate, (Node *) from->fromlist);
-				JumbleExpr(jstate, from->quals);
-			}
-			break;
-		case T_List:
-			foreach(temp, (List *) node)
-			{
-				JumbleExpr(jstate, (Node *) lfirst(temp));
-			}
-			break;
-		case T_SortGroupClause:
-			{
-				SortGroupClause *sgc = (SortGroupClause *) node;
+	return found;
+}
 
-				APP_JUMB(sgc->tleSortGroupRef);
-				APP_JUMB(sgc->eqop);
-				APP_JUMB(sgc->sortop);
-				APP_JUMB(sgc->nulls_first);
-			}
-			break;
-		case T_WindowClause:
-			{
-				WindowClause *wc = (WindowClause *) node;
+/*
+ * Drop all the structural rules, see sql_firewall_reset().
+ */
+static void
+structural_reset(void)
+{
+	pgfw_lock_acquire(LW_EXCLUSIVE);
 
-				APP_JUMB(wc->winref);
-				APP_JUMB(wc->frameOptions);
-				JumbleExpr(jstate, (Node *) wc->partitionClause);
-				JumbleExpr(jstate, (Node *) wc->orderClause);
-				JumbleExpr(jstate, wc->startOffset);
-				JumbleExpr(jstate, wc->endOffset);
-			}
-			break;
-		case T_CommonTableExpr:
-			{
-				CommonTableExpr *cte = (CommonTableExpr *) node;
+	pgss->structural->nrules = 0;
+	pgss->rules_generation++;
+	pg_write_barrier();
+	structural_rules_save();
 
-				/* we store the string name because RTE_CTE RTEs need it */
-				APP_JUMB_STRING(cte->ctename);
-				JumbleQuery(jstate, (Query *) cte->ctequery);
-			}
-			break;
-		case T_SetOperationStmt:
-			{
-				SetOperationStmt *setop = (SetOperationStmt *) node;
+	LWLockRelease(pgss->lock);
+}
 
-				APP_JUMB(setop->op);
-				APP_JUMB(setop->all);
-				JumbleExpr(jstate, setop->larg);
-				JumbleExpr(jstate, setop->rarg);
-			}
-			break;
-		case T_RangeTblFunction:
-			{
-				RangeTblFunction *rtfunc = (RangeTblFunction *) node;
+/*
+ * Load the structural rules saved by structural_rules_save(), at startup.
+ */
+static void
+structural_rules_load(void)
+{
+	pgfwStructuralRules *rules = pgss->structural;
+	FILE	   *file;
+	uint32		header[2];
+	int32		nrules;
 
-				JumbleExpr(jstate, rtfunc->funcexpr);
-			}
-			break;
-		default:
-			/* Only a warning, since we can stumble along anyway */
-			elog(WARNING, "unrecognized node type: %d",
-				 (int) nodeTag(node));
-			break;
+	file = AllocateFile(PGFW_STRUCTURAL_FILE, PG_BINARY_R);
+	if (file == NULL)
+	{
+		if (errno != ENOENT)
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("could not read sql_firewall file \"%s\": %m",
+							PGFW_STRUCTURAL_FILE)));
+		return;
+	}
+
+	if (fread(header, sizeof(header), 1, file) != 1 ||
+		header[0] != PGFW_STRUCTURAL_MAGIC ||
+		header[1] != PGFW_STRUCTURAL_VERSION ||
+		fread(&nrules, sizeof(nrules), 1, file) != 1 ||
+		nrules < 0 || nrules > PGFW_MAX_STRUCTURAL_RULES ||
+		fread(rules->rules, sizeof(pgfwStructuralRule), nrules,
+			  file) != (size_t) nrules)
+	{
+		ereport(LOG,
+				(errmsg("ignoring invalid sql_firewall file \"%s\"",
+						PGFW_STRUCTURAL_FILE)));
+		nrules = 0;
 	}
+
+	rules->nrules = nrules;
+
+	FreeFile(file);
 }
 
 /*
- * Record location of constant within query string of query tree
- * that is currently being walked.
+ * Save the structural rules, on every change: there are few of them, and
+ * they change rarely.
+ * caller must hold an exclusive lock on pgss->lock
  */
 static void
-RecordConstLocation(pgssJumbleState *jstate, int location)
+structural_rules_save(void)
 {
-	/* -1 indicates unknown or undefined location */
-	if (location >= 0)
+	pgfwStructuralRules *rules = pgss->structural;
+	FILE	   *file;
+	uint32		header[2] = {PGFW_STRUCTURAL_MAGIC, PGFW_STRUCTURAL_VERSION};
+	int32		nrules = rules->nrules;
+
+	if (!pgss_save)
+		return;
+
+	file = AllocateFile(PGFW_STRUCTURAL_FILE ".tmp", PG_BINARY_W);
+	if (file == NULL)
+		goto error;
+
+	if (fwrite(header, sizeof(header), 1, file) != 1 ||
+		fwrite(&nrules, sizeof(nrules), 1, file) != 1 ||
+		fwrite(rules->rules, sizeof(pgfwStructuralRule), nrules,
+			   file) != (size_t) nrules)
+		goto error;
+
+	if (FreeFile(file))
 	{
-		/* enlarge array if needed */
-		if (jstate->clocations_count >= jstate->clocations_buf_size)
-		{
-			jstate->clocations_buf_size *= 2;
-			jstate->clocations = (pgssLocationLen *)
-				repalloc(jstate->clocations,
-						 jstate->clocations_buf_size *
-						 sizeof(pgssLocationLen));
-		}
-		jstate->clocations[jstate->clocations_count].location = location;
-		/* initialize lengths to -1 to simplify fill_in_constant_lengths */
-		jstate->clocations[jstate->clocations_count].length = -1;
-		jstate->clocations_count++;
+		file = NULL;
+		goto error;
 	}
+
+	if (rename(PGFW_STRUCTURAL_FILE ".tmp", PGFW_STRUCTURAL_FILE) != 0)
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not rename sql_firewall file \"%s\": %m",
+						PGFW_STRUCTURAL_FILE ".tmp")));
+	return;
+
+error:
+	ereport(LOG,
+			(errcode_for_file_access(),
+			 errmsg("could not write sql_firewall file \"%s\": %m",
+					PGFW_STRUCTURAL_FILE ".tmp")));
+	if (file)
+		FreeFile(file);
+	unlink(PGFW_STRUCTURAL_FILE ".tmp");
 }
 
+
+
+
 /*
- * Generate a normalized version of the query string that will be used to
- * represent all similar queries.
+ * calculate a query's queryid
  *
- * Note that the normalized representation may well vary depending on
- * just which "equivalent" query is used to create the hashtable entry.
- * We assume this is OK.
+ * called when the database administrator import sql firewall rules or insert a
+ * sql firewall rule manually.
  *
- * *query_len_p contains the input string length, and is updated with
- * the result string length (which cannot be longer) on exit.
+ * in:
+ *   query_string
  *
- * Returns a palloc'd string.
+ * out:
+ *   normalized_query
  */
-static char *
-generate_normalized_query(pgssJumbleState *jstate, const char *query,
-						  int *query_len_p, int encoding)
+static uint32
+sql_firewall_queryid(const char *query_string, char **normalized_query)
 {
-	char	   *norm_query;
-	int			query_len = *query_len_p;
-	int			i,
-				len_to_wrt,		/* Length (in bytes) to write */
-				quer_loc = 0,	/* Source query byte location */
-				n_quer_loc = 0, /* Normalized query byte location */
-				last_off = 0,	/* Offset from start for previous tok */
-				last_tok_len = 0;		/* Length (in bytes) of that tok */
+	List         *parsetree = pg_parse_query(query_string);
+	Node	     *parsenode = NULL;
+	Query	     *query     = NULL;
+	pgssJumbleState *jstate;
+	uint32        queryid   = 0;
 
-	/*
-	 * Get constants' lengths (core system only gives us locations).  Note
-	 * this also ensures the items are sorted by location.
-	 */
-	fill_in_constant_lengths(jstate, query);
+	if (list_length(parsetree) != 1) {
+		elog(ERROR, "sql firewall: error - statement result in only one parsetree is supported."
+			 "but \'%s\' result in %d.", query_string, list_length(parsetree));
+	}
 
-	/* Allocate result buffer */
-	norm_query = palloc(query_len + 1);
+	parsenode = (Node *) linitial(parsetree);
 
-	for (i = 0; i < jstate->clocations_count; i++)
+	/*
+	 * The rules may be added or imported while they are enforced, keep our
+	 * own hook from checking the rule text as if it were run.
+	 */
+	rule_text_analyzing = true;
+	PG_TRY();
 	{
-		int			off,		/* Offset from start for cur tok */
-					tok_len;	/* Length (in bytes) of that tok */
+		query = parse_analyze(parsenode, query_string, NULL, 0);
+	}
+	PG_CATCH();
+	{
+		rule_text_analyzing = false;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+	rule_text_analyzing = false;
 
-		off = jstate->clocations[i].location;
-		tok_len = jstate->clocations[i].length;
+	/* utility statements have no Query tree of their own to jumble */
+	if (query->utilityStmt)
+	{
+		queryid = utility_queryid(query_string, &jstate);
 
-		if (tok_len < 0)
-			continue;			/* ignore any duplicates */
+		if (normalized_query)
+		{
+			int			query_len = strlen(query_string);
 
-		/* Copy next chunk (what precedes the next constant) */
-		len_to_wrt = off - last_off;
-		len_to_wrt -= last_tok_len;
+			if (jstate)
+				*normalized_query = generate_normalized_query(jstate,
+															  query_string,
+															  &query_len,
+															  GetDatabaseEncoding());
+			else
+				*normalized_query = pstrdup(query_string);
+		}
 
-		Assert(len_to_wrt >= 0);
-		memcpy(norm_query + n_quer_loc, query + quer_loc, len_to_wrt);
-		n_quer_loc += len_to_wrt;
+		return queryid;
+	}
 
-		/* And insert a '?' in place of the constant token */
-		norm_query[n_quer_loc++] = '?';
+	/*
+	 * calculate the query id of the given query
+	 */
+	/* Set up workspace for query jumbling */
+	jstate = jumble_workspace_reset();
 
-		quer_loc = off + tok_len;
-		last_off = off;
-		last_tok_len = tok_len;
-	}
+	/* Compute query ID and mark the Query node with it */
+	JumbleQuery(jstate, query);
+	queryid = hash_any(jstate->jumble, jstate->jumble_len);
 
 	/*
-	 * We've copied up until the last ignorable constant.  Copy over the
-	 * remaining bytes of the original query string.
+	 * If we are unlucky enough to get a hash of zero, use 1 instead, to
+	 * prevent confusion with the utility-statement case.
 	 */
-	len_to_wrt = query_len - quer_loc;
+	if (queryid == 0)
+		queryid = 1;
 
-	Assert(len_to_wrt >= 0);
-	memcpy(norm_query + n_quer_loc, query + quer_loc, len_to_wrt);
-	n_quer_loc += len_to_wrt;
+	if (normalized_query) {
+		int encoding  = GetDatabaseEncoding();
+		int query_len = strlen(query_string);
 
-	Assert(n_quer_loc <= query_len);
-	norm_query[n_quer_loc] = '\0';
+		*normalized_query = generate_normalized_query(jstate,
+													  query_string,
+													  &query_len,
+													  encoding);
+	}
 
-	*query_len_p = n_quer_loc;
-	return norm_query;
+	return queryid;
 }
 
+
 /*
- * Given a valid SQL string and an array of constant-location records,
- * fill in the textual lengths of those constants.
- *
- * The constants may use any allowed constant syntax, such as float literals,
- * bit-strings, single-quoted strings and dollar-quoted strings.  This is
- * accomplished by using the public API for the core scanner.
- *
- * It is the caller's job to ensure that the string is a valid SQL statement
- * with constants at the indicated locations.  Since in practice the string
- * has already been parsed, and the locations that the caller provides will
- * have originated from within the authoritative parser, this should not be
- * a problem.
- *
- * Duplicate constant pointers are possible, and will have their lengths
- * marked as '-1', so that they are later ignored.  (Actually, we assume the
- * lengths were initialized as -1 to start with, and don't change them here.)
- *
- * N.B. There is an assumption that a '-' character at a Const location begins
- * a negative numeric constant.  This precludes there ever being another
- * reason for a constant to start with a '-'.
+ * Count the calls of a cached rule in its cache entry, and add them to the
+ * rule entry itself only now and then.  Hot statements thus take the
+ * spinlock of their rule entries once every PGFW_COUNTER_FLUSH_CALLS
+ * statements; on the other hand, the counters shown by other backends lag
+ * by up to PGFW_COUNTER_FLUSH_MS behind those of a busy backend.
  */
 static void
-fill_in_constant_lengths(pgssJumbleState *jstate, const char *query)
+count_cached_rule(pgfwCacheEntry *centry, pgssEntry *entry)
 {
-	pgssLocationLen *locs;
-	core_yyscan_t yyscanner;
-	core_yy_extra_type yyextra;
-	core_YYSTYPE yylval;
-	YYLTYPE		yylloc;
-	int			last_loc = -1;
-	int			i;
+	int64		pending;
 
+	if (entry == centry->whitelist_entry && entry->type == PGFW_WHITELIST_ENTRY)
+		pending = ++centry->pending_calls;
+	else if (entry == centry->blacklist_entry && entry->type == PGFW_BLACKLIST_ENTRY)
+		pending = ++centry->pending_banned;
+	else
+		return;
+
+	local_cache_pending = true;
+
+	if (pending >= PGFW_COUNTER_FLUSH_CALLS ||
+		TimestampDifferenceExceeds(local_cache_flushed,
+								   GetCurrentStatementStartTimestamp(),
+								   PGFW_COUNTER_FLUSH_MS))
+		local_cache_flush_counters();
+}
+
+/*
+ * we count hit also for PERMISSIVE mode
+ */
+static void
+collect_entry_statistics(pgssEntry *entry, pgfwCacheEntry *centry)
+{
 	/*
-	 * Sort the records by location so that we can process them in order while
-	 * scanning the query text.
+	 * Grab the spinlock while updating the counters (see comment about
+	 * locking rules at the head of the file)
 	 */
-	if (jstate->clocations_count > 1)
-		qsort(jstate->clocations, jstate->clocations_count,
-			  sizeof(pgssLocationLen), comp_location);
-	locs = jstate->clocations;
+	/*
+	 * If the entry is not found, it means the statement is not in
+	 * the firewall list.
+	 */
+	if (!entry)
+		return;
 
-	/* initialize the flex scanner --- should match raw_parser() */
-	yyscanner = scanner_init(query,
-							 &yyextra,
-							 ScanKeywords,
-							 NumScanKeywords);
+	if (entry->type == PGFW_WHITELIST_ENTRY && !pgfw_track_calls)
+		return;
 
-	/* Search for each constant, in sequence */
-	for (i = 0; i < jstate->clocations_count; i++)
+	if (centry != NULL)
 	{
-		int			loc = locs[i].location;
-		int			tok;
+		count_cached_rule(centry, entry);
+		return;
+	}
 
-		Assert(loc >= 0);
+	SpinLockAcquire(&entry->mutex);
 
-		if (loc <= last_loc)
-			continue;			/* Duplicate constant, ignore */
+	switch (entry->type) {
+	case PGFW_WHITELIST_ENTRY:
+		entry->counters.calls++;
+		break;
+	case PGFW_BLACKLIST_ENTRY:
+		entry->counters.banned++;
+		break;
+	}
 
-		/* Lex tokens until we find the desired constant */
-		for (;;)
-		{
-			tok = core_yylex(&yylval, &yylloc, yyscanner);
+	SpinLockRelease(&entry->mutex);
+}
 
-			/* We should not hit end-of-string, but if we do, behave sanely */
-			if (tok == 0)
-				break;			/* out of inner for-loop */
+/*
+ * the core logic of the sql firewall rule engine is here.
+ *
+ * and collect necessary staticstics, in centry if the rules come from the
+ * backend-local cache.  A statement allowed by the structural rules counts
+ * as whitelisted.
+ */
+static bool
+to_be_prohibited(pgssEntry *whitelist_entry, pgssEntry *blacklist_entry,
+				 pgfwCacheEntry *centry, bool structural)
+{
+	bool  whitelist_hit = (whitelist_entry != NULL || structural);
+	bool  blacklist_hit = (blacklist_entry != NULL);
+	bool  prohibited    = true;
 
+	switch (pgfw_rule_engine) {
+	case PGFW_ENGINE_WHITELIST:
+		prohibited = !whitelist_hit;
+		collect_entry_statistics(whitelist_entry, centry);
+		break;
+	case PGFW_ENGINE_BLACKLIST:
+		prohibited = blacklist_hit;
+		collect_entry_statistics(blacklist_entry, centry);
+		break;
+	case PGFW_ENGINE_HYBRID:
+		prohibited = (!whitelist_hit || blacklist_hit);
+		if (whitelist_hit && !blacklist_hit) {
 			/*
-			 * We should find the token position exactly, but if we somehow
-			 * run past it, work with that.
+			 * this is the only case of hybrid rule engine that allow a query
 			 */
-			if (yylloc >= loc)
-			{
-				if (query[loc] == '-')
-				{
-					/*
-					 * It's a negative value - this is the one and only case
-					 * where we replace more than a single token.
-					 *
-					 * Do not compensate for the core system's special-case
-					 * adjustment of location to that of the leading '-'
-					 * operator in the event of a negative constant.  It is
-					 * also useful for our purposes to start from the minus
-					 * symbol.  In this way, queries like "select * from foo
-					 * where bar = 1" and "select * from foo where bar = -2"
-					 * will have identical normalized query strings.
-					 */
-					tok = core_yylex(&yylval, &yylloc, yyscanner);
-					if (tok == 0)
-						break;	/* out of inner for-loop */
-				}
+			collect_entry_statistics(whitelist_entry, centry);
+		} else if (blacklist_hit) {
+			/*
+			 * query is being banned by the blacklist entry
+			 */
+			collect_entry_statistics(blacklist_entry, centry);
+		}
+		break;
+	default:
+		elog(ERROR, "sql firewall: error must have a rule engine when it is enabled.");
+	}
+	
+	return prohibited;
+}
 
-				/*
-				 * We now rely on the assumption that flex has placed a zero
-				 * byte after the text of the current token in scanbuf.
-				 */
-				locs[i].length = strlen(yyextra.scanbuf + loc);
-				break;			/* out of inner for-loop */
-			}
+/*
+ * search the rule table for both whitelist or blacklist
+ *
+ */
+static pgssEntry *
+__lookup_rule(pgssHashKey *key)
+{
+	pgssEntry   *entry = NULL;
+
+	entry = (pgssEntry *)hash_search(pgss_hash, key, HASH_FIND, NULL);
+
+	return entry;
+}
+
+
+/*
+ * caller should hold lock of the hash table
+ *
+ */
+static pgssEntry *
+lookup_rule(Oid dbid, Oid userid, uint32 queryid, uint32 rule_type)
+{
+	pgssHashKey  key   = {0};
+	pgssEntry   *entry = NULL;
+	bool         database_rules;
+
+	/*
+	 * fill the common key field
+	 */
+	key.queryid    = queryid;
+	key.type       = rule_type;
+
+	/*
+	 * the rules of the database come first, if there are any of any
+	 * database at all.
+	 */
+	database_rules = (dbid != InvalidOid && pgss->database_rules > 0);
+
+	/*
+	 * try exactly matched entry for a specified user
+	 *
+	 * userid == InvalidOid, means the rule should be applied to
+	 * all users.
+	 */
+	if (userid != InvalidOid) {
+		key.userid     = userid;
+		if (database_rules) {
+			key.dbid   = dbid;
+			entry      = __lookup_rule(&key);
+
+			if (entry != NULL)
+				return entry;
 		}
 
-		/* If we hit end-of-string, give up, leaving remaining lengths -1 */
-		if (tok == 0)
-			break;
+		key.dbid       = InvalidOid;
+		entry           = __lookup_rule(&key);
+		
+		if (entry != NULL)
+			return entry;
+	}
 
-		last_loc = loc;
+	/*
+	 * then try the rule should be applied to all users.
+	 */
+	key.userid = InvalidOid;
+	if (database_rules) {
+		key.dbid   = dbid;
+		entry      = __lookup_rule(&key);
+
+		if (entry != NULL)
+			return entry;
 	}
 
-	scanner_finish(yyscanner);
+	key.dbid   = InvalidOid;
+	entry       = __lookup_rule(&key);
+
+	return entry;
 }
 
 /*
- * comp_location: comparator for qsorting pgssLocationLen structs by location
+ * lookup if there exists matched rule entry for (userid, queryid)
+ * in the whitelist rule.
+ *
  */
-static int
-comp_location(const void *a, const void *b)
+static pgssEntry *
+lookup_whitelist(Oid dbid, Oid userid, uint32 queryid)
 {
-	int			l = ((const pgssLocationLen *) a)->location;
-	int			r = ((const pgssLocationLen *) b)->location;
+	return lookup_rule(dbid, userid, queryid, (uint32)PGFW_WHITELIST_ENTRY);
+}
 
-	if (l < r)
-		return -1;
-	else if (l > r)
-		return +1;
-	else
-		return 0;
+/*
+ * lookup if there exists matched rule entry for (userid, queryid)
+ * in the blacklist rule.
+ *
+ */
+static pgssEntry *
+lookup_blacklist(Oid userid, uint32 queryid)
+{
+	return lookup_rule(MyDatabaseId, userid, queryid, (uint32)PGFW_BLACKLIST_ENTRY);
 }
 
 /*
- * parse a sql firewall rule engine name to its engine id
+ * given a (userid, queryid) vector, we search the rules which may decide
+ * whether to prohibit the query; to_be_prohibited() gives the verdict.
+ * The rules of the current database take precedence over the rules of all
+ * databases, after the rules of the user over the rules of all users.
  *
- * TODO: capital consideration
+ * Both rule types are searched whatever the rule engine is, so that the
+ * result can be kept in the backend-local cache.
+ *
+ * out:
+ *   whitelist_entry   :   the matched whitelist rule entry, or NULL
+ *   blacklist_entry   :   the matched blacklist rule entry, or NULL
+ *
+ * note:
+ *   caller should has held at least a shared lock on pgss
+ */
+static void
+lookup_rules(Oid userid, uint32 queryid,
+			 pgssEntry **whitelist_entry, pgssEntry **blacklist_entry)
+{
+	*blacklist_entry = lookup_blacklist(userid, queryid);
+	*whitelist_entry = lookup_whitelist(MyDatabaseId, userid, queryid);
+}
+
+/*
+ * Number of slots of a rule snapshot.  The slots are kept at most half full,
+ * so that probes stay short.
  */
 static uint32
-rule_typeid(const char *rule_type_name)
+rule_snapshot_nslots(void)
 {
-	uint32 rule_type = (uint32)PGFW_DUMMY_ENTRY;
+	uint32		nslots = 1;
 
-	for (int i = 0; rule_type_options[i].name != NULL; i++)
-	{
-		if (!strcmp(rule_type_name, rule_type_options[i].name))
-		{
-			rule_type = rule_type_options[i].val;
-			break;
-		}
-	}
+	while (nslots < (uint32) pgss_max && nslots < ((uint32) 1 << 30))
+		nslots <<= 1;
 
-	return rule_type;
+	return nslots << 1;
 }
 
 /*
- * used for user display only, make a more readable display
+ * Offset of the user rules from the start of a rule snapshot.
  */
-static char *
-rule_typename(char rule_type)
+static Size
+rule_snapshot_users_offset(void)
 {
-	char *typename = "unknown";
+	return MAXALIGN(add_size(offsetof(pgfwRuleSnapshot, slots),
+							 mul_size(rule_snapshot_nslots(),
+									  sizeof(pgfwRuleSlot))));
+}
 
-	switch (rule_type)
+/*
+ * Estimate the size of one rule snapshot.
+ */
+static Size
+rule_snapshot_size(void)
+{
+	return MAXALIGN(add_size(rule_snapshot_users_offset(),
+							 mul_size(pgss_max, sizeof(pgfwUserRule))));
+}
+
+/*
+ * The rules have changed, the snapshot must not be used anymore.
+ *
+ * caller must hold an exclusive lock on pgss->lock
+ */
+static void
+invalidate_rule_snapshot(void)
+{
+	pgss->snapshot_valid = false;
+	pgss->rules_generation++;
+	pg_write_barrier();
+}
+
+/*
+ * Find the slot of queryid in a snapshot being built, claiming an unused one
+ * if the query has none yet.
+ */
+static pgfwRuleSlot *
+snapshot_claim_slot(volatile pgfwRuleSnapshot *snap, uint32 queryid)
+{
+	uint32		mask = snap->nslots - 1;
+	uint32		i = queryid & mask;
+
+	while (snap->slots[i].used && snap->slots[i].queryid != queryid)
+		i = (i + 1) & mask;
+
+	if (!snap->slots[i].used)
 	{
-	case PGFW_DUMMY_ENTRY:
-		typename = "dummy";
-		break;
-	case PGFW_WHITELIST_ENTRY:
-		typename = "whitelist";
-		break;
-	case PGFW_BLACKLIST_ENTRY:
-		typename = "blacklist";
-		break;
+		snap->slots[i].used = true;
+		snap->slots[i].queryid = queryid;
 	}
 
-	return typename;
+	return (pgfwRuleSlot *) &snap->slots[i];
 }
 
 /*
- * add a sql firewall rule, it is a blacklist rule. This rule would
- * prohibit user to query database.
+ * Rebuild the snapshot not currently in use from the hashtable, and make it
+ * the current one.
  *
- * user name is empty '', means the rule would prohibit all user's query.
+ * The first pass over the hashtable gathers the queries and counts their
+ * user rules, the second one hands the user rules out to the runs reserved
+ * for them.  A run may end up shorter than counted when a user has both a
+ * whitelist and a blacklist rule for the query.
  *
- * engine can be one of [white, black]:
- *   white: means it is a rule entry to be inserted to whitelist
- *   black: means it is a rule entry to be inserted to blacklist
+ * Readers may still be searching the snapshot we overwrite, if it was the
+ * current one before the previous rebuild; they notice changecount moving
+ * and retry.
  *
+ * caller must hold an exclusive lock on pgss->lock
  */
-Datum
-sql_firewall_add_rule(PG_FUNCTION_ARGS)
+static void
+publish_rule_snapshot(void)
 {
-	char	   *username        = text_to_cstring(PG_GETARG_TEXT_P(0));
-	char	   *query_string    = text_to_cstring(PG_GETARG_TEXT_P(1));
-	char	   *rule_type_name  = text_to_cstring(PG_GETARG_TEXT_P(2));
-	uint32	    rule_type       = rule_typeid(rule_type_name);
+	int			next = 1 - pgss->snapshot_current;
+	volatile pgfwRuleSnapshot *snap = pgss->snapshots[next];
+	uint32		nslots = rule_snapshot_nslots();
+	uint32		nusers = 0;
+	uint32		i;
+	HASH_SEQ_STATUS hash_seq;
+	pgssEntry  *entry;
 
-	/* hash table must exist already */
-	if (!pgss || !pgss_hash)
-		ereport(ERROR,
-				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
-				 errmsg("sql_firewall must be loaded via shared_preload_libraries")));
+	snap->changecount++;
+	pg_write_barrier();
 
-	if (!superuser())
-		ereport(ERROR,
-				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
-				 (errmsg("must be superuser to use sql_firewall_add_rule"))));
+	snap->nslots = nslots;
+	memset((void *) snap->slots, 0, nslots * sizeof(pgfwRuleSlot));
 
-	if (pgfw_mode != PGFW_MODE_DISABLED)
-		ereport(ERROR,
-				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
-				 errmsg("sql_firewall_add_rule() is available only under the disable mode")));
+	hash_seq_init(&hash_seq, pgss_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		pgfwRuleSlot *slot;
 
-	if (rule_type == PGFW_DUMMY_ENTRY)
-		ereport(ERROR,
-				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
-				 errmsg("sql_firewall_add_rule() engine must be one of [\'whitelist\', \'blacklist\']")));
+		if (entry->key.type != PGFW_WHITELIST_ENTRY &&
+			entry->key.type != PGFW_BLACKLIST_ENTRY)
+			continue;
+
+		slot = snapshot_claim_slot(snap, entry->key.queryid);
+		if (entry->key.userid == InvalidOid && entry->key.dbid == InvalidOid)
+		{
+			if (entry->key.type == PGFW_WHITELIST_ENTRY)
+				slot->whitelist_entry = entry;
+			else
+				slot->blacklist_entry = entry;
+		}
+		else
+			slot->nusers++;
+	}
+
+	/* reserve the runs, nusers is only a count until the second pass */
+	for (i = 0; i < nslots; i++)
+	{
+		volatile pgfwRuleSlot *slot = &snap->slots[i];
 
+		slot->first = nusers;
+		nusers += slot->nusers;
+		slot->nusers = 0;
+	}
 
-	add_rule(username, query_string, rule_type);
+	Assert(nusers <= (uint32) pgss_max);
 
-	PG_RETURN_BOOL(true);
+	hash_seq_init(&hash_seq, pgss_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		pgfwRuleSlot *slot;
+		pgfwUserRule *user = NULL;
+		uint32		j;
+
+		if ((entry->key.userid == InvalidOid &&
+			 entry->key.dbid == InvalidOid) ||
+			(entry->key.type != PGFW_WHITELIST_ENTRY &&
+			 entry->key.type != PGFW_BLACKLIST_ENTRY))
+			continue;
+
+		slot = snapshot_claim_slot(snap, entry->key.queryid);
+		for (j = 0; j < slot->nusers; j++)
+		{
+			if (snap->users[slot->first + j].userid == entry->key.userid &&
+				snap->users[slot->first + j].dbid == entry->key.dbid)
+			{
+				user = &snap->users[slot->first + j];
+				break;
+			}
+		}
+		if (user == NULL)
+		{
+			user = &snap->users[slot->first + slot->nusers++];
+			user->userid = entry->key.userid;
+			user->dbid = entry->key.dbid;
+			user->whitelist_entry = NULL;
+			user->blacklist_entry = NULL;
+		}
+
+		if (entry->key.type == PGFW_WHITELIST_ENTRY)
+			user->whitelist_entry = entry;
+		else
+			user->blacklist_entry = entry;
+	}
+
+	pg_write_barrier();
+	snap->changecount++;
+
+	pg_write_barrier();
+	pgss->snapshot_current = next;
+	pg_write_barrier();
+	pgss->snapshot_valid = true;
 }
 
 /*
- * delete a sql firewall rule, it is a blacklist rule.
+ * lookup_rules() without any lock, using the current rule snapshot.
  *
- * user name is empty '', means the rule would prohibit all user's query.
+ * A rule of the user itself takes precedence over a rule of the same type
+ * applied to all users, and a rule of the current database over a rule
+ * applied to all databases, as in lookup_rule().
  *
- * engine can be one of [white, black, both]:
- *   white: means only delete the mathed rule entry from whitelist
- *   black: means only delete the mathed rule entry from blacklist
- *   both : means only delete the mathed rule entry from whitelist and blacklist
+ * return:
+ *   false   :   the snapshot is out of date, the caller has to search the
+ *               hashtable instead
+ *   true    :   *whitelist_entry and *blacklist_entry have been set
  */
-Datum
-sql_firewall_del_rule(PG_FUNCTION_ARGS)
+static bool
+snapshot_lookup_rules(Oid userid, uint32 queryid,
+					  pgssEntry **whitelist_entry, pgssEntry **blacklist_entry)
 {
-	char	   *username        = text_to_cstring(PG_GETARG_TEXT_P(0));
-	char	   *query_string    = text_to_cstring(PG_GETARG_TEXT_P(1));
-	char	   *rule_type_name  = text_to_cstring(PG_GETARG_TEXT_P(2));
-	uint32	    rule_type       = rule_typeid(rule_type_name);
+	volatile pgssSharedState *s = (volatile pgssSharedState *) pgss;
+	int			retry;
 
-	/* hash table must exist already */
-	if (!pgss || !pgss_hash)
-		ereport(ERROR,
-				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
-				 errmsg("sql_firewall must be loaded via shared_preload_libraries")));
+	for (retry = 0; retry < RULE_SNAPSHOT_RETRIES; retry++)
+	{
+		volatile pgfwRuleSnapshot *snap;
+		pgssEntry  *whitelist = NULL;
+		pgssEntry  *blacklist = NULL;
+		uint32		changecount;
+		uint32		nslots;
+		uint32		i;
+		uint32		probes;
+
+		if (!s->snapshot_valid)
+			return false;
+
+		pg_read_barrier();
+		snap = s->snapshots[s->snapshot_current];
+		changecount = snap->changecount;
+		pg_read_barrier();
+
+		if (changecount & 1)
+			continue;
 
-	if (!superuser())
-		ereport(ERROR,
-				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
-				 (errmsg("must be superuser to use sql_firewall_del_rule"))));
+		nslots = snap->nslots;
+		i = queryid & (nslots - 1);
+		for (probes = 0; probes < nslots; probes++)
+		{
+			volatile pgfwRuleSlot *slot = &snap->slots[i];
 
-	if (pgfw_mode != PGFW_MODE_DISABLED)
-		ereport(ERROR,
-				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
-				 errmsg("sql_firewall_del_rule() is available only under the disable mode")));
+			if (!slot->used)
+				break;
 
-	del_rule(username, query_string, rule_type);
+			if (slot->queryid == queryid)
+			{
+				uint32		first = slot->first;
+				uint32		nusers = slot->nusers;
+				uint32		j;
+				int			whitelist_rank = 0;
+				int			blacklist_rank = 0;
 
-	PG_RETURN_BOOL(true);
+				whitelist = slot->whitelist_entry;
+				blacklist = slot->blacklist_entry;
+
+				/*
+				 * Up to three runs apply, each ranked by how specific it is.
+				 * A torn read is caught by the changecount check below.
+				 */
+				for (j = 0; j < nusers && first + j < (uint32) pgss_max; j++)
+				{
+					volatile pgfwUserRule *user = &snap->users[first + j];
+					int			rank;
+
+					if ((user->userid != InvalidOid && user->userid != userid) ||
+						(user->dbid != InvalidOid && user->dbid != MyDatabaseId))
+						continue;
+
+					rank = (user->userid != InvalidOid ? 2 : 0) +
+						(user->dbid != InvalidOid ? 1 : 0);
+					if (user->whitelist_entry != NULL && rank > whitelist_rank)
+					{
+						whitelist = user->whitelist_entry;
+						whitelist_rank = rank;
+					}
+					if (user->blacklist_entry != NULL && rank > blacklist_rank)
+					{
+						blacklist = user->blacklist_entry;
+						blacklist_rank = rank;
+					}
+				}
+				break;
+			}
+			i = (i + 1) & (nslots - 1);
+		}
+
+		pg_read_barrier();
+		if (snap->changecount != changecount)
+			continue;
+
+		*whitelist_entry = whitelist;
+		*blacklist_entry = blacklist;
+		return true;
+	}
+
+	return false;
 }
 
-static int
-__add_rule(Oid user, uint32 queryid, const char *query_string, uint32 rule_type)
+/*
+ * Search the rule cache of this backend.
+ *
+ * The cache remembers the rule entries found for a (userid, queryid) pair,
+ * so that the hot statements of a session do not touch shared memory but
+ * for reading rules_generation.  Any change of the rules bumps the
+ * generation, and the whole cache is flushed then; an entry pointer is
+ * therefore never used once its entry has been removed from the hashtable,
+ * except by a statement racing with the removal, exactly as when searching
+ * the snapshot.
+ *
+ * return the cache entry, or NULL on a cache miss or if the cache is
+ * disabled
+ */
+static pgfwCacheEntry *
+local_cache_lookup(Oid userid, uint32 queryid, uint32 generation)
 {
-	bool ret;
+	pgfwCacheKey key;
+	pgfwCacheEntry *centry;
 
-	elog(DEBUG1, "sql firewall: __add_rule: [:user_id %u, :query_id %u, query: %s, rule_type: %c]",
-		 user, queryid, query_string, rule_type);
+	if (local_cache != NULL &&
+		(local_cache_generation != generation ||
+		 local_cache_capacity != pgfw_cache_size))
+		local_cache_flush();
 
-	ret = pgss_restore(user,
-					   queryid,
-					   query_string,
-					   0,
-					   0,
-					   rule_type);
+	if (pgfw_cache_size <= 0)
+		return NULL;
 
-	elog(DEBUG1, "sql firewall: __add_rule: result %d", ret);
+	if (local_cache != NULL)
+	{
+		memset(&key, 0, sizeof(pgfwCacheKey));
+		key.userid = userid;
+		key.queryid = queryid;
 
-	return 0;
+		centry = (pgfwCacheEntry *) hash_search(local_cache, &key,
+												HASH_FIND, NULL);
+		if (centry != NULL)
+		{
+			local_cache_hits++;
+			return centry;
+		}
+	}
+
+	local_cache_misses++;
+	return NULL;
 }
 
 /*
- * add a firewall rule
+ * Remember the rule entries found for (userid, queryid), which were searched
+ * for after reading the given rules_generation.
+ *
+ * The cache is simply flushed when it is full: the statements which are
+ * still hot get cached again right away.
+ *
+ * return the new cache entry, or NULL if the cache is disabled
  */
-static int
-add_rule(const char* user, const char *query_string, uint32 rule_type)
+static pgfwCacheEntry *
+local_cache_insert(Oid userid, uint32 queryid, uint32 generation,
+				   pgssEntry *whitelist_entry, pgssEntry *blacklist_entry)
 {
-	Oid          userid;
-	uint32       queryid;
-	int          ret;
-	char        *normalized_query = NULL;
-	char        *query            = NULL;
+	static bool exit_callback_registered = false;
+	pgfwCacheKey key;
+	pgfwCacheEntry *centry;
 
-	/*
-	 * InvalidOid as user id, means any user.
-	 */
-	userid   = get_role_oid(user, true);
-	queryid  = sql_firewall_queryid(query_string, &normalized_query);
-	query    = normalized_query ? normalized_query : (char *)query_string;
-	ret      = __add_rule(userid, queryid, query, rule_type);
-	
-	if (normalized_query)
-		pfree(normalized_query);
+	if (pgfw_cache_size <= 0)
+		return NULL;
+
+	if (local_cache != NULL &&
+		hash_get_num_entries(local_cache) >= pgfw_cache_size)
+		local_cache_flush();
+
+	if (local_cache == NULL)
+	{
+		HASHCTL		info;
+
+		memset(&info, 0, sizeof(info));
+		info.keysize = sizeof(pgfwCacheKey);
+		info.entrysize = sizeof(pgfwCacheEntry);
+		info.hash = tag_hash;
+		info.hcxt = TopMemoryContext;
+
+		local_cache = hash_create("sql_firewall rule cache",
+								  Min(pgfw_cache_size, 1024),
+								  &info,
+								  HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+		local_cache_capacity = pgfw_cache_size;
+		local_cache_generation = generation;
+		local_cache_flushed = GetCurrentStatementStartTimestamp();
+
+		/* the counters kept in the cache must not be lost at exit */
+		if (!exit_callback_registered)
+		{
+			before_shmem_exit(local_cache_shmem_exit, (Datum) 0);
+			exit_callback_registered = true;
+		}
+	}
 
-	return ret;
+	memset(&key, 0, sizeof(pgfwCacheKey));
+	key.userid = userid;
+	key.queryid = queryid;
+
+	centry = (pgfwCacheEntry *) hash_search(local_cache, &key,
+											HASH_ENTER, NULL);
+	centry->whitelist_entry = whitelist_entry;
+	centry->blacklist_entry = blacklist_entry;
+	centry->pending_calls = 0;
+	centry->pending_banned = 0;
+	centry->shadow = 0;
+
+	return centry;
 }
 
 /*
- * delete an entry of the given key (userid, queryid) from the hash table.
+ * Find the verdict memo of the previous execution of a plan: the cache
+ * entry it used, and whether the structural rules allow it.
+ *
+ * A prepared statement keeps executing the same PlannedStmt, whose queryId
+ * can't change, so most executions skip even the search of the rule cache.
+ * The user, the queryid and the generation of the rules are checked as
+ * well, so a plan freed and its memory reused for another statement is
+ * harmless.
  */
-static int
-entry_delete(Oid userid, uint32 queryid, uint32 rule_type)
+static pgfwPlanVerdict *
+plan_verdict_lookup(const PlannedStmt *plan, Oid userid, uint32 queryid,
+					uint32 generation)
 {
-	pgssHashKey key;
+	pgfwPlanVerdict *memo;
 
-	/*
-	 * 10 | 3294787656 | select * from k1 where uid = ?; |     2
-	 */
-	key.userid   = userid;
-	key.queryid  = queryid;
-	key.type     = rule_type;
+	memo = &plan_verdicts[((uintptr_t) plan >> 4) % PLAN_VERDICT_SLOTS];
 
-	/*
-	 * remove the entry from the hash table.
-	 */
-	LWLockAcquire(pgss->lock, LW_EXCLUSIVE);
-	hash_search(pgss_hash, &key, HASH_REMOVE, NULL);
-	LWLockRelease(pgss->lock);
+	if (memo->plan != plan ||
+		memo->userid != userid ||
+		memo->queryid != queryid ||
+		memo->generation != generation ||
+		memo->cache_epoch != local_cache_epoch ||
+		local_cache_capacity != pgfw_cache_size)
+		return NULL;
 
-	return 0;
+	local_cache_hits++;
+	return memo;
 }
 
-static int
-__del_rule(Oid userid, uint32 queryid, const char *query_string, uint32 rule_type)
+/*
+ * Remember the cache entry used to execute a plan, and whether the
+ * structural rules allow it.
+ */
+static void
+plan_verdict_remember(const PlannedStmt *plan, Oid userid, uint32 queryid,
+					  uint32 generation, pgfwCacheEntry *centry,
+					  bool structural)
 {
-	int      ret;
-
-	elog(DEBUG1, "sql firewall: __del_rule: [:user_id %u, :query_id %u, query: %s, rule_type:%c]",
-		 userid, queryid, query_string, rule_type);
-
-	ret = entry_delete(userid, queryid, rule_type);
+	pgfwPlanVerdict *memo;
 
-	elog(DEBUG1, "sql firewall: __del_rule: result %d", ret);
+	memo = &plan_verdicts[((uintptr_t) plan >> 4) % PLAN_VERDICT_SLOTS];
 
-	return ret;
+	memo->plan = plan;
+	memo->userid = userid;
+	memo->queryid = queryid;
+	memo->generation = generation;
+	memo->cache_epoch = local_cache_epoch;
+	memo->centry = centry;
+	memo->structural = structural;
 }
 
 /*
- * delete a firewall rule
+ * Has this nested statement been let through already during the current
+ * top-level statement, against the same rules?  With sql_firewall.track
+ * set to all, a function looping over a statement would otherwise check
+ * it, and count a call of its rule, on every iteration.
  */
-static int
-del_rule(const char* user, const char *query_string, uint32 rule_type)
+static bool
+nested_verdict_known(Oid userid, uint32 queryid)
 {
-	Oid          userid;
-	uint32       queryid;
-	int          ret;
+	pgfwNestedVerdict *memo;
 
-	/*
-	 * InvalidOid as user id, means any user.
-	 */
-	userid   = get_role_oid(user, true);
-	queryid  = sql_firewall_queryid(query_string, NULL);
-	ret      = __del_rule(userid, queryid, query_string, rule_type);
-	
-	return ret;
+	memo = &nested_verdicts[queryid % NESTED_VERDICT_SLOTS];
+
+	return memo->top_level_epoch == top_level_epoch &&
+		memo->userid == userid &&
+		memo->queryid == queryid &&
+		memo->generation == ((volatile pgssSharedState *) pgss)->rules_generation;
 }
 
+/*
+ * Remember a nested statement let through.  Only the statements which
+ * passed the check are remembered, as a prohibited one caught by an
+ * exception block could be retried.
+ */
+static void
+nested_verdict_remember(Oid userid, uint32 queryid, uint32 generation)
+{
+	pgfwNestedVerdict *memo;
 
+	memo = &nested_verdicts[queryid % NESTED_VERDICT_SLOTS];
 
+	memo->userid = userid;
+	memo->queryid = queryid;
+	memo->generation = generation;
+	memo->top_level_epoch = top_level_epoch;
+}
 
 /*
- * calculate a query's queryid
- *
- * called when the database administrator import sql firewall rules or insert a
- * sql firewall rule manually.
+ * Find the query id of a statement text analyzed before by this backend.
  *
- * in:
- *   query_string
+ * Parse analysis turns the same text into the same tree, hence the same
+ * query id, unless the catalogs, the search_path or one of the settings
+ * changing the parser output have changed meanwhile.  The settings are
+ * part of the key, and any change of the catalogs used to resolve names
+ * flushes the cache.  Texts with several statements are not cached, all of
+ * them having the same source text, nor are the statements with parameters,
+ * whose types are given apart from the text.
  *
- * out:
- *   normalized_query
+ * *key is set up for fingerprint_remember() either way.
  */
-static uint32
-sql_firewall_queryid(const char *query_string, char **normalized_query)
+static pgfwFingerprint *
+fingerprint_lookup(ParseState *pstate, pgfwFingerprintKey *key)
 {
-	List         *parsetree = pg_parse_query(query_string);
-	Node	     *parsenode = NULL;
-	Query	     *query     = NULL;
-	pgssJumbleState jstate  = {0};
-	uint32        queryid   = 0;
-
-	if (list_length(parsetree) != 1) {
-		elog(ERROR, "sql firewall: error - statement result in only one parsetree is supported."
-			 "but \'%s\' result in %d.", query_string, list_length(parsetree));
-	}
+	const char *text = pstate->p_sourcetext;
+	const char *semicolon;
+	pgfwFingerprint *fingerprint;
+	uint32		flags;
 
-	parsenode = (Node *) linitial(parsetree);
-	query     = parse_analyze(parsenode, query_string, NULL, 0);
+	memset(key, 0, sizeof(pgfwFingerprintKey));
+	key->text_len = -1;
 
-	/*
-	 * calculate the query id of the given query
-	 */
-	/* Set up workspace for query jumbling */
-	jstate.jumble = (unsigned char *) palloc(JUMBLE_SIZE);
-	jstate.jumble_len = 0;
-	jstate.clocations_buf_size = 32;
-	jstate.clocations = (pgssLocationLen *)
-		palloc(jstate.clocations_buf_size * sizeof(pgssLocationLen));
-	jstate.clocations_count = 0;
+	if (fingerprint_cache != NULL &&
+		fingerprint_cache_capacity != pgfw_fingerprint_cache_size)
+		fingerprint_cache_flush();
 
-	/* Compute query ID and mark the Query node with it */
-	JumbleQuery(&jstate, query);
-	queryid = hash_any(jstate.jumble, jstate.jumble_len);
+	if (pgfw_fingerprint_cache_size <= 0 || text == NULL ||
+		pstate->p_paramref_hook != NULL)
+		return NULL;
 
-	/*
-	 * If we are unlucky enough to get a hash of zero, use 1 instead, to
-	 * prevent confusion with the utility-statement case.
-	 */
-	if (queryid == 0)
-		queryid = 1;
+	/* nothing but a statement and its terminating semicolons */
+	semicolon = strchr(text, ';');
+	if (semicolon != NULL &&
+		semicolon[strspn(semicolon, "; \t\r\n\f")] != '\0')
+		return NULL;
 
-	if (normalized_query) {
-		int encoding  = GetDatabaseEncoding();
-		int query_len = strlen(query_string);
+	key->text_len = strlen(text);
+	key->text_hash = hash_any((const unsigned char *) text, key->text_len);
+	key->userid = GetUserId();
+	flags = (standard_conforming_strings ? 1 : 0) |
+		(Transform_null_equals ? 2 : 0);
+	key->env_hash = hash_any((const unsigned char *) namespace_search_path,
+							 strlen(namespace_search_path)) ^ hash_uint32(flags);
 
-		*normalized_query = generate_normalized_query(&jstate,
-													  query_string,
-													  &query_len,
-													  encoding);
-	}
+	if (fingerprint_cache == NULL)
+		return NULL;
 
-	pfree(jstate.jumble);
-	pfree(jstate.clocations);
+	fingerprint = (pgfwFingerprint *) hash_search(fingerprint_cache, key,
+												  HASH_FIND, NULL);
+	if (fingerprint == NULL ||
+		memcmp(fingerprint->text, text, key->text_len) != 0)
+		return NULL;
 
-	return queryid;
+	return fingerprint;
 }
 
-
 /*
- * we count hit also for PERMISSIVE mode
+ * Remember the query id of a statement text, within the memory budget of
+ * sql_firewall.fingerprint_cache_size.  Like the rule cache, the cache is
+ * simply flushed when it is full.
  */
 static void
-collect_entry_statistics(pgssEntry *entry)
+fingerprint_remember(pgfwFingerprintKey *key, const char *text,
+					 uint32 queryid, bool has_constants)
 {
-	/*
-	 * Grab the spinlock while updating the counters (see comment about
-	 * locking rules at the head of the file)
-	 */
-	/*
-	 * If the entry is not found, it means the statement is not in
-	 * the firewall list.
-	 */
-	if (!entry)
-		return;
+	static bool callbacks_registered = false;
+	pgfwFingerprint *fingerprint;
+	Size		size;
+	Size		budget = (Size) pgfw_fingerprint_cache_size * 1024;
+	bool		found;
 
-	SpinLockAcquire(&entry->mutex);
+	if (key->text_len < 0 || pgfw_fingerprint_cache_size <= 0)
+		return;
 
-	switch (entry->type) {
-	case PGFW_WHITELIST_ENTRY:
-		entry->counters.calls++;
-		break;
-	case PGFW_BLACKLIST_ENTRY:
-		entry->counters.banned++;
-		break;
-	}
+	/* a single text mustn't take much of the budget */
+	size = sizeof(pgfwFingerprint) + key->text_len + 1;
+	if (size > budget / 8)
+		return;
 
-	SpinLockRelease(&entry->mutex);
-}
+	if (fingerprint_cache != NULL && fingerprint_cache_used + size > budget)
+		fingerprint_cache_flush();
 
-/*
- * the core logic of the sql firewall rule engine is here.
- *
- * and collect necessary staticstics.
- */
-static bool
-__to_be_prohibited(pgssEntry *whitelist_entry, pgssEntry *blacklist_entry)
-{
-	bool  whitelist_hit = (whitelist_entry != NULL);
-	bool  blacklist_hit = (blacklist_entry != NULL);
-	bool  prohibited    = true;
+	if (fingerprint_cache == NULL)
+	{
+		HASHCTL		info;
 
-	switch (pgfw_rule_engine) {
-	case PGFW_ENGINE_WHITELIST:
-		prohibited = !whitelist_hit;
-		collect_entry_statistics(whitelist_entry);
-		break;
-	case PGFW_ENGINE_BLACKLIST:
-		prohibited = blacklist_hit;
-		collect_entry_statistics(blacklist_entry);
-		break;
-	case PGFW_ENGINE_HYBRID:
-		prohibited = (!whitelist_hit || blacklist_hit);
-		if (whitelist_hit && !blacklist_hit) {
-			/*
-			 * this is the only case of hybrid rule engine that allow a query
-			 */
-			collect_entry_statistics(whitelist_entry);
-		} else if (blacklist_hit) {
-			/*
-			 * query is being banned by the blacklist entry
-			 */
-			collect_entry_statistics(blacklist_entry);
+		if (!callbacks_registered)
+		{
+			CacheRegisterRelcacheCallback(fingerprint_relcache_callback,
+										  (Datum) 0);
+			CacheRegisterSyscacheCallback(RELOID,
+										  fingerprint_syscache_callback,
+										  (Datum) 0);
+			CacheRegisterSyscacheCallback(TYPEOID,
+										  fingerprint_syscache_callback,
+										  (Datum) 0);
+			CacheRegisterSyscacheCallback(PROCOID,
+										  fingerprint_syscache_callback,
+										  (Datum) 0);
+			CacheRegisterSyscacheCallback(OPEROID,
+										  fingerprint_syscache_callback,
+										  (Datum) 0);
+			CacheRegisterSyscacheCallback(NAMESPACEOID,
+										  fingerprint_syscache_callback,
+										  (Datum) 0);
+			callbacks_registered = true;
 		}
-		break;
-	default:
-		elog(ERROR, "sql firewall: error must have a rule engine when it is enabled.");
+
+		fingerprint_cxt = AllocSetContextCreate(TopMemoryContext,
+												"sql_firewall fingerprint cache",
+												ALLOCSET_DEFAULT_MINSIZE,
+												ALLOCSET_DEFAULT_INITSIZE,
+												ALLOCSET_DEFAULT_MAXSIZE);
+
+		memset(&info, 0, sizeof(info));
+		info.keysize = sizeof(pgfwFingerprintKey);
+		info.entrysize = sizeof(pgfwFingerprint);
+		info.hash = tag_hash;
+		info.hcxt = fingerprint_cxt;
+
+		fingerprint_cache = hash_create("sql_firewall fingerprint cache",
+										256,
+										&info,
+										HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+		fingerprint_cache_capacity = pgfw_fingerprint_cache_size;
+		fingerprint_cache_used = 0;
 	}
-	
-	return prohibited;
+
+	fingerprint = (pgfwFingerprint *) hash_search(fingerprint_cache, key,
+												  HASH_ENTER, &found);
+	if (!found)
+	{
+		fingerprint->text = MemoryContextAlloc(fingerprint_cxt,
+											   key->text_len + 1);
+		fingerprint_cache_used += size;
+	}
+	/* the text of an entry found may differ, but its length is the same */
+	memcpy(fingerprint->text, text, key->text_len + 1);
+	fingerprint->queryid = queryid;
+	fingerprint->has_constants = has_constants;
 }
 
 /*
- * search the rule table for both whitelist or blacklist
- *
+ * Forget every query id cached by this backend.
  */
-static pgssEntry *
-__lookup_rule(pgssHashKey *key)
+static void
+fingerprint_cache_flush(void)
 {
-	pgssEntry   *entry = NULL;
-
-	entry = (pgssEntry *)hash_search(pgss_hash, key, HASH_FIND, NULL);
+	if (fingerprint_cache == NULL)
+		return;
 
-	return entry;
+	MemoryContextDelete(fingerprint_cxt);
+	fingerprint_cxt = NULL;
+	fingerprint_cache = NULL;
+	fingerprint_cache_used = 0;
 }
 
-
 /*
- * caller should hold lock of the hash table
- *
+ * The catalogs the query ids depend on have changed.
  */
-static pgssEntry *
-lookup_rule(Oid userid, uint32 queryid, uint32 rule_type)
+static void
+fingerprint_syscache_callback(Datum arg, int cacheid, uint32 hashvalue)
 {
-	pgssHashKey  key   = {0};
-	pgssEntry   *entry = NULL;
-
-	/*
-	 * fill the common key field
-	 */
-	key.queryid    = queryid;
-	key.type       = rule_type;
-
-	/*
-	 * try exactly matched entry for a specified user
-	 *
-	 * userid == InvalidOid, means the rule should be applied to
-	 * all users.
-	 */
-	if (userid != InvalidOid) {
-		key.userid     = userid;
-		entry           = __lookup_rule(&key);
-		
-		if (entry != NULL)
-			return entry;
-	}
-
-	/*
-	 * then try the rule should be applied to all users.
-	 */
-	key.userid = InvalidOid;
-	entry       = __lookup_rule(&key);
-
-	return entry;
+	fingerprint_cache_flush();
 }
 
-/*
- * lookup if there exists matched rule entry for (userid, queryid)
- * in the whitelist rule.
- *
- */
-static pgssEntry *
-lookup_whitelist(Oid userid, uint32 queryid)
+static void
+fingerprint_relcache_callback(Datum arg, Oid relid)
 {
-	return lookup_rule(userid, queryid, (uint32)PGFW_WHITELIST_ENTRY);
+	fingerprint_cache_flush();
 }
 
 /*
- * lookup if there exists matched rule entry for (userid, queryid)
- * in the blacklist rule.
- *
+ * Forget everything cached by this backend.
  */
-static pgssEntry *
-lookup_blacklist(Oid userid, uint32 queryid)
+static void
+local_cache_flush(void)
 {
-	return lookup_rule(userid, queryid, (uint32)PGFW_BLACKLIST_ENTRY);
+	if (local_cache == NULL)
+		return;
+
+	local_cache_flush_counters();
+
+	hash_destroy(local_cache);
+	local_cache = NULL;
+	local_cache_epoch++;
 }
 
 /*
- * given a (userid, queryid) vector, we decide whether to prohibit
- * the query
- *
- * return:
- *   false   :   allow to execute the query
- *   true    :   prohibit to execute
- *
- * out:
- *   entry   :   the matched rule entry, which is applying to the query
+ * Add the counters kept in the cache to the rule entries.
  *
- * note:
- *   caller should has held at least a shared lock on pgss
+ * This backend calls it before changing the rules itself, so the entries
+ * are still there.  When somebody else has changed them meanwhile, an entry
+ * may have been removed, and its memory even reused for another rule; the
+ * key of the entry is checked, and whatever doesn't match is dropped.
  */
-static bool
-to_be_prohibited(Oid userid, uint32 queryid)
+static void
+local_cache_flush_counters(void)
 {
-	pgssEntry    *whitelist_entry = NULL;
-	pgssEntry    *blacklist_entry = NULL;
+	HASH_SEQ_STATUS hash_seq;
+	pgfwCacheEntry *centry;
 
-	/*
-	 * first we search the blacklist rules, if there exists one
-	 * the query of user is prohibited according to the blacklist
-	 * rule engine.
-	 *
-	 */
-	if (pgfw_rule_engine == PGFW_ENGINE_BLACKLIST ||
-		pgfw_rule_engine == PGFW_ENGINE_HYBRID)
+	if (local_cache == NULL || !local_cache_pending)
+		return;
+
+	hash_seq_init(&hash_seq, local_cache);
+	while ((centry = hash_seq_search(&hash_seq)) != NULL)
 	{
-		blacklist_entry = lookup_blacklist(userid, queryid);
-	}
+		volatile pgssEntry *e;
 
-	if (blacklist_entry == NULL) {
-		/*
-		 * then we search the whitelist rules, if there exists one
-		 * the query of user is allowed according to the whitelist
-		 * rule engine.
-		 *
-		 */
-		if (pgfw_rule_engine == PGFW_ENGINE_WHITELIST ||
-			pgfw_rule_engine == PGFW_ENGINE_HYBRID)
+		if (centry->pending_calls > 0 &&
+			(e = centry->whitelist_entry) != NULL &&
+			e->key.queryid == centry->key.queryid &&
+			e->key.type == PGFW_WHITELIST_ENTRY)
+		{
+			SpinLockAcquire(&e->mutex);
+			e->counters.calls += centry->pending_calls;
+			SpinLockRelease(&e->mutex);
+		}
+
+		if (centry->pending_banned > 0 &&
+			(e = centry->blacklist_entry) != NULL &&
+			e->key.queryid == centry->key.queryid &&
+			e->key.type == PGFW_BLACKLIST_ENTRY)
 		{
-			whitelist_entry = lookup_whitelist(userid, queryid);
+			SpinLockAcquire(&e->mutex);
+			e->counters.banned += centry->pending_banned;
+			SpinLockRelease(&e->mutex);
 		}
+
+		centry->pending_calls = 0;
+		centry->pending_banned = 0;
 	}
 
-	return __to_be_prohibited(whitelist_entry, blacklist_entry);
+	local_cache_pending = false;
+	local_cache_flushed = GetCurrentStatementStartTimestamp();
 }
 
+/*
+ * before_shmem_exit callback: don't lose the counters kept in the cache.
+ */
+static void
+local_cache_shmem_exit(int code, Datum arg)
+{
+	if (pgss)
+		local_cache_flush_counters();
+}